@@ -1,4 +1,4 @@
-﻿// AmendEcgAnnotation.cpp : main entry point
+﻿// AmendEcgAnnotation.cpp : main entry point; command line client of the amendment library (AmendEcgAnnotation.h)
 // Fix dicom Waveform Annotations tags while archving from Muse to VNA.
 // Compiled with Visual Studio (W10-64) and Red Hat linux 7 and 8.
 //
@@ -8,10 +8,19 @@
 //	0  = success
 //	<0 = failure; source data not specified/accessible or destination write failure
 //	>0 = warning
+//	in batch mode (--batch or --output-dir) and with --retrospective-conversion the most severe result of all files is returned
+//	in filter mode (--stdio or '-') the original stream is written to stdout if it can't be amended
 //
 // (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
 
 #include "AmendEcgAnnotation.h"
+#include "Archive.h"
+#include "Crawler.h"
+#include "EmbeddedDictionary.h"
+#include "Log.h"
+#include "MemoryBudget.h"
+#include "ProcessedIndex.h"
+#include "Relay.h"
 
 #include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
 #include "dcmtk/ofstd/ofstream.h"
@@ -19,97 +28,1086 @@
 #include "dcmtk/dcmdata/cmdlnarg.h"
 #include "dcmtk/ofstd/ofconapp.h"
 #include "dcmtk/ofstd/ofstd.h"
-#include "dcmtk/ofstd/ofstack.h"
-#include "dcmtk/ofstd/ofstrutl.h"
+#include "dcmtk/ofstd/offile.h"
+#include "dcmtk/ofstd/ofvector.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <cerrno>
+#include <csignal>
+
+#ifdef __linux__
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 #define MY_NAME "AmendEcgAnnotation"
 #define MY_VERSION "0.9.3"
 #define MY_RELEASEDATE "2021-10-13"
 
-#define RESULT_SUCCESS 0
-#define RESULT_FAILED_TO_CREATE -1
-#define RESULT_FAILED_TO_READ -2
-#define RESULT_ERROR_MISSING_TAG -3
-#define RESULT_ERROR_WRONGSOP_CLASS -4
-#define RESULT_WARN_NO_CHANGES 1
-#define RESULT_WARN_ALREADY_AMENDED 2
-#define RESULT_FAILED_TO_CLONE_OFFSET 10 // either pos or neg, depending on result code of error/warning
-
 static const char rcsid[]	= "$amc.nl: " MY_NAME " v" MY_VERSION " " MY_RELEASEDATE " $";
 static OFBool _bVerbose = OFFalse;
-static OFBool _bforceOutput = OFFalse;
-static OFBool _bNoCloneOnErrror = OFFalse;
-static OFBool _bMergeLines = OFFalse;
-//static OFBool _bRetrospectiveConversion = OFFalse;
-static OFBool _bIncludeBevestigingDoor = OFTrue; // set to false when 'Bevestigd' is found in one of the text annotations
+static AmendOptions _options; // amendment options from the command line; streams are set per file
+static OFBool _bTriageOnly = OFFalse; // batch mode: only print the triage class of every file
+static OFBool _bStdio = OFFalse; // filter mode: read the input from stdin and write the output to stdout
+static OFBool _bRetrospectiveConversion = OFFalse; // crawl the parameters as archive trees (resumable, throttled)
+static CrawlerConfig _crawlerConfig;
+static OFBool _bBatch = OFFalse;
+static OFString _ofstrOutputDir; // batch mode: output directory (empty: amend in-place)
+static OFCmdUnsignedInt _nJobs = 1; // batch/watch mode: number of parallel workers
+static OFCmdUnsignedInt _nPrefetch = 0; // batch mode: inputs read ahead by the pipeline (0: no pipeline)
+static OFCmdUnsignedInt _nIOThreads = 4; // batch mode: pipeline readers and writers (each)
+static MemoryBudget _memoryBudget; // --memory-budget: files in progress of all batch, watch and crawl workers
+static OFString _ofstrWatchDir; // watch mode: spool directory
+static OFString _ofstrErrorDir; // watch mode: inputs that could not be amended or cloned are moved here
+static RelayConfig _relayConfig; // relay mode: enabled by a listen port
+static OFBool _bArchive = OFFalse; // archive mode: amend the members of a tar or zip bundle
+static ArchiveConfig _archiveConfig;
+static MetricsCollector _metrics; // --metrics-json/--metrics-prom; nothing is measured unless enabled
+static ProcessedIndex _index; // --index: outcomes of earlier runs, to skip unchanged inputs
+static OutputCommitter _committer; // --fsync: how outputs are made durable
+static AnnotationPlan _plan; // --rules: compiled annotation rules
+static AsyncLog& _log = AsyncLog::global(); // --log-level/--log-json; started for all but filter mode
+static OFCmdUnsignedInt _nLogBuffer = 8192; // --log-buffer: records queued for the log writer
 
 #define SHORTCOL 3
 #define LONGCOL 20
 
 using namespace std;
 
-// used tags (info)
-static const DcmTagKey _tagPatientID(DCM_PatientID);
-static const DcmTagKey _tagAccessionNumber(DCM_AccessionNumber);
-static const DcmTagKey _tagStudyDescription(DCM_StudyDescription);							// (0008,1030)
-static const DcmTagKey _tagSOPClassUID(DCM_SOPClassUID);									// (0008,0016)
-static const DcmTagKey _tagWaveformSequence(DCM_WaveformSequence);							// (5400,0100) SQ each item represents one waveform multiplex group
-static const DcmTagKey _tagWaveformOriginality(DCM_WaveformOriginality);					// (003a,0004) CS 
-static const DcmTagKey _tagNumberOfWaveformChannels(DCM_NumberOfWaveformChannels);			// (003a,0005) US 
-// used tags (sources)
-static const DcmTagKey _tagVisitComments(DCM_VisitComments);								// (0038,4000) LT
-static const DcmTagKey _tagOperatorsName(DCM_OperatorsName);								// (0008,1070) PN (multiplicity 1-n)
-static const DcmTagKey _tagReferringPhysicianName(DCM_ReferringPhysicianName);				// (0008,0090) PN 
-static const DcmTagKey _tagPhysiciansOfRecord(DCM_PhysiciansOfRecord);						// (0008,1048) PN (multiplicity 1-n)
-static const DcmTagKey _tagNameOfPhysiciansReadingStudy(DCM_NameOfPhysiciansReadingStudy);	// (0008,1060) PN (multiplicity 1-n)
-// used tags (destination)
-static const DcmTagKey _tagWaveformAnnotationSequence(DCM_WaveformAnnotationSequence);		// (0040,b020) SQ
-static const DcmTagKey _tagUnformattedTextValue(DCM_UnformattedTextValue);					// (0070,0006) ST
-static const DcmTagKey _tagReferencedWaveformChannels(DCM_ReferencedWaveformChannels);		// (0040,a0b0) US 1\0 (multiplicity 2-2n)
-static const DcmTagKey _tagAnnotationGroupNumber(DCM_AnnotationGroupNumber);				// (0040,a180) US
-
-static const OFString _ofstrAnnotationSeparator("-+-");
-
-// clone input to output in case of an error
-static int TryFileClone(const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile, int resultSoFar)
-{
-	if (_bNoCloneOnErrror && resultSoFar<0)
-		return resultSoFar;
-
-	if (OFStandard::fileExists(ofstrInputFile))
-	{
-		if (0==strcmp(ofstrInputFile.getCharPointer(), ofstrOutputFile.getCharPointer()))
-			return resultSoFar; // no need to copy on itself
-
-		if (OFStandard::copyFile(ofstrInputFile, ofstrOutputFile))
-		{
-			if (_bVerbose)
-				COUT << "Cloned " << ofstrOutputFile;
-			return resultSoFar;
+// the command line options with the message streams of one file (or one worker)
+static AmendOptions MakeOptions(STD_NAMESPACE ostream& osOut, STD_NAMESPACE ostream& osErr)
+{
+	AmendOptions options(_options);
+	options.pOut = &osOut;
+	options.pErr = &osErr;
+	return options;
+}
+
+// amend a single file and, when enabled, record its stage timings, sizes and result
+static AmendResult AmendFileMeasured(const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile, STD_NAMESPACE ostream& osOut, STD_NAMESPACE ostream& osErr)
+{
+	const AmendOptions options = MakeOptions(osOut, osErr);
+	const Uint64 nInputSize = OFStandard::getFileSize(ofstrInputFile); // before an in-place amendment changes it
+	const Uint64 nReserved = _memoryBudget.acquire(EstimateFileMemory(nInputSize));
+	if (!_metrics.isEnabled())
+	{
+		const AmendResult result = amendFile(ofstrInputFile, ofstrOutputFile, options);
+		_memoryBudget.release(nReserved);
+		return result;
+	}
+
+	FileMetrics metrics;
+	metrics.nBytesRead = nInputSize;
+	const AmendResult result = amendFile(ofstrInputFile, ofstrOutputFile, options, &metrics);
+	_memoryBudget.release(nReserved);
+	if (result.code == RESULT_SUCCESS)
+		metrics.nBytesWritten = OFStandard::getFileSize(ofstrOutputFile);
+	else if (result.cloneResult != ECR_failed)
+		metrics.nBytesWritten = result.nClonedBytes;
+	_metrics.add(ofstrInputFile.getCharPointer(), result.code, metrics);
+	return result;
+}
+
+// --index: the result of an earlier run, if the input didn't change since and its output still exists;
+// only stat() is needed for this (the output may have been cleaned up, so it is checked too)
+static OFBool FindIndexedResult(const OFString& ofstrInputFile, const OFString& ofstrOutputFile, int& iResult, STD_NAMESPACE ostream& osOut)
+{
+	ProcessedEntry entry;
+	Uint64 nSize, nMTime;
+	if (!_index.isOpen() || !ProcessedIndex::statFile(ofstrInputFile, nSize, nMTime) || !_index.find(ofstrInputFile, entry)
+		|| entry.nSize != nSize || entry.nMTime != nMTime || !isFinalResult(entry.iResult) || !OFStandard::fileExists(ofstrOutputFile))
+		return OFFalse;
+	if (_bVerbose)
+		osOut << "INFO: unchanged since an earlier run (result " << entry.iResult << "), skipped: " << ofstrInputFile << endl;
+	iResult = entry.iResult;
+	return OFTrue;
+}
+
+// --index: record the result; the input is stat'ed again, as an in-place amendment changed it and
+// a rerun should skip the amended file
+static void RecordIndexedResult(const OFString& ofstrInputFile, const AmendResult& result, STD_NAMESPACE ostream& osErr)
+{
+	ProcessedEntry entry;
+	if (!_index.isOpen() || !ProcessedIndex::statFile(ofstrInputFile, entry.nSize, entry.nMTime))
+		return;
+	entry.iResult = result.code;
+	entry.nUIDHash = result.ofstrSOPInstanceUID.empty() ? 0 : ProcessedIndex::hash(result.ofstrSOPInstanceUID);
+	if (!_index.add(ofstrInputFile, entry))
+		osErr << "WARN: could not record the result in the index: " << ofstrInputFile << endl;
+}
+
+// amend a single file, unless the index shows that an earlier run already handled it as it is now
+static AmendResult AmendFileIndexed(const OFString& ofstrInputFile, const OFString& ofstrOutputFile, STD_NAMESPACE ostream& osOut, STD_NAMESPACE ostream& osErr)
+{
+	AmendResult result;
+	if (FindIndexedResult(ofstrInputFile, ofstrOutputFile, result.code, osOut))
+		return result;
+	result = AmendFileMeasured(ofstrInputFile, ofstrOutputFile, osOut, osErr);
+	RecordIndexedResult(ofstrInputFile, result, osErr);
+	return result;
+}
+
+// write the metrics that are still buffered; the result of the run is passed through
+static int FinishMetrics(int iResult)
+{
+	if (_metrics.isEnabled() && !_metrics.flush())
+		LogLine(ELL_warn) << "WARN: could not write metrics";
+	return iResult;
+}
+
+// filter mode: amend the Part 10 stream on stdin and write it to stdout; on errors the original bytes
+// are passed through instead of a clone. All messages go to stderr, the result is the exit status.
+static int AmendStdio(FileMetrics* pMetrics)
+{
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	OFVector<Uint8> input;
+	Uint8 chunk[65536];
+	size_t nRead;
+	while ((nRead = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+		input.insert(input.end(), chunk, chunk + nRead);
+	if (ferror(stdin) || input.empty())
+	{
+		CERR << "ERROR: could not read dicom stream from stdin" << endl;
+		return RESULT_FAILED_TO_READ;
+	}
+
+	OFVector<Uint8> output;
+	const int iResult = amendStream(input, output, MakeOptions(CERR, CERR), pMetrics).code;
+	if (iResult != RESULT_SUCCESS && _options.bNoCloneOnError && iResult < 0)
+		return iResult;
+
+	// nothing has been written yet, so the output is either complete or the unmodified input
+	const OFVector<Uint8>& result = iResult == RESULT_SUCCESS ? output : input;
+	if (fwrite(&result[0], 1, result.size(), stdout) != result.size() || fflush(stdout) != 0)
+	{
+		CERR << "ERROR: could not write dicom stream to stdout" << endl;
+		if (iResult == RESULT_SUCCESS)
+			return RESULT_FAILED_TO_CREATE;
+		return (iResult<0 ? iResult-RESULT_FAILED_TO_CLONE_OFFSET: iResult+RESULT_FAILED_TO_CLONE_OFFSET);
+	}
+	if (pMetrics)
+		pMetrics->nBytesWritten = result.size();
+	if (_bVerbose)
+		CERR << "INFO: Wrote " << result.size() << (iResult == RESULT_SUCCESS ? " bytes of amended" : " bytes of original") << " stream to stdout" << endl;
+	return iResult;
+}
+
+// batch mode: one input/output pair per file
+struct BatchItem
+{
+	OFString ofstrInputFile;
+	OFString ofstrOutputFile;
+};
+
+// map an input file to its output file; relative to the output directory (if any) or in-place
+static OFString MakeOutputPath(const OFString& ofstrInputFile, const OFString& ofstrRelativePath)
+{
+	if (_ofstrOutputDir.empty())
+		return ofstrInputFile;
+
+	OFString ofstrOutputFile;
+	OFStandard::combineDirAndFilename(ofstrOutputFile, _ofstrOutputDir, ofstrRelativePath, OFTrue);
+	return ofstrOutputFile;
+}
+
+// expand a batch parameter (file, directory or @filelist) into input/output pairs
+static OFBool AddBatchInput(const OFString& ofstrParam, OFVector<BatchItem>& items, OFBool bAllowFileList = OFTrue)
+{
+	BatchItem item;
+	if (bAllowFileList && !ofstrParam.empty() && ofstrParam[0] == '@')
+	{
+		// one path per line; empty lines and lines starting with '#' are ignored
+		STD_NAMESPACE ifstream fileList(ofstrParam.c_str() + 1);
+		if (!fileList)
+		{
+			LogLine(ELL_error) << "ERROR: cannot read file list: " << ofstrParam.c_str() + 1;
+			return OFFalse;
+		}
+		STD_NAMESPACE string strLine;
+		while (STD_NAMESPACE getline(fileList, strLine))
+		{
+			OFString ofstrLine(strLine.c_str());
+			OFStandard::trimString(ofstrLine);
+			if (ofstrLine.empty() || ofstrLine[0] == '#')
+				continue;
+			if (!AddBatchInput(ofstrLine, items, OFFalse))
+				return OFFalse;
+		}
+	}
+	else if (OFStandard::dirExists(ofstrParam))
+	{
+		// all files in the directory tree; the tree structure is mirrored in the output directory
+		OFString ofstrDir;
+		OFList<OFString> files;
+		OFStandard::normalizeDirName(ofstrDir, ofstrParam);
+		OFStandard::searchDirectoryRecursively(ofstrDir, files, "", "", OFTrue);
+		for (OFListIterator(OFString) it = files.begin(); it != files.end(); ++it)
+		{
+			OFString ofstrRelativePath;
+			if (it->length() > ofstrDir.length() && it->compare(0, ofstrDir.length(), ofstrDir) == 0 && (*it)[ofstrDir.length()] == PATH_SEPARATOR)
+				ofstrRelativePath = it->substr(ofstrDir.length() + 1);
+			else
+				OFStandard::getFilenameFromPath(ofstrRelativePath, *it);
+			item.ofstrInputFile = *it;
+			item.ofstrOutputFile = MakeOutputPath(*it, ofstrRelativePath);
+			items.push_back(item);
+		}
+	}
+	else
+	{
+		OFString ofstrFilename;
+		OFStandard::getFilenameFromPath(ofstrFilename, ofstrParam);
+		item.ofstrInputFile = ofstrParam;
+		item.ofstrOutputFile = MakeOutputPath(ofstrParam, ofstrFilename);
+		items.push_back(item);
+	}
+	return OFTrue;
+}
+
+// combine per-file results into one exit status: failures win over warnings, warnings over success
+static int AggregateResult(int iSoFar, int iResult)
+{
+	if (iSoFar < 0 || iResult < 0)
+		return iResult < iSoFar ? iResult : iSoFar;
+	return iResult > iSoFar ? iResult : iSoFar;
+}
+
+// shared state of the batch worker pool; workers claim the next unprocessed file from a
+// common cursor, so a few huge recordings never hold up the files queued behind them
+struct BatchQueue
+{
+	explicit BatchQueue(const OFVector<BatchItem>& batchItems)
+		: items(batchItems), iNext(0), results(batchItems.size(), RESULT_SUCCESS), done(batchItems.size(), 0),
+		  outLogs(batchItems.size()), errLogs(batchItems.size()), uids(batchItems.size()) {}
+
+	const OFVector<BatchItem>& items;
+	std::atomic<size_t> iNext;					// next item to be claimed by any idle worker
+	OFVector<int> results;						// per item, in input order
+	OFVector<char> done;						// per item; set when result and logs are available
+	OFVector<STD_NAMESPACE string> outLogs;		// buffered per-file output, written in input order
+	OFVector<STD_NAMESPACE string> errLogs;
+	OFVector<OFString> uids;					// per item, for the log context
+	std::mutex mutex;
+	std::condition_variable cvDone;
+};
+
+// one batch item: amend it, or only classify it with --triage-only
+static AmendResult ProcessBatchItem(const BatchItem& item, STD_NAMESPACE ostream& osOut, STD_NAMESPACE ostream& osErr)
+{
+	if (_bTriageOnly)
+	{
+		AmendResult result;
+		result.code = triageFile(item.ofstrInputFile, _options.pPlan);
+		return result;
+	}
+	return AmendFileIndexed(item.ofstrInputFile, item.ofstrOutputFile, osOut, osErr);
+}
+
+static void BatchWorker(BatchQueue* pQueue)
+{
+	for (;;)
+	{
+		const size_t iItem = pQueue->iNext++;
+		if (iItem >= pQueue->items.size())
+			break;
+
+		OFOStringStream osOut, osErr;
+		const BatchItem& item = pQueue->items[iItem];
+		const AmendResult result = ProcessBatchItem(item, osOut, osErr);
+
+		std::lock_guard<std::mutex> lock(pQueue->mutex);
+		pQueue->results[iItem] = result.code;
+		pQueue->outLogs[iItem] = osOut.str();
+		pQueue->errLogs[iItem] = osErr.str();
+		pQueue->uids[iItem] = result.ofstrSOPInstanceUID;
+		pQueue->done[iItem] = 1;
+		pQueue->cvDone.notify_one();
+	}
+}
+
+// --prefetch: reading, amending and writing of different files overlap. Reader threads keep the next
+// inputs in memory ahead of the amend workers, which parse them from those buffers (amendStream) and
+// hand the outputs to writer threads. Everything is in memory, so --load-short, --splice and --triage
+// don't apply.
+enum E_PrefetchState
+{
+	EPS_pending,
+	EPS_read,
+	EPS_readFailed,
+	EPS_skipped		// --index: handled by an earlier run
+};
+
+// an amended (or to be cloned) file on its way to the writers
+struct PipelineWrite
+{
+	size_t iItem;
+	AmendResult result;
+	OFVector<Uint8> output;			// the amended stream (RESULT_SUCCESS)
+	OFBool bClone;					// clone the input file if the output is not written
+	FileMetrics metrics;
+	STD_NAMESPACE string strOut;	// messages so far
+	STD_NAMESPACE string strErr;
+};
+
+struct PipelineState
+{
+	PipelineState(BatchQueue& batchQueue, size_t nPrefetchDepth)
+		: queue(batchQueue), nDepth(nPrefetchDepth), iNextRead(0), iNextAmend(0), inputs(batchQueue.items.size()),
+		  states(batchQueue.items.size(), EPS_pending), reserved(batchQueue.items.size(), 0), nWorkersRunning(0), dRead(0), dReadStall(0), dWrite(0), dWriteStall(0),
+		  nBytesRead(0), nBytesWritten(0) {}
+
+	BatchQueue& queue;
+	const size_t nDepth;					// inputs read ahead of the workers, and outputs waiting for the writers
+	std::mutex mutex;
+	std::condition_variable cvRead;			// readers: the workers moved on
+	std::condition_variable cvReady;		// workers: an input was read
+	std::condition_variable cvWrite;		// writers: an output was queued
+	std::condition_variable cvWriteSpace;	// workers: a writer took an output
+	size_t iNextRead;
+	size_t iNextAmend;
+	OFVector<OFVector<Uint8> > inputs;		// per item, from read until a worker takes it
+	OFVector<int> states;					// E_PrefetchState per item
+	OFVector<Uint64> reserved;				// of the memory budget, per item until it is finished
+	std::mutex mutexIntake;					// readers claim items and reserve their memory in item order
+	STD_NAMESPACE deque<PipelineWrite*> writes;
+	size_t nWorkersRunning;
+	// seconds of I/O, and the part of it the workers had to wait for (the rest overlapped with amending)
+	double dRead, dReadStall, dWrite, dWriteStall;
+	Uint64 nBytesRead, nBytesWritten;
+};
+
+static double SecondsSince(std::chrono::steady_clock::time_point tStart)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+}
+
+static OFBool ReadInputFile(const OFString& ofstrInputFile, OFVector<Uint8>& data)
+{
+	OFFile file;
+	if (!file.fopen(ofstrInputFile, "rb"))
+		return OFFalse;
+	data.resize(OFStandard::getFileSize(ofstrInputFile));
+	const OFBool bRead = data.empty() || file.fread(&data[0], 1, data.size()) == data.size();
+	file.fclose();
+	return bRead;
+}
+
+// hand the result of an item to the batch collector
+static void FinishPipelineItem(PipelineState* pState, size_t iItem, int iResult, const OFString& ofstrUID, const STD_NAMESPACE string& strOut, const STD_NAMESPACE string& strErr)
+{
+	_memoryBudget.release(pState->reserved[iItem]);
+	std::lock_guard<std::mutex> lock(pState->queue.mutex);
+	pState->queue.results[iItem] = iResult;
+	pState->queue.uids[iItem] = ofstrUID;
+	pState->queue.outLogs[iItem] = strOut;
+	pState->queue.errLogs[iItem] = strErr;
+	pState->queue.done[iItem] = 1;
+	pState->queue.cvDone.notify_one();
+}
+
+static void FinishPipelineWrite(PipelineState* pState, PipelineWrite* pWrite)
+{
+	const OFString& ofstrInputFile = pState->queue.items[pWrite->iItem].ofstrInputFile;
+	OFOStringStream osErr;
+	if (_metrics.isEnabled())
+		_metrics.add(ofstrInputFile, pWrite->result.code, pWrite->metrics);
+	RecordIndexedResult(ofstrInputFile, pWrite->result, osErr);
+	FinishPipelineItem(pState, pWrite->iItem, pWrite->result.code, pWrite->result.ofstrSOPInstanceUID, pWrite->strOut, pWrite->strErr + osErr.str());
+	delete pWrite;
+}
+
+static void PipelineReader(PipelineState* pState)
+{
+	const size_t nItems = pState->queue.items.size();
+	for (;;)
+	{
+		// the memory is reserved in item order: a later item never holds the budget that the item
+		// the workers wait for needs
+		size_t iItem;
+		OFOStringStream osOut;
+		int iResult;
+		OFBool bIndexed;
+		{
+			std::lock_guard<std::mutex> lockIntake(pState->mutexIntake);
+			{
+				std::unique_lock<std::mutex> lock(pState->mutex);
+				while (pState->iNextRead < nItems && pState->iNextRead >= pState->iNextAmend + pState->nDepth)
+					pState->cvRead.wait(lock);
+				if (pState->iNextRead >= nItems)
+					break;
+				iItem = pState->iNextRead++;
+			}
+			const BatchItem& item = pState->queue.items[iItem];
+			bIndexed = FindIndexedResult(item.ofstrInputFile, item.ofstrOutputFile, iResult, osOut);
+			if (!bIndexed)
+				pState->reserved[iItem] = _memoryBudget.acquire(EstimateFileMemory(OFStandard::getFileSize(item.ofstrInputFile)));
+		}
+
+		const BatchItem& item = pState->queue.items[iItem];
+		OFVector<Uint8> input;
+		int state = EPS_skipped;
+		double dRead = 0;
+		if (bIndexed)
+			FinishPipelineItem(pState, iItem, iResult, OFString(), osOut.str(), STD_NAMESPACE string());
+		else
+		{
+			const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+			state = ReadInputFile(item.ofstrInputFile, input) ? EPS_read : EPS_readFailed;
+			dRead = SecondsSince(tStart);
+		}
+
+		std::lock_guard<std::mutex> lock(pState->mutex);
+		pState->dRead += dRead;
+		pState->nBytesRead += input.size();
+		pState->inputs[iItem].swap(input);
+		pState->states[iItem] = state;
+		pState->cvReady.notify_all();
+	}
+}
+
+static void PipelineWorker(PipelineState* pState)
+{
+	const size_t nItems = pState->queue.items.size();
+	for (;;)
+	{
+		size_t iItem;
+		int state;
+		OFVector<Uint8> input;
+		{
+			std::unique_lock<std::mutex> lock(pState->mutex);
+			if (pState->iNextAmend >= nItems)
+				break;
+			iItem = pState->iNextAmend++;
+			pState->cvRead.notify_all();
+			const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+			while (pState->states[iItem] == EPS_pending)
+				pState->cvReady.wait(lock);
+			pState->dReadStall += SecondsSince(tStart);
+			state = pState->states[iItem];
+			input.swap(pState->inputs[iItem]);
+		}
+		if (state == EPS_skipped)
+			continue;
+
+		const BatchItem& item = pState->queue.items[iItem];
+		const OFBool bInPlace = item.ofstrInputFile == item.ofstrOutputFile;
+		OFOStringStream osOut, osErr;
+		PipelineWrite* pWrite = new PipelineWrite;
+		pWrite->iItem = iItem;
+		pWrite->bClone = OFFalse;
+		if (_bVerbose)
+		{
+			osOut << "inp: " << item.ofstrInputFile << endl;
+			osOut << "out: " << item.ofstrOutputFile << endl;
+		}
+		if (state == EPS_readFailed)
+		{
+			osErr << "ERROR: could not read input file: " << item.ofstrInputFile << endl;
+			pWrite->result.code = RESULT_FAILED_TO_READ - RESULT_FAILED_TO_CLONE_OFFSET; // as amendFile() for an unreadable input
+		}
+		else if (!_options.bForceOutput && !bInPlace && OFStandard::fileExists(item.ofstrOutputFile))
+		{
+			osErr << "ERROR: Output file exists; use --force to overwrite: " << item.ofstrOutputFile << endl;
+			pWrite->result.code = RESULT_FAILED_TO_CREATE;
+		}
+		else
+		{
+			pWrite->metrics.nBytesRead = input.size();
+			pWrite->result = amendStream(input, pWrite->output, MakeOptions(osOut, osErr), _metrics.isEnabled() ? &pWrite->metrics : NULL);
+			// as amendFile(): the input is cloned if the output can't be written, also for warnings
+			pWrite->bClone = !bInPlace && !(_options.bNoCloneOnError && pWrite->result.code < 0);
+		}
+		pWrite->strOut = osOut.str();
+		pWrite->strErr = osErr.str();
+
+		if (pWrite->result.code != RESULT_SUCCESS && !pWrite->bClone)
+		{
+			FinishPipelineWrite(pState, pWrite);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(pState->mutex);
+		const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+		while (pState->writes.size() >= pState->nDepth)
+			pState->cvWriteSpace.wait(lock);
+		pState->dWriteStall += SecondsSince(tStart);
+		pState->writes.push_back(pWrite);
+		pState->cvWrite.notify_one();
+	}
+
+	std::lock_guard<std::mutex> lock(pState->mutex);
+	if (--pState->nWorkersRunning == 0)
+		pState->cvWrite.notify_all();
+}
+
+static void PipelineWriter(PipelineState* pState)
+{
+	for (;;)
+	{
+		PipelineWrite* pWrite;
+		{
+			std::unique_lock<std::mutex> lock(pState->mutex);
+			while (pState->writes.empty() && pState->nWorkersRunning > 0)
+				pState->cvWrite.wait(lock);
+			if (pState->writes.empty())
+				break;
+			pWrite = pState->writes.front();
+			pState->writes.pop_front();
+			pState->cvWriteSpace.notify_one();
+		}
+
+		const BatchItem& item = pState->queue.items[pWrite->iItem];
+		const OFString& ofstrOutputFile = item.ofstrOutputFile;
+		OFOStringStream osOut, osErr;
+		const AmendOptions options = MakeOptions(osOut, osErr);
+		FileMetrics* pMetrics = _metrics.isEnabled() ? &pWrite->metrics : NULL;
+		int& iResult = pWrite->result.code;
+		Uint64 nWritten = 0;
+		const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+		if (iResult == RESULT_SUCCESS)
+		{
+			if (writeOutputFile(pWrite->output, ofstrOutputFile, options, pMetrics))
+			{
+				nWritten = pWrite->output.size();
+				if (_bVerbose)
+					osOut << "INFO: Created output file: " << ofstrOutputFile << endl;
+			}
+			else
+				iResult = RESULT_FAILED_TO_CREATE;
+		}
+		// as amendFile(): the input file (unchanged on disk) is cloned with --clone-method
+		if (iResult != RESULT_SUCCESS && pWrite->bClone)
+		{
+			if (cloneInputFile(item.ofstrInputFile, ofstrOutputFile, options, pWrite->result, pMetrics))
+				nWritten = pWrite->result.nClonedBytes;
+			else
+				iResult = iResult < 0 ? iResult - RESULT_FAILED_TO_CLONE_OFFSET : iResult + RESULT_FAILED_TO_CLONE_OFFSET;
+		}
+		const double dWrite = SecondsSince(tStart);
+		{
+			std::lock_guard<std::mutex> lock(pState->mutex);
+			pState->dWrite += dWrite;
+			pState->nBytesWritten += nWritten;
+		}
+		pWrite->strOut += osOut.str();
+		pWrite->strErr += osErr.str();
+		FinishPipelineWrite(pState, pWrite);
+	}
+}
+
+// start the pipeline threads; they end when all items are done
+static void StartPipeline(PipelineState& state, size_t nWorkers, STD_NAMESPACE vector<std::thread>& threads)
+{
+	const size_t nIOThreads = _nIOThreads < state.nDepth ? _nIOThreads : state.nDepth;
+	state.nWorkersRunning = nWorkers;
+	for (size_t iThread = 0; iThread < nIOThreads; iThread++)
+		threads.push_back(std::thread(PipelineReader, &state));
+	for (size_t iThread = 0; iThread < nWorkers; iThread++)
+		threads.push_back(std::thread(PipelineWorker, &state));
+	for (size_t iThread = 0; iThread < nIOThreads; iThread++)
+		threads.push_back(std::thread(PipelineWriter, &state));
+}
+
+// process all batch parameters with the options and data dictionary loaded once
+static int RunBatch(OFCommandLine& cmd)
+{
+	if (_ofstrOutputDir.empty() && !_options.bForceOutput && !_bTriageOnly)
+	{
+		LogLine(ELL_error) << "ERROR: Use --force to overwrite the original files, or specify an output directory.";
+		return RESULT_FAILED_TO_CREATE;
+	}
+	if (!_ofstrOutputDir.empty() && !OFStandard::dirExists(_ofstrOutputDir) && OFStandard::createDirectory(_ofstrOutputDir, OFFilename()).bad())
+	{
+		LogLine(ELL_error) << "ERROR: could not create output directory: " << _ofstrOutputDir;
+		return RESULT_FAILED_TO_CREATE;
+	}
+
+	OFVector<BatchItem> items;
+	const int nArgs = cmd.getParamCount();
+	for (int iArg = 0; iArg < nArgs; iArg++)
+	{
+		OFString ofstrParam;
+		if (cmd.getParam(iArg + 1, ofstrParam) == OFCommandLine::E_ParamValueStatus::PVS_Normal && !AddBatchInput(ofstrParam, items))
+			return RESULT_FAILED_TO_READ;
+	}
+
+	// create the output tree up front, so workers never race on creating the same directory; in-place
+	// outputs are next to their inputs, which exist
+	OFString ofstrLastDir;
+	for (size_t iItem = 0; iItem < items.size() && !_bTriageOnly && !_ofstrOutputDir.empty(); iItem++)
+	{
+		if (items[iItem].ofstrOutputFile == items[iItem].ofstrInputFile)
+			continue;
+		OFString ofstrDir;
+		OFStandard::getDirNameFromPath(ofstrDir, items[iItem].ofstrOutputFile, OFFalse); // empty for a bare file name
+		if (ofstrDir.empty() || ofstrDir == ofstrLastDir)
+			continue;
+		if (!OFStandard::dirExists(ofstrDir) && OFStandard::createDirectory(ofstrDir, _ofstrOutputDir).bad())
+		{
+			LogLine(ELL_error) << "ERROR: could not create output directory: " << ofstrDir;
+			return RESULT_FAILED_TO_CREATE;
+		}
+		ofstrLastDir = ofstrDir;
+	}
+
+	int iAggregate = RESULT_SUCCESS;
+	unsigned long nSucceeded = 0, nWarnings = 0, nFailed = 0;
+	unsigned long nTriaged[TRIAGE_CLASSES] = { 0 };
+	OFCmdUnsignedInt nJobs = _nJobs ? _nJobs : std::thread::hardware_concurrency();
+	if (nJobs > items.size())
+		nJobs = OFstatic_cast(OFCmdUnsignedInt, items.size());
+
+	BatchQueue queue(items);
+	PipelineState pipeline(queue, _nPrefetch);
+	STD_NAMESPACE vector<std::thread> workers;
+	const OFBool bPipeline = _nPrefetch > 0 && !_bTriageOnly;
+	if (bPipeline)
+	{
+		LogLine(ELL_info) << "INFO: starting pipeline: prefetch " << _nPrefetch << ", " << nJobs << " workers";
+		StartPipeline(pipeline, nJobs ? nJobs : 1, workers);
+	}
+	else if (nJobs > 1)
+	{
+		LogLine(ELL_info) << "INFO: starting " << nJobs << " workers";
+		for (OFCmdUnsignedInt iJob = 0; iJob < nJobs; iJob++)
+			workers.push_back(std::thread(BatchWorker, &queue));
+	}
+
+	for (size_t iItem = 0; iItem < items.size(); iItem++)
+	{
+		int iResult;
+		LogContext context(items[iItem].ofstrInputFile);
+		if (workers.empty())
+		{
+			OFOStringStream osOut, osErr;
+			const AmendResult result = ProcessBatchItem(items[iItem], osOut, osErr);
+			iResult = result.code;
+			context.ofstrSOPInstanceUID = result.ofstrSOPInstanceUID;
+			_log.writeLines(osOut.str(), &context);
+			_log.writeLines(osErr.str(), &context);
 		}
 		else
 		{
-			CERR << "ERROR: could not clone " << ofstrOutputFile;
-			return (resultSoFar<0 ? resultSoFar-RESULT_FAILED_TO_CLONE_OFFSET: resultSoFar+RESULT_FAILED_TO_CLONE_OFFSET);
+			// collect results in input order, while the workers carry on with the rest
+			std::unique_lock<std::mutex> lock(queue.mutex);
+			while (!queue.done[iItem])
+				queue.cvDone.wait(lock);
+			iResult = queue.results[iItem];
+			context.ofstrSOPInstanceUID = queue.uids[iItem];
+			_log.writeLines(queue.outLogs[iItem], &context);
+			_log.writeLines(queue.errLogs[iItem], &context);
+			STD_NAMESPACE string().swap(queue.outLogs[iItem]);
+			STD_NAMESPACE string().swap(queue.errLogs[iItem]);
 		}
+
+		if (_bTriageOnly)
+		{
+			LogLine(ELL_output, &context) << "TRIAGE: " << triageClassName(iResult) << " " << items[iItem].ofstrInputFile;
+			nTriaged[iResult]++;
+			continue;
+		}
+
+		// per-file status line: result code and input file
+		LogLine(ELL_output, &context) << "RESULT: " << iResult << " " << items[iItem].ofstrInputFile;
+
+		if (iResult < 0) nFailed++;
+		else if (iResult > 0) nWarnings++;
+		else nSucceeded++;
+		iAggregate = AggregateResult(iAggregate, iResult);
+	}
+
+	for (size_t iJob = 0; iJob < workers.size(); iJob++)
+		workers[iJob].join();
+
+	if (bPipeline)
+	{
+		// I/O time minus the time the workers waited for it is the part that overlapped with amending
+		const double dReadOverlap = pipeline.dRead > pipeline.dReadStall ? pipeline.dRead - pipeline.dReadStall : 0;
+		const double dWriteOverlap = pipeline.dWrite > pipeline.dWriteStall ? pipeline.dWrite - pipeline.dWriteStall : 0;
+		LogLine(ELL_output) << "PIPELINE: read " << pipeline.nBytesRead << " bytes in " << pipeline.dRead << " s (" << dReadOverlap << " s overlapped), wrote "
+			<< pipeline.nBytesWritten << " bytes in " << pipeline.dWrite << " s (" << dWriteOverlap << " s overlapped)";
+	}
+
+	if (_bTriageOnly)
+	{
+		LogLine line(ELL_output);
+		line << "INFO: triaged " << items.size() << " files:";
+		for (int iClass = 0; iClass < TRIAGE_CLASSES; iClass++)
+			line << " " << triageClassName(iClass) << "=" << nTriaged[iClass];
+		return RESULT_SUCCESS;
+	}
+
+	LogLine(ELL_info) << "INFO: processed " << items.size() << " files: " << nSucceeded << " succeeded, " << nWarnings << " warnings, " << nFailed << " failed";
+	Uint64 nResident, nPeak;
+	ProcessMemory(nResident, nPeak);
+	LogLine(ELL_info) << "INFO: peak resident size " << nPeak / (1024 * 1024) << " MB; " << _memoryBudget.getWaits() << " files waited for the memory budget";
+
+	return iAggregate;
+}
+
+// watch mode: a file that was written into the spool directory and waits to be amended
+struct WatchJob
+{
+	OFString ofstrInputFile;
+	std::chrono::steady_clock::time_point tQueued;
+};
+
+// watch mode: spool queue shared by the inotify reader and the workers, plus the counters
+struct WatchQueue
+{
+	WatchQueue()
+		: bStop(OFFalse), nQueued(0), nMaxDepth(0), nSucceeded(0), nWarnings(0), nFailed(0), dLatencySum(0), dLatencyMax(0) {}
+
+	STD_NAMESPACE deque<WatchJob> jobs;
+	STD_NAMESPACE set<OFString> pending;	// queued or in progress; ignores repeated events for the same file
+	STD_NAMESPACE set<OFString> replaced;	// pending files that got another event, i.e. a new export with the same name
+	OFBool bStop;
+	std::mutex mutex;
+	std::condition_variable cvJobs;
+	// counters
+	unsigned long nQueued, nMaxDepth, nSucceeded, nWarnings, nFailed;
+	double dLatencySum, dLatencyMax;		// seconds from queued to done
+};
+
+static volatile sig_atomic_t _bWatchStop = 0;
+static volatile sig_atomic_t _bWatchStats = 0;
+
+static void WatchSignalHandler(int iSignal)
+{
+	if (iSignal == SIGINT || iSignal == SIGTERM)
+		_bWatchStop = 1;
+	else
+		_bWatchStats = 1;
+}
+
+// move a file, falling back to copy and delete when rename is not possible (e.g. across volumes)
+static OFBool MoveFile(const OFString& ofstrFrom, const OFString& ofstrTo)
+{
+	if (OFStandard::renameFile(ofstrFrom, ofstrTo))
+		return OFTrue;
+	return OFStandard::copyFile(ofstrFrom, ofstrTo) && OFStandard::deleteFile(ofstrFrom);
+}
+
+// bEvent: for an inotify event, which for a pending file means it was replaced (a rescan only finds it again)
+static void WatchEnqueue(WatchQueue& queue, const OFString& ofstrInputFile, OFBool bEvent)
+{
+	// writers commonly use hidden names for files in progress
+	OFString ofstrFilename;
+	OFStandard::getFilenameFromPath(ofstrFilename, ofstrInputFile);
+	if (ofstrFilename.empty() || ofstrFilename[0] == '.')
+		return;
+
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (!queue.pending.insert(ofstrInputFile).second)
+	{
+		if (bEvent)
+			queue.replaced.insert(ofstrInputFile); // queued again when the current job is done
+		return;
+	}
+	WatchJob job;
+	job.ofstrInputFile = ofstrInputFile;
+	job.tQueued = std::chrono::steady_clock::now();
+	queue.jobs.push_back(job);
+	queue.nQueued++;
+	if (queue.jobs.size() > queue.nMaxDepth)
+		queue.nMaxDepth = OFstatic_cast(unsigned long, queue.jobs.size());
+	queue.cvJobs.notify_one();
+}
+
+// queue everything that is already in the spool directory (at startup and after an event queue overflow)
+static void WatchScanDirectory(WatchQueue& queue)
+{
+	OFList<OFString> files;
+	OFStandard::searchDirectoryRecursively(_ofstrWatchDir, files, "", "", OFFalse);
+	for (OFListIterator(OFString) it = files.begin(); it != files.end(); ++it)
+		WatchEnqueue(queue, *it, OFFalse);
+}
+
+static void PrintWatchStats(WatchQueue& queue)
+{
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	const unsigned long nDone = queue.nSucceeded + queue.nWarnings + queue.nFailed;
+	Uint64 nResident, nPeak;
+	ProcessMemory(nResident, nPeak);
+	LogLine(ELL_output) << "STATS: queued=" << queue.nQueued << " depth=" << queue.jobs.size() << " maxdepth=" << queue.nMaxDepth
+		<< " succeeded=" << queue.nSucceeded << " warnings=" << queue.nWarnings << " failed=" << queue.nFailed
+		<< " latency_avg_ms=" << (nDone ? 1000.0 * queue.dLatencySum / nDone : 0.0) << " latency_max_ms=" << 1000.0 * queue.dLatencyMax
+		<< " rss_MB=" << nResident / (1024 * 1024) << " peak_rss_MB=" << nPeak / (1024 * 1024)
+		<< " reserved_MB=" << _memoryBudget.getReserved() / (1024 * 1024) << " budget_waits=" << _memoryBudget.getWaits();
+}
+
+static void WatchWorker(WatchQueue* pQueue)
+{
+	for (;;)
+	{
+		WatchJob job;
+		{
+			std::unique_lock<std::mutex> lock(pQueue->mutex);
+			while (pQueue->jobs.empty() && !pQueue->bStop)
+				pQueue->cvJobs.wait(lock);
+			if (pQueue->jobs.empty())
+				break; // stopped and drained
+			job = pQueue->jobs.front();
+			pQueue->jobs.pop_front();
+		}
+
+		OFString ofstrFilename, ofstrOutputFile, ofstrErrorFile;
+		OFStandard::getFilenameFromPath(ofstrFilename, job.ofstrInputFile);
+		OFStandard::combineDirAndFilename(ofstrOutputFile, _ofstrOutputDir, ofstrFilename, OFTrue);
+		OFStandard::combineDirAndFilename(ofstrErrorFile, _ofstrErrorDir, ofstrFilename, OFTrue);
+
+		OFOStringStream osOut, osErr;
+		const AmendResult result = AmendFileMeasured(job.ofstrInputFile, ofstrOutputFile, osOut, osErr);
+		const int iResult = result.code;
+
+		// amended or cloned: the input is done; anything else (including a failed clone) goes to the error directory
+		const OFBool bDone = iResult >= RESULT_SUCCESS && iResult < RESULT_FAILED_TO_CLONE_OFFSET;
+
+		// release the name before the input goes, so an export arriving from now on is queued again; one that
+		// arrived while this file was processed has replaced the input, so that is kept and queued instead
+		OFBool bReplaced;
+		{
+			std::lock_guard<std::mutex> lock(pQueue->mutex);
+			pQueue->pending.erase(job.ofstrInputFile);
+			bReplaced = pQueue->replaced.erase(job.ofstrInputFile) > 0;
+		}
+		if (bReplaced)
+			WatchEnqueue(*pQueue, job.ofstrInputFile, OFFalse);
+		else if (bDone)
+		{
+			if (!OFStandard::deleteFile(job.ofstrInputFile))
+				osErr << "ERROR: could not remove input file: " << job.ofstrInputFile << endl;
+		}
+		else if (!MoveFile(job.ofstrInputFile, ofstrErrorFile))
+			osErr << "ERROR: could not move input file to error directory: " << job.ofstrInputFile << endl;
+
+		const double dLatency = std::chrono::duration<double>(std::chrono::steady_clock::now() - job.tQueued).count();
+
+		std::lock_guard<std::mutex> lock(pQueue->mutex);
+		const LogContext context(job.ofstrInputFile, result.ofstrSOPInstanceUID);
+		_log.writeLines(osOut.str(), &context);
+		_log.writeLines(osErr.str(), &context);
+		LogLine(ELL_output, &context) << "RESULT: " << iResult << " " << job.ofstrInputFile;
+		if (!bDone) pQueue->nFailed++;
+		else if (iResult > 0) pQueue->nWarnings++;
+		else pQueue->nSucceeded++;
+		pQueue->dLatencySum += dLatency;
+		if (dLatency > pQueue->dLatencyMax)
+			pQueue->dLatencyMax = dLatency;
 	}
-	return RESULT_FAILED_TO_READ - RESULT_FAILED_TO_CLONE_OFFSET;
 }
 
-static OFString& HumanReadableName(OFString& s)
+// retrospective conversion: the most severe result of all crawled files
+static std::mutex _mutexCrawl;
+static int _iCrawlResult = RESULT_SUCCESS;
+
+static AmendResult AmendCrawledFile(const OFString& ofstrInputFile, const OFString& ofstrOutputFile, STD_NAMESPACE ostream& osOut, STD_NAMESPACE ostream& osErr)
 {
-	// removes carets from DICOM PN
-	static const OFString _ofstrCaret3("^^^");
-	static const OFString _ofstrCaret2("^^");
-	static const OFString _ofstrCaret("^");
-	static const OFString _ofstrCommaSpace(", ");
-	OFStringUtil::replace_all(s, _ofstrCaret3, _ofstrCaret);
-	OFStringUtil::replace_all(s, _ofstrCaret2, _ofstrCaret);
-	OFStringUtil::replace_all(s, _ofstrCaret2, _ofstrCaret);
-	if (*s.begin() == '^') s.erase(0, 1);
-	if (*(s.end()-1) == '^') s.erase(s.length()-1, 1);
-	OFStringUtil::replace_all(s, _ofstrCaret, _ofstrCommaSpace);
-	return s;
+	const AmendResult result = AmendFileIndexed(ofstrInputFile, ofstrOutputFile, osOut, osErr);
+	std::lock_guard<std::mutex> lock(_mutexCrawl);
+	_iCrawlResult = AggregateResult(_iCrawlResult, result.code);
+	return result;
+}
+
+// crawl archive trees; SIGINT/SIGTERM stop after the files in progress (resume with the same --journal)
+static int RunRetrospective(OFCommandLine& cmd)
+{
+	if (_ofstrOutputDir.empty() && !_options.bForceOutput)
+	{
+		LogLine(ELL_error) << "ERROR: Use --force to amend the archive in-place, or specify an output directory.";
+		return RESULT_FAILED_TO_CREATE;
+	}
+	if (!_ofstrOutputDir.empty() && !OFStandard::dirExists(_ofstrOutputDir) && OFStandard::createDirectory(_ofstrOutputDir, OFFilename()).bad())
+	{
+		LogLine(ELL_error) << "ERROR: could not create output directory: " << _ofstrOutputDir;
+		return RESULT_FAILED_TO_CREATE;
+	}
+
+	const int nArgs = cmd.getParamCount();
+	for (int iArg = 0; iArg < nArgs; iArg++)
+	{
+		OFString ofstrParam;
+		if (cmd.getParam(iArg + 1, ofstrParam) != OFCommandLine::E_ParamValueStatus::PVS_Normal)
+			continue;
+		if (!OFStandard::dirExists(ofstrParam))
+		{
+			LogLine(ELL_error) << "ERROR: not a directory: " << ofstrParam;
+			return RESULT_FAILED_TO_READ;
+		}
+		_crawlerConfig.roots.push_back(ofstrParam);
+	}
+	_crawlerConfig.ofstrOutputDir = _ofstrOutputDir;
+	_crawlerConfig.nWorkers = _nJobs ? _nJobs : std::thread::hardware_concurrency();
+
+	signal(SIGINT, WatchSignalHandler);
+	signal(SIGTERM, WatchSignalHandler);
+	const int iCrawlResult = RunCrawler(_crawlerConfig, AmendCrawledFile, &_bWatchStop);
+	return AggregateResult(_iCrawlResult, iCrawlResult);
+}
+
+// archive mode: the most severe result of all amended members
+static std::mutex _mutexArchive;
+static int _iArchiveResult = RESULT_SUCCESS;
+
+static AmendResult AmendArchiveMember(const OFString& ofstrMember, const OFVector<Uint8>& input, OFVector<Uint8>& output, STD_NAMESPACE ostream& osOut, STD_NAMESPACE ostream& osErr)
+{
+	FileMetrics metrics;
+	metrics.nBytesRead = input.size();
+	const AmendResult result = amendStream(input, output, MakeOptions(osOut, osErr), _metrics.isEnabled() ? &metrics : NULL);
+	if (_metrics.isEnabled())
+		_metrics.add(ofstrMember, result.code, metrics);
+	std::lock_guard<std::mutex> lock(_mutexArchive);
+	_iArchiveResult = AggregateResult(_iArchiveResult, result.code);
+	return result;
+}
+
+// amend the ECGs in a tar or zip bundle into a new bundle (default: replace the input, with --force)
+static int RunArchiveMode(OFCommandLine& cmd)
+{
+	const int nArgs = cmd.getParamCount();
+	if (nArgs < 1 || nArgs > 2)
+	{
+		LogLine(ELL_error) << "ERROR: --archive requires an input archive and optionally an output archive.";
+		return RESULT_FAILED_TO_READ;
+	}
+	OFString ofstrInputFile, ofstrOutputFile;
+	cmd.getParam(1, ofstrInputFile);
+	if (nArgs == 2)
+		cmd.getParam(2, ofstrOutputFile);
+	else
+		ofstrOutputFile = ofstrInputFile;
+	if (!_options.bForceOutput && OFStandard::fileExists(ofstrOutputFile))
+	{
+		LogLine(ELL_error) << "ERROR: Output file exists; use --force to overwrite: " << ofstrOutputFile;
+		return RESULT_FAILED_TO_CREATE;
+	}
+
+	_archiveConfig.nWorkers = _nJobs ? _nJobs : std::thread::hardware_concurrency();
+	_archiveConfig.bNoCloneOnError = _options.bNoCloneOnError;
+	const int iArchiveResult = RunArchive(_archiveConfig, ofstrInputFile, ofstrOutputFile, AmendArchiveMember, _committer);
+	return AggregateResult(_iArchiveResult, iArchiveResult);
+}
+
+// relay mode: amend a received dataset in memory; amend() leaves it unchanged when it fails, so
+// the dataset is then forwarded as it was received
+static int AmendRelayDataset(DcmDataset& dataset, STD_NAMESPACE ostream& out, STD_NAMESPACE ostream& err)
+{
+	return amend(dataset, MakeOptions(out, err)).code;
+}
+
+// resident mode: amend every file that is closed after writing in (or moved into) the spool directory
+static int RunWatch()
+{
+#ifdef __linux__
+	if (_ofstrOutputDir.empty() || _ofstrErrorDir.empty())
+	{
+		LogLine(ELL_error) << "ERROR: --watch requires --output-dir and --error-dir.";
+		return RESULT_FAILED_TO_CREATE;
+	}
+	if ((!OFStandard::dirExists(_ofstrOutputDir) && OFStandard::createDirectory(_ofstrOutputDir, OFFilename()).bad())
+		|| (!OFStandard::dirExists(_ofstrErrorDir) && OFStandard::createDirectory(_ofstrErrorDir, OFFilename()).bad()))
+	{
+		LogLine(ELL_error) << "ERROR: could not create output or error directory.";
+		return RESULT_FAILED_TO_CREATE;
+	}
+
+	const int fdNotify = inotify_init1(IN_CLOEXEC);
+	if (fdNotify < 0 || inotify_add_watch(fdNotify, _ofstrWatchDir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		LogLine(ELL_error) << "ERROR: could not watch directory: " << _ofstrWatchDir << ": " << strerror(errno);
+		if (fdNotify >= 0)
+			close(fdNotify);
+		return RESULT_FAILED_TO_READ;
+	}
+
+	signal(SIGINT, WatchSignalHandler);
+	signal(SIGTERM, WatchSignalHandler);
+	signal(SIGUSR1, WatchSignalHandler);
+
+	WatchQueue queue;
+	STD_NAMESPACE vector<std::thread> workers;
+	const OFCmdUnsignedInt nJobs = _nJobs ? _nJobs : std::thread::hardware_concurrency();
+	for (OFCmdUnsignedInt iJob = 0; iJob < (nJobs ? nJobs : 1); iJob++)
+		workers.push_back(std::thread(WatchWorker, &queue));
+
+	LogLine(ELL_info) << "INFO: watching " << _ofstrWatchDir << " with " << workers.size() << " workers; SIGUSR1 prints statistics";
+
+	// the watch is already active, so files arriving during the scan are not missed (duplicates are ignored)
+	WatchScanDirectory(queue);
+
+	char buffer[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+	std::chrono::steady_clock::time_point tMetrics = std::chrono::steady_clock::now();
+	while (!_bWatchStop)
+	{
+		if (_bWatchStats)
+		{
+			_bWatchStats = 0;
+			PrintWatchStats(queue);
+		}
+		if (_metrics.isEnabled() && std::chrono::steady_clock::now() - tMetrics >= std::chrono::seconds(10))
+		{
+			tMetrics = std::chrono::steady_clock::now();
+			FinishMetrics(RESULT_SUCCESS);
+		}
+
+		struct pollfd pfd;
+		pfd.fd = fdNotify;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) <= 0)
+		{
+			_memoryBudget.trimIfIdle();
+			continue; // timeout or signal
+		}
+
+		const ssize_t nRead = read(fdNotify, buffer, sizeof(buffer));
+		for (ssize_t iPos = 0; iPos < nRead; )
+		{
+			const struct inotify_event* pEvent = OFreinterpret_cast(const struct inotify_event*, buffer + iPos);
+			if (pEvent->mask & IN_Q_OVERFLOW)
+			{
+				LogLine(ELL_warn) << "WARN: inotify event queue overflow; rescanning " << _ofstrWatchDir;
+				WatchScanDirectory(queue);
+			}
+			else if (pEvent->len > 0 && !(pEvent->mask & IN_ISDIR))
+			{
+				OFString ofstrInputFile;
+				OFStandard::combineDirAndFilename(ofstrInputFile, _ofstrWatchDir, pEvent->name, OFTrue);
+				WatchEnqueue(queue, ofstrInputFile, OFTrue);
+			}
+			iPos += sizeof(struct inotify_event) + pEvent->len;
+		}
+	}
+
+	LogLine(ELL_info) << "INFO: stopping; finishing queued files";
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.bStop = OFTrue;
+		queue.cvJobs.notify_all();
+	}
+	for (size_t iJob = 0; iJob < workers.size(); iJob++)
+		workers[iJob].join();
+	close(fdNotify);
+
+	PrintWatchStats(queue);
+	return RESULT_SUCCESS;
+#else
+	LogLine(ELL_error) << "ERROR: --watch is only supported on Linux.";
+	return RESULT_FAILED_TO_CREATE;
+#endif
 }
 
 int main(int argc, char* argv[])
@@ -118,48 +1116,118 @@ int main(int argc, char* argv[])
 	OFCommandLine cmd;
 	OFFilename ofstrInputFile;
 	OFFilename ofstrOutputFile;
-	E_FileReadMode readMode = ERM_autoDetect;
-	E_TransferSyntax xfer = EXS_Unknown;
-	OFCmdUnsignedInt maxReadLength = 128; // default is 128 bytes
-	DcmFileFormat dfile;
-	OFCondition cond;
+	E_SyncMode eSyncMode = ESM_none;
+	OFCmdUnsignedInt nSyncGroup = 64;
+	OFCmdUnsignedInt nSyncDelay = 10;
+	OFCmdUnsignedInt nDeflateThreads = 0;
+	OFCmdUnsignedInt nMemoryBudget = 2048;
+	E_LogLevel eLogLevel = ELL_warn;
+	E_LogFormat eLogFormat = ELF_text;
 
 	cmd.setOptionColumns(LONGCOL, SHORTCOL);
 	cmd.setParamColumn(LONGCOL + SHORTCOL + 4);
 
-	cmd.addParam("dcmfile-in",  "DICOM input filename to be converted", OFCmdParam::PM_Mandatory);
-	cmd.addParam("dcmfile-out", "DICOM output filename (default: dcmfile-in)", OFCmdParam::PM_Optional);
+	cmd.addParam("dcmfile-in",  "DICOM input filename to be converted, - for stdin\n(batch: file, directory or @filelist; watch: none)", OFCmdParam::PM_Optional);
+	cmd.addParam("dcmfile-out", "DICOM output filename (default: dcmfile-in)\n(batch: more input files, directories or @filelists)", OFCmdParam::PM_MultiOptional);
 
 	cmd.addGroup("general options:", LONGCOL, SHORTCOL + 2);
 	cmd.addOption("--help", "-h", "print this help text and exit");
 	cmd.addOption("--version", "print version information and exit", OFTrue /* exclusive */);
 	cmd.addOption("--verbose", "-v", "verbose mode, print processing details");
+	cmd.addOption("--log-level", "-l", 1, "[l]evel: error, warn, info or debug", "messages to print (default: warn; verbose: debug)");
+	cmd.addOption("--log-json", "print messages as JSON lines with time, level,\nfile and SOPInstanceUID");
+	cmd.addOption("--log-buffer", 1, "[n]umber: integer (default: 8192)", "messages buffered for the log writer; when it is\nfull, info and debug messages are dropped");
+	cmd.addOption("--full-dictionary", "load the complete data dictionary at startup,\nnot only the embedded tags (if compiled in)");
 
 	cmd.addGroup("output options:");
 	//cmd.addSubGroup("filesystem options:");
-	cmd.addOption("--force", "-f", "overwrite existing file");
+	cmd.addOption("--force", "-f", "overwrite existing file (a new file with the mode,\nowner and group of the old one; hard links to it\nkeep the old content)");
 	cmd.addOption("--no-clone", "-n", "don't try to create clone on errors");
+	cmd.addOption("--clone-method", "-c", 1, "[m]ethod: copy, fast or hardlink", "how to clone on errors (default: copy)\nfast: reflink, else copy_file_range\nhardlink: hardlink on the same volume, else fast");
 	cmd.addOption("--merge-lines", "-m", "merge amended lines into one paragraph");
-	cmd.addOption("--retrospective-conversion", "-r", "retrospective (offline) conversion");
+	cmd.addOption("--rules", "-u", 1, "[f]ile: string", "annotation rules (default: built-in Muse rules),\none per line: tag | label | text or name |\nline when missing | suppress when in annotation");
+	cmd.addOption("--load-short", "-M", "don't load waveform data into memory; copy it\nfrom the input file while saving (not in-place)");
+	cmd.addOption("--splice", "-s", "only rewrite the WaveformAnnotationSequence and\ncopy the rest of the input as is (not in-place)");
+	cmd.addOption("--fsync", "-y", 1, "[m]ode: none, file, group or syncfs", "sync outputs before they replace the destination\n(default: none, only atomic rename); file: fsync\neach output and its directory; group: each worker\nfsyncs its output, the renames of parallel workers\nshare one directory fsync; syncfs: one syncfs()\nper group of outputs (Linux)");
+	cmd.addOption("--fsync-group", 1, "[n]umber: integer (default: 64)", "group modes: at most n outputs per group (limited\nby the number of workers)");
+	cmd.addOption("--fsync-delay", 1, "[t]ime: integer (default: 10)", "group modes: commit at most t ms after an output\nwas written, even if the group isn't full");
+	cmd.addOption("--write-deflated", "-x", "write Deflated Explicit VR Little Endian (deflated\ninputs are always written deflated); --splice is\nignored for these outputs");
+	cmd.addOption("--deflate-level", 1, "[l]evel: integer (default: 6)", "zlib compression level of deflated outputs, 0-9");
+	cmd.addOption("--deflate-threads", 1, "[n]umber: integer (default: 0)", "threads that deflate one output in parallel\n(0: CPU cores divided by the number of jobs)");
+	cmd.addOption("--verify", "compare a digest of the WaveformData and of all other\nelements but the annotations of input and output;\nprints a VERIFY line per file, a mismatch fails it\nwith result -5 (not in relay mode)");
+	cmd.addOption("--stdio", "-p", "filter: read stdin and write stdout (same as '-'\nas input); passes the input through on errors");
+
+	cmd.addGroup("batch options:");
+	cmd.addOption("--batch", "-b", "all parameters are inputs; print one RESULT line\nper file and exit with the most severe result");
+	cmd.addOption("--output-dir", "-o", 1, "[d]irectory: string", "write output files to directory d (implies --batch)");
+	cmd.addOption("--jobs", "-j", 1, "[n]umber: integer (default: 1)", "amend n files in parallel (0: one per CPU core)");
+	cmd.addOption("--prefetch", "-d", 1, "[n]umber: integer (default: 0)", "read up to n inputs ahead and write outputs in\nthe background, overlapping I/O with amending\n(in memory: not with --load-short/--splice; --triage\nunused)");
+	cmd.addOption("--io-threads", 1, "[n]umber: integer (default: 4)", "prefetch: reader and writer threads (each)");
+	cmd.addOption("--memory-budget", 1, "[m]egabytes: integer (default: 2048)", "files in progress (about twice their size each)\nmay take at most m MB together; workers wait for\nit (batch, watch and crawl; 0: unlimited)");
+	cmd.addOption("--index", "-i", 1, "[f]ile: string", "record the result of every input in index f (and\nf.log); inputs with the same path, size and mtime\nas recorded are skipped (batch and single file)");
+
+	cmd.addGroup("triage options:");
+	cmd.addOption("--triage", "-t", "pre-screen the raw tags; only files that need to\nbe amended are parsed with DCMTK");
+	cmd.addOption("--triage-only", "-T", "only classify the inputs, one TRIAGE line per file\n(implies --batch)");
+
+	cmd.addGroup("relay options:");
+	cmd.addOption("--relay", "-R", 1, "[p]ort: integer", "accept C-STORE associations on port p, amend the\nobjects in memory and forward them (see --forward);\nthe original is forwarded if it can't be amended");
+	cmd.addOption("--forward", "-F", 1, "[d]estination: aetitle@host:port", "relay mode: forward to this C-STORE SCP (e.g. VNA)");
+	cmd.addOption("--aetitle", "-a", 1, "[a]etitle: string (default: AMENDECG)", "relay mode: own AE title");
+	cmd.addOption("--max-associations", "-A", 1, "[n]umber: integer (default: 8)", "relay mode: concurrent incoming associations");
+	cmd.addOption("--queue-size", "-Q", 1, "[n]umber: integer (default: 16)", "relay mode: objects waiting to be forwarded; senders\nare held when full (--jobs sets the forwarders)");
+
+	cmd.addGroup("retrospective conversion options:");
+	cmd.addOption("--retrospective-conversion", "-r", "retrospective (offline) conversion: crawl the\nparameters as archive trees, in-place (--force) or\ninto --output-dir; prints PROGRESS lines with eta");
+	cmd.addOption("--journal", "-k", 1, "[f]ile: string", "record completed directories in file f; a rerun\nwith the same f resumes where the crawl stopped\n(directories with read/write failures are redone)");
+	cmd.addOption("--walkers", 1, "[n]umber: integer (default: 4)", "threads listing directories");
+	cmd.addOption("--max-read-rate", 1, "[r]ate: float", "read at most r MB/s (default: unlimited)");
+	cmd.addOption("--max-write-rate", 1, "[r]ate: float", "write at most r MB/s (default: unlimited)");
+	cmd.addOption("--max-iops", 1, "[n]umber: float", "at most n I/O operations per second; a directory\nlisting or a file (per started MB) is one operation");
+
+	cmd.addGroup("archive options:");
+	cmd.addOption("--archive", "-g", "the parameters are an input and output tar or zip\nbundle (default output: the input, with --force);\nmembers are amended in memory (--jobs in parallel)");
+	cmd.addOption("--archive-inflight", 1, "[n]umber: integer (default: 32)", "archive mode: members read ahead of the writer");
+	cmd.addOption("--archive-memory", 1, "[m]egabytes: integer (default: 512)", "archive mode: memory for the members in flight;\na larger member is processed on its own");
 
+	cmd.addGroup("metrics options:");
+	cmd.addOption("--metrics-json", "-J", 1, "[f]ile: string", "append wall/CPU time per stage, sizes and result\nof every file as one JSON line to file f");
+	cmd.addOption("--metrics-prom", "-P", 1, "[f]ile: string", "write totals per stage and result to file f in\nPrometheus textfile format (watch: every 10 s)");
+
+	cmd.addGroup("watch options:");
+	cmd.addOption("--watch", "-w", 1, "[d]irectory: string", "keep running and amend every file written to\ndirectory d into --output-dir; inputs are removed\nwhen done (SIGUSR1: print statistics, SIGTERM: stop)");
+	cmd.addOption("--error-dir", "-e", 1, "[d]irectory: string", "watch mode: move inputs that failed to directory d");
+
+
+	// the embedded dictionary (if compiled in) has to be in place before anything looks up a tag, e.g. --rules
+	FileMetrics dictionaryMetrics;
+	{
+		StageTimer timer(&dictionaryMetrics, EMS_dictionary);
+		installEmbeddedDictionary();
+	}
 
 	/* evaluate command line */
 	prepareCmdLineArgs(argc, argv, MY_NAME);
 
+	// parameters starting with '@' are file lists (see batch options), not DCMTK command files
 #ifdef HAVE_WINDOWS_H
 #if OFFIS_DCMTK_VERSION_NUMBER>354
-	const int CLflags = OFCommandLine::PF_ExpandWildcards;
+	const int CLflags = OFCommandLine::PF_ExpandWildcards | OFCommandLine::PF_NoCommandFiles;
 #else
-	const int CLflags = OFCommandLine::ExpandWildcards;
+	const int CLflags = OFCommandLine::ExpandWildcards | OFCommandLine::NoCommandFiles;
 #endif
 #else
-	const int CLflags = 0;
+#if OFFIS_DCMTK_VERSION_NUMBER>354
+	const int CLflags = OFCommandLine::PF_NoCommandFiles;
+#else
+	const int CLflags = OFCommandLine::NoCommandFiles;
+#endif
 #endif
 	if (app.parseCommandLine(cmd, argc, argv, CLflags))
 	{
 		/* check exclusive options first */
 
-		if (cmd.getParamCount() == 0)
+		if (cmd.getParamCount() == 0 && !cmd.findOption("--watch") && !cmd.findOption("--stdio") && !cmd.findOption("--relay"))
 		{
 			app.printHeader(OFTrue /*print host identifier*/);
 			app.printUsage(&cmd);
@@ -174,421 +1242,406 @@ int main(int argc, char* argv[])
 			app.printUsage(&cmd);
 
 		if (cmd.findOption("--verbose"))
-			_bVerbose = OFTrue;
+			eLogLevel = ELL_debug;
+
+		if (cmd.findOption("--log-level"))
+		{
+			OFString ofstrLevel;
+			app.checkValue(cmd.getValue(ofstrLevel));
+			if (!AsyncLog::parseLevel(ofstrLevel, eLogLevel))
+				app.printError("unknown --log-level; use error, warn, info or debug");
+		}
+
+		if (cmd.findOption("--log-json"))
+			eLogFormat = ELF_json;
+
+		if (cmd.findOption("--log-buffer"))
+			app.checkValue(cmd.getValueAndCheckMinMax(_nLogBuffer, 16, 1048576));
+
+		if (cmd.findOption("--full-dictionary"))
+		{
+			StageTimer timer(&dictionaryMetrics, EMS_dictionary);
+			requireFullDictionary();
+		}
 
 		if (cmd.findOption("--force"))
-			_bforceOutput = OFTrue;
+			_options.bForceOutput = OFTrue;
 
 		if (cmd.findOption("--no-clone"))
-			_bNoCloneOnErrror = OFTrue;
+			_options.bNoCloneOnError = OFTrue;
 
-		if (cmd.findOption("--merge-lines"))
-			_bMergeLines = OFTrue;
-
-//		if (cmd.findOption("--retrospective-conversion"))
-//			_bRetrospectiveConversion = OFTrue;
-	}
+		if (cmd.findOption("--clone-method"))
+		{
+			OFString ofstrMethod;
+			app.checkValue(cmd.getValue(ofstrMethod));
+			if (ofstrMethod == "copy")
+				_options.cloneMethod = ECM_copy;
+			else if (ofstrMethod == "fast")
+				_options.cloneMethod = ECM_fast;
+			else if (ofstrMethod == "hardlink")
+				_options.cloneMethod = ECM_hardlink;
+			else
+				app.printError("unknown --clone-method; use copy, fast or hardlink");
+		}
 
-	// make sure data dictionary is loaded
-	if (!dcmDataDict.isDictionaryLoaded())
-	{
-		CERR << "ERROR: no data dictionary loaded;  check environment variable: " << DCM_DICT_ENVIRONMENT_VARIABLE << std::endl;
-		return RESULT_FAILED_TO_CREATE;
-	}
+		if (cmd.findOption("--merge-lines"))
+			_options.bMergeLines = OFTrue;
 
-	// loop through all arguments (i.e. input paths)
-	const int nArgs = cmd.getParamCount();
-	for (int iArg = 0; iArg < nArgs; iArg++)
-	{
-		OFFilename ofFilename;
-		if (cmd.getParam(iArg + 1, ofFilename) == OFCommandLine::E_ParamValueStatus::PVS_Normal)
+		if (cmd.findOption("--rules"))
 		{
-			switch (iArg)
+			OFString ofstrFile, ofstrError;
+			app.checkValue(cmd.getValue(ofstrFile));
+			if (!_plan.load(ofstrFile, ofstrError))
 			{
-			case 0: ofstrInputFile = ofFilename; break;
-			case 1: ofstrOutputFile = ofFilename; break;
-			default: assert(false);
+				CERR << "ERROR: invalid rules file " << ofstrFile << ": " << ofstrError << endl;
+				return RESULT_FAILED_TO_READ;
 			}
+			_options.pPlan = &_plan;
 		}
-	}
 
-	if (ofstrOutputFile.isEmpty())
-	{
-		ofstrOutputFile = ofstrInputFile; 
-		// requires --force
-		if (!_bforceOutput)
+		if (cmd.findOption("--load-short"))
+			_options.bLoadShort = OFTrue;
+
+		if (cmd.findOption("--splice"))
+			_options.bSplice = OFTrue;
+
+		if (cmd.findOption("--fsync"))
 		{
-			CERR << "ERROR: Use --force to overwrite the original file, or specify an output file.";
-			return RESULT_FAILED_TO_CREATE;
+			OFString ofstrMode;
+			app.checkValue(cmd.getValue(ofstrMode));
+			if (!ParseSyncMode(ofstrMode, eSyncMode))
+				app.printError("unknown --fsync mode; use none, file, group or syncfs");
 		}
-	}
-	else if (!_bforceOutput && OFStandard::fileExists(ofstrOutputFile))
-	{
-		CERR << "ERROR: Output file exists; use --force to overwrite.";
-		return RESULT_FAILED_TO_CREATE;
-	}
 
-	if (_bVerbose)
-	{
-		COUT << "inp: " << ofstrInputFile << std::endl;
-		COUT << "out: " << ofstrOutputFile << std::endl;
-	}
+		if (cmd.findOption("--fsync-group"))
+			app.checkValue(cmd.getValueAndCheckMinMax(nSyncGroup, 1, 65536));
 
-	cond = dfile.loadFile(ofstrInputFile, xfer, EGL_noChange, maxReadLength, readMode);
-	if (cond.bad())
-	{
-		CERR << "ERROR: could not load dicom file: " << cond.text() << endl;
-		return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_FAILED_TO_READ);
-	}
-	if (dfile.loadAllDataIntoMemory().good())
-	{
-		DcmDataset* pDataset = dfile.getDataset();
-		//(0008,0016) UI =TwelveLeadECGWaveformStorage            #  30, 1 SOPClassUID
-		OFString ofstrValue;
-		OFStack<OFString> ofstrStack; // stack with all lines to be added to the wave form annotation sequence
-		char bufST[1024]; // maxumum number of characters allowed in VR=ST
+		if (cmd.findOption("--fsync-delay"))
+			app.checkValue(cmd.getValueAndCheckMinMax(nSyncDelay, 0, 60000));
 
-		// first collect all relevant text items 
-
-		OFString ofstrSOPClassUID;
-		if (pDataset->findAndGetOFString(_tagSOPClassUID, ofstrSOPClassUID).good() && !ofstrSOPClassUID.empty())
-		{
-			if (_bVerbose)
-				COUT << "INFO: SOPClassUID: " << ofstrSOPClassUID << endl;
-		}
-		else
+		if (cmd.findOption("--write-deflated"))
 		{
-			if (_bVerbose)
-				CERR << "WARN: SOPClassUID is missing or empty" << endl;
+#ifdef WITH_ZLIB
+			_options.bWriteDeflated = OFTrue;
+#else
+			app.printError("--write-deflated requires DCMTK with zlib support");
+#endif
 		}
-		if (   ofstrSOPClassUID.compare("1.2.840.10008.5.1.4.1.1.9.1.1")!=0 
-			&& ofstrSOPClassUID.compare("1.2.840.10008.5.1.4.1.1.9.1.2")!=0 
-			&& ofstrSOPClassUID.compare("1.2.840.10008.5.1.4.1.1.9.1.3")!=0)
+
+		if (cmd.findOption("--deflate-level"))
 		{
-			CERR << "ERROR: SOP class is not 12-lead, general or ambulatory ECG" << endl;
-			return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_ERROR_WRONGSOP_CLASS);
+			OFCmdSignedInt iLevel;
+			app.checkValue(cmd.getValueAndCheckMinMax(iLevel, 0, 9));
+			_options.iDeflateLevel = OFstatic_cast(int, iLevel);
 		}
 
-		if (_bVerbose)
-		{
-			OFString ofstrPatientID;
-			if (pDataset->findAndGetOFString(_tagPatientID, ofstrPatientID).good())
-				COUT << "INFO: PatientID: " << ofstrPatientID << endl;
-			else
-				CERR << "WARN: PatientID is missing" << endl;
+		if (cmd.findOption("--deflate-threads"))
+			app.checkValue(cmd.getValueAndCheckMinMax(nDeflateThreads, 0, 256));
 
-			OFString ofstrAccessionNumber;
-			if (pDataset->findAndGetOFString(_tagAccessionNumber, ofstrAccessionNumber).good())
-				COUT << "INFO: AccessionNumber: " << ofstrAccessionNumber << endl;
-			else
-				CERR << "WARN: AccessionNumber is missing" << endl;
-		}
+		if (cmd.findOption("--verify"))
+			_options.bVerify = OFTrue;
+
+		if (cmd.findOption("--stdio"))
+			_bStdio = OFTrue;
+
+		if (cmd.findOption("--retrospective-conversion"))
+			_bRetrospectiveConversion = OFTrue;
 
-		OFString ofstrStudyDescription;
-		if (pDataset->findAndGetOFString(_tagStudyDescription, ofstrStudyDescription).good() && !ofstrStudyDescription.empty())
+		if (cmd.findOption("--journal"))
+			app.checkValue(cmd.getValue(_crawlerConfig.ofstrJournalFile));
+
+		if (cmd.findOption("--walkers"))
 		{
-			if (_bVerbose)
-				COUT << "INFO: StudyDescription: " << ofstrStudyDescription << endl;
+			OFCmdUnsignedInt nWalkers;
+			app.checkValue(cmd.getValueAndCheckMinMax(nWalkers, 1, 256));
+			_crawlerConfig.nWalkers = nWalkers;
 		}
-		else
+
+		if (cmd.findOption("--max-read-rate"))
 		{
-			if (_bVerbose)
-				CERR << "WARN: StudyDescription is missing or empty" << endl;
+			OFCmdFloat dRate;
+			app.checkValue(cmd.getValueAndCheckMin(dRate, 0.001));
+			_crawlerConfig.dMaxReadRate = dRate * 1e6;
 		}
 
-		OFString ofstrVisitComments;
-		if (pDataset->findAndGetOFString(_tagVisitComments, ofstrVisitComments).good() && !ofstrVisitComments.empty())
+		if (cmd.findOption("--max-write-rate"))
 		{
-			if (_bVerbose)
-				COUT << "INFO: VisitComments: " << ofstrVisitComments.c_str() << endl;
-			snprintf(bufST, sizeof(bufST)/sizeof(bufST[0]), "Testind: %s", ofstrVisitComments.c_str());
-			ofstrVisitComments = bufST;
+			OFCmdFloat dRate;
+			app.checkValue(cmd.getValueAndCheckMin(dRate, 0.001));
+			_crawlerConfig.dMaxWriteRate = dRate * 1e6;
 		}
-		else
+
+		if (cmd.findOption("--max-iops"))
 		{
-			if (_bVerbose)
-				CERR << "WARN: VisitComments is missing or empty" << endl;
+			OFCmdFloat dIOPS;
+			app.checkValue(cmd.getValueAndCheckMin(dIOPS, 0.001));
+			_crawlerConfig.dMaxIOPS = dIOPS;
 		}
 
-		OFString ofstrOperatorsName;
-		if (pDataset->findAndGetOFStringArray(_tagOperatorsName, ofstrOperatorsName).good() && !ofstrOperatorsName.empty())
+		if (cmd.findOption("--archive"))
+			_bArchive = OFTrue;
+
+		if (cmd.findOption("--archive-inflight"))
 		{
-			if (_bVerbose)
-				COUT << "INFO: OperatorsName: " << ofstrOperatorsName.c_str() << endl;
-			HumanReadableName(ofstrOperatorsName);
-			snprintf(bufST, sizeof(bufST) / sizeof(bufST[0]), "Technicus: %s", ofstrOperatorsName.c_str());
-			ofstrOperatorsName = bufST;
+			OFCmdUnsignedInt nInFlight;
+			app.checkValue(cmd.getValueAndCheckMinMax(nInFlight, 1, 65536));
+			_archiveConfig.nMaxInFlight = nInFlight;
 		}
-		else
+
+		if (cmd.findOption("--archive-memory"))
 		{
-			if (_bVerbose)
-				CERR << "WARN: OperatorsName is missing or empty" << endl;
+			OFCmdUnsignedInt nMegabytes;
+			app.checkValue(cmd.getValueAndCheckMinMax(nMegabytes, 1, 1048576));
+			_archiveConfig.nMemoryBudget = OFstatic_cast(Uint64, nMegabytes) * 1024 * 1024;
 		}
 
-		OFString ofstrReferringPhysicianName;
-		if (pDataset->findAndGetOFString(_tagReferringPhysicianName, ofstrReferringPhysicianName).good() && !ofstrReferringPhysicianName.empty())
+		if (cmd.findOption("--batch"))
+			_bBatch = OFTrue;
+
+		if (cmd.findOption("--output-dir"))
 		{
-			if (_bVerbose)
-				COUT << "INFO: ReferringPhysicianName: " << ofstrReferringPhysicianName.c_str() << endl;
-			HumanReadableName(ofstrReferringPhysicianName);
-			snprintf(bufST, sizeof(bufST) / sizeof(bufST[0]), "Verwezen door: %s", ofstrReferringPhysicianName.c_str());
-			ofstrReferringPhysicianName = bufST;
+			app.checkValue(cmd.getValue(_ofstrOutputDir));
+			_bBatch = OFTrue;
 		}
-		else
+
+		if (cmd.findOption("--jobs"))
+			app.checkValue(cmd.getValueAndCheckMinMax(_nJobs, 0, 1024));
+
+		if (cmd.findOption("--prefetch"))
 		{
-			if (_bVerbose)
-				CERR << "WARN: ReferringPhysicianName is missing or empty" << endl;
+			app.checkValue(cmd.getValueAndCheckMinMax(_nPrefetch, 0, 65536));
+			if (_nPrefetch > 0 && (_options.bLoadShort || _options.bSplice))
+				app.printError("--prefetch amends in memory; it can't be combined with --load-short or --splice");
 		}
 
-		OFString ofstrPhysiciansOfRecord;
-		if (pDataset->findAndGetOFStringArray(_tagPhysiciansOfRecord, ofstrPhysiciansOfRecord).good() && !ofstrPhysiciansOfRecord.empty())
+		if (cmd.findOption("--io-threads"))
+			app.checkValue(cmd.getValueAndCheckMinMax(_nIOThreads, 1, 256));
+
+		if (cmd.findOption("--memory-budget"))
+			app.checkValue(cmd.getValueAndCheckMinMax(nMemoryBudget, 0, 1048576));
+
+		if (cmd.findOption("--index"))
 		{
-			if (_bVerbose)
-				COUT << "INFO: PhysiciansOfRecord : " << ofstrPhysiciansOfRecord.c_str() << endl;
-			HumanReadableName(ofstrPhysiciansOfRecord);
-			snprintf(bufST, sizeof(bufST) / sizeof(bufST[0]), "Aangevraagd door: %s", ofstrPhysiciansOfRecord.c_str());
-			ofstrPhysiciansOfRecord = bufST;
+			OFString ofstrFile;
+			app.checkValue(cmd.getValue(ofstrFile));
+			if (!_index.open(ofstrFile))
+			{
+				CERR << "ERROR: could not open index: " << ofstrFile << endl;
+				return RESULT_FAILED_TO_CREATE;
+			}
 		}
-		else
+
+		if (cmd.findOption("--triage"))
+			_options.bTriage = OFTrue;
+
+		if (cmd.findOption("--triage-only"))
 		{
-			if (_bVerbose)
-				CERR << "WARN: PhysiciansOfRecord  is missing or empty" << endl;
+			_bTriageOnly = OFTrue;
+			_bBatch = OFTrue;
 		}
 
-		OFString ofstrNameOfPhysiciansReadingStudy;
-		if (pDataset->findAndGetOFStringArray(_tagNameOfPhysiciansReadingStudy, ofstrNameOfPhysiciansReadingStudy).good() && !ofstrNameOfPhysiciansReadingStudy.empty())
-		{
-			if (_bVerbose)
-				COUT << "INFO: NameOfPhysiciansReadingStudy : " << ofstrNameOfPhysiciansReadingStudy.c_str() << endl;
+		if (cmd.findOption("--watch"))
+			app.checkValue(cmd.getValue(_ofstrWatchDir));
 
-			// only add this name in restropective mode; not in the live stream because it will already be handled in that case
-			if (_bIncludeBevestigingDoor)
-			{
-				HumanReadableName(ofstrNameOfPhysiciansReadingStudy);
-				snprintf(bufST, sizeof(bufST) / sizeof(bufST[0]), "Bevestigd door: %s", ofstrNameOfPhysiciansReadingStudy.c_str());
-				ofstrNameOfPhysiciansReadingStudy = bufST;
-			}
-			else
-				ofstrNameOfPhysiciansReadingStudy.clear();
-		}
-		else
+		if (cmd.findOption("--error-dir"))
+			app.checkValue(cmd.getValue(_ofstrErrorDir));
+
+		if (cmd.findOption("--relay"))
 		{
-			if (_bVerbose)
-				CERR << "WARN: NameOfPhysiciansReadingStudy  is missing or empty" << endl;
+			OFCmdUnsignedInt nPort;
+			app.checkValue(cmd.getValueAndCheckMinMax(nPort, 1, 65535));
+			_relayConfig.nPort = OFstatic_cast(Uint16, nPort);
+		}
 
-			ofstrNameOfPhysiciansReadingStudy="Bevestigd door: Onbevestigd";
+		if (cmd.findOption("--forward"))
+		{
+			OFString ofstrDestination;
+			app.checkValue(cmd.getValue(ofstrDestination));
+			if (!ParseRelayDestination(ofstrDestination, _relayConfig))
+				app.printError("invalid --forward destination; use aetitle@host:port");
 		}
 
-		// add text items to stack; start with a separator
-		/*always*/											ofstrStack.push(_ofstrAnnotationSeparator);
-		if (!ofstrVisitComments.empty())					ofstrStack.push(ofstrVisitComments);
-		if (!ofstrOperatorsName.empty())					ofstrStack.push(ofstrOperatorsName);
-		if (!ofstrReferringPhysicianName.empty())			ofstrStack.push(ofstrReferringPhysicianName);
-		if (!ofstrPhysiciansOfRecord.empty())				ofstrStack.push(ofstrPhysiciansOfRecord);
-		if (!ofstrNameOfPhysiciansReadingStudy.empty())		ofstrStack.push(ofstrNameOfPhysiciansReadingStudy);
+		if (cmd.findOption("--aetitle"))
+			app.checkValue(cmd.getValue(_relayConfig.ofstrAETitle));
 
-		// stop here if there is nothing to add
-		if (ofstrStack.size()<=1) // first item is a dummy separator
+		if (cmd.findOption("--max-associations"))
 		{
-			CERR << "WARN: All source tags are missing; skipping" << endl;
-			return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_WARN_NO_CHANGES);
+			OFCmdUnsignedInt nAssociations;
+			app.checkValue(cmd.getValueAndCheckMinMax(nAssociations, 1, 256));
+			_relayConfig.nMaxAssociations = OFstatic_cast(Uint16, nAssociations);
 		}
 
-		OFString ofstrMerged;
-		if (_bMergeLines)
+		if (cmd.findOption("--queue-size"))
 		{
-			if (_bVerbose)
-				COUT << "INFO: Merging lines into paragraph" << endl;
-
-			for (; !ofstrStack.empty(); ofstrStack.pop())
-			{
-				const OFString& strLine = ofstrStack.top();
-				if (ofstrMerged.empty())
-					ofstrMerged = strLine;
-				else
-					ofstrMerged = strLine + "\r\n" + ofstrMerged;
-			}
-			ofstrStack.push(ofstrMerged);
+			OFCmdUnsignedInt nQueueSize;
+			app.checkValue(cmd.getValueAndCheckMinMax(nQueueSize, 1, 4096));
+			_relayConfig.nQueueSize = nQueueSize;
 		}
 
-		// get a reference to the Waveform Sequence; this is just to make sure we have waveforms
-		DcmSequenceOfItems* seqWaveform = NULL;
-		OFString ofstrReferencedWaveformChannels;
-		unsigned long ulNumberOfMultiplexWaveforms = 0;
-		if (pDataset->findAndGetSequence(_tagWaveformSequence, seqWaveform).good())
+		if (cmd.findOption("--metrics-json"))
 		{
-			ulNumberOfMultiplexWaveforms = seqWaveform->card();
-			unsigned long iMultiplexWaveform = 0;
-			for (iMultiplexWaveform = 0; iMultiplexWaveform < ulNumberOfMultiplexWaveforms; iMultiplexWaveform++)
+			OFString ofstrFile;
+			app.checkValue(cmd.getValue(ofstrFile));
+			if (!_metrics.openJson(ofstrFile))
 			{
-				DcmItem* pItem = seqWaveform->getItem(iMultiplexWaveform);
-				if (_bVerbose && pItem)
-				{
-					OFString ofstdWaveformOriginality;
-					Uint16 nChannels;
-
-					pItem->findAndGetOFString(_tagWaveformOriginality, ofstdWaveformOriginality);
-					pItem->findAndGetUint16(_tagNumberOfWaveformChannels, nChannels);
-
-					if (ofstrReferencedWaveformChannels.empty() && ofstdWaveformOriginality.compare("ORIGINAL")==0)
-					{
-						snprintf(bufST, sizeof(bufST) / sizeof(bufST[0]), "%lu\\0", iMultiplexWaveform+1);
-						ofstrReferencedWaveformChannels = bufST;
-					}
-
-					COUT << "INFO: MultiplexWaveform [" << iMultiplexWaveform << "] = " << ofstdWaveformOriginality << ", N=" << nChannels << endl;
-				}
+				CERR << "ERROR: could not open metrics file: " << ofstrFile << endl;
+				return RESULT_FAILED_TO_CREATE;
 			}
 		}
-		if (ulNumberOfMultiplexWaveforms == 0)
+
+		if (cmd.findOption("--metrics-prom"))
 		{
-			CERR << "ERROR: No waveform multiplex sequence." << endl;
-			return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_ERROR_MISSING_TAG);
+			OFString ofstrFile;
+			app.checkValue(cmd.getValue(ofstrFile));
+			_metrics.setPrometheusFile(ofstrFile);
 		}
+	}
 
-		// get a reference to the Waveform Annotation Sequence and locate the last item with an UnformattedTextValue tag
-		DcmSequenceOfItems* seqWaveformAnnotations = NULL;
-		DcmItem* pLastUnformattedTextItem = NULL;
-		unsigned long iFirstNonTextItem = DCM_EndOfListIndex; // this will be the item to insert at/before
-		if (pDataset->findAndGetSequence(_tagWaveformAnnotationSequence, seqWaveformAnnotations).good())
-		{
-			// Example ofstrUnformattedTextValue annotation Item
-			// (fffe, e000) na(Item with undefined length # = 3)         # u / l, 1 Item
-			//    (0040, a0b0) US 1\0                                      #   4, 2 ReferencedWaveformChannels
-			//    (0040, a180) US 0                                        #   2, 1 AnnotationGroupNumber
-			//    (0070, 0006) ST[Sinusbradycardie Met 1e graads av - block Met incidentele Ventricula... #  84, 1 UnformattedTextValue
-			// (fffe, e00d) na(ItemDelimitationItem)                   #   0, 0 ItemDelimitationItem
+	// the amendment only produces the messages of -v when they are printed
+	_log.configure(eLogLevel, eLogFormat);
+	_bVerbose = _log.isEnabled(ELL_info);
+	_options.bVerbose = _bVerbose;
 
-			OFString ofstrValue;
-			for (unsigned long iItem = 0; iItem < seqWaveformAnnotations->card(); iItem++)
-			{
-				if (_bVerbose)
-					COUT << "INFO: Item: " << iItem << endl;
-				DcmItem* pItem = seqWaveformAnnotations->getItem(iItem);
-
-				// check for an UnformattedTextValue
-				if (pItem->findAndGetOFString(_tagUnformattedTextValue, ofstrValue).good())
-				{
-					if (_bVerbose)
-						COUT << "INFO: Found UnformattedTextValue: " << ofstrValue << endl;
-
-					//std::transform(ofstrValue.begin(), ofstrValue.end(), ofstrValue.begin(), ::toupper);
-					if (ofstrValue.find(_ofstrAnnotationSeparator) != string::npos)
-					{
-						CERR << "WARN: Waveform annotation already amended; skipping" << endl;
-						return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_WARN_ALREADY_AMENDED);
-					}
-					else if (ofstrValue.find("evestigd") != string::npos) // Ignore capital B from Bevestigd in case it might be lower case
-					{
-						if (_bVerbose)
-							COUT << "INFO: Bevestiging al ingevoerd; skip this item in amendment" << endl;
-						_bIncludeBevestigingDoor = OFFalse;
-					}
-					pLastUnformattedTextItem = pItem;
-				}
-				else
-				{
-					// if UnformattedTextValue is missing, sremember to start insertions of new item here
-					if (iFirstNonTextItem==DCM_EndOfListIndex)
-						iFirstNonTextItem = iItem;
-				}
+	// a group can't be larger than the number of threads that wait for it: the workers, or the pipeline
+	// writers with --prefetch (see StartPipeline)
+	const OFCmdUnsignedInt nWorkers = _nJobs ? _nJobs : std::thread::hardware_concurrency();
+	OFCmdUnsignedInt nCommitters = nWorkers;
+	if (_bBatch && _nPrefetch > 0 && !_bTriageOnly)
+		nCommitters = _nIOThreads < _nPrefetch ? _nIOThreads : _nPrefetch;
+	_committer.configure(eSyncMode, nSyncGroup < nCommitters ? nSyncGroup : nCommitters, OFstatic_cast(unsigned int, nSyncDelay));
+	_options.pCommitter = &_committer;
+	_memoryBudget.configure(OFstatic_cast(Uint64, nMemoryBudget) * 1024 * 1024);
 
-				if (_bVerbose)
-				{
-					// ReferencedWaveformChannels
-					if (pItem->findAndGetOFStringArray(_tagReferencedWaveformChannels, ofstrValue).good())
-						COUT << "      ReferencedWaveformChannels: " << ofstrValue << endl;
-
-					// AnnotationGroupNumber
-					if (pItem->findAndGetOFString(_tagAnnotationGroupNumber, ofstrValue).good())
-						COUT << "      AnnotationGroupNumber: " << ofstrValue << endl;
-				}
-			}
-		}
-		if (!seqWaveformAnnotations)
+	// the parallel jobs already keep the cores busy; split them over the deflaters of one output
+	if (nDeflateThreads == 0)
+		nDeflateThreads = nWorkers > 0 && nWorkers < std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() / nWorkers : 1;
+	_options.nDeflateThreads = OFstatic_cast(unsigned int, nDeflateThreads);
+
+	// make sure data dictionary is loaded (the first access loads it, unless the embedded one is installed)
+	OFBool bDictionaryLoaded;
+	{
+		StageTimer timer(&dictionaryMetrics, EMS_dictionary);
+		bDictionaryLoaded = isDictionaryPartial() || dcmDataDict.isDictionaryLoaded();
+		timer.stop();
+		if (_metrics.isEnabled())
+			_metrics.addProcess(dictionaryMetrics);
+	}
+	if (!bDictionaryLoaded)
+	{
+		CERR << "ERROR: no data dictionary loaded;  check environment variable: " << DCM_DICT_ENVIRONMENT_VARIABLE << std::endl;
+		return RESULT_FAILED_TO_CREATE;
+	}
+
+	if (_relayConfig.nPort)
+	{
+		if (_relayConfig.ofstrPeerAETitle.empty())
 		{
-			DcmElement* pNewItem = pDataset->newDicomElement(_tagWaveformAnnotationSequence);
-			if (!pNewItem)
-			{
-				CERR << "FAIL: Failed to create new WaveformAnnotationSequence" << endl;
-				return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_FAILED_TO_CREATE);
-			}
-			else
-			{
-				if (_bVerbose)
-					COUT << "INFO: added new WaveformAnnotationSequence" << endl;
-				seqWaveformAnnotations = OFstatic_cast(DcmSequenceOfItems*, pNewItem);
-			}
+			CERR << "ERROR: --relay requires --forward." << endl;
+			return RESULT_FAILED_TO_CREATE;
 		}
-		// create a dummy annotation, even if there was nothing defined yet
-		if (pLastUnformattedTextItem == NULL)
+		_relayConfig.nForwarders = _nJobs ? _nJobs : std::thread::hardware_concurrency();
+		_relayConfig.bVerbose = _bVerbose;
+		signal(SIGINT, WatchSignalHandler);
+		signal(SIGTERM, WatchSignalHandler);
+		requireFullDictionary(); // DIMSE commands are implicit VR, and so may be the objects
+		_log.start(_nLogBuffer);
+		return FinishMetrics(RunRelay(_relayConfig, AmendRelayDataset, &_bWatchStop).good() ? RESULT_SUCCESS : RESULT_FAILED_TO_CREATE);
+	}
+
+	// all modes but filter mode log through the writer thread; it is drained when the process exits
+	if (!_ofstrWatchDir.empty())
+	{
+		_log.start(_nLogBuffer);
+		return FinishMetrics(RunWatch());
+	}
+
+	if (_bRetrospectiveConversion)
+	{
+		_log.start(_nLogBuffer);
+		const int iResult = RunRetrospective(cmd);
+		_index.close();
+		return FinishMetrics(iResult);
+	}
+
+	if (_bArchive)
+	{
+		_log.start(_nLogBuffer);
+		return FinishMetrics(RunArchiveMode(cmd));
+	}
+
+	if (_bBatch)
+	{
+		_log.start(_nLogBuffer);
+		const int iResult = RunBatch(cmd);
+		_index.close();
+		return FinishMetrics(iResult);
+	}
+
+	// loop through all arguments (i.e. input paths)
+	const int nArgs = cmd.getParamCount();
+	if (!_bStdio && nArgs >= 1)
+	{
+		OFString ofstrParam;
+		cmd.getParam(1, ofstrParam);
+		_bStdio = ofstrParam == "-";
+	}
+	if (_bStdio)
+	{
+		OFString ofstrParam;
+		for (int iArg = 1; iArg <= nArgs; iArg++)
 		{
-			if (ofstrReferencedWaveformChannels.empty())
-			{
-				COUT << "WARN: ORIGINAL Waveform multiplex group not found; assuming group 1" << endl;
-				ofstrReferencedWaveformChannels = "1\\0";
-			}
-			if (_bVerbose)
-				COUT << "INFO: creating a dummy annotation." << endl;
-			pLastUnformattedTextItem = new DcmItem;
-			if (pLastUnformattedTextItem->putAndInsertString(_tagReferencedWaveformChannels, ofstrReferencedWaveformChannels.c_str()).bad()) // putAndInsertStringArray fails
-			{
-				CERR << "FAIL: Failed to add ReferencedWaveformChannels to dummy: " << ofstrReferencedWaveformChannels << endl;
-				return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_FAILED_TO_CREATE);
-			}
-			if (pLastUnformattedTextItem->putAndInsertString(_tagAnnotationGroupNumber, "0").bad())
+			if (cmd.getParam(iArg, ofstrParam) != OFCommandLine::PVS_Normal || ofstrParam != "-")
 			{
-				CERR << "FAIL: Failed to add AnnotationGroupNumber to dummy: 0" << endl;
-				return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_FAILED_TO_CREATE);
+				CERR << "ERROR: --stdio reads stdin and writes stdout; only '-' is accepted as file argument." << endl;
+				return RESULT_FAILED_TO_CREATE;
 			}
 		}
-
-		if (pLastUnformattedTextItem!=NULL)
+		// stdout carries the data, so all messages go to stderr
+		if (!_metrics.isEnabled())
+			return AmendStdio(NULL);
+		FileMetrics metrics;
+		const int iResult = AmendStdio(&metrics);
+		_metrics.add("-", iResult, metrics);
+		return FinishMetrics(iResult);
+	}
+	if (nArgs > 2)
+	{
+		CERR << "ERROR: Too many parameters; use --batch to process multiple files." << endl;
+		return RESULT_FAILED_TO_CREATE;
+	}
+	for (int iArg = 0; iArg < nArgs; iArg++)
+	{
+		OFFilename ofFilename;
+		if (cmd.getParam(iArg + 1, ofFilename) == OFCommandLine::E_ParamValueStatus::PVS_Normal)
 		{
-			for (;!ofstrStack.empty(); ofstrStack.pop())
+			switch (iArg)
 			{
-				const OFString& strLine = ofstrStack.top();
-				DcmItem* pNew = OFstatic_cast(DcmItem*, pLastUnformattedTextItem->clone());
-				// UnformattedTextValue
-				if (pNew->putAndInsertString(_tagUnformattedTextValue, strLine.c_str()).good())
-				{
-					// and insert it after the previous text annotation
-					seqWaveformAnnotations->insert(pNew, iFirstNonTextItem, true);
-					if (_bVerbose)
-					{
-						unsigned long ulInsertAt = iFirstNonTextItem == DCM_EndOfListIndex ? 0 : iFirstNonTextItem;
-						COUT << "INFO: Inserting new annotation: [" << ulInsertAt << "] = " << strLine << endl;
-					}
-				}
-				else
-				{
-					CERR << "ERROR: missing tag UnformattedTextValue" << endl;
-					return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_ERROR_MISSING_TAG);
-				}
+			case 0: ofstrInputFile = ofFilename; break;
+			case 1: ofstrOutputFile = ofFilename; break;
+			default: assert(false);
 			}
 		}
-		else
-		{
-			CERR << "FAIL: failed to create dummy Waveform annotation" << endl;
-			return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_FAILED_TO_CREATE);
-		}
+	}
 
-		if (dfile.saveFile(ofstrOutputFile, pDataset->getOriginalXfer(), EET_UndefinedLength, EGL_recalcGL, EPD_noChange, 0, 0, EWM_createNewMeta).good())
-		{
-			if (_bVerbose)
-				COUT << "INFO: Created output file: " << ofstrOutputFile << endl;
-		}
-		else
+	if (ofstrOutputFile.isEmpty())
+	{
+		ofstrOutputFile = ofstrInputFile; 
+		// requires --force
+		if (!_options.bForceOutput)
 		{
-			CERR << "FAIL: failed to create output file: " << ofstrOutputFile << endl;
-			return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_FAILED_TO_CREATE);
+			CERR << "ERROR: Use --force to overwrite the original file, or specify an output file.";
+			return RESULT_FAILED_TO_CREATE;
 		}
 	}
-	else
+
+	_log.start(_nLogBuffer);
+	int iResult;
 	{
-		CERR << "ERROR: failed reading all data" << endl;
-		return TryFileClone(ofstrInputFile, ofstrOutputFile, RESULT_FAILED_TO_READ);
+		// the lines are logged while the file is amended; its SOPInstanceUID is only known at the end
+		const LogContext context(ofstrInputFile.getCharPointer());
+		LogStream osOut(context), osErr(context);
+		iResult = AmendFileIndexed(ofstrInputFile.getCharPointer(), ofstrOutputFile.getCharPointer(), osOut, osErr).code;
 	}
-
-	return RESULT_SUCCESS;
+	_index.close();
+	return FinishMetrics(iResult);
 }
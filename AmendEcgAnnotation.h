@@ -1,8 +1,105 @@
-﻿// AmendEcgAnnotation.h : Include file for standard system include files,
-// or project specific include files.
+﻿// AmendEcgAnnotation.h : public interface of the amendment library
+// Copies VisitComments, OperatorsName and the physician names (or the sources of a rules file, see
+// AnnotationRules.h) as text annotations into the WaveformAnnotationSequence of 12-lead, general
+// and ambulatory ECG objects (Muse exports).
+// All functions are thread-safe; amend() works on the dataset only and does no I/O.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
 
 #pragma once
 
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/dcmdata/dctk.h"
+#include "dcmtk/ofstd/ofvector.h"
+
+#include "AnnotationRules.h"
+#include "ContentDigest.h"
+#include "FileCopy.h"
+#include "Metrics.h"
+#include "OutputCommit.h"
+
 #include <iostream>
 
-// TODO: Reference additional headers your program requires here.
+// result codes
+#define RESULT_SUCCESS 0
+#define RESULT_FAILED_TO_CREATE -1
+#define RESULT_FAILED_TO_READ -2
+#define RESULT_ERROR_MISSING_TAG -3
+#define RESULT_ERROR_WRONGSOP_CLASS -4
+#define RESULT_FAILED_VERIFY -5 // --verify: the output differs from the input outside the annotations
+#define RESULT_WARN_NO_CHANGES 1
+#define RESULT_WARN_ALREADY_AMENDED 2
+#define RESULT_FAILED_TO_CLONE_OFFSET 10 // either pos or neg, depending on result code of error/warning
+
+// results that will be the same for an unchanged input; failures to read, write or verify are worth another try
+OFBool isFinalResult(int iResult);
+
+struct AmendOptions
+{
+	AmendOptions();
+
+	OFBool bMergeLines;				// merge amended lines into one paragraph
+	OFBool bVerbose;				// print processing details to pOut
+	const AnnotationPlan* pPlan;	// annotation rules (NULL: the built-in rules)
+	OFBool bVerify;					// amendFile(), amendStream(): compare the content digests of input and output
+	OFBool bWriteDeflated;			// amendFile(), amendStream(): write Deflated Explicit VR Little Endian (needs zlib)
+	int iDeflateLevel;				// zlib compression level of deflated outputs (0-9)
+	unsigned int nDeflateThreads;	// threads that deflate one output in parallel
+	STD_NAMESPACE ostream* pOut;	// info messages (NULL: discarded)
+	STD_NAMESPACE ostream* pErr;	// warnings and errors (NULL: discarded)
+
+	// amendFile() only
+	OFBool bForceOutput;			// overwrite an existing output file
+	OFBool bNoCloneOnError;			// don't clone the input to the output on errors
+	E_CloneMethod cloneMethod;
+	OFBool bLoadShort;				// keep long values (WaveformData) on disk while amending (not in-place)
+	OFBool bSplice;					// only rewrite the WaveformAnnotationSequence in the output (not in-place)
+	OFBool bTriage;					// decide skipped files from the raw tags, before a full parse
+	OutputCommitter* pCommitter;	// how outputs are synced (NULL: renamed without sync)
+};
+
+struct AmendResult
+{
+	AmendResult();
+
+	int code;						// RESULT_*, plus RESULT_FAILED_TO_CLONE_OFFSET when amendFile() could not clone
+	unsigned long nInserted;		// annotation items added
+	E_CloneResult cloneResult;		// amendFile(): how the input was cloned (ECR_failed: not cloned)
+	Uint64 nClonedBytes;
+	OFString ofstrSOPInstanceUID;	// when the dataset was parsed as far as the SOP class check
+	OFBool bVerified;				// --verify: the output has the content digest of the input
+	ContentDigest digest;
+};
+
+// amend a dataset in memory. With RESULT_SUCCESS the dataset was changed and has to be saved;
+// with any other code it is left exactly as it was. pMetrics (optional) receives the stage timings.
+AmendResult amend(DcmDataset& dataset, const AmendOptions& options, FileMetrics* pMetrics = NULL);
+
+// amend a file; in-place when both names are equal. Unless options.bNoCloneOnError is set, the input
+// is cloned to the output when it can't be amended (also for warnings), so the output always exists.
+// Outputs and clones are written to a temporary file that replaces the output when it is complete.
+AmendResult amendFile(const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile, const AmendOptions& options, FileMetrics* pMetrics = NULL);
+
+// amend a complete Part 10 stream (e.g. a received file) in memory; output is only filled with RESULT_SUCCESS
+AmendResult amendStream(const OFVector<Uint8>& input, OFVector<Uint8>& output, const AmendOptions& options, FileMetrics* pMetrics = NULL);
+
+// write a stream (e.g. the output of amendStream) to a file the way amendFile() does: through a
+// temporary file that is committed with options.pCommitter
+OFBool writeOutputFile(const OFVector<Uint8>& data, const OFFilename& ofstrOutputFile, const AmendOptions& options, FileMetrics* pMetrics = NULL);
+
+// clone a file unchanged the way amendFile() does when it can't amend: with options.cloneMethod, through
+// a temporary file committed with options.pCommitter; fills result.cloneResult and result.nClonedBytes
+OFBool cloneInputFile(const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile, const AmendOptions& options, AmendResult& result, FileMetrics* pMetrics = NULL);
+
+// triage classes, decided from the raw top-level tags before any DCMTK parsing
+enum E_TriageClass
+{
+	ETC_needsAmendment,		// needs the full amendment; also for files the scanner can't handle
+	ETC_wrongSOPClass,
+	ETC_alreadyAmended,
+	ETC_noSources
+};
+#define TRIAGE_CLASSES 4
+
+E_TriageClass triageFile(const OFFilename& ofstrInputFile, const AnnotationPlan* pPlan = NULL);
+const char* triageClassName(int triage);
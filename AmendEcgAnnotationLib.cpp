@@ -0,0 +1,1026 @@
+﻿// AmendEcgAnnotationLib.cpp : the amendment library (see AmendEcgAnnotation.h)
+// Fix dicom Waveform Annotations tags while archving from Muse to VNA.
+//
+// https://dicom.innolitics.com/ciods/12-lead-ecg/waveform-annotation
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "AmendEcgAnnotation.h"
+#include "ContentDigest.h"
+#include "Deflate.h"
+#include "DicomScanner.h"
+#include "EmbeddedDictionary.h"
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstream.h"
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/ofstd/ofstrutl.h"
+#include "dcmtk/ofstd/offile.h"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// used tags (info; SOP class and the sources are extracted by the AnnotationPlan)
+static const DcmTagKey _tagWaveformSequence(DCM_WaveformSequence);							// (5400,0100) SQ each item represents one waveform multiplex group
+static const DcmTagKey _tagWaveformOriginality(DCM_WaveformOriginality);					// (003a,0004) CS 
+static const DcmTagKey _tagNumberOfWaveformChannels(DCM_NumberOfWaveformChannels);			// (003a,0005) US 
+// used tags (destination)
+static const DcmTagKey _tagWaveformAnnotationSequence(DCM_WaveformAnnotationSequence);		// (0040,b020) SQ
+static const DcmTagKey _tagUnformattedTextValue(DCM_UnformattedTextValue);					// (0070,0006) ST
+static const DcmTagKey _tagReferencedWaveformChannels(DCM_ReferencedWaveformChannels);		// (0040,a0b0) US 1\0 (multiplicity 2-2n)
+static const DcmTagKey _tagAnnotationGroupNumber(DCM_AnnotationGroupNumber);				// (0040,a180) US
+
+static const OFString _ofstrAnnotationSeparator("-+-");
+
+// per-call state; every call gets a fresh context so nothing leaks into the next file or another thread
+struct AmendContext
+{
+	AmendContext(const AmendOptions& amendOptions, FileMetrics* pFileMetrics)
+		: options(amendOptions), pAnnotations(NULL), bAddedSequence(OFFalse), ulInsertedAt(0), nInserted(0),
+		  cloneResult(ECR_failed), nClonedBytes(0), bVerified(OFFalse), pMetrics(pFileMetrics), nullStream(NULL),
+		  out(amendOptions.pOut ? *amendOptions.pOut : nullStream), err(amendOptions.pErr ? *amendOptions.pErr : nullStream) {}
+
+	const AmendOptions& options;
+	DcmSequenceOfItems* pAnnotations;	// the WaveformAnnotationSequence once it is being changed (else NULL)
+	OFBool bAddedSequence;			// pAnnotations was added by the amendment
+	unsigned long ulInsertedAt;		// the new items are [ulInsertedAt, ulInsertedAt + nInserted) of pAnnotations
+	unsigned long nInserted;
+	E_CloneResult cloneResult;		// how the input was cloned by TryFileClone (ECR_failed: not cloned)
+	Uint64 nClonedBytes;
+	OFString ofstrSOPInstanceUID;
+	OFBool bVerified;
+	ContentDigest digest;			// --verify: of the input, and so of the output
+	FileMetrics* pMetrics;			// stage timings (NULL: metrics disabled)
+	STD_NAMESPACE ostream nullStream;	// discards the messages of a NULL pOut/pErr
+	STD_NAMESPACE ostream& out;		// info messages
+	STD_NAMESPACE ostream& err;		// warnings and errors
+
+private:
+	AmendContext(const AmendContext&);
+	AmendContext& operator=(const AmendContext&);
+};
+
+// working data of the amendment that every thread keeps from file to file: the vectors and strings
+// keep their buffers, so a long-running process doesn't allocate (and fragment the heap with) the
+// same data again for every file. Nothing in it is valid beyond the file that filled it.
+struct AmendScratch
+{
+	AmendScratch() : nLines(0) {}
+
+	// the next line; its buffer is reused
+	OFString& addLine()
+	{
+		if (nLines == lines.size())
+			lines.resize(nLines + 1);
+		return lines[nLines++];
+	}
+
+	// forget the data of the last file; buffers that an unusual file grew are released
+	void reset()
+	{
+		nLines = 0;
+		newItems.clear();
+		if (lines.size() > 1024 || ofstrMerged.capacity() > 65536)
+		{
+			OFVector<OFString>().swap(lines);
+			ofstrMerged = OFString();
+		}
+	}
+
+	OFVector<OFString> values;		// extracted by the AnnotationPlan
+	OFVector<OFBool> suppressed;	// per rule
+	OFVector<OFString> lines;		// new annotation lines in insertion order, the separator first
+	size_t nLines;					// lines in use
+	OFString ofstrMerged;			// --merge-lines
+	OFVector<DcmItem*> newItems;
+};
+
+static thread_local AmendScratch _scratch;
+
+// replace the output with a completely written temporary file
+static OFBool CommitOutput(AmendContext& ctx, const OFString& ofstrTempFile, const OFFilename& ofstrOutputFile)
+{
+	StageTimer timer(ctx.pMetrics, EMS_sync);
+	if (ctx.options.pCommitter)
+		return ctx.options.pCommitter->commit(ofstrTempFile, ofstrOutputFile.getCharPointer());
+	return ReplaceOutputFile(ofstrTempFile, ofstrOutputFile.getCharPointer());
+}
+
+// clone the input through a temporary file with the configured method; sets ctx.cloneResult
+static OFBool CloneToOutput(AmendContext& ctx, const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile)
+{
+	Uint64 nBytes = 0;
+	const OFString ofstrTempFile = MakeTempOutputName(ofstrOutputFile.getCharPointer());
+	E_CloneResult cloneResult = CloneFile(ofstrInputFile, ofstrTempFile, ctx.options.cloneMethod, nBytes);
+	if (cloneResult == ECR_failed)
+		OFStandard::deleteFile(ofstrTempFile);
+	else if (!CommitOutput(ctx, ofstrTempFile, ofstrOutputFile))
+		cloneResult = ECR_failed;
+	if (cloneResult == ECR_failed)
+	{
+		ctx.err << "ERROR: could not clone " << ofstrOutputFile << endl;
+		return OFFalse;
+	}
+	ctx.cloneResult = cloneResult;
+	ctx.nClonedBytes = nBytes;
+	if (ctx.options.bVerbose)
+		ctx.out << "Cloned " << ofstrOutputFile << " (" << CloneResultName(cloneResult) << ", " << nBytes << " bytes)" << endl;
+	return OFTrue;
+}
+
+// clone input to output in case of an error
+static int TryFileClone(AmendContext& ctx, const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile, int resultSoFar)
+{
+	if (ctx.options.bNoCloneOnError && resultSoFar<0)
+		return resultSoFar;
+
+	StageTimer timer(ctx.pMetrics, EMS_clone);
+	if (OFStandard::fileExists(ofstrInputFile))
+	{
+		if (0==strcmp(ofstrInputFile.getCharPointer(), ofstrOutputFile.getCharPointer()))
+			return resultSoFar; // no need to copy on itself
+		if (CloneToOutput(ctx, ofstrInputFile, ofstrOutputFile))
+			return resultSoFar;
+		return (resultSoFar<0 ? resultSoFar-RESULT_FAILED_TO_CLONE_OFFSET: resultSoFar+RESULT_FAILED_TO_CLONE_OFFSET);
+	}
+	return RESULT_FAILED_TO_READ - RESULT_FAILED_TO_CLONE_OFFSET;
+}
+
+// append whatever an output buffer stream has collected so far
+static void AppendFlushed(DcmOutputBufferStream& stream, OFVector<Uint8>& encoded)
+{
+	void* pFlushed = NULL;
+	offile_off_t nFlushed = 0;
+	stream.flushBuffer(pFlushed, nFlushed);
+	encoded.insert(encoded.end(), OFstatic_cast(Uint8*, pFlushed), OFstatic_cast(Uint8*, pFlushed) + nFlushed);
+}
+
+// encode a single element (e.g. a sequence with all its items) into memory
+static OFCondition EncodeElement(DcmObject* pObject, E_TransferSyntax xfer, OFVector<Uint8>& encoded)
+{
+	Uint8 chunk[65536];
+	DcmOutputBufferStream stream(chunk, sizeof(chunk));
+	OFCondition cond;
+
+	encoded.clear();
+	pObject->transferInit();
+	while ((cond = pObject->write(stream, xfer, EET_UndefinedLength, NULL)) == EC_StreamNotifyClient)
+		AppendFlushed(stream, encoded);
+	pObject->transferEnd();
+	if (cond.good())
+	{
+		stream.flush();
+		AppendFlushed(stream, encoded);
+	}
+	return cond;
+}
+
+// encode a complete file (preamble, new meta header and dataset) into memory
+static OFCondition EncodeFileFormat(DcmFileFormat& dfile, E_TransferSyntax xfer, OFVector<Uint8>& encoded)
+{
+	Uint8 chunk[65536];
+	DcmOutputBufferStream stream(chunk, sizeof(chunk));
+	OFCondition cond;
+
+	encoded.clear();
+	dfile.transferInit();
+	while ((cond = dfile.write(stream, xfer, EET_UndefinedLength, NULL, EGL_recalcGL, EPD_noChange, 0, 0, 0, EWM_createNewMeta)) == EC_StreamNotifyClient)
+		AppendFlushed(stream, encoded);
+	dfile.transferEnd();
+	if (cond.good())
+	{
+		stream.flush();
+		AppendFlushed(stream, encoded);
+	}
+	return cond;
+}
+
+// deflated inputs are written deflated again, but by encodeDeflated() (in parallel) instead of DCMTK
+static OFBool IsDeflatedOutput(const AmendContext& ctx, E_TransferSyntax xfer)
+{
+	return ctx.options.bWriteDeflated || xfer == EXS_DeflatedLittleEndianExplicit;
+}
+
+// encode a complete file as Deflated Explicit VR Little Endian
+static OFCondition EncodeDeflated(const AmendContext& ctx, DcmFileFormat& dfile, OFVector<Uint8>& encoded)
+{
+	OFVector<Uint8> plain;
+	OFCondition cond = EncodeFileFormat(dfile, EXS_LittleEndianExplicit, plain);
+	if (cond.good() && !encodeDeflated(plain, encoded, ctx.options.iDeflateLevel, ctx.options.nDeflateThreads))
+		cond = EC_InvalidStream;
+	if (cond.good() && ctx.options.bVerbose)
+		ctx.out << "INFO: deflated " << plain.size() << " to " << encoded.size() << " bytes" << endl;
+	return cond;
+}
+
+// write data to a (temporary) file
+static OFBool WriteTempFile(const OFVector<Uint8>& data, const OFString& ofstrTempFile)
+{
+	OFFile file;
+	if (!file.fopen(ofstrTempFile, "wb"))
+		return OFFalse;
+	const OFBool bWritten = data.empty() || file.fwrite(&data[0], 1, data.size()) == data.size();
+	return file.fclose() == 0 && bWritten;
+}
+
+// copy a byte range of the input to the output file; inside the kernel with copy_file_range() where available
+static OFBool CopyInputRange(const MappedFile& input, size_t nOffset, size_t nLength, OFFile& output)
+{
+#ifdef __linux__
+	if (output.fflush() == 0)
+	{
+		Sint64 offIn = OFstatic_cast(Sint64, nOffset);
+		Sint64 offOut = OFstatic_cast(Sint64, output.ftell());
+		while (nLength > 0)
+		{
+			const long nCopied = CopyFileRange(input.fd(), &offIn, fileno(output.file()), &offOut, nLength);
+			if (nCopied <= 0)
+				break; // not supported for this pair of files; copy the rest from the mapping
+			nOffset += nCopied;
+			nLength -= nCopied;
+		}
+		if (output.fseek(offOut, SEEK_SET) != 0)
+			return OFFalse;
+	}
+#endif
+	return nLength == 0 || output.fwrite(input.data() + nOffset, 1, nLength) == nLength;
+}
+
+// write the output as the unmodified input with only the WaveformAnnotationSequence replaced; returns
+// EC_IllegalCall if the input can't be spliced (e.g. an encoding the scanner doesn't support) so the caller
+// can fall back to a full save. The meta header of the input is kept as is.
+static OFCondition SpliceSave(AmendContext& ctx, const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile, DcmSequenceOfItems* seqWaveformAnnotations, E_TransferSyntax xfer)
+{
+	MappedFile input;
+	DicomScanner scanner;
+	if (!input.open(ofstrInputFile))
+		return EC_IllegalCall;
+	OFCondition cond = scanner.scan(input.data(), input.size());
+	if (cond.bad() || scanner.getXfer() != xfer || scanner.find(DcmTagKey(_tagWaveformAnnotationSequence.getGroup(), 0x0000)))
+	{
+		// group lengths would have to be recalculated
+		if (ctx.options.bVerbose)
+			ctx.out << "INFO: input can't be spliced; saving complete file" << endl;
+		return EC_IllegalCall;
+	}
+
+	// the bytes to be replaced: the original sequence, or an empty range where it has to be inserted
+	size_t nFrom, nTo;
+	const ScannedElement* pSequence = scanner.find(_tagWaveformAnnotationSequence);
+	if (pSequence)
+	{
+		nFrom = pSequence->offset;
+		nTo = pSequence->endOffset;
+	}
+	else
+		nFrom = nTo = scanner.insertPosition(_tagWaveformAnnotationSequence);
+
+	OFVector<Uint8> encoded;
+	cond = EncodeElement(seqWaveformAnnotations, xfer, encoded);
+	if (cond.bad())
+		return cond;
+
+	OFFile output;
+	if (!output.fopen(ofstrOutputFile, "wb"))
+		return EC_InvalidStream;
+	const OFBool bWritten = CopyInputRange(input, 0, nFrom, output)
+		&& (encoded.empty() || output.fwrite(&encoded[0], 1, encoded.size()) == encoded.size())
+		&& CopyInputRange(input, nTo, input.size() - nTo, output);
+	if (output.fclose() != 0 || !bWritten)
+	{
+		OFStandard::deleteFile(ofstrOutputFile);
+		return EC_InvalidStream;
+	}
+
+	if (ctx.options.bVerbose)
+		ctx.out << "INFO: Spliced " << encoded.size() << " bytes of WaveformAnnotationSequence over [" << nFrom << ", " << nTo << ")" << endl;
+	return EC_Normal;
+}
+
+// --verify: the output must have the content digest of the input; both are scanned from their encoded
+// bytes, the input while it is still in the page cache (or memory) and the output before it is committed
+static int VerifyOutput(AmendContext& ctx, const Uint8* pInput, size_t nInput, const Uint8* pOutput, size_t nOutput)
+{
+	StageTimer timer(ctx.pMetrics, EMS_verify);
+	ContentDigest input, output;
+	OFCondition cond = computeContentDigest(pInput, nInput, input);
+	if (cond.good())
+		cond = computeContentDigest(pOutput, nOutput, output);
+	if (cond.bad())
+	{
+		ctx.err << "FAIL: could not verify the output (" << (cond == EC_IllegalCall ? "encoding not supported" : cond.text()) << ")" << endl;
+		return RESULT_FAILED_VERIFY;
+	}
+	if (input != output)
+	{
+		ctx.err << "FAIL: output content differs from the input: " << output.toString() << " != " << input.toString() << endl;
+		return RESULT_FAILED_VERIFY;
+	}
+	ctx.bVerified = OFTrue;
+	ctx.digest = input;
+	ctx.out << "VERIFY: " << input.toString() << " groups=" << input.nMultiplexGroups << endl;
+	return RESULT_SUCCESS;
+}
+
+// as VerifyOutput, for files on disk
+static int VerifyOutputFile(AmendContext& ctx, const OFFilename& ofstrInputFile, const OFString& ofstrOutputFile)
+{
+	MappedFile input, output;
+	if (!input.open(ofstrInputFile) || !output.open(ofstrOutputFile.c_str()))
+	{
+		ctx.err << "FAIL: could not verify the output (can't map input or output)" << endl;
+		return RESULT_FAILED_VERIFY;
+	}
+	return VerifyOutput(ctx, input.data(), input.size(), output.data(), output.size());
+}
+
+const char* triageClassName(int triage)
+{
+	switch (triage)
+	{
+	case ETC_wrongSOPClass: return "wrong-sop-class";
+	case ETC_alreadyAmended: return "already-amended";
+	case ETC_noSources: return "no-sources";
+	default: return "needs-amendment";
+	}
+}
+
+static OFBool IsEcgSOPClass(const OFString& ofstrSOPClassUID)
+{
+	return ofstrSOPClassUID.compare("1.2.840.10008.5.1.4.1.1.9.1.1") == 0
+		|| ofstrSOPClassUID.compare("1.2.840.10008.5.1.4.1.1.9.1.2") == 0
+		|| ofstrSOPClassUID.compare("1.2.840.10008.5.1.4.1.1.9.1.3") == 0;
+}
+
+// walks the top-level tags in a memory mapping, in the same order as AmendDataset decides
+E_TriageClass triageFile(const OFFilename& ofstrInputFile, const AnnotationPlan* pPlan)
+{
+	MappedFile input;
+	DicomScanner scanner;
+	if (!input.open(ofstrInputFile) || scanner.scan(input.data(), input.size()).bad())
+		return ETC_needsAmendment;
+
+	const AnnotationPlan& plan = pPlan ? *pPlan : AnnotationPlan::builtIn();
+	OFVector<OFString>& values = _scratch.values;
+	plan.extract(scanner, values);
+	if (!IsEcgSOPClass(values[EPF_SOPClassUID]))
+		return ETC_wrongSOPClass;
+
+	// a rule with a line for missing values always counts, because suppressions are only
+	// decided while scanning the annotations
+	unsigned long nLines = 0;
+	for (size_t iRule = 0; iRule < plan.getRules().size(); iRule++)
+	{
+		if (!plan.ruleValue(values, iRule).empty() || !plan.getRules()[iRule].ofstrMissing.empty())
+			nLines++;
+	}
+	if (nLines == 0)
+		return ETC_noSources;
+
+	// a missing waveform is reported by AmendFile before it looks at the annotations
+	OFString ofstrValue;
+	OFVector<OFVector<ScannedElement> > items;
+	const ScannedElement* pElement = scanner.find(_tagWaveformSequence);
+	if (!pElement || scanner.getItems(*pElement, items).bad() || items.empty())
+		return ETC_needsAmendment;
+
+	pElement = scanner.find(_tagWaveformAnnotationSequence);
+	items.clear();
+	if (pElement && scanner.getItems(*pElement, items).good())
+	{
+		for (size_t iItem = 0; iItem < items.size(); iItem++)
+		{
+			const ScannedElement* pText = DicomScanner::find(items[iItem], _tagUnformattedTextValue);
+			if (pText && scanner.getString(*pText, ofstrValue) && ofstrValue.find(_ofstrAnnotationSeparator) != OFString_npos)
+				return ETC_alreadyAmended;
+		}
+	}
+	return ETC_needsAmendment;
+}
+
+// amend the waveform annotations of a dataset in memory; returns RESULT_SUCCESS when the dataset was
+// changed and has to be saved, or the RESULT_* code that explains why it was not (see amend())
+static int AmendDataset(AmendContext& ctx, DcmDataset* pDataset)
+{
+	//(0008,0016) UI =TwelveLeadECGWaveformStorage            #  30, 1 SOPClassUID
+	OFString ofstrValue;
+	AmendScratch& scratch = _scratch; // all lines to be added to the wave form annotation sequence, and more
+	char bufST[1024]; // maxumum number of characters allowed in VR=ST
+	StageTimer timer(ctx.pMetrics, EMS_extractTags);
+	scratch.reset();
+
+	// first collect all relevant text items in one walk of the dataset
+	const AnnotationPlan& plan = ctx.options.pPlan ? *ctx.options.pPlan : AnnotationPlan::builtIn();
+	const OFVector<AnnotationRule>& rules = plan.getRules();
+	OFVector<OFString>& values = scratch.values;
+	plan.extract(*pDataset, values);
+
+	const OFString& ofstrSOPClassUID = values[EPF_SOPClassUID];
+	if (!ofstrSOPClassUID.empty())
+	{
+		if (ctx.options.bVerbose)
+			ctx.out << "INFO: SOPClassUID: " << ofstrSOPClassUID << endl;
+	}
+	else
+	{
+		if (ctx.options.bVerbose)
+			ctx.err << "WARN: SOPClassUID is missing or empty" << endl;
+	}
+	if (!IsEcgSOPClass(ofstrSOPClassUID))
+	{
+		ctx.err << "ERROR: SOP class is not 12-lead, general or ambulatory ECG" << endl;
+		return RESULT_ERROR_WRONGSOP_CLASS;
+	}
+	ctx.ofstrSOPInstanceUID = values[EPF_SOPInstanceUID];
+
+	if (ctx.options.bVerbose)
+	{
+		if (!values[EPF_PatientID].empty())
+			ctx.out << "INFO: PatientID: " << values[EPF_PatientID] << endl;
+		else
+			ctx.err << "WARN: PatientID is missing" << endl;
+
+		if (!values[EPF_AccessionNumber].empty())
+			ctx.out << "INFO: AccessionNumber: " << values[EPF_AccessionNumber] << endl;
+		else
+			ctx.err << "WARN: AccessionNumber is missing" << endl;
+
+		if (!values[EPF_StudyDescription].empty())
+			ctx.out << "INFO: StudyDescription: " << values[EPF_StudyDescription] << endl;
+		else
+			ctx.err << "WARN: StudyDescription is missing or empty" << endl;
+	}
+
+	// the lines themselves are only made when the annotations have been scanned for suppressions
+	unsigned long nLines = 0;
+	for (size_t iRule = 0; iRule < rules.size(); iRule++)
+	{
+		const OFString& ofstrSource = plan.ruleValue(values, iRule);
+		if (!ofstrSource.empty())
+		{
+			if (ctx.options.bVerbose)
+				ctx.out << "INFO: " << rules[iRule].ofstrName << ": " << ofstrSource << endl;
+			nLines++;
+		}
+		else
+		{
+			if (ctx.options.bVerbose)
+				ctx.err << "WARN: " << rules[iRule].ofstrName << " is missing or empty" << endl;
+			if (!rules[iRule].ofstrMissing.empty())
+				nLines++;
+		}
+	}
+
+	// stop here if there is nothing to add
+	if (nLines == 0)
+	{
+		ctx.err << "WARN: All source tags are missing; skipping" << endl;
+		return RESULT_WARN_NO_CHANGES;
+	}
+
+	// get a reference to the Waveform Sequence; this is just to make sure we have waveforms
+	DcmSequenceOfItems* seqWaveform = NULL;
+	OFString ofstrReferencedWaveformChannels;
+	unsigned long ulNumberOfMultiplexWaveforms = 0;
+	if (pDataset->findAndGetSequence(_tagWaveformSequence, seqWaveform).good())
+	{
+		ulNumberOfMultiplexWaveforms = seqWaveform->card();
+		unsigned long iMultiplexWaveform = 0;
+		for (iMultiplexWaveform = 0; iMultiplexWaveform < ulNumberOfMultiplexWaveforms; iMultiplexWaveform++)
+		{
+			DcmItem* pItem = seqWaveform->getItem(iMultiplexWaveform);
+			if (ctx.options.bVerbose && pItem)
+			{
+				OFString ofstdWaveformOriginality;
+				Uint16 nChannels;
+
+				pItem->findAndGetOFString(_tagWaveformOriginality, ofstdWaveformOriginality);
+				pItem->findAndGetUint16(_tagNumberOfWaveformChannels, nChannels);
+
+				if (ofstrReferencedWaveformChannels.empty() && ofstdWaveformOriginality.compare("ORIGINAL")==0)
+				{
+					snprintf(bufST, sizeof(bufST) / sizeof(bufST[0]), "%lu\\0", iMultiplexWaveform+1);
+					ofstrReferencedWaveformChannels = bufST;
+				}
+
+				ctx.out << "INFO: MultiplexWaveform [" << iMultiplexWaveform << "] = " << ofstdWaveformOriginality << ", N=" << nChannels << endl;
+			}
+		}
+	}
+	if (ulNumberOfMultiplexWaveforms == 0)
+	{
+		ctx.err << "ERROR: No waveform multiplex sequence." << endl;
+		return RESULT_ERROR_MISSING_TAG;
+	}
+
+	// get a reference to the Waveform Annotation Sequence and locate the last item with an UnformattedTextValue tag
+	timer.next(EMS_scanAnnotations);
+	DcmSequenceOfItems* seqWaveformAnnotations = NULL;
+	DcmItem* pLastUnformattedTextItem = NULL;
+	OFVector<OFBool>& suppressed = scratch.suppressed;
+	suppressed.resize(rules.size());
+	for (size_t iRule = 0; iRule < suppressed.size(); iRule++)
+		suppressed[iRule] = OFFalse;
+	unsigned long iFirstNonTextItem = DCM_EndOfListIndex; // this will be the item to insert at/before
+	if (pDataset->findAndGetSequence(_tagWaveformAnnotationSequence, seqWaveformAnnotations).good())
+	{
+		// Example ofstrUnformattedTextValue annotation Item
+		// (fffe, e000) na(Item with undefined length # = 3)         # u / l, 1 Item
+		//    (0040, a0b0) US 1\0                                      #   4, 2 ReferencedWaveformChannels
+		//    (0040, a180) US 0                                        #   2, 1 AnnotationGroupNumber
+		//    (0070, 0006) ST[Sinusbradycardie Met 1e graads av - block Met incidentele Ventricula... #  84, 1 UnformattedTextValue
+		// (fffe, e00d) na(ItemDelimitationItem)                   #   0, 0 ItemDelimitationItem
+
+		// one pass over all items in list order (getItem() would seek from the start for every item); only
+		// a separator ends it early, any later item may still carry one or suppress a source
+		OFString ofstrValue;
+		unsigned long iItem = 0;
+		for (DcmObject* pObject = seqWaveformAnnotations->nextInContainer(NULL); pObject; pObject = seqWaveformAnnotations->nextInContainer(pObject), iItem++)
+		{
+			if (ctx.options.bVerbose)
+				ctx.out << "INFO: Item: " << iItem << endl;
+			DcmItem* pItem = OFstatic_cast(DcmItem*, pObject);
+
+			// check for an UnformattedTextValue
+			if (pItem->findAndGetOFString(_tagUnformattedTextValue, ofstrValue).good())
+			{
+				if (ctx.options.bVerbose)
+					ctx.out << "INFO: Found UnformattedTextValue: " << ofstrValue << endl;
+
+				//std::transform(ofstrValue.begin(), ofstrValue.end(), ofstrValue.begin(), ::toupper);
+				if (ofstrValue.find(_ofstrAnnotationSeparator) != string::npos)
+				{
+					ctx.err << "WARN: Waveform annotation already amended; skipping" << endl;
+					return RESULT_WARN_ALREADY_AMENDED;
+				}
+				for (size_t iRule = 0; iRule < rules.size(); iRule++)
+				{
+					if (!suppressed[iRule] && !rules[iRule].ofstrSuppress.empty() && ofstrValue.find(rules[iRule].ofstrSuppress) != string::npos)
+					{
+						if (ctx.options.bVerbose)
+							ctx.out << "INFO: " << rules[iRule].ofstrName << " already annotated; skip this item in amendment" << endl;
+						suppressed[iRule] = OFTrue;
+					}
+				}
+				pLastUnformattedTextItem = pItem;
+			}
+			else
+			{
+				// if UnformattedTextValue is missing, sremember to start insertions of new item here
+				if (iFirstNonTextItem==DCM_EndOfListIndex)
+					iFirstNonTextItem = iItem;
+			}
+
+			if (ctx.options.bVerbose)
+			{
+				// ReferencedWaveformChannels
+				if (pItem->findAndGetOFStringArray(_tagReferencedWaveformChannels, ofstrValue).good())
+					ctx.out << "      ReferencedWaveformChannels: " << ofstrValue << endl;
+
+				// AnnotationGroupNumber
+				if (pItem->findAndGetOFString(_tagAnnotationGroupNumber, ofstrValue).good())
+					ctx.out << "      AnnotationGroupNumber: " << ofstrValue << endl;
+			}
+		}
+	}
+
+	// collect the text lines; start with a separator
+	/*always*/	scratch.addLine() = _ofstrAnnotationSeparator;
+	for (size_t iRule = 0; iRule < rules.size(); iRule++)
+	{
+		if (suppressed[iRule])
+			continue;
+		plan.formatLine(iRule, plan.ruleValue(values, iRule), scratch.addLine());
+		if (scratch.lines[scratch.nLines - 1].empty())
+			scratch.nLines--;
+	}
+	if (scratch.nLines<=1) // first item is a dummy separator
+	{
+		ctx.err << "WARN: All source tags are already annotated; skipping" << endl;
+		return RESULT_WARN_NO_CHANGES;
+	}
+
+	if (ctx.options.bMergeLines)
+	{
+		if (ctx.options.bVerbose)
+			ctx.out << "INFO: Merging lines into paragraph" << endl;
+
+		// one pass into a buffer of the final size
+		size_t nLength = 0;
+		for (size_t iLine = 0; iLine < scratch.nLines; iLine++)
+			nLength += scratch.lines[iLine].length() + 2;
+		OFString& ofstrMerged = scratch.ofstrMerged;
+		ofstrMerged.clear();
+		ofstrMerged.reserve(nLength);
+		for (size_t iLine = 0; iLine < scratch.nLines; iLine++)
+		{
+			if (iLine > 0)
+				ofstrMerged += "\r\n";
+			ofstrMerged += scratch.lines[iLine];
+		}
+		scratch.lines[0] = ofstrMerged;
+		scratch.nLines = 1;
+	}
+
+	// from here on the dataset is changed; ctx records how, so amend() can undo a failure
+	timer.next(EMS_insertItems);
+	if (!seqWaveformAnnotations)
+	{
+		DcmElement* pNewItem = pDataset->newDicomElement(_tagWaveformAnnotationSequence);
+		if (!pNewItem || pDataset->insert(pNewItem).bad())
+		{
+			delete pNewItem;
+			ctx.err << "FAIL: Failed to create new WaveformAnnotationSequence" << endl;
+			return RESULT_FAILED_TO_CREATE;
+		}
+		else
+		{
+			if (ctx.options.bVerbose)
+				ctx.out << "INFO: added new WaveformAnnotationSequence" << endl;
+			seqWaveformAnnotations = OFstatic_cast(DcmSequenceOfItems*, pNewItem);
+			ctx.bAddedSequence = OFTrue;
+		}
+	}
+	ctx.pAnnotations = seqWaveformAnnotations;
+	// all new items are copies of one template: the last text annotation without its text, or a
+	// dummy annotation if there was nothing defined yet
+	DcmItem templateItem;
+	if (pLastUnformattedTextItem != NULL)
+	{
+		templateItem = *pLastUnformattedTextItem;
+		delete templateItem.remove(_tagUnformattedTextValue);
+	}
+	else
+	{
+		if (ofstrReferencedWaveformChannels.empty())
+		{
+			ctx.out << "WARN: ORIGINAL Waveform multiplex group not found; assuming group 1" << endl;
+			ofstrReferencedWaveformChannels = "1\\0";
+		}
+		if (ctx.options.bVerbose)
+			ctx.out << "INFO: creating a dummy annotation." << endl;
+		if (templateItem.putAndInsertString(_tagReferencedWaveformChannels, ofstrReferencedWaveformChannels.c_str()).bad()) // putAndInsertStringArray fails
+		{
+			ctx.err << "FAIL: Failed to add ReferencedWaveformChannels to dummy: " << ofstrReferencedWaveformChannels << endl;
+			return RESULT_FAILED_TO_CREATE;
+		}
+		if (templateItem.putAndInsertString(_tagAnnotationGroupNumber, "0").bad())
+		{
+			ctx.err << "FAIL: Failed to add AnnotationGroupNumber to dummy: 0" << endl;
+			return RESULT_FAILED_TO_CREATE;
+		}
+	}
+
+	// build all new items before touching the sequence, in their final order: each line used to be
+	// inserted before the same item (separator first), or appended (separator last)
+	OFVector<DcmItem*>& newItems = scratch.newItems;
+	for (size_t iLine = 0; iLine < scratch.nLines; iLine++)
+	{
+		DcmItem* pNew = new DcmItem(templateItem);
+		if (pNew->putAndInsertString(_tagUnformattedTextValue, scratch.lines[iLine].c_str()).bad())
+		{
+			delete pNew;
+			for (size_t iNew = 0; iNew < newItems.size(); iNew++)
+				delete newItems[iNew];
+			ctx.err << "ERROR: missing tag UnformattedTextValue" << endl;
+			return RESULT_ERROR_MISSING_TAG;
+		}
+		newItems.push_back(pNew);
+	}
+	if (iFirstNonTextItem == DCM_EndOfListIndex)
+		std::reverse(newItems.begin(), newItems.end());
+
+	// splice them in with a single seek: each item goes after the previous one
+	const unsigned long ulInsertAt = iFirstNonTextItem == DCM_EndOfListIndex ? seqWaveformAnnotations->card() : iFirstNonTextItem;
+	ctx.ulInsertedAt = ulInsertAt;
+	for (size_t iNew = 0; iNew < newItems.size(); iNew++)
+	{
+		OFCondition cond;
+		if (iNew == 0)
+			cond = seqWaveformAnnotations->insert(newItems[iNew], iFirstNonTextItem, OFTrue);
+		else
+			cond = seqWaveformAnnotations->insertAtCurrentPos(newItems[iNew], OFFalse);
+		if (cond.bad())
+		{
+			for (; iNew < newItems.size(); iNew++)
+				delete newItems[iNew];
+			ctx.err << "FAIL: Failed to insert annotation: " << cond.text() << endl;
+			return RESULT_FAILED_TO_CREATE;
+		}
+		ctx.nInserted++;
+		if (ctx.options.bVerbose)
+		{
+			newItems[iNew]->findAndGetOFString(_tagUnformattedTextValue, ofstrValue);
+			ctx.out << "INFO: Inserting new annotation: [" << ulInsertAt + iNew << "] = " << ofstrValue << endl;
+		}
+	}
+
+	return RESULT_SUCCESS;
+}
+
+// implicit VR data read with only the embedded dictionary has VR UN for every tag that isn't in it
+static OFBool NeedsFullDictionary(DcmDataset* pDataset)
+{
+	if (pDataset->getOriginalXfer() != EXS_LittleEndianImplicit)
+		return OFFalse;
+	DcmStack stack;
+	while (pDataset->nextObject(stack, OFTrue).good())
+	{
+		const DcmTagKey tag = stack.top()->getTag();
+		if (tag.getGroup() != 0xfffe && tag.getElement() != 0x0000 && !tag.isPrivate() && !isEmbeddedTag(tag))
+			return OFTrue;
+	}
+	return OFFalse;
+}
+
+// amend a single file; returns one of the RESULT_* codes
+static int AmendFile(AmendContext& ctx, const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile)
+{
+	E_FileReadMode readMode = ERM_autoDetect;
+	E_TransferSyntax xfer = EXS_Unknown;
+	OFCmdUnsignedInt maxReadLength = 128; // default is 128 bytes
+	DcmFileFormat dfile;
+	OFCondition cond;
+
+	// with --load-short, long values (i.e. the WaveformData of every multiplex group) stay on disk and are
+	// copied from the input in chunks while saving; overwriting the input requires everything in memory though
+	const OFBool bInPlace = 0 == strcmp(ofstrInputFile.getCharPointer(), ofstrOutputFile.getCharPointer());
+	const OFBool bLoadAll = !ctx.options.bLoadShort || bInPlace;
+	if (!bLoadAll)
+		maxReadLength = 4096; // all but the waveform samples are read in one go
+
+	if (!ctx.options.bForceOutput && !bInPlace && OFStandard::fileExists(ofstrOutputFile))
+	{
+		ctx.err << "ERROR: Output file exists; use --force to overwrite: " << ofstrOutputFile << endl;
+		return RESULT_FAILED_TO_CREATE;
+	}
+
+	if (ctx.options.bVerbose)
+	{
+		ctx.out << "inp: " << ofstrInputFile << std::endl;
+		ctx.out << "out: " << ofstrOutputFile << std::endl;
+	}
+
+	// files that will be skipped anyway are decided without loading them
+	if (ctx.options.bTriage)
+	{
+		switch (triageFile(ofstrInputFile, ctx.options.pPlan))
+		{
+		case ETC_wrongSOPClass:
+			ctx.err << "ERROR: SOP class is not 12-lead, general or ambulatory ECG" << endl;
+			return TryFileClone(ctx, ofstrInputFile, ofstrOutputFile, RESULT_ERROR_WRONGSOP_CLASS);
+		case ETC_alreadyAmended:
+			ctx.err << "WARN: Waveform annotation already amended; skipping" << endl;
+			return TryFileClone(ctx, ofstrInputFile, ofstrOutputFile, RESULT_WARN_ALREADY_AMENDED);
+		case ETC_noSources:
+			ctx.err << "WARN: All source tags are missing; skipping" << endl;
+			return TryFileClone(ctx, ofstrInputFile, ofstrOutputFile, RESULT_WARN_NO_CHANGES);
+		default:
+			if (ctx.options.bVerbose)
+				ctx.out << "INFO: triage: needs amendment" << endl;
+			break;
+		}
+	}
+
+	{
+		const OFBool bPartialDictionary = isDictionaryPartial();
+		StageTimer timer(ctx.pMetrics, EMS_loadFile);
+		cond = dfile.loadFile(ofstrInputFile, xfer, EGL_noChange, maxReadLength, readMode);
+		if (cond.good() && bPartialDictionary && NeedsFullDictionary(dfile.getDataset()))
+		{
+			if (ctx.options.bVerbose)
+				ctx.out << "INFO: implicit VR; loading again with the complete data dictionary" << endl;
+			requireFullDictionary();
+			cond = dfile.loadFile(ofstrInputFile, xfer, EGL_noChange, maxReadLength, readMode);
+		}
+	}
+	if (cond.bad())
+	{
+		ctx.err << "ERROR: could not load dicom file: " << cond.text() << endl;
+		return TryFileClone(ctx, ofstrInputFile, ofstrOutputFile, RESULT_FAILED_TO_READ);
+	}
+	if (ctx.options.bVerbose && ctx.options.bLoadShort && bInPlace)
+		ctx.out << "INFO: amending in-place; loading all data into memory" << endl;
+	OFBool bLoaded = !bLoadAll;
+	if (bLoadAll)
+	{
+		StageTimer timer(ctx.pMetrics, EMS_loadAllData);
+		bLoaded = dfile.loadAllDataIntoMemory().good();
+	}
+	if (bLoaded)
+	{
+		DcmDataset* pDataset = dfile.getDataset();
+		const int iResult = AmendDataset(ctx, pDataset);
+		if (iResult != RESULT_SUCCESS)
+			return TryFileClone(ctx, ofstrInputFile, ofstrOutputFile, iResult);
+
+		// a crash while saving leaves a stray temporary file, never a partial output (or a damaged original)
+		DcmSequenceOfItems* seqWaveformAnnotations = NULL;
+		const OFString ofstrTempFile = MakeTempOutputName(ofstrOutputFile.getCharPointer());
+		OFBool bSaved;
+		if (IsDeflatedOutput(ctx, pDataset->getOriginalXfer()))
+		{
+			// no splicing; the whole dataset is compressed anyway
+			StageTimer timer(ctx.pMetrics, EMS_saveFile);
+			OFVector<Uint8> encoded;
+			bSaved = EncodeDeflated(ctx, dfile, encoded).good() && WriteTempFile(encoded, ofstrTempFile);
+		}
+		else
+		{
+			StageTimer timer(ctx.pMetrics, EMS_saveFile);
+			bSaved = (ctx.options.bSplice && !bInPlace && pDataset->findAndGetSequence(_tagWaveformAnnotationSequence, seqWaveformAnnotations).good()
+				&& SpliceSave(ctx, ofstrInputFile, ofstrTempFile, seqWaveformAnnotations, pDataset->getOriginalXfer()).good())
+				|| dfile.saveFile(ofstrTempFile, pDataset->getOriginalXfer(), EET_UndefinedLength, EGL_recalcGL, EPD_noChange, 0, 0, EWM_createNewMeta).good();
+		}
+		if (bSaved && ctx.options.bVerify && VerifyOutputFile(ctx, ofstrInputFile, ofstrTempFile) != RESULT_SUCCESS)
+		{
+			OFStandard::deleteFile(ofstrTempFile);
+			return TryFileClone(ctx, ofstrInputFile, ofstrOutputFile, RESULT_FAILED_VERIFY);
+		}
+		if (!bSaved)
+			OFStandard::deleteFile(ofstrTempFile);
+		else
+			bSaved = CommitOutput(ctx, ofstrTempFile, ofstrOutputFile);
+		if (bSaved)
+		{
+			if (ctx.options.bVerbose)
+				ctx.out << "INFO: Created output file: " << ofstrOutputFile << endl;
+		}
+		else
+		{
+			ctx.err << "FAIL: failed to create output file: " << ofstrOutputFile << endl;
+			return TryFileClone(ctx, ofstrInputFile, ofstrOutputFile, RESULT_FAILED_TO_CREATE);
+		}
+	}
+	else
+	{
+		ctx.err << "ERROR: failed reading all data" << endl;
+		return TryFileClone(ctx, ofstrInputFile, ofstrOutputFile, RESULT_FAILED_TO_READ);
+	}
+
+	return RESULT_SUCCESS;
+}
+
+AmendOptions::AmendOptions()
+	: bMergeLines(OFFalse), bVerbose(OFFalse), pPlan(NULL), bVerify(OFFalse), bWriteDeflated(OFFalse), iDeflateLevel(6), nDeflateThreads(1), pOut(NULL), pErr(NULL), bForceOutput(OFFalse), bNoCloneOnError(OFFalse),
+	  cloneMethod(ECM_copy), bLoadShort(OFFalse), bSplice(OFFalse), bTriage(OFFalse), pCommitter(NULL)
+{
+}
+
+OFBool isFinalResult(int iResult)
+{
+	return iResult > -RESULT_FAILED_TO_CLONE_OFFSET && iResult < RESULT_FAILED_TO_CLONE_OFFSET
+		&& iResult != RESULT_FAILED_TO_CREATE && iResult != RESULT_FAILED_TO_READ && iResult != RESULT_FAILED_VERIFY;
+}
+
+AmendResult::AmendResult()
+	: code(RESULT_SUCCESS), nInserted(0), cloneResult(ECR_failed), nClonedBytes(0), bVerified(OFFalse)
+{
+}
+
+static AmendResult MakeResult(const AmendContext& ctx, int iCode)
+{
+	AmendResult result;
+	result.code = iCode;
+	result.nInserted = iCode == RESULT_SUCCESS ? ctx.nInserted : 0;
+	result.cloneResult = ctx.cloneResult;
+	result.nClonedBytes = ctx.nClonedBytes;
+	result.ofstrSOPInstanceUID = ctx.ofstrSOPInstanceUID;
+	result.bVerified = ctx.bVerified;
+	result.digest = ctx.digest;
+	return result;
+}
+
+AmendResult amend(DcmDataset& dataset, const AmendOptions& options, FileMetrics* pMetrics)
+{
+	AmendContext ctx(options, pMetrics);
+	int iResult = AmendDataset(ctx, &dataset);
+	if (iResult != RESULT_SUCCESS && ctx.pAnnotations)
+	{
+		// remove the sequence that was added, or the items inserted so far (they are contiguous)
+		if (ctx.bAddedSequence)
+			dataset.findAndDeleteElement(_tagWaveformAnnotationSequence);
+		else
+		{
+			for (unsigned long iInserted = 0; iInserted < ctx.nInserted; iInserted++)
+				delete ctx.pAnnotations->remove(ctx.ulInsertedAt);
+		}
+	}
+	return MakeResult(ctx, iResult);
+}
+
+AmendResult amendFile(const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile, const AmendOptions& options, FileMetrics* pMetrics)
+{
+	AmendContext ctx(options, pMetrics);
+	const int iResult = AmendFile(ctx, ofstrInputFile, ofstrOutputFile);
+	return MakeResult(ctx, iResult);
+}
+
+static OFCondition ReadStream(DcmFileFormat& dfile, const OFVector<Uint8>& input)
+{
+	DcmInputBufferStream stream;
+	stream.setBuffer(&input[0], input.size());
+	stream.setEos();
+	dfile.transferInit();
+	const OFCondition cond = dfile.read(stream);
+	dfile.transferEnd();
+	return cond;
+}
+
+AmendResult amendStream(const OFVector<Uint8>& input, OFVector<Uint8>& output, const AmendOptions& options, FileMetrics* pMetrics)
+{
+	AmendContext ctx(options, pMetrics);
+	output.clear();
+	if (pMetrics)
+		pMetrics->nBytesRead = input.size();
+	if (input.empty())
+	{
+		ctx.err << "ERROR: empty dicom stream" << endl;
+		return MakeResult(ctx, RESULT_FAILED_TO_READ);
+	}
+
+	DcmFileFormat dfile;
+	OFCondition cond;
+	{
+		const OFBool bPartialDictionary = isDictionaryPartial();
+		StageTimer timer(pMetrics, EMS_loadFile);
+		cond = ReadStream(dfile, input);
+		if (cond.good() && bPartialDictionary && NeedsFullDictionary(dfile.getDataset()))
+		{
+			if (ctx.options.bVerbose)
+				ctx.out << "INFO: implicit VR; reading again with the complete data dictionary" << endl;
+			requireFullDictionary();
+			dfile.clear();
+			cond = ReadStream(dfile, input);
+		}
+	}
+	if (cond.bad())
+	{
+		ctx.err << "ERROR: could not parse dicom stream: " << cond.text() << endl;
+		return MakeResult(ctx, RESULT_FAILED_TO_READ);
+	}
+
+	const int iResult = AmendDataset(ctx, dfile.getDataset());
+	if (iResult != RESULT_SUCCESS)
+		return MakeResult(ctx, iResult);
+
+	{
+		StageTimer timer(pMetrics, EMS_saveFile);
+		const E_TransferSyntax xfer = dfile.getDataset()->getOriginalXfer();
+		cond = IsDeflatedOutput(ctx, xfer) ? EncodeDeflated(ctx, dfile, output) : EncodeFileFormat(dfile, xfer, output);
+	}
+	if (cond.bad())
+	{
+		ctx.err << "FAIL: failed to encode output stream: " << cond.text() << endl;
+		output.clear();
+		return MakeResult(ctx, RESULT_FAILED_TO_CREATE);
+	}
+	if (ctx.options.bVerify && VerifyOutput(ctx, &input[0], input.size(), &output[0], output.size()) != RESULT_SUCCESS)
+	{
+		output.clear();
+		return MakeResult(ctx, RESULT_FAILED_VERIFY);
+	}
+	if (pMetrics)
+		pMetrics->nBytesWritten = output.size();
+	return MakeResult(ctx, RESULT_SUCCESS);
+}
+
+OFBool writeOutputFile(const OFVector<Uint8>& data, const OFFilename& ofstrOutputFile, const AmendOptions& options, FileMetrics* pMetrics)
+{
+	AmendContext ctx(options, pMetrics);
+	const OFString ofstrTempFile = MakeTempOutputName(ofstrOutputFile.getCharPointer());
+	OFBool bWritten = OFFalse;
+	{
+		StageTimer timer(pMetrics, EMS_saveFile);
+		bWritten = WriteTempFile(data, ofstrTempFile);
+	}
+	if (!bWritten)
+	{
+		ctx.err << "FAIL: failed to write output file: " << ofstrOutputFile << endl;
+		OFStandard::deleteFile(ofstrTempFile);
+		return OFFalse;
+	}
+	if (!CommitOutput(ctx, ofstrTempFile, ofstrOutputFile))
+	{
+		ctx.err << "FAIL: failed to commit output file: " << ofstrOutputFile << endl;
+		return OFFalse;
+	}
+	if (pMetrics)
+		pMetrics->nBytesWritten = data.size();
+	return OFTrue;
+}
+
+OFBool cloneInputFile(const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile, const AmendOptions& options, AmendResult& result, FileMetrics* pMetrics)
+{
+	AmendContext ctx(options, pMetrics);
+	StageTimer timer(pMetrics, EMS_clone);
+	const OFBool bCloned = CloneToOutput(ctx, ofstrInputFile, ofstrOutputFile);
+	result.cloneResult = ctx.cloneResult;
+	result.nClonedBytes = ctx.nClonedBytes;
+	return bCloned;
+}
@@ -0,0 +1,300 @@
+﻿// AnnotationRules.cpp : rule table and extraction plan (see AnnotationRules.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "AnnotationRules.h"
+#include "DicomScanner.h"
+#include "EmbeddedDictionary.h"
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/ofstd/ofstrutl.h"
+
+#include <algorithm>
+#include <fstream>
+
+#define MAX_ST_LENGTH 1024 // maximum number of characters allowed in VR=ST
+
+// the built-in rules for Muse exports
+struct BuiltInRule
+{
+	DcmTagKey tag;
+	const char* pszLabel;
+	E_RuleFormat format;
+	const char* pszMissing;
+	const char* pszSuppress;
+};
+
+static const BuiltInRule _builtInRules[] =
+{
+	{ DCM_VisitComments,				"Testind:",				ERF_text,	"",								"" },
+	{ DCM_OperatorsName,				"Technicus:",			ERF_name,	"",								"" },
+	{ DCM_ReferringPhysicianName,		"Verwezen door:",		ERF_name,	"",								"" },
+	{ DCM_PhysiciansOfRecord,			"Aangevraagd door:",	ERF_name,	"",								"" },
+	// only added in retrospective mode; in the live stream the reading physician is already annotated
+	// ('Bevestigd' may be lower case, so its capital is ignored)
+	{ DCM_NameOfPhysiciansReadingStudy,	"Bevestigd door:",		ERF_name,	"Bevestigd door: Onbevestigd",	"evestigd" }
+};
+
+// tags of the E_PlanField fields
+static const DcmTagKey _planFieldTags[EPF_count] =
+{
+	DCM_SOPClassUID,
+	DCM_SOPInstanceUID,
+	DCM_PatientID,
+	DCM_AccessionNumber,
+	DCM_StudyDescription
+};
+
+static OFString& HumanReadableName(OFString& s)
+{
+	// removes carets from DICOM PN
+	static const OFString _ofstrCaret3("^^^");
+	static const OFString _ofstrCaret2("^^");
+	static const OFString _ofstrCaret("^");
+	static const OFString _ofstrCommaSpace(", ");
+	OFStringUtil::replace_all(s, _ofstrCaret3, _ofstrCaret);
+	OFStringUtil::replace_all(s, _ofstrCaret2, _ofstrCaret);
+	OFStringUtil::replace_all(s, _ofstrCaret2, _ofstrCaret);
+	if (*s.begin() == '^') s.erase(0, 1);
+	if (*(s.end()-1) == '^') s.erase(s.length()-1, 1);
+	OFStringUtil::replace_all(s, _ofstrCaret, _ofstrCommaSpace);
+	return s;
+}
+
+// (gggg,eeee), gggg,eeee or a dictionary name
+static OFBool ParseTag(const OFString& ofstrTag, DcmTagKey& tag)
+{
+	unsigned int nGroup = 0, nElement = 0;
+	char cEnd = 0;
+	const char* pszTag = ofstrTag.c_str();
+	if (*pszTag == '(')
+	{
+		if (sscanf(pszTag, "(%x,%x%c", &nGroup, &nElement, &cEnd) == 3 && cEnd == ')' && nGroup <= 0xffff && nElement <= 0xffff)
+		{
+			tag = DcmTagKey(OFstatic_cast(Uint16, nGroup), OFstatic_cast(Uint16, nElement));
+			return OFTrue;
+		}
+		return OFFalse;
+	}
+	if (sscanf(pszTag, "%x,%x%c", &nGroup, &nElement, &cEnd) == 2 && nGroup <= 0xffff && nElement <= 0xffff)
+	{
+		tag = DcmTagKey(OFstatic_cast(Uint16, nGroup), OFstatic_cast(Uint16, nElement));
+		return OFTrue;
+	}
+	// names the embedded dictionary doesn't know are looked up in the complete one
+	DcmTag dictTag;
+	if (DcmTag::findTagFromName(pszTag, dictTag).good() || (requireFullDictionary() && DcmTag::findTagFromName(pszTag, dictTag).good()))
+	{
+		tag = dictTag;
+		return OFTrue;
+	}
+	return OFFalse;
+}
+
+AnnotationRule::AnnotationRule()
+	: format(ERF_text)
+{
+}
+
+AnnotationPlan::AnnotationPlan()
+{
+}
+
+OFBool AnnotationPlan::compile(const OFVector<AnnotationRule>& rules, OFString& ofstrError)
+{
+	if (rules.empty())
+	{
+		ofstrError = "no rules";
+		return OFFalse;
+	}
+
+	OFVector<DcmTagKey> fields(_planFieldTags, _planFieldTags + EPF_count);
+	m_rules = rules;
+	m_ruleFields.clear();
+	for (size_t iRule = 0; iRule < m_rules.size(); iRule++)
+	{
+		AnnotationRule& rule = m_rules[iRule];
+		if (rule.ofstrName.empty())
+			rule.ofstrName = DcmTag(rule.tag).getTagName();
+
+		// rules with the same source share its field
+		size_t iField = 0;
+		while (iField < fields.size() && fields[iField] != rule.tag)
+			iField++;
+		if (iField == fields.size())
+			fields.push_back(rule.tag);
+		m_ruleFields.push_back(iField);
+	}
+
+	// the walk visits the fields in the order of the dataset
+	m_walk.clear();
+	for (size_t iField = 0; iField < fields.size(); iField++)
+	{
+		WalkStep step;
+		step.tag = fields[iField];
+		step.iField = iField;
+		m_walk.push_back(step);
+	}
+	std::sort(m_walk.begin(), m_walk.end(), [](const WalkStep& a, const WalkStep& b) { return a.tag < b.tag; });
+	return OFTrue;
+}
+
+OFBool AnnotationPlan::load(const OFFilename& ofstrFile, OFString& ofstrError)
+{
+	STD_NAMESPACE ifstream rulesFile(ofstrFile.getCharPointer());
+	if (!rulesFile)
+	{
+		ofstrError = "cannot read rules file";
+		return OFFalse;
+	}
+
+	OFVector<AnnotationRule> rules;
+	STD_NAMESPACE string strLine;
+	unsigned long nLine = 0;
+	char bufLine[32];
+	while (STD_NAMESPACE getline(rulesFile, strLine))
+	{
+		nLine++;
+		snprintf(bufLine, sizeof(bufLine), "line %lu: ", nLine);
+		OFString ofstrLine(strLine.c_str());
+		OFStandard::trimString(ofstrLine);
+		if (ofstrLine.empty() || ofstrLine[0] == '#')
+			continue;
+
+		OFVector<OFString> fields;
+		size_t nStart = 0;
+		for (;;)
+		{
+			const size_t nEnd = ofstrLine.find('|', nStart);
+			OFString ofstrField(ofstrLine.substr(nStart, nEnd == OFString_npos ? OFString_npos : nEnd - nStart));
+			OFStandard::trimString(ofstrField);
+			fields.push_back(ofstrField);
+			if (nEnd == OFString_npos)
+				break;
+			nStart = nEnd + 1;
+		}
+		if (fields.size() > 5)
+		{
+			ofstrError = OFString(bufLine) + "too many fields";
+			return OFFalse;
+		}
+		fields.resize(5);
+
+		AnnotationRule rule;
+		if (!ParseTag(fields[0], rule.tag))
+		{
+			ofstrError = OFString(bufLine) + "unknown tag '" + fields[0] + "'";
+			return OFFalse;
+		}
+		rule.ofstrLabel = fields[1];
+		if (fields[2].empty() || fields[2] == "text")
+			rule.format = ERF_text;
+		else if (fields[2] == "name")
+			rule.format = ERF_name;
+		else
+		{
+			ofstrError = OFString(bufLine) + "unknown format '" + fields[2] + "'; use text or name";
+			return OFFalse;
+		}
+		rule.ofstrMissing = fields[3];
+		rule.ofstrSuppress = fields[4];
+		rules.push_back(rule);
+	}
+	return compile(rules, ofstrError);
+}
+
+static AnnotationPlan CompileBuiltInPlan()
+{
+	OFVector<AnnotationRule> rules;
+	for (size_t iRule = 0; iRule < sizeof(_builtInRules) / sizeof(_builtInRules[0]); iRule++)
+	{
+		AnnotationRule rule;
+		rule.tag = _builtInRules[iRule].tag;
+		rule.ofstrLabel = _builtInRules[iRule].pszLabel;
+		rule.format = _builtInRules[iRule].format;
+		rule.ofstrMissing = _builtInRules[iRule].pszMissing;
+		rule.ofstrSuppress = _builtInRules[iRule].pszSuppress;
+		rules.push_back(rule);
+	}
+	AnnotationPlan plan;
+	OFString ofstrError;
+	plan.compile(rules, ofstrError);
+	return plan;
+}
+
+const AnnotationPlan& AnnotationPlan::builtIn()
+{
+	static const AnnotationPlan plan(CompileBuiltInPlan()); // compiled once, on first use
+	return plan;
+}
+
+// empty all values, keeping the buffers of the strings
+static void ResetValues(OFVector<OFString>& values, size_t nValues)
+{
+	values.resize(nValues);
+	for (size_t iValue = 0; iValue < nValues; iValue++)
+		values[iValue].clear();
+}
+
+void AnnotationPlan::extract(DcmItem& dataset, OFVector<OFString>& values) const
+{
+	// both the elements and the walk are in tag order, so one pass over each suffices; the walk
+	// ends at the last field, long before the waveform data
+	ResetValues(values, m_walk.size());
+	size_t iStep = 0;
+	for (DcmObject* pObject = dataset.nextInContainer(NULL); pObject && iStep < m_walk.size(); pObject = dataset.nextInContainer(pObject))
+	{
+		const DcmTagKey tag = pObject->getTag();
+		while (iStep < m_walk.size() && m_walk[iStep].tag < tag)
+			iStep++;
+		if (iStep < m_walk.size() && m_walk[iStep].tag == tag)
+		{
+			OFString& ofstrValue = values[m_walk[iStep++].iField];
+			if (OFstatic_cast(DcmElement*, pObject)->getOFStringArray(ofstrValue).bad())
+				ofstrValue.clear();
+		}
+	}
+}
+
+void AnnotationPlan::extract(const DicomScanner& scanner, OFVector<OFString>& values) const
+{
+	ResetValues(values, m_walk.size());
+	const OFVector<ScannedElement>& elements = scanner.getElements();
+	size_t iStep = 0;
+	for (size_t iElement = 0; iElement < elements.size() && iStep < m_walk.size(); iElement++)
+	{
+		const DcmTagKey& tag = elements[iElement].tag;
+		while (iStep < m_walk.size() && m_walk[iStep].tag < tag)
+			iStep++;
+		if (iStep < m_walk.size() && m_walk[iStep].tag == tag)
+		{
+			OFString& ofstrValue = values[m_walk[iStep++].iField];
+			if (!scanner.getString(elements[iElement], ofstrValue))
+				ofstrValue.clear();
+		}
+	}
+}
+
+void AnnotationPlan::formatLine(size_t iRule, const OFString& ofstrValue, OFString& ofstrLine) const
+{
+	const AnnotationRule& rule = m_rules[iRule];
+	if (ofstrValue.empty())
+	{
+		ofstrLine = rule.ofstrMissing;
+		return;
+	}
+
+	ofstrLine = rule.ofstrLabel;
+	if (!ofstrLine.empty())
+		ofstrLine += ' ';
+	if (rule.format == ERF_name)
+	{
+		OFString ofstrText(ofstrValue);
+		ofstrLine += HumanReadableName(ofstrText);
+	}
+	else
+		ofstrLine += ofstrValue;
+	if (ofstrLine.length() > MAX_ST_LENGTH)
+		ofstrLine.erase(MAX_ST_LENGTH);
+}
@@ -0,0 +1,86 @@
+﻿// AnnotationRules.h : the rules that turn source tags into annotation lines
+// A rule copies one top-level tag into a text annotation, e.g. OperatorsName as 'Technicus: <name>'.
+// The rules are compiled once into a plan that extracts every tag it needs in one walk of the dataset,
+// so the cost per file doesn't depend on the number of rules.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/dcmdata/dctk.h"
+#include "dcmtk/ofstd/ofvector.h"
+
+class DicomScanner;
+
+// how a source value is formatted
+enum E_RuleFormat
+{
+	ERF_text,	// as is
+	ERF_name	// PN in human readable form, e.g. 'Groot, Paul'
+};
+
+struct AnnotationRule
+{
+	AnnotationRule();
+
+	DcmTagKey tag;			// top-level source tag
+	OFString ofstrName;		// name in messages (default: the dictionary name)
+	OFString ofstrLabel;	// prefix of the line, e.g. 'Technicus:' (empty: the value only)
+	E_RuleFormat format;
+	OFString ofstrMissing;	// line when the tag is missing or empty (empty: no line)
+	OFString ofstrSuppress;	// no line when an existing text annotation contains this (empty: never)
+};
+
+// fields that every plan extracts, before the sources of its rules
+enum E_PlanField
+{
+	EPF_SOPClassUID,
+	EPF_SOPInstanceUID,
+	EPF_PatientID,
+	EPF_AccessionNumber,
+	EPF_StudyDescription,
+	EPF_count
+};
+
+class AnnotationPlan
+{
+public:
+	AnnotationPlan();
+
+	// compile a rule table; rules yield their lines in table order
+	OFBool compile(const OFVector<AnnotationRule>& rules, OFString& ofstrError);
+
+	// read and compile a rules file; one rule per line, fields separated by '|':
+	//   tag | label | format (text or name) | line when missing | suppress when an annotation contains
+	// tag is (gggg,eeee) or a dictionary name; empty lines and lines starting with '#' are ignored
+	OFBool load(const OFFilename& ofstrFile, OFString& ofstrError);
+
+	// the plan of the built-in rules for Muse exports
+	static const AnnotationPlan& builtIn();
+
+	const OFVector<AnnotationRule>& getRules() const { return m_rules; }
+
+	// values of all fields (E_PlanField, then one per source tag) in one walk of the top-level
+	// elements; missing tags yield empty values. The strings already in values are reused.
+	void extract(DcmItem& dataset, OFVector<OFString>& values) const;
+	void extract(const DicomScanner& scanner, OFVector<OFString>& values) const;
+
+	// the source value of a rule in the extracted values
+	const OFString& ruleValue(const OFVector<OFString>& values, size_t iRule) const { return values[m_ruleFields[iRule]]; }
+
+	// the line of a rule for its source value, written into ofstrLine so its buffer can be reused;
+	// empty when the rule yields no line
+	void formatLine(size_t iRule, const OFString& ofstrValue, OFString& ofstrLine) const;
+
+private:
+	struct WalkStep
+	{
+		DcmTagKey tag;
+		size_t iField;
+	};
+
+	OFVector<AnnotationRule> m_rules;
+	OFVector<size_t> m_ruleFields;	// field of every rule
+	OFVector<WalkStep> m_walk;		// one step per field, in tag order
+};
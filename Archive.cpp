@@ -0,0 +1,1127 @@
+﻿// Archive.cpp : tar and zip bundles in archive mode (see Archive.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "Archive.h"
+#include "Log.h"
+
+#include "dcmtk/ofstd/offile.h"
+#include "dcmtk/ofstd/ofstream.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK)		// tar pads archives to a multiple of this
+#define TAR_MAX_EXTENSION (1024 * 1024)	// largest long name or pax header accepted
+
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END 0x06054b50
+#define ZIP64_END 0x06064b50
+#define ZIP64_LOCATOR 0x07064b50
+#define ZIP64_EXTRA 0x0001
+#define ZIP64_VERSION 45
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+#define ZIP_FLAG_ENCRYPTED 0x0001
+#define ZIP_FLAG_DESCRIPTOR 0x0008		// sizes and crc follow the data
+#define ZIP_MAX_CENTRAL (1024 * 1024 * 1024)
+
+#define ZLIB_CHUNK (1024 * 1024 * 1024)	// zlib counts in 32 bit
+
+ArchiveConfig::ArchiveConfig()
+	: nWorkers(1), nMaxInFlight(32), nMemoryBudget(OFstatic_cast(Uint64, 512) * 1024 * 1024), bNoCloneOnError(OFFalse)
+{
+}
+
+// the fields of a zip member; sizes and offset are the 64 bit values, the extras are without their zip64 field
+struct ZipEntry
+{
+	ZipEntry() : nVersionMadeBy(0), nVersionNeeded(0), nFlags(0), nMethod(0), nTime(0), nDate(0), nInternalAttributes(0),
+		nCrc(0), nExternalAttributes(0), nCompressedSize(0), nSize(0), nLocalOffset(0) {}
+
+	Uint16 nVersionMadeBy;
+	Uint16 nVersionNeeded;
+	Uint16 nFlags;
+	Uint16 nMethod;
+	Uint16 nTime;
+	Uint16 nDate;
+	Uint16 nInternalAttributes;
+	Uint32 nCrc;
+	Uint32 nExternalAttributes;
+	Uint64 nCompressedSize;
+	Uint64 nSize;
+	Uint64 nLocalOffset;
+	OFVector<Uint8> name;
+	OFVector<Uint8> localExtra;
+	OFVector<Uint8> centralExtra;
+	OFVector<Uint8> comment;
+};
+
+struct ArchiveMember
+{
+	ArchiveMember() : nStoredSize(0), nContentSize(0), bFile(OFFalse), bAmendable(OFFalse), nBudget(0),
+		iResult(RESULT_SUCCESS), bDicom(OFFalse), bAmended(OFFalse), bDropped(OFFalse), nOutputCrc(0), nOutputSize(0), bDone(OFFalse) {}
+
+	OFString ofstrName;
+	Uint64 nStoredSize;				// bytes of data in the archive (zip: compressed)
+	Uint64 nContentSize;			// bytes of the file itself
+	OFBool bFile;					// a regular file; anything else is copied as is
+	OFBool bAmendable;				// a file whose content can be read and replaced
+	OFVector<Uint8> header;			// tar: all header blocks, including long names and pax headers
+	ZipEntry zip;
+	OFVector<Uint8> data;			// as stored in the input
+	Uint64 nBudget;					// bytes of the memory budget held until the member is written
+
+	// set by the worker
+	int iResult;
+	OFString ofstrSOPInstanceUID;
+	OFBool bDicom;
+	OFBool bAmended;				// output replaces data
+	OFBool bDropped;				// left out (--no-clone)
+	OFVector<Uint8> output;			// as stored in the output (zip: compressed like the input)
+	Uint32 nOutputCrc;
+	Uint64 nOutputSize;
+	STD_NAMESPACE string strOut;
+	STD_NAMESPACE string strErr;
+	OFBool bDone;
+};
+
+static Uint16 GetLE16(const Uint8* p)
+{
+	return OFstatic_cast(Uint16, p[0] | (p[1] << 8));
+}
+
+static Uint32 GetLE32(const Uint8* p)
+{
+	return OFstatic_cast(Uint32, p[0]) | (OFstatic_cast(Uint32, p[1]) << 8) | (OFstatic_cast(Uint32, p[2]) << 16) | (OFstatic_cast(Uint32, p[3]) << 24);
+}
+
+static Uint64 GetLE64(const Uint8* p)
+{
+	return GetLE32(p) | (OFstatic_cast(Uint64, GetLE32(p + 4)) << 32);
+}
+
+static void PutLE16(OFVector<Uint8>& buffer, Uint16 nValue)
+{
+	buffer.push_back(OFstatic_cast(Uint8, nValue));
+	buffer.push_back(OFstatic_cast(Uint8, nValue >> 8));
+}
+
+static void PutLE32(OFVector<Uint8>& buffer, Uint32 nValue)
+{
+	PutLE16(buffer, OFstatic_cast(Uint16, nValue));
+	PutLE16(buffer, OFstatic_cast(Uint16, nValue >> 16));
+}
+
+static void PutLE64(OFVector<Uint8>& buffer, Uint64 nValue)
+{
+	PutLE32(buffer, OFstatic_cast(Uint32, nValue));
+	PutLE32(buffer, OFstatic_cast(Uint32, nValue >> 32));
+}
+
+static void PutBytes(OFVector<Uint8>& buffer, const OFVector<Uint8>& bytes)
+{
+	buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+}
+
+static OFBool ReadFully(OFFile& file, void* pBuffer, size_t nBytes)
+{
+	return nBytes == 0 || file.fread(pBuffer, 1, nBytes) == nBytes;
+}
+
+static OFBool ReadFully(OFFile& file, OFVector<Uint8>& buffer, Uint64 nBytes)
+{
+	buffer.resize(OFstatic_cast(size_t, nBytes));
+	return buffer.empty() || ReadFully(file, &buffer[0], buffer.size());
+}
+
+Uint32 ArchiveCrc32(const OFVector<Uint8>& data)
+{
+#ifdef WITH_ZLIB
+	uLong nCrc = crc32(0L, Z_NULL, 0);
+	for (size_t nPos = 0; nPos < data.size(); nPos += ZLIB_CHUNK)
+		nCrc = crc32(nCrc, &data[nPos], OFstatic_cast(uInt, min<size_t>(ZLIB_CHUNK, data.size() - nPos)));
+	return OFstatic_cast(Uint32, nCrc);
+#else
+	static Uint32 table[256];
+	static std::once_flag tableOnce;
+	std::call_once(tableOnce, []()
+	{
+		for (Uint32 n = 0; n < 256; n++)
+		{
+			Uint32 c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+	});
+	Uint32 nCrc = 0xffffffff;
+	for (size_t nPos = 0; nPos < data.size(); nPos++)
+		nCrc = table[(nCrc ^ data[nPos]) & 0xff] ^ (nCrc >> 8);
+	return nCrc ^ 0xffffffff;
+#endif
+}
+
+#ifdef WITH_ZLIB
+// raw deflate data (zip method 8) of a member of nSize bytes
+static OFBool Inflate(const OFVector<Uint8>& input, Uint64 nSize, OFVector<Uint8>& output)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+		return OFFalse;
+	output.resize(OFstatic_cast(size_t, nSize));
+	Uint8 nDummy = 0;
+	stream.next_out = &nDummy; // an empty file still has to reach the end of the stream
+	size_t nInPos = 0, nOutPos = 0; // handed to zlib so far
+	int iStatus = Z_OK;
+	while (iStatus == Z_OK)
+	{
+		if (stream.avail_in == 0 && nInPos < input.size())
+		{
+			stream.next_in = OFconst_cast(Bytef*, &input[nInPos]);
+			stream.avail_in = OFstatic_cast(uInt, min<size_t>(ZLIB_CHUNK, input.size() - nInPos));
+			nInPos += stream.avail_in;
+		}
+		if (stream.avail_out == 0 && nOutPos < output.size())
+		{
+			stream.next_out = &output[nOutPos];
+			stream.avail_out = OFstatic_cast(uInt, min<size_t>(ZLIB_CHUNK, output.size() - nOutPos));
+			nOutPos += stream.avail_out;
+		}
+		iStatus = inflate(&stream, Z_NO_FLUSH);
+	}
+	const OFBool bComplete = iStatus == Z_STREAM_END && stream.avail_out == 0 && nOutPos == output.size();
+	inflateEnd(&stream);
+	return bComplete;
+}
+
+static OFBool Deflate(const OFVector<Uint8>& input, OFVector<Uint8>& output)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return OFFalse;
+	// deflateBound() for 64 bit sizes
+	const size_t nSize = input.size();
+	output.resize(nSize + (nSize >> 12) + (nSize >> 14) + (nSize >> 25) + 64);
+	size_t nInPos = 0, nOutPos = 0;
+	int iStatus = Z_OK;
+	while (iStatus == Z_OK)
+	{
+		if (stream.avail_in == 0 && nInPos < input.size())
+		{
+			stream.next_in = OFconst_cast(Bytef*, &input[nInPos]);
+			stream.avail_in = OFstatic_cast(uInt, min<size_t>(ZLIB_CHUNK, input.size() - nInPos));
+			nInPos += stream.avail_in;
+		}
+		if (stream.avail_out == 0 && nOutPos < output.size())
+		{
+			stream.next_out = &output[nOutPos];
+			stream.avail_out = OFstatic_cast(uInt, min<size_t>(ZLIB_CHUNK, output.size() - nOutPos));
+			nOutPos += stream.avail_out;
+		}
+		iStatus = deflate(&stream, nInPos == input.size() ? Z_FINISH : Z_NO_FLUSH);
+	}
+	output.resize(nOutPos - stream.avail_out);
+	deflateEnd(&stream);
+	return iStatus == Z_STREAM_END;
+}
+#endif
+
+// --- readers
+
+class ArchiveReader
+{
+public:
+	explicit ArchiveReader(OFFile& file) : m_file(file) {}
+	virtual ~ArchiveReader() {}
+
+	// the next member without its data; OFFalse at the end, or on errors
+	virtual OFBool next(ArchiveMember& member) = 0;
+	virtual OFBool readData(ArchiveMember& member) = 0;
+
+	OFBool failed() const { return !m_ofstrError.empty(); }
+	const OFString& error() const { return m_ofstrError; }
+
+protected:
+	OFFile& m_file;
+	OFString m_ofstrError;
+};
+
+// octal, or GNU base-256 for values that don't fit
+static Uint64 TarNumber(const Uint8* pField, size_t nLength)
+{
+	Uint64 nValue = 0;
+	if (pField[0] & 0x80)
+	{
+		nValue = pField[0] & 0x7f;
+		for (size_t iByte = 1; iByte < nLength; iByte++)
+			nValue = (nValue << 8) | pField[iByte];
+		return nValue;
+	}
+	OFBool bDigits = OFFalse;
+	for (size_t iByte = 0; iByte < nLength; iByte++)
+	{
+		if (pField[iByte] >= '0' && pField[iByte] <= '7')
+		{
+			nValue = nValue * 8 + (pField[iByte] - '0');
+			bDigits = OFTrue;
+		}
+		else if (pField[iByte] != ' ' || bDigits)
+			break;
+	}
+	return nValue;
+}
+
+static unsigned long TarChecksum(const Uint8* pBlock)
+{
+	unsigned long nSum = 0;
+	for (int iByte = 0; iByte < TAR_BLOCK; iByte++)
+		nSum += (iByte >= 148 && iByte < 156) ? ' ' : pBlock[iByte];
+	return nSum;
+}
+
+static OFBool IsTarHeader(const Uint8* pBlock)
+{
+	return TarNumber(pBlock + 148, 8) == TarChecksum(pBlock);
+}
+
+static OFString TarString(const Uint8* pField, size_t nLength)
+{
+	size_t nEnd = 0;
+	while (nEnd < nLength && pField[nEnd])
+		nEnd++;
+	return OFString(OFreinterpret_cast(const char*, pField), nEnd);
+}
+
+// the records of a pax extended header ("<length> <key>=<value>\n")
+static void ParsePaxHeader(const Uint8* pData, size_t nSize, OFString& ofstrPath, OFBool& bSize)
+{
+	const char* pszData = OFreinterpret_cast(const char*, pData);
+	size_t nPos = 0;
+	while (nPos < nSize)
+	{
+		size_t nLength = 0, nSpace = nPos;
+		while (nSpace < nSize && pszData[nSpace] >= '0' && pszData[nSpace] <= '9')
+			nLength = nLength * 10 + (pszData[nSpace++] - '0');
+		if (nSpace >= nSize || pszData[nSpace] != ' ' || nPos + nLength > nSize || nSpace + 2 > nPos + nLength)
+			break;
+		const OFString ofstrRecord(pszData + nSpace + 1, nPos + nLength - nSpace - 2);
+		if (ofstrRecord.compare(0, 5, "path=") == 0)
+			ofstrPath = ofstrRecord.substr(5);
+		else if (ofstrRecord.compare(0, 5, "size=") == 0)
+			bSize = OFTrue;
+		nPos += nLength;
+	}
+}
+
+class TarReader : public ArchiveReader
+{
+public:
+	explicit TarReader(OFFile& file) : ArchiveReader(file) {}
+
+	virtual OFBool next(ArchiveMember& member);
+	virtual OFBool readData(ArchiveMember& member);
+};
+
+OFBool TarReader::next(ArchiveMember& member)
+{
+	OFString ofstrLongName, ofstrPaxPath;
+	OFBool bPaxSize = OFFalse;
+	for (;;)
+	{
+		Uint8 block[TAR_BLOCK];
+		if (!ReadFully(m_file, block, TAR_BLOCK))
+		{
+			if (!member.header.empty())
+				m_ofstrError = "truncated tar header";
+			return OFFalse; // like tar, a missing end-of-archive block is accepted
+		}
+		if (std::count(block, block + TAR_BLOCK, 0) == TAR_BLOCK)
+			return OFFalse;
+		if (!IsTarHeader(block))
+		{
+			m_ofstrError = "invalid tar header checksum";
+			return OFFalse;
+		}
+
+		const Uint64 nSize = TarNumber(block + 124, 12);
+		const char cType = OFstatic_cast(char, block[156]);
+		member.header.insert(member.header.end(), block, block + TAR_BLOCK);
+		if (cType == 'L' || cType == 'K' || cType == 'x' || cType == 'g')
+		{
+			// these blocks belong to the header of the next entry
+			if (nSize > TAR_MAX_EXTENSION)
+			{
+				m_ofstrError = "tar extension header too large";
+				return OFFalse;
+			}
+			const size_t nStart = member.header.size();
+			const size_t nPadded = OFstatic_cast(size_t, (nSize + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK);
+			member.header.resize(nStart + nPadded);
+			if (nPadded && !ReadFully(m_file, &member.header[nStart], nPadded))
+			{
+				m_ofstrError = "truncated tar extension header";
+				return OFFalse;
+			}
+			if (cType == 'L')
+				ofstrLongName = TarString(&member.header[nStart], OFstatic_cast(size_t, nSize));
+			else if (cType == 'x' && nSize)
+				ParsePaxHeader(&member.header[nStart], OFstatic_cast(size_t, nSize), ofstrPaxPath, bPaxSize);
+			continue;
+		}
+
+		if (!ofstrPaxPath.empty())
+			member.ofstrName = ofstrPaxPath;
+		else if (!ofstrLongName.empty())
+			member.ofstrName = ofstrLongName;
+		else
+		{
+			member.ofstrName = TarString(block, 100);
+			const OFString ofstrPrefix = memcmp(block + 257, "ustar", 5) == 0 ? TarString(block + 345, 155) : OFString();
+			if (!ofstrPrefix.empty())
+				member.ofstrName = ofstrPrefix + "/" + member.ofstrName;
+		}
+		// links, devices, directories and fifos have no data, whatever their size field says
+		const OFBool bNoData = cType >= '1' && cType <= '6';
+		member.nStoredSize = bNoData ? 0 : nSize;
+		member.nContentSize = member.nStoredSize;
+		member.bFile = cType == '0' || cType == '\0' || cType == '7';
+		member.bAmendable = member.bFile && !bPaxSize; // a pax size record would contradict the new size
+		return OFTrue;
+	}
+}
+
+OFBool TarReader::readData(ArchiveMember& member)
+{
+	const Uint64 nPadding = (TAR_BLOCK - member.nStoredSize % TAR_BLOCK) % TAR_BLOCK;
+	if (!ReadFully(m_file, member.data, member.nStoredSize) || (nPadding && m_file.fseek(OFstatic_cast(offile_off_t, nPadding), SEEK_CUR) != 0))
+	{
+		m_ofstrError = "truncated tar member: " + member.ofstrName;
+		return OFFalse;
+	}
+	return OFTrue;
+}
+
+// removes the zip64 field from an extra field, taking the values of the fields that were saturated
+static void TakeZip64Extra(const OFVector<Uint8>& extra, OFVector<Uint8>& rest, Uint64* pValues[], size_t nValues)
+{
+	rest.clear();
+	size_t nPos = 0;
+	while (nPos + 4 <= extra.size())
+	{
+		const Uint16 nId = GetLE16(&extra[nPos]);
+		const size_t nLength = min<size_t>(GetLE16(&extra[nPos + 2]), extra.size() - nPos - 4);
+		if (nId == ZIP64_EXTRA)
+		{
+			size_t nField = nPos + 4;
+			for (size_t iValue = 0; iValue < nValues; iValue++)
+			{
+				if (pValues[iValue] && nField + 8 <= nPos + 4 + nLength)
+				{
+					*pValues[iValue] = GetLE64(&extra[nField]);
+					nField += 8;
+				}
+			}
+		}
+		else
+			rest.insert(rest.end(), extra.begin() + nPos, extra.begin() + nPos + 4 + nLength);
+		nPos += 4 + nLength;
+	}
+}
+
+// reads the members in the order of the central directory
+class ZipReader : public ArchiveReader
+{
+public:
+	ZipReader(OFFile& file, Uint64 nFileSize) : ArchiveReader(file), m_nFileSize(nFileSize), m_nPos(0), m_nEntries(0), m_nEntry(0) {}
+
+	OFBool open();
+	const OFVector<Uint8>& comment() const { return m_comment; }
+
+	virtual OFBool next(ArchiveMember& member);
+	virtual OFBool readData(ArchiveMember& member);
+
+private:
+	Uint64 m_nFileSize;
+	OFVector<Uint8> m_central;
+	size_t m_nPos;
+	Uint64 m_nEntries;
+	Uint64 m_nEntry;
+	OFVector<Uint8> m_comment;
+};
+
+OFBool ZipReader::open()
+{
+	// the end of central directory record is followed by at most 64 kB of comment
+	const size_t nTail = OFstatic_cast(size_t, min<Uint64>(m_nFileSize, 22 + 65535));
+	OFVector<Uint8> tail;
+	if (nTail < 22 || m_file.fseek(OFstatic_cast(offile_off_t, m_nFileSize - nTail), SEEK_SET) != 0 || !ReadFully(m_file, tail, nTail))
+	{
+		m_ofstrError = "not a zip archive";
+		return OFFalse;
+	}
+	size_t nEnd = nTail - 22 + 1;
+	do
+		nEnd--;
+	while (nEnd > 0 && !(GetLE32(&tail[nEnd]) == ZIP_END && nEnd + 22 + GetLE16(&tail[nEnd + 20]) <= nTail));
+	if (GetLE32(&tail[nEnd]) != ZIP_END)
+	{
+		m_ofstrError = "zip end of central directory not found";
+		return OFFalse;
+	}
+	if (GetLE16(&tail[nEnd + 4]) != 0 || GetLE16(&tail[nEnd + 6]) != 0)
+	{
+		m_ofstrError = "multi-volume zip archives are not supported";
+		return OFFalse;
+	}
+	m_nEntries = GetLE16(&tail[nEnd + 10]);
+	Uint64 nCentralSize = GetLE32(&tail[nEnd + 12]);
+	Uint64 nCentralOffset = GetLE32(&tail[nEnd + 16]);
+	m_comment = OFVector<Uint8>(tail.begin() + nEnd + 22, tail.begin() + nEnd + 22 + GetLE16(&tail[nEnd + 20]));
+
+	// zip64: the locator precedes the end record
+	if (nEnd >= 20 && GetLE32(&tail[nEnd - 20]) == ZIP64_LOCATOR)
+	{
+		Uint8 end64[56];
+		if (m_file.fseek(OFstatic_cast(offile_off_t, GetLE64(&tail[nEnd - 12])), SEEK_SET) != 0 || !ReadFully(m_file, end64, sizeof(end64))
+			|| GetLE32(end64) != ZIP64_END)
+		{
+			m_ofstrError = "invalid zip64 end of central directory";
+			return OFFalse;
+		}
+		m_nEntries = GetLE64(end64 + 32);
+		nCentralSize = GetLE64(end64 + 40);
+		nCentralOffset = GetLE64(end64 + 48);
+	}
+
+	if (nCentralSize > ZIP_MAX_CENTRAL || nCentralOffset + nCentralSize > m_nFileSize
+		|| m_file.fseek(OFstatic_cast(offile_off_t, nCentralOffset), SEEK_SET) != 0 || !ReadFully(m_file, m_central, nCentralSize))
+	{
+		m_ofstrError = "invalid zip central directory";
+		return OFFalse;
+	}
+	return OFTrue;
+}
+
+OFBool ZipReader::next(ArchiveMember& member)
+{
+	if (m_nEntry == m_nEntries)
+		return OFFalse;
+	const Uint8* pRecord = m_central.size() >= m_nPos + 46 ? &m_central[m_nPos] : NULL;
+	const size_t nRecord = pRecord ? 46 + GetLE16(pRecord + 28) + GetLE16(pRecord + 30) + GetLE16(pRecord + 32) : 0;
+	if (!pRecord || GetLE32(pRecord) != ZIP_CENTRAL_HEADER || m_nPos + nRecord > m_central.size())
+	{
+		m_ofstrError = "invalid zip central directory record";
+		return OFFalse;
+	}
+
+	ZipEntry& zip = member.zip;
+	zip.nVersionMadeBy = GetLE16(pRecord + 4);
+	zip.nVersionNeeded = GetLE16(pRecord + 6);
+	zip.nFlags = GetLE16(pRecord + 8);
+	zip.nMethod = GetLE16(pRecord + 10);
+	zip.nTime = GetLE16(pRecord + 12);
+	zip.nDate = GetLE16(pRecord + 14);
+	zip.nCrc = GetLE32(pRecord + 16);
+	zip.nCompressedSize = GetLE32(pRecord + 20);
+	zip.nSize = GetLE32(pRecord + 24);
+	zip.nInternalAttributes = GetLE16(pRecord + 36);
+	zip.nExternalAttributes = GetLE32(pRecord + 38);
+	zip.nLocalOffset = GetLE32(pRecord + 42);
+	const Uint8* pName = pRecord + 46;
+	const Uint8* pExtra = pName + GetLE16(pRecord + 28);
+	const Uint8* pComment = pExtra + GetLE16(pRecord + 30);
+	zip.name = OFVector<Uint8>(pName, pExtra);
+	zip.comment = OFVector<Uint8>(pComment, pComment + GetLE16(pRecord + 32));
+	Uint64* pValues[] =
+	{
+		zip.nSize == 0xffffffff ? &zip.nSize : NULL,
+		zip.nCompressedSize == 0xffffffff ? &zip.nCompressedSize : NULL,
+		zip.nLocalOffset == 0xffffffff ? &zip.nLocalOffset : NULL
+	};
+	TakeZip64Extra(OFVector<Uint8>(pExtra, pComment), zip.centralExtra, pValues, 3);
+	m_nPos += nRecord;
+	m_nEntry++;
+
+	member.ofstrName.assign(OFreinterpret_cast(const char*, pName), zip.name.size());
+	member.nStoredSize = zip.nCompressedSize;
+	member.nContentSize = zip.nSize;
+	member.bFile = zip.name.empty() || zip.name.back() != '/';
+#ifdef WITH_ZLIB
+	const OFBool bMethod = zip.nMethod == ZIP_STORED || zip.nMethod == ZIP_DEFLATED;
+#else
+	const OFBool bMethod = zip.nMethod == ZIP_STORED;
+#endif
+	member.bAmendable = member.bFile && bMethod && !(zip.nFlags & ZIP_FLAG_ENCRYPTED);
+	return OFTrue;
+}
+
+OFBool ZipReader::readData(ArchiveMember& member)
+{
+	Uint8 header[30];
+	OFVector<Uint8> nameAndExtra;
+	if (m_file.fseek(OFstatic_cast(offile_off_t, member.zip.nLocalOffset), SEEK_SET) != 0 || !ReadFully(m_file, header, sizeof(header))
+		|| GetLE32(header) != ZIP_LOCAL_HEADER || !ReadFully(m_file, nameAndExtra, GetLE16(header + 26) + GetLE16(header + 28))
+		|| !ReadFully(m_file, member.data, member.nStoredSize))
+	{
+		m_ofstrError = "invalid or truncated zip member: " + member.ofstrName;
+		return OFFalse;
+	}
+	OFVector<Uint8> localExtra(nameAndExtra.begin() + GetLE16(header + 26), nameAndExtra.end());
+	Uint64 nSize = 0, nCompressedSize = 0;
+	Uint64* pValues[] = { &nSize, &nCompressedSize };
+	TakeZip64Extra(localExtra, member.zip.localExtra, pValues, 2);
+	return OFTrue;
+}
+
+// --- writers
+
+class ArchiveWriter
+{
+public:
+	explicit ArchiveWriter(OFFile& file) : m_file(file), m_nWritten(0), m_bFailed(OFFalse) {}
+	virtual ~ArchiveWriter() {}
+
+	virtual OFBool write(const ArchiveMember& member) = 0;
+	virtual OFBool finish() = 0;
+
+protected:
+	OFBool put(const void* pData, size_t nBytes)
+	{
+		if (nBytes && !m_bFailed && m_file.fwrite(pData, 1, nBytes) != nBytes)
+			m_bFailed = OFTrue;
+		m_nWritten += nBytes;
+		return !m_bFailed;
+	}
+	OFBool put(const OFVector<Uint8>& data) { return data.empty() || put(&data[0], data.size()); }
+
+	OFFile& m_file;
+	Uint64 m_nWritten;
+	OFBool m_bFailed;
+};
+
+// the header blocks are copied; only the size (and checksum) of an amended member changes
+class TarWriter : public ArchiveWriter
+{
+public:
+	explicit TarWriter(OFFile& file) : ArchiveWriter(file) {}
+
+	virtual OFBool write(const ArchiveMember& member);
+	virtual OFBool finish();
+};
+
+OFBool TarWriter::write(const ArchiveMember& member)
+{
+	const OFVector<Uint8>& data = member.bAmended ? member.output : member.data;
+	if (!member.bAmended)
+		put(member.header);
+	else
+	{
+		OFVector<Uint8> header(member.header);
+		Uint8* pBlock = &header[header.size() - TAR_BLOCK];
+		char szField[24];
+		const Uint64 nSize = data.size();
+		if (nSize < (OFstatic_cast(Uint64, 1) << 33))
+		{
+			snprintf(szField, sizeof(szField), "%011llo", OFstatic_cast(unsigned long long, nSize));
+			memcpy(pBlock + 124, szField, 12); // with the terminating NUL
+		}
+		else
+		{
+			pBlock[124] = 0x80;
+			for (int iByte = 0; iByte < 11; iByte++)
+				pBlock[135 - iByte] = OFstatic_cast(Uint8, nSize >> (8 * iByte));
+		}
+		snprintf(szField, sizeof(szField), "%06lo", TarChecksum(pBlock));
+		memcpy(pBlock + 148, szField, 7);
+		pBlock[155] = ' ';
+		put(header);
+	}
+	put(data);
+	static const Uint8 zeros[TAR_BLOCK] = { 0 };
+	return put(zeros, OFstatic_cast(size_t, (TAR_BLOCK - data.size() % TAR_BLOCK) % TAR_BLOCK));
+}
+
+OFBool TarWriter::finish()
+{
+	static const Uint8 zeros[TAR_RECORD] = { 0 };
+	put(zeros, 2 * TAR_BLOCK);
+	return put(zeros, OFstatic_cast(size_t, (TAR_RECORD - m_nWritten % TAR_RECORD) % TAR_RECORD));
+}
+
+// local headers are written with the sizes (no data descriptors); zip64 fields only where needed
+class ZipWriter : public ArchiveWriter
+{
+public:
+	ZipWriter(OFFile& file, const OFVector<Uint8>& comment) : ArchiveWriter(file), m_comment(comment), m_nEntries(0) {}
+
+	virtual OFBool write(const ArchiveMember& member);
+	virtual OFBool finish();
+
+private:
+	OFVector<Uint8> m_comment;
+	OFVector<Uint8> m_central;
+	Uint64 m_nEntries;
+};
+
+OFBool ZipWriter::write(const ArchiveMember& member)
+{
+	ZipEntry zip = member.zip;
+	const OFVector<Uint8>& data = member.bAmended ? member.output : member.data;
+	if (member.bAmended)
+	{
+		zip.nCrc = member.nOutputCrc;
+		zip.nSize = member.nOutputSize;
+	}
+	zip.nCompressedSize = data.size();
+	zip.nFlags &= ~ZIP_FLAG_DESCRIPTOR;
+	zip.nLocalOffset = m_nWritten;
+	const OFBool bZip64Sizes = zip.nSize >= 0xffffffff || zip.nCompressedSize >= 0xffffffff;
+	const OFBool bZip64Offset = zip.nLocalOffset >= 0xffffffff;
+	if (bZip64Sizes || bZip64Offset)
+		zip.nVersionNeeded = max<Uint16>(zip.nVersionNeeded, ZIP64_VERSION);
+
+	// the local zip64 field has both sizes, or nothing
+	OFVector<Uint8> localExtra;
+	if (bZip64Sizes)
+	{
+		PutLE16(localExtra, ZIP64_EXTRA);
+		PutLE16(localExtra, 16);
+		PutLE64(localExtra, zip.nSize);
+		PutLE64(localExtra, zip.nCompressedSize);
+	}
+	PutBytes(localExtra, zip.localExtra);
+
+	OFVector<Uint8> local;
+	PutLE32(local, ZIP_LOCAL_HEADER);
+	PutLE16(local, zip.nVersionNeeded);
+	PutLE16(local, zip.nFlags);
+	PutLE16(local, zip.nMethod);
+	PutLE16(local, zip.nTime);
+	PutLE16(local, zip.nDate);
+	PutLE32(local, zip.nCrc);
+	PutLE32(local, bZip64Sizes ? 0xffffffff : OFstatic_cast(Uint32, zip.nCompressedSize));
+	PutLE32(local, bZip64Sizes ? 0xffffffff : OFstatic_cast(Uint32, zip.nSize));
+	PutLE16(local, OFstatic_cast(Uint16, zip.name.size()));
+	PutLE16(local, OFstatic_cast(Uint16, localExtra.size()));
+	PutBytes(local, zip.name);
+	PutBytes(local, localExtra);
+	put(local);
+	put(data);
+
+	// the central zip64 field has the saturated values only, in this order
+	OFVector<Uint8> zip64;
+	if (zip.nSize >= 0xffffffff)
+		PutLE64(zip64, zip.nSize);
+	if (zip.nCompressedSize >= 0xffffffff)
+		PutLE64(zip64, zip.nCompressedSize);
+	if (bZip64Offset)
+		PutLE64(zip64, zip.nLocalOffset);
+	OFVector<Uint8> centralExtra;
+	if (!zip64.empty())
+	{
+		PutLE16(centralExtra, ZIP64_EXTRA);
+		PutLE16(centralExtra, OFstatic_cast(Uint16, zip64.size()));
+		PutBytes(centralExtra, zip64);
+	}
+	PutBytes(centralExtra, zip.centralExtra);
+
+	PutLE32(m_central, ZIP_CENTRAL_HEADER);
+	PutLE16(m_central, zip.nVersionMadeBy);
+	PutLE16(m_central, zip.nVersionNeeded);
+	PutLE16(m_central, zip.nFlags);
+	PutLE16(m_central, zip.nMethod);
+	PutLE16(m_central, zip.nTime);
+	PutLE16(m_central, zip.nDate);
+	PutLE32(m_central, zip.nCrc);
+	PutLE32(m_central, OFstatic_cast(Uint32, min<Uint64>(zip.nCompressedSize, 0xffffffff)));
+	PutLE32(m_central, OFstatic_cast(Uint32, min<Uint64>(zip.nSize, 0xffffffff)));
+	PutLE16(m_central, OFstatic_cast(Uint16, zip.name.size()));
+	PutLE16(m_central, OFstatic_cast(Uint16, centralExtra.size()));
+	PutLE16(m_central, OFstatic_cast(Uint16, zip.comment.size()));
+	PutLE16(m_central, 0); // disk
+	PutLE16(m_central, zip.nInternalAttributes);
+	PutLE32(m_central, zip.nExternalAttributes);
+	PutLE32(m_central, OFstatic_cast(Uint32, min<Uint64>(zip.nLocalOffset, 0xffffffff)));
+	PutBytes(m_central, zip.name);
+	PutBytes(m_central, centralExtra);
+	PutBytes(m_central, zip.comment);
+	m_nEntries++;
+	return !m_bFailed;
+}
+
+OFBool ZipWriter::finish()
+{
+	const Uint64 nCentralOffset = m_nWritten;
+	const Uint64 nCentralSize = m_central.size();
+	put(m_central);
+
+	OFVector<Uint8> end;
+	if (m_nEntries >= 0xffff || nCentralOffset >= 0xffffffff || nCentralSize >= 0xffffffff)
+	{
+		const Uint64 nEnd64Offset = m_nWritten;
+		PutLE32(end, ZIP64_END);
+		PutLE64(end, 44); // size of the rest of the record
+		PutLE16(end, ZIP64_VERSION);
+		PutLE16(end, ZIP64_VERSION);
+		PutLE32(end, 0);
+		PutLE32(end, 0);
+		PutLE64(end, m_nEntries);
+		PutLE64(end, m_nEntries);
+		PutLE64(end, nCentralSize);
+		PutLE64(end, nCentralOffset);
+		PutLE32(end, ZIP64_LOCATOR);
+		PutLE32(end, 0);
+		PutLE64(end, nEnd64Offset);
+		PutLE32(end, 1);
+	}
+	PutLE32(end, ZIP_END);
+	PutLE16(end, 0);
+	PutLE16(end, 0);
+	PutLE16(end, OFstatic_cast(Uint16, min<Uint64>(m_nEntries, 0xffff)));
+	PutLE16(end, OFstatic_cast(Uint16, min<Uint64>(m_nEntries, 0xffff)));
+	PutLE32(end, OFstatic_cast(Uint32, min<Uint64>(nCentralSize, 0xffffffff)));
+	PutLE32(end, OFstatic_cast(Uint32, min<Uint64>(nCentralOffset, 0xffffffff)));
+	PutLE16(end, OFstatic_cast(Uint16, m_comment.size()));
+	PutBytes(end, m_comment);
+	return put(end);
+}
+
+// --- pipeline
+
+struct ArchiveState
+{
+	ArchiveState(const ArchiveConfig& archiveConfig, ArchiveAmendFunction amendFunction, ArchiveReader& archiveReader, OFBool bZipArchive)
+		: config(archiveConfig), amend(amendFunction), reader(archiveReader), bZip(bZipArchive),
+		  nInFlight(0), nBytesInFlight(0), bReadDone(OFFalse), bStop(OFFalse) {}
+
+	const ArchiveConfig& config;
+	ArchiveAmendFunction amend;
+	ArchiveReader& reader;
+	const OFBool bZip;
+
+	std::mutex mutex;
+	std::condition_variable cvSpace;	// the reader waits for the budget
+	std::condition_variable cvWork;		// workers wait for members
+	std::condition_variable cvDone;		// the writer waits for the next member in order
+	std::deque<std::unique_ptr<ArchiveMember> > members;	// in flight, in archive order
+	std::deque<ArchiveMember*> work;						// still to be amended
+	size_t nInFlight;
+	Uint64 nBytesInFlight;
+	OFBool bReadDone;
+	OFBool bStop;						// writing failed; read no more
+};
+
+// reads ahead as far as the number of members in flight and the memory budget allow; a member larger
+// than the budget is only read when nothing else is in flight
+static void ArchiveReaderThread(ArchiveState* pState)
+{
+	for (;;)
+	{
+		std::unique_ptr<ArchiveMember> pMember(new ArchiveMember);
+		if (!pState->reader.next(*pMember))
+			break;
+		// the input, the inflated input and the output may all be in memory at once
+		pMember->nBudget = pMember->nStoredSize + (pMember->bAmendable ? 2 * pMember->nContentSize : 0);
+		{
+			std::unique_lock<std::mutex> lock(pState->mutex);
+			while (!pState->bStop && pState->nInFlight > 0 && (pState->nInFlight >= pState->config.nMaxInFlight
+				|| pState->nBytesInFlight + pMember->nBudget > pState->config.nMemoryBudget))
+				pState->cvSpace.wait(lock);
+			if (pState->bStop)
+				break;
+			pState->nInFlight++;
+			pState->nBytesInFlight += pMember->nBudget;
+		}
+
+		const OFBool bRead = pState->reader.readData(*pMember);
+		std::lock_guard<std::mutex> lock(pState->mutex);
+		if (!bRead)
+		{
+			pState->nInFlight--;
+			pState->nBytesInFlight -= pMember->nBudget;
+			break;
+		}
+		if (pMember->bAmendable)
+		{
+			pState->work.push_back(pMember.get());
+			pState->cvWork.notify_one();
+		}
+		else
+			pMember->bDone = OFTrue;
+		pState->members.push_back(std::move(pMember));
+		pState->cvDone.notify_all();
+	}
+
+	std::lock_guard<std::mutex> lock(pState->mutex);
+	pState->bReadDone = OFTrue;
+	pState->cvWork.notify_all();
+	pState->cvDone.notify_all();
+}
+
+static void AmendMember(ArchiveState* pState, ArchiveMember& member)
+{
+	OFOStringStream osOut, osErr;
+	const OFBool bDeflated = pState->bZip && member.zip.nMethod == ZIP_DEFLATED;
+	OFVector<Uint8> inflated;
+	const OFVector<Uint8>* pContent = &member.data;
+#ifdef WITH_ZLIB
+	if (bDeflated)
+	{
+		if (!Inflate(member.data, member.nContentSize, inflated))
+		{
+			osErr << "ERROR: could not inflate member; copied as is" << endl;
+			member.bDicom = OFTrue;
+			member.iResult = RESULT_FAILED_TO_READ;
+			member.strErr = osErr.str();
+			return;
+		}
+		pContent = &inflated;
+	}
+#endif
+
+	// anything else in the bundle (a manifest, a readme) is copied without a RESULT line
+	member.bDicom = pContent->size() >= 132 && memcmp(&(*pContent)[128], "DICM", 4) == 0;
+	if (!member.bDicom)
+		return;
+
+	OFVector<Uint8> output;
+	const AmendResult result = pState->amend(member.ofstrName, *pContent, output, osOut, osErr);
+	member.iResult = result.code;
+	member.ofstrSOPInstanceUID = result.ofstrSOPInstanceUID;
+	if (result.code == RESULT_SUCCESS)
+	{
+		member.nOutputSize = output.size();
+		if (pState->bZip)
+			member.nOutputCrc = ArchiveCrc32(output);
+		member.bAmended = OFTrue;
+#ifdef WITH_ZLIB
+		if (bDeflated && !Deflate(output, member.output))
+		{
+			osErr << "FAIL: could not deflate the amended member; copied as is" << endl;
+			member.iResult = RESULT_FAILED_TO_CREATE;
+			member.bAmended = OFFalse;
+		}
+#endif
+		if (!bDeflated)
+			member.output.swap(output);
+		if (member.bAmended)
+			OFVector<Uint8>().swap(member.data);
+	}
+	else if (result.code < 0 && pState->config.bNoCloneOnError)
+		member.bDropped = OFTrue;
+	member.strOut = osOut.str();
+	member.strErr = osErr.str();
+}
+
+static void ArchiveWorker(ArchiveState* pState)
+{
+	for (;;)
+	{
+		ArchiveMember* pMember;
+		OFBool bStop;
+		{
+			std::unique_lock<std::mutex> lock(pState->mutex);
+			while (pState->work.empty() && !pState->bReadDone)
+				pState->cvWork.wait(lock);
+			if (pState->work.empty())
+				return;
+			pMember = pState->work.front();
+			pState->work.pop_front();
+			bStop = pState->bStop;
+		}
+		if (!bStop)
+			AmendMember(pState, *pMember);
+		std::lock_guard<std::mutex> lock(pState->mutex);
+		pMember->bDone = OFTrue;
+		pState->cvDone.notify_all();
+	}
+}
+
+// the reader for the format of the content of input (opened from ofstrInputFile); NULL with the reason if
+// there is none
+static ArchiveReader* OpenArchiveReader(OFFile& input, const OFString& ofstrInputFile, OFBool& bZip, OFString& ofstrError)
+{
+	if (!input.fopen(ofstrInputFile, "rb"))
+	{
+		ofstrError = "could not open archive";
+		return NULL;
+	}
+	Uint8 magic[TAR_BLOCK];
+	const size_t nMagic = input.fread(magic, 1, sizeof(magic));
+	input.fseek(0, SEEK_SET);
+
+	bZip = nMagic >= 4 && (GetLE32(magic) == ZIP_LOCAL_HEADER || GetLE32(magic) == ZIP_END);
+	if (bZip)
+	{
+		std::unique_ptr<ZipReader> pZipReader(new ZipReader(input, OFStandard::getFileSize(ofstrInputFile)));
+		if (!pZipReader->open())
+		{
+			ofstrError = pZipReader->error();
+			return NULL;
+		}
+		return pZipReader.release();
+	}
+	if (nMagic == TAR_BLOCK && IsTarHeader(magic))
+		return new TarReader(input);
+	if (nMagic >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		ofstrError = "compressed tar archives are not supported; decompress first";
+	else
+		ofstrError = "not a tar or zip archive";
+	return NULL;
+}
+
+int RunArchive(const ArchiveConfig& config, const OFString& ofstrInputFile, const OFString& ofstrOutputFile,
+	ArchiveAmendFunction amend, OutputCommitter& committer)
+{
+	OFFile input;
+	OFBool bZip = OFFalse;
+	OFString ofstrError;
+	std::unique_ptr<ArchiveReader> pReader(OpenArchiveReader(input, ofstrInputFile, bZip, ofstrError));
+	if (!pReader)
+	{
+		LogLine(ELL_error) << "ERROR: " << ofstrError << ": " << ofstrInputFile;
+		return RESULT_FAILED_TO_READ;
+	}
+	OFVector<Uint8> comment;
+	if (bZip)
+		comment = OFstatic_cast(ZipReader*, pReader.get())->comment();
+
+	// the output only replaces an existing file when it is complete
+	const OFString ofstrTempFile = MakeTempOutputName(ofstrOutputFile);
+	OFFile output;
+	if (!output.fopen(ofstrTempFile, "wb"))
+	{
+		LogLine(ELL_error) << "ERROR: could not create output archive: " << ofstrOutputFile;
+		return RESULT_FAILED_TO_CREATE;
+	}
+	std::unique_ptr<ArchiveWriter> pWriter(bZip ? OFstatic_cast(ArchiveWriter*, new ZipWriter(output, comment)) : new TarWriter(output));
+
+	ArchiveState state(config, amend, *pReader, bZip);
+	STD_NAMESPACE vector<std::thread> threads;
+	threads.push_back(std::thread(ArchiveReaderThread, &state));
+	for (size_t iWorker = 0; iWorker < (config.nWorkers ? config.nWorkers : 1); iWorker++)
+		threads.push_back(std::thread(ArchiveWorker, &state));
+
+	// write the members in archive order as they are done
+	unsigned long nMembers = 0, nAmended = 0, nDropped = 0;
+	OFBool bWritten = OFTrue;
+	for (;;)
+	{
+		ArchiveMember* pMember;
+		{
+			std::unique_lock<std::mutex> lock(state.mutex);
+			while (state.members.empty() ? !state.bReadDone : !state.members.front()->bDone)
+				state.cvDone.wait(lock);
+			if (state.members.empty())
+				break;
+			pMember = state.members.front().get();
+		}
+
+		const LogContext context(pMember->ofstrName, pMember->ofstrSOPInstanceUID);
+		AsyncLog::global().writeLines(pMember->strOut, &context);
+		AsyncLog::global().writeLines(pMember->strErr, &context);
+		if (pMember->bDicom)
+			LogLine(ELL_output, &context) << "RESULT: " << pMember->iResult << " " << pMember->ofstrName;
+		if (pMember->bDropped)
+		{
+			LogLine(ELL_warn, &context) << "WARN: left out of the output archive: " << pMember->ofstrName;
+			nDropped++;
+		}
+		else if (bWritten && !pWriter->write(*pMember))
+		{
+			LogLine(ELL_error) << "ERROR: could not write output archive: " << ofstrOutputFile;
+			bWritten = OFFalse;
+		}
+		nMembers++;
+		if (pMember->bAmended)
+			nAmended++;
+
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.nInFlight--;
+		state.nBytesInFlight -= pMember->nBudget;
+		state.members.pop_front();
+		if (!bWritten)
+			state.bStop = OFTrue;
+		state.cvSpace.notify_all();
+	}
+	for (size_t iThread = 0; iThread < threads.size(); iThread++)
+		threads[iThread].join();
+
+	if (pReader->failed())
+		LogLine(ELL_error) << "ERROR: " << pReader->error() << " in " << ofstrInputFile;
+	bWritten = bWritten && pWriter->finish();
+	if (output.fclose() != 0 && bWritten)
+	{
+		LogLine(ELL_error) << "ERROR: could not write output archive: " << ofstrOutputFile;
+		bWritten = OFFalse;
+	}
+	input.fclose();
+	if (pReader->failed() || !bWritten)
+	{
+		OFStandard::deleteFile(ofstrTempFile);
+		return pReader->failed() ? RESULT_FAILED_TO_READ : RESULT_FAILED_TO_CREATE;
+	}
+	if (!committer.commit(ofstrTempFile, ofstrOutputFile))
+	{
+		LogLine(ELL_error) << "ERROR: could not replace output archive: " << ofstrOutputFile;
+		return RESULT_FAILED_TO_CREATE;
+	}
+	LogLine(ELL_info) << "INFO: archive: " << nMembers << " members, " << nAmended << " amended, "
+		<< nMembers - nAmended - nDropped << " copied, " << nDropped << " left out";
+	return RESULT_SUCCESS;
+}
+
+OFBool ReadArchive(const OFString& ofstrFile, OFVector<ArchiveEntry>& entries, OFString& ofstrError)
+{
+	entries.clear();
+	OFFile input;
+	OFBool bZip = OFFalse;
+	std::unique_ptr<ArchiveReader> pReader(OpenArchiveReader(input, ofstrFile, bZip, ofstrError));
+	if (!pReader)
+		return OFFalse;
+	ArchiveMember member;
+	while (pReader->next(member) && pReader->readData(member))
+	{
+		ArchiveEntry entry;
+		entry.ofstrName = member.ofstrName;
+		entry.bFile = member.bFile;
+		entry.nMethod = member.zip.nMethod;
+		entry.nCrc = member.zip.nCrc;
+		entry.nSize = member.nContentSize;
+		entry.nLocalOffset = member.zip.nLocalOffset;
+		OFBool bContent = !bZip || member.zip.nMethod == ZIP_STORED;
+		if (bContent)
+			entry.content.swap(member.data);
+#ifdef WITH_ZLIB
+		else if (member.zip.nMethod == ZIP_DEFLATED)
+			bContent = Inflate(member.data, member.nContentSize, entry.content);
+#endif
+		if (!bContent)
+		{
+			ofstrError = "could not inflate member: " + member.ofstrName;
+			return OFFalse;
+		}
+		entries.push_back(entry);
+		member = ArchiveMember();
+	}
+	if (pReader->failed())
+		ofstrError = pReader->error();
+	return !pReader->failed();
+}
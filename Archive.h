@@ -0,0 +1,54 @@
+﻿// Archive.h : archive mode; the ECGs in a tar or zip bundle (e.g. a Muse bulk export) are amended in
+// memory and written to a new bundle of the same format, without extracting them to disk. A reader
+// thread streams the members in, workers amend them, and the calling thread writes them in order.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "AmendEcgAnnotation.h"
+#include "OutputCommit.h"
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/ofstd/ofvector.h"
+
+struct ArchiveConfig
+{
+	ArchiveConfig();
+
+	size_t nWorkers;				// amend threads
+	size_t nMaxInFlight;			// members read but not yet written; the reader waits when it is reached
+	Uint64 nMemoryBudget;			// bytes held by the members in flight; a larger member is handled on its own
+	OFBool bNoCloneOnError;			// leave out members that failed with an error instead of copying them
+};
+
+// amends one member (a Part 10 stream); with anything but RESULT_SUCCESS the member is copied byte for byte
+typedef AmendResult (*ArchiveAmendFunction)(const OFString& ofstrMember, const OFVector<Uint8>& input, OFVector<Uint8>& output, STD_NAMESPACE ostream& out, STD_NAMESPACE ostream& err);
+
+// amend the members of a tar or zip bundle (detected from its content) into ofstrOutputFile, which is only
+// replaced when complete. Returns RESULT_SUCCESS, or a RESULT_FAILED_* code when the bundles could not be
+// read or written (the per-member results are only reported through the amend function and the RESULT lines)
+int RunArchive(const ArchiveConfig& config, const OFString& ofstrInputFile, const OFString& ofstrOutputFile,
+	ArchiveAmendFunction amend, OutputCommitter& committer);
+
+// a member of a bundle as RunArchive() reads it, e.g. to check an output bundle
+struct ArchiveEntry
+{
+	ArchiveEntry() : bFile(OFFalse), nMethod(0), nCrc(0), nSize(0), nLocalOffset(0) {}
+
+	OFString ofstrName;
+	OFBool bFile;
+	Uint16 nMethod;					// zip: 0 stored, 8 deflated
+	Uint32 nCrc;					// zip: CRC-32 of the content according to the central directory
+	Uint64 nSize;					// of the content according to the header
+	Uint64 nLocalOffset;			// zip: of the local header, after the zip64 field
+	OFVector<Uint8> content;		// zip: inflated
+};
+
+// all members of a tar or zip bundle, read with the readers of RunArchive(); OFFalse with the reason
+// when the bundle or a member can't be read
+OFBool ReadArchive(const OFString& ofstrFile, OFVector<ArchiveEntry>& entries, OFString& ofstrError);
+
+// the CRC-32 of zip members
+Uint32 ArchiveCrc32(const OFVector<Uint8>& data);
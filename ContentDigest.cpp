@@ -0,0 +1,211 @@
+﻿// ContentDigest.cpp : content digest of a DICOM Part 10 file (see ContentDigest.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "ContentDigest.h"
+#include "Deflate.h"
+#include "DicomScanner.h"
+
+#include <cstdio>
+
+static const DcmTagKey _tagWaveformSequence(DCM_WaveformSequence);							// (5400,0100)
+static const DcmTagKey _tagWaveformData(DCM_WaveformData);									// (5400,1010)
+static const DcmTagKey _tagWaveformAnnotationSequence(DCM_WaveformAnnotationSequence);		// (0040,b020)
+static const DcmTagKey _tagPixelData(DCM_PixelData);										// (7fe0,0010)
+
+XxHash64::XxHash64()
+	: m_nBuffered(0), m_nTotal(0)
+{
+	m_lanes[0] = s_nPrime1 + s_nPrime2;
+	m_lanes[1] = s_nPrime2;
+	m_lanes[2] = 0;
+	m_lanes[3] = 0 - s_nPrime1;
+}
+
+Uint64 XxHash64::read64Partial(const Uint8* p, int nBytes)
+{
+	Uint64 nValue = 0;
+	for (int iByte = nBytes - 1; iByte >= 0; iByte--)
+		nValue = (nValue << 8) | p[iByte];
+	return nValue;
+}
+
+Uint64 XxHash64::read64(const Uint8* p)
+{
+	return read64Partial(p, 8);
+}
+
+void XxHash64::stripe(const Uint8* p)
+{
+	m_lanes[0] = round(m_lanes[0], read64(p));
+	m_lanes[1] = round(m_lanes[1], read64(p + 8));
+	m_lanes[2] = round(m_lanes[2], read64(p + 16));
+	m_lanes[3] = round(m_lanes[3], read64(p + 24));
+}
+
+void XxHash64::update(const Uint8* pData, size_t nSize)
+{
+	m_nTotal += nSize;
+	if (m_nBuffered + nSize < sizeof(m_buffer))
+	{
+		if (nSize)
+			memcpy(m_buffer + m_nBuffered, pData, nSize);
+		m_nBuffered += nSize;
+		return;
+	}
+	if (m_nBuffered)
+	{
+		const size_t nFill = sizeof(m_buffer) - m_nBuffered;
+		memcpy(m_buffer + m_nBuffered, pData, nFill);
+		stripe(m_buffer);
+		pData += nFill;
+		nSize -= nFill;
+		m_nBuffered = 0;
+	}
+	for (; nSize >= sizeof(m_buffer); pData += sizeof(m_buffer), nSize -= sizeof(m_buffer))
+		stripe(pData);
+	if (nSize)
+		memcpy(m_buffer, pData, nSize);
+	m_nBuffered = nSize;
+}
+
+Uint64 XxHash64::digest() const
+{
+	Uint64 nHash;
+	if (m_nTotal >= sizeof(m_buffer))
+	{
+		nHash = rotl(m_lanes[0], 1) + rotl(m_lanes[1], 7) + rotl(m_lanes[2], 12) + rotl(m_lanes[3], 18);
+		for (int iLane = 0; iLane < 4; iLane++)
+			nHash = merge(nHash, m_lanes[iLane]);
+	}
+	else
+		nHash = s_nPrime5;
+	nHash += m_nTotal;
+
+	const Uint8* p = m_buffer;
+	const Uint8* pEnd = m_buffer + m_nBuffered;
+	for (; p + 8 <= pEnd; p += 8)
+		nHash = rotl(nHash ^ round(0, read64(p)), 27) * s_nPrime1 + s_nPrime4;
+	if (p + 4 <= pEnd)
+	{
+		nHash = rotl(nHash ^ (read32(p) * s_nPrime1), 23) * s_nPrime2 + s_nPrime3;
+		p += 4;
+	}
+	for (; p < pEnd; p++)
+		nHash = rotl(nHash ^ (*p * s_nPrime5), 11) * s_nPrime1;
+
+	nHash ^= nHash >> 33;
+	nHash *= s_nPrime2;
+	nHash ^= nHash >> 29;
+	nHash *= s_nPrime3;
+	nHash ^= nHash >> 32;
+	return nHash;
+}
+
+ContentDigest::ContentDigest()
+	: nWaveform(0), nDataset(0), nMultiplexGroups(0)
+{
+}
+
+OFBool ContentDigest::operator==(const ContentDigest& other) const
+{
+	return nWaveform == other.nWaveform && nDataset == other.nDataset && nMultiplexGroups == other.nMultiplexGroups;
+}
+
+OFString ContentDigest::toString() const
+{
+	char szDigest[40];
+	snprintf(szDigest, sizeof(szDigest), "%016llx/%016llx", OFstatic_cast(unsigned long long, nWaveform), OFstatic_cast(unsigned long long, nDataset));
+	return szDigest;
+}
+
+// the tag and a 64-bit count or length, little endian, so adjacent values can't run into each other
+static void HashTag(XxHash64& hash, const DcmTagKey& tag, Uint64 nCount)
+{
+	Uint8 header[12];
+	header[0] = OFstatic_cast(Uint8, tag.getGroup());
+	header[1] = OFstatic_cast(Uint8, tag.getGroup() >> 8);
+	header[2] = OFstatic_cast(Uint8, tag.getElement());
+	header[3] = OFstatic_cast(Uint8, tag.getElement() >> 8);
+	for (int iByte = 0; iByte < 8; iByte++)
+		header[4 + iByte] = OFstatic_cast(Uint8, nCount >> (8 * iByte));
+	hash.update(header, sizeof(header));
+}
+
+// whether the items of an element are datasets rather than (pixel data) fragments
+static OFBool IsSequence(const ScannedElement& elem)
+{
+	if (elem.vr[0])
+		return (elem.vr[0] == 'S' && elem.vr[1] == 'Q') || (elem.vr[0] == 'U' && elem.vr[1] == 'N' && elem.length == DCM_UndefinedLength);
+	if (elem.length == DCM_UndefinedLength)
+		return elem.tag != _tagPixelData;
+	return DcmTag(elem.tag).getEVR() == EVR_SQ; // implicit VR: only the dictionary knows
+}
+
+static OFCondition HashElements(const DicomScanner& scanner, const Uint8* pData, const OFVector<ScannedElement>& elements,
+	OFBool bTopLevel, OFBool bMultiplexGroup, XxHash64& dataset, XxHash64& waveform, ContentDigest& digest)
+{
+	for (size_t iElement = 0; iElement < elements.size(); iElement++)
+	{
+		const ScannedElement& elem = elements[iElement];
+		if (elem.tag.getElement() == 0x0000)
+			continue; // group lengths are recalculated when saving
+		if (bTopLevel && elem.tag == _tagWaveformAnnotationSequence)
+			continue; // the part that is amended
+		if (bMultiplexGroup && elem.tag == _tagWaveformData)
+		{
+			const size_t nLength = elem.endOffset - elem.valueOffset;
+			HashTag(waveform, elem.tag, nLength);
+			waveform.update(pData + elem.valueOffset, nLength);
+			continue;
+		}
+		if (!IsSequence(elem))
+		{
+			const size_t nLength = elem.endOffset - elem.valueOffset;
+			HashTag(dataset, elem.tag, nLength);
+			dataset.update(pData + elem.valueOffset, nLength);
+			continue;
+		}
+
+		OFVector<OFVector<ScannedElement> > items;
+		OFCondition cond = scanner.getItems(elem, items);
+		if (cond.bad())
+			return cond;
+		HashTag(dataset, elem.tag, items.size());
+		const OFBool bWaveformSequence = bTopLevel && elem.tag == _tagWaveformSequence;
+		if (bWaveformSequence)
+			digest.nMultiplexGroups = OFstatic_cast(unsigned long, items.size());
+		for (size_t iItem = 0; iItem < items.size(); iItem++)
+		{
+			HashTag(dataset, DCM_Item, iItem);
+			cond = HashElements(scanner, pData, items[iItem], OFFalse, bWaveformSequence, dataset, waveform, digest);
+			if (cond.bad())
+				return cond;
+		}
+	}
+	return EC_Normal;
+}
+
+OFCondition computeContentDigest(const Uint8* pData, size_t nSize, ContentDigest& digest)
+{
+	DicomScanner scanner;
+	OFCondition cond = scanner.scan(pData, nSize);
+	OFVector<Uint8> inflated;
+	if (cond == EC_IllegalCall && decodeDeflated(pData, nSize, inflated) && !inflated.empty())
+	{
+		// deflated files are digested as the explicit VR little endian file they decode to
+		pData = &inflated[0];
+		cond = scanner.scan(pData, inflated.size());
+	}
+	if (cond.bad())
+		return cond;
+
+	XxHash64 dataset, waveform;
+	digest = ContentDigest();
+	cond = HashElements(scanner, pData, scanner.getElements(), OFTrue, OFFalse, dataset, waveform, digest);
+	if (cond.bad())
+		return cond;
+	digest.nWaveform = waveform.digest();
+	digest.nDataset = dataset.digest();
+	return EC_Normal;
+}
@@ -0,0 +1,59 @@
+﻿// ContentDigest.h : digest of the content of a DICOM Part 10 file that an amendment must not change,
+// computed from the encoded bytes (see DicomScanner.h) so input and output can be compared without
+// a DCMTK parse. Element values are hashed with their tags, not their length encoding, so a sequence
+// written with undefined length where the input had a defined one still gives the same digest.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/dcmdata/dctk.h"
+
+// streaming XXH64 with seed 0 (https://github.com/Cyan4973/xxHash); 32 bytes per round in four
+// independent lanes, which runs well ahead of the disk without any SIMD
+class XxHash64
+{
+public:
+	XxHash64();
+	void update(const Uint8* pData, size_t nSize);
+	Uint64 digest() const;
+
+private:
+	static const Uint64 s_nPrime1 = 0x9E3779B185EBCA87ULL;
+	static const Uint64 s_nPrime2 = 0xC2B2AE3D27D4EB4FULL;
+	static const Uint64 s_nPrime3 = 0x165667B19E3779F9ULL;
+	static const Uint64 s_nPrime4 = 0x85EBCA77C2B2AE63ULL;
+	static const Uint64 s_nPrime5 = 0x27D4EB2F165667C5ULL;
+
+	static Uint64 rotl(Uint64 nValue, int nBits) { return (nValue << nBits) | (nValue >> (64 - nBits)); }
+	static Uint64 read64(const Uint8* p);
+	static Uint32 read32(const Uint8* p) { return OFstatic_cast(Uint32, read64Partial(p, 4)); }
+	static Uint64 read64Partial(const Uint8* p, int nBytes);
+	static Uint64 round(Uint64 nAcc, Uint64 nInput) { return rotl(nAcc + nInput * s_nPrime2, 31) * s_nPrime1; }
+	static Uint64 merge(Uint64 nAcc, Uint64 nLane) { return (nAcc ^ round(0, nLane)) * s_nPrime1 + s_nPrime4; }
+	void stripe(const Uint8* p);
+
+	Uint64 m_lanes[4];
+	Uint8 m_buffer[32];
+	size_t m_nBuffered;
+	Uint64 m_nTotal;
+};
+
+struct ContentDigest
+{
+	ContentDigest();
+
+	OFBool operator==(const ContentDigest& other) const;
+	OFBool operator!=(const ContentDigest& other) const { return !(*this == other); }
+
+	// <waveform>/<dataset> as hexadecimal XXH64 values
+	OFString toString() const;
+
+	Uint64 nWaveform;				// the WaveformData of every multiplex group, in order
+	Uint64 nDataset;				// all other dataset elements but the WaveformAnnotationSequence and group lengths
+	unsigned long nMultiplexGroups;
+};
+
+// digest of a Part 10 file in memory; EC_IllegalCall for encodings the scanner doesn't support
+OFCondition computeContentDigest(const Uint8* pData, size_t nSize, ContentDigest& digest);
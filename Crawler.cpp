@@ -0,0 +1,436 @@
+﻿// Crawler.cpp : retrospective conversion crawler (see Crawler.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "Crawler.h"
+#include "AmendEcgAnnotation.h"
+#include "Log.h"
+
+#include "dcmtk/ofstd/ofstream.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+#define CRAWL_IO_SIZE (1024 * 1024) // bytes per counted operation for the IOPS limit
+
+CrawlerConfig::CrawlerConfig()
+	: nWalkers(4), nWorkers(1), nQueueSize(4096), dMaxReadRate(0), dMaxWriteRate(0), dMaxIOPS(0), nProgressInterval(10)
+{
+}
+
+// token bucket with a burst of one second; acquire() sleeps until the amount fits into the rate
+class RateLimiter
+{
+public:
+	explicit RateLimiter(double dRate) : m_dRate(dRate), m_tNext(std::chrono::steady_clock::now()) {}
+
+	void acquire(double dAmount)
+	{
+		if (m_dRate <= 0 || dAmount <= 0)
+			return;
+		std::chrono::steady_clock::time_point tUntil;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			const std::chrono::steady_clock::time_point tBurst = std::chrono::steady_clock::now() - std::chrono::seconds(1);
+			if (m_tNext < tBurst)
+				m_tNext = tBurst;
+			m_tNext += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(dAmount / m_dRate));
+			tUntil = m_tNext;
+		}
+		std::this_thread::sleep_until(tUntil);
+	}
+
+private:
+	RateLimiter(const RateLimiter&);
+	RateLimiter& operator=(const RateLimiter&);
+
+	const double m_dRate;
+	std::mutex m_mutex;
+	std::chrono::steady_clock::time_point m_tNext;	// when everything acquired so far has been used
+};
+
+// a directory to be listed, with the directory its outputs go to (empty: in-place)
+struct CrawlDirJob
+{
+	OFString ofstrPath;
+	OFString ofstrOutputDir;
+};
+
+// a listed directory; it is journaled as complete when all of its files have been handled
+struct CrawlDirectory
+{
+	explicit CrawlDirectory(const OFString& ofstrDirPath) : ofstrPath(ofstrDirPath), nPending(1), nRetry(0) {} // 1: still being listed
+
+	OFString ofstrPath;
+	std::atomic<size_t> nPending;
+	std::atomic<size_t> nRetry;		// files without a final result (see isFinalResult), e.g. a read error on a network share
+};
+
+struct CrawlFile
+{
+	OFString ofstrInputFile;
+	OFString ofstrOutputFile;
+	std::shared_ptr<CrawlDirectory> pDirectory;
+};
+
+struct CrawlState
+{
+	CrawlState(const CrawlerConfig& crawlerConfig, CrawlerAmendFunction amendFunction, volatile sig_atomic_t* pbStopFlag)
+		: config(crawlerConfig), amend(amendFunction), pbStop(pbStopFlag), readLimiter(crawlerConfig.dMaxReadRate),
+		  writeLimiter(crawlerConfig.dMaxWriteRate), iopsLimiter(crawlerConfig.dMaxIOPS), pJournal(NULL), iResult(RESULT_SUCCESS),
+		  nBusyWalkers(0), nWalkersRunning(0), nWorkersRunning(0), bWalkDone(OFFalse), nDirs(0), nDirsSkipped(0), nFound(0),
+		  nDone(0), nWarnings(0), nFailed(0), nBytesRead(0), nBytesWritten(0) {}
+
+	OFBool stopped() const { return *pbStop != 0; }
+
+	const CrawlerConfig& config;
+	CrawlerAmendFunction amend;
+	volatile sig_atomic_t* pbStop;
+	RateLimiter readLimiter;
+	RateLimiter writeLimiter;
+	RateLimiter iopsLimiter;
+	STD_NAMESPACE set<OFString> completed;	// from the journal; not changed during the crawl
+	FILE* pJournal;
+	int iResult;							// RESULT_FAILED_* when the crawl is incomplete
+	std::mutex mutex;						// everything below, the journal and the output streams
+	std::condition_variable cvDirs;
+	std::condition_variable cvFiles;
+	std::condition_variable cvSpace;
+	std::condition_variable cvDone;
+	STD_NAMESPACE deque<CrawlDirJob> dirs;
+	STD_NAMESPACE deque<CrawlFile> files;
+	size_t nBusyWalkers, nWalkersRunning, nWorkersRunning;
+	OFBool bWalkDone;
+	// progress
+	std::atomic<Uint64> nDirs, nDirsSkipped, nFound, nDone, nWarnings, nFailed, nBytesRead, nBytesWritten;
+};
+
+// names of the files and subdirectories in one directory; symbolic links to directories are not
+// followed, so the walk can't loop
+static OFBool ListDirectory(const OFString& ofstrDir, OFVector<OFString>& dirs, OFVector<OFString>& files)
+{
+#ifdef _WIN32
+	WIN32_FIND_DATAA data;
+	HANDLE hFind = FindFirstFileA((ofstrDir + "\\*").c_str(), &data);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return GetLastError() == ERROR_FILE_NOT_FOUND;
+	do
+	{
+		const OFString ofstrName(data.cFileName);
+		if (ofstrName == "." || ofstrName == "..")
+			continue;
+		if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			files.push_back(ofstrName);
+		else if (!(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			dirs.push_back(ofstrName);
+	} while (FindNextFileA(hFind, &data));
+	FindClose(hFind);
+#else
+	DIR* pDir = opendir(ofstrDir.c_str());
+	if (!pDir)
+		return OFFalse;
+	while (struct dirent* pEntry = readdir(pDir))
+	{
+		const OFString ofstrName(pEntry->d_name);
+		if (ofstrName == "." || ofstrName == "..")
+			continue;
+		unsigned char type = pEntry->d_type;
+		if (type == DT_UNKNOWN || type == DT_LNK)
+		{
+			OFString ofstrPath;
+			OFStandard::combineDirAndFilename(ofstrPath, ofstrDir, ofstrName, OFTrue);
+			struct stat st;
+			if (type == DT_UNKNOWN && lstat(ofstrPath.c_str(), &st) == 0)
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+			if (type == DT_LNK && stat(ofstrPath.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+				type = DT_REG;
+		}
+		if (type == DT_DIR)
+			dirs.push_back(ofstrName);
+		else if (type == DT_REG)
+			files.push_back(ofstrName);
+	}
+	closedir(pDir);
+#endif
+	return OFTrue;
+}
+
+static OFString FormatDuration(double dSeconds)
+{
+	const unsigned long nSeconds = OFstatic_cast(unsigned long, dSeconds + 0.5);
+	char buf[32];
+	sprintf(buf, "%lu:%02lu:%02lu", nSeconds / 3600, nSeconds / 60 % 60, nSeconds % 60);
+	return buf;
+}
+
+// one handled file (or the end of the listing) of a directory; the last one journals the directory, unless
+// a file has to be tried again: a resumed crawl skips journaled directories without looking at their files
+static void FinishFile(CrawlState* pState, const std::shared_ptr<CrawlDirectory>& pDirectory)
+{
+	if (--pDirectory->nPending != 0 || !pState->pJournal)
+		return;
+	if (pDirectory->nRetry > 0)
+	{
+		LogLine(ELL_info) << "INFO: not journaled, " << pDirectory->nRetry << " files to try again: " << pDirectory->ofstrPath;
+		return;
+	}
+	std::lock_guard<std::mutex> lock(pState->mutex);
+	fprintf(pState->pJournal, "%s\n", pDirectory->ofstrPath.c_str());
+	if (fflush(pState->pJournal) != 0 && pState->iResult == RESULT_SUCCESS)
+	{
+		LogLine(ELL_error) << "ERROR: could not write journal: " << pState->config.ofstrJournalFile;
+		pState->iResult = RESULT_FAILED_TO_CREATE;
+	}
+}
+
+// list one directory: queue its subdirectories for the walkers and its files for the workers
+static void WalkDirectory(CrawlState* pState, const CrawlDirJob& job)
+{
+	OFVector<OFString> subdirs, files;
+	pState->iopsLimiter.acquire(1);
+	if (!ListDirectory(job.ofstrPath, subdirs, files))
+	{
+		LogLine(ELL_error) << "ERROR: could not list directory: " << job.ofstrPath;
+		std::lock_guard<std::mutex> lock(pState->mutex);
+		pState->iResult = RESULT_FAILED_TO_READ;
+		return;
+	}
+	pState->nDirs++;
+
+	if (!subdirs.empty())
+	{
+		std::lock_guard<std::mutex> lock(pState->mutex);
+		for (size_t iDir = 0; iDir < subdirs.size(); iDir++)
+		{
+			CrawlDirJob subdir;
+			OFStandard::combineDirAndFilename(subdir.ofstrPath, job.ofstrPath, subdirs[iDir], OFTrue);
+			if (!job.ofstrOutputDir.empty())
+				OFStandard::combineDirAndFilename(subdir.ofstrOutputDir, job.ofstrOutputDir, subdirs[iDir], OFTrue);
+			pState->dirs.push_back(subdir);
+		}
+		pState->cvDirs.notify_all();
+	}
+
+	if (files.empty())
+		return;
+	if (pState->completed.count(job.ofstrPath))
+	{
+		pState->nDirsSkipped++;
+		return;
+	}
+	if (!job.ofstrOutputDir.empty() && !OFStandard::dirExists(job.ofstrOutputDir)
+		&& OFStandard::createDirectory(job.ofstrOutputDir, pState->config.ofstrOutputDir).bad() && !OFStandard::dirExists(job.ofstrOutputDir))
+	{
+		LogLine(ELL_error) << "ERROR: could not create output directory: " << job.ofstrOutputDir;
+		std::lock_guard<std::mutex> lock(pState->mutex);
+		pState->iResult = RESULT_FAILED_TO_CREATE;
+		return;
+	}
+
+	std::shared_ptr<CrawlDirectory> pDirectory(new CrawlDirectory(job.ofstrPath));
+	for (size_t iFile = 0; iFile < files.size(); iFile++)
+	{
+		CrawlFile file;
+		OFStandard::combineDirAndFilename(file.ofstrInputFile, job.ofstrPath, files[iFile], OFTrue);
+		if (job.ofstrOutputDir.empty())
+			file.ofstrOutputFile = file.ofstrInputFile;
+		else
+			OFStandard::combineDirAndFilename(file.ofstrOutputFile, job.ofstrOutputDir, files[iFile], OFTrue);
+		file.pDirectory = pDirectory;
+
+		std::unique_lock<std::mutex> lock(pState->mutex);
+		while (pState->files.size() >= pState->config.nQueueSize && !pState->stopped())
+			pState->cvSpace.wait_for(lock, std::chrono::seconds(1));
+		if (pState->stopped())
+			return; // the directory stays incomplete, so a resumed crawl does it again
+		pDirectory->nPending++;
+		pState->files.push_back(file);
+		pState->nFound++;
+		pState->cvFiles.notify_one();
+	}
+	FinishFile(pState, pDirectory); // the listing is done
+}
+
+static void CrawlWalker(CrawlState* pState)
+{
+	for (;;)
+	{
+		CrawlDirJob job;
+		{
+			std::unique_lock<std::mutex> lock(pState->mutex);
+			while (pState->dirs.empty() && pState->nBusyWalkers > 0 && !pState->stopped())
+				pState->cvDirs.wait_for(lock, std::chrono::seconds(1));
+			if (pState->dirs.empty() || pState->stopped())
+				break;
+			job = pState->dirs.front();
+			pState->dirs.pop_front();
+			pState->nBusyWalkers++;
+		}
+
+		WalkDirectory(pState, job);
+
+		std::lock_guard<std::mutex> lock(pState->mutex);
+		if (--pState->nBusyWalkers == 0 && pState->dirs.empty())
+			pState->cvDirs.notify_all(); // the walk is complete
+	}
+
+	std::lock_guard<std::mutex> lock(pState->mutex);
+	if (--pState->nWalkersRunning == 0)
+	{
+		pState->bWalkDone = OFTrue;
+		pState->cvFiles.notify_all();
+	}
+}
+
+static void CrawlWorker(CrawlState* pState)
+{
+	for (;;)
+	{
+		CrawlFile file;
+		{
+			std::unique_lock<std::mutex> lock(pState->mutex);
+			while (pState->files.empty() && !pState->bWalkDone && !pState->stopped())
+				pState->cvFiles.wait_for(lock, std::chrono::seconds(1));
+			if (pState->files.empty() || pState->stopped())
+				break;
+			file = pState->files.front();
+			pState->files.pop_front();
+			pState->cvSpace.notify_one();
+		}
+
+		const Uint64 nInputSize = OFStandard::getFileSize(file.ofstrInputFile);
+		pState->readLimiter.acquire(OFstatic_cast(double, nInputSize));
+		pState->iopsLimiter.acquire(1.0 + nInputSize / CRAWL_IO_SIZE);
+
+		OFOStringStream osOut, osErr;
+		const AmendResult result = pState->amend(file.ofstrInputFile, file.ofstrOutputFile, osOut, osErr);
+		const int iResult = result.code;
+
+		// in-place files are only rewritten when amended; clones count as written too
+		Uint64 nOutputSize = 0;
+		if (iResult == RESULT_SUCCESS || file.ofstrOutputFile != file.ofstrInputFile)
+			nOutputSize = OFStandard::getFileSize(file.ofstrOutputFile);
+		pState->writeLimiter.acquire(OFstatic_cast(double, nOutputSize));
+		if (nOutputSize)
+			pState->iopsLimiter.acquire(1.0 + nOutputSize / CRAWL_IO_SIZE);
+
+		pState->nBytesRead += nInputSize;
+		pState->nBytesWritten += nOutputSize;
+		if (iResult < 0) pState->nFailed++;
+		else if (iResult > 0) pState->nWarnings++;
+		if (!isFinalResult(iResult))
+			file.pDirectory->nRetry++;
+		{
+			// keeps the lines of one file together
+			std::lock_guard<std::mutex> lock(pState->mutex);
+			const LogContext context(file.ofstrInputFile, result.ofstrSOPInstanceUID);
+			AsyncLog::global().writeLines(osOut.str(), &context);
+			AsyncLog::global().writeLines(osErr.str(), &context);
+			LogLine(ELL_output, &context) << "RESULT: " << iResult << " " << file.ofstrInputFile;
+		}
+		pState->nDone++;
+		FinishFile(pState, file.pDirectory);
+	}
+
+	std::lock_guard<std::mutex> lock(pState->mutex);
+	if (--pState->nWorkersRunning == 0)
+		pState->cvDone.notify_all();
+}
+
+// called with the mutex held
+static void PrintProgress(const CrawlState& state, std::chrono::steady_clock::time_point tStart)
+{
+	const double dElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+	const Uint64 nDone = state.nDone, nFound = state.nFound;
+	const double dRate = dElapsed > 0 ? nDone / dElapsed : 0;
+	LogLine line(ELL_output);
+	line << "PROGRESS: " << nDone << "/" << nFound << (state.bWalkDone ? "" : "+") << " files, " << state.nDirs << " directories ("
+		<< state.nDirsSkipped << " done earlier), " << state.nWarnings << " warnings, " << state.nFailed << " failed, "
+		<< dRate << " files/s, read " << (dElapsed > 0 ? state.nBytesRead / dElapsed / 1e6 : 0) << " MB/s, written "
+		<< (dElapsed > 0 ? state.nBytesWritten / dElapsed / 1e6 : 0) << " MB/s, elapsed " << FormatDuration(dElapsed) << ", eta ";
+	if (dRate > 0)
+		line << FormatDuration((nFound - nDone) / dRate) << (state.bWalkDone ? "" : " (still walking)");
+	else
+		line << "unknown";
+}
+
+// read the completed directories and open the journal for appending
+static OFBool LoadJournal(CrawlState& state)
+{
+	STD_NAMESPACE ifstream journal(state.config.ofstrJournalFile.c_str());
+	STD_NAMESPACE string strLine;
+	while (STD_NAMESPACE getline(journal, strLine))
+	{
+		if (!strLine.empty())
+			state.completed.insert(strLine.c_str());
+	}
+	state.pJournal = fopen(state.config.ofstrJournalFile.c_str(), "a");
+	return state.pJournal != NULL;
+}
+
+int RunCrawler(const CrawlerConfig& config, CrawlerAmendFunction amend, volatile sig_atomic_t* pbStop)
+{
+	CrawlState state(config, amend, pbStop);
+	if (!config.ofstrJournalFile.empty())
+	{
+		if (!LoadJournal(state))
+		{
+			LogLine(ELL_error) << "ERROR: could not open journal: " << config.ofstrJournalFile;
+			return RESULT_FAILED_TO_CREATE;
+		}
+		if (!state.completed.empty())
+			LogLine(ELL_info) << "INFO: resuming; " << state.completed.size() << " directories were completed earlier";
+	}
+
+	for (size_t iRoot = 0; iRoot < config.roots.size(); iRoot++)
+	{
+		CrawlDirJob job;
+		OFStandard::normalizeDirName(job.ofstrPath, config.roots[iRoot]);
+		job.ofstrOutputDir = config.ofstrOutputDir;
+		state.dirs.push_back(job);
+	}
+
+	const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+	STD_NAMESPACE vector<std::thread> threads;
+	state.nWalkersRunning = config.nWalkers ? config.nWalkers : 1;
+	state.nWorkersRunning = config.nWorkers ? config.nWorkers : 1;
+	for (size_t iWalker = 0; iWalker < state.nWalkersRunning; iWalker++)
+		threads.push_back(std::thread(CrawlWalker, &state));
+	for (size_t iWorker = 0; iWorker < state.nWorkersRunning; iWorker++)
+		threads.push_back(std::thread(CrawlWorker, &state));
+
+	{
+		std::unique_lock<std::mutex> lock(state.mutex);
+		while (state.nWorkersRunning > 0)
+		{
+			state.cvDone.wait_for(lock, std::chrono::seconds(config.nProgressInterval ? config.nProgressInterval : 1));
+			if (state.nWorkersRunning > 0)
+				PrintProgress(state, tStart);
+		}
+	}
+	for (size_t iThread = 0; iThread < threads.size(); iThread++)
+		threads[iThread].join();
+
+	PrintProgress(state, tStart);
+	if (state.stopped())
+		LogLine(ELL_info) << "INFO: stopped; " << (config.ofstrJournalFile.empty() ? "use --journal to be able to resume" : "run again with the same --journal to resume");
+	if (state.pJournal)
+		fclose(state.pJournal);
+	return state.iResult;
+}
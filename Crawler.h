@@ -0,0 +1,40 @@
+﻿// Crawler.h : retrospective conversion of a complete archive tree. Walker threads list the
+// directories while amend workers process the files they find; reading and writing are throttled
+// so a live system on the same storage keeps its I/O, and a journal of completed directories lets
+// an interrupted crawl resume where it stopped.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "AmendEcgAnnotation.h"
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/ofstd/ofvector.h"
+
+#include <csignal>
+
+struct CrawlerConfig
+{
+	CrawlerConfig();
+
+	OFVector<OFString> roots;		// directories to crawl
+	OFString ofstrOutputDir;		// the trees are mirrored here (empty: amend in-place)
+	OFString ofstrJournalFile;		// directories whose files all got a final result (empty: no resume)
+	size_t nWalkers;				// directory listing threads
+	size_t nWorkers;				// amend threads
+	size_t nQueueSize;				// files found but not yet amended; walkers wait when it is full
+	double dMaxReadRate;			// bytes per second (0: unlimited)
+	double dMaxWriteRate;			// bytes per second (0: unlimited)
+	double dMaxIOPS;				// operations per second (0: unlimited)
+	unsigned int nProgressInterval;	// seconds between PROGRESS lines
+};
+
+// amends one file and returns its result (code and SOPInstanceUID are used); messages go to the streams
+typedef AmendResult (*CrawlerAmendFunction)(const OFString& ofstrInputFile, const OFString& ofstrOutputFile, STD_NAMESPACE ostream& out, STD_NAMESPACE ostream& err);
+
+// crawl all roots until done or *pbStop is set; returns RESULT_SUCCESS, or a RESULT_FAILED_* code when
+// a directory could not be listed or created or the journal could not be written (the per-file results
+// are only reported through the amend function and the RESULT lines)
+int RunCrawler(const CrawlerConfig& config, CrawlerAmendFunction amend, volatile sig_atomic_t* pbStop);
@@ -0,0 +1,217 @@
+﻿// Deflate.cpp : parallel deflate of Part 10 files (see Deflate.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "Deflate.h"
+
+#include "dcmtk/dcmdata/dctk.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#define DEFLATE_CHUNK (128 * 1024)
+#define DEFLATE_WINDOW (32 * 1024)
+
+static Uint16 ReadUint16(const Uint8* p)
+{
+	return OFstatic_cast(Uint16, p[0] | (p[1] << 8));
+}
+
+static Uint32 ReadUint32(const Uint8* p)
+{
+	return OFstatic_cast(Uint32, p[0]) | (OFstatic_cast(Uint32, p[1]) << 8) | (OFstatic_cast(Uint32, p[2]) << 16) | (OFstatic_cast(Uint32, p[3]) << 24);
+}
+
+// copy the preamble and meta header (always explicit VR little endian) with another TransferSyntaxUID
+// and a recalculated group length; nDatasetOffset is where the dataset starts in the input
+static OFBool RewriteMetaHeader(const Uint8* pData, size_t nSize, const char* pszTransferSyntaxUID,
+	OFVector<Uint8>& output, size_t& nDatasetOffset, OFString& ofstrOldTransferSyntaxUID)
+{
+	if (nSize < 132 || memcmp(pData + 128, "DICM", 4) != 0)
+		return OFFalse;
+	output = OFVector<Uint8>(pData, pData + 132);
+	size_t nGroupLength = 0; // position of the group length element in the output (0: none)
+	size_t nPos = 132;
+	while (nPos + 8 <= nSize && ReadUint16(pData + nPos) == 0x0002)
+	{
+		const Uint16 nElement = ReadUint16(pData + nPos + 2);
+		static const char* const longVRs[] = { "OB", "OD", "OF", "OL", "OV", "OW", "SQ", "SV", "UC", "UN", "UR", "UT", "UV" };
+		OFBool bLongVR = OFFalse;
+		for (size_t i = 0; i < sizeof(longVRs) / sizeof(longVRs[0]) && !bLongVR; i++)
+			bLongVR = pData[nPos + 4] == longVRs[i][0] && pData[nPos + 5] == longVRs[i][1];
+		const size_t nHeader = bLongVR ? 12 : 8;
+		if (nPos + nHeader > nSize)
+			return OFFalse;
+		const Uint32 nLength = bLongVR ? ReadUint32(pData + nPos + 8) : ReadUint16(pData + nPos + 6);
+		if (nLength > nSize - nPos - nHeader)
+			return OFFalse;
+
+		if (nElement == 0x0010)
+		{
+			const char* pszValue = OFreinterpret_cast(const char*, pData + nPos + nHeader);
+			size_t nValue = nLength;
+			while (nValue > 0 && (pszValue[nValue - 1] == '\0' || pszValue[nValue - 1] == ' '))
+				nValue--;
+			ofstrOldTransferSyntaxUID.assign(pszValue, nValue);
+
+			const size_t nUID = strlen(pszTransferSyntaxUID);
+			const size_t nPadded = nUID + (nUID & 1);
+			const Uint8 header[8] = { 0x02, 0x00, 0x10, 0x00, 'U', 'I', OFstatic_cast(Uint8, nPadded), OFstatic_cast(Uint8, nPadded >> 8) };
+			output.insert(output.end(), header, header + sizeof(header));
+			output.insert(output.end(), pszTransferSyntaxUID, pszTransferSyntaxUID + nUID);
+			if (nPadded > nUID)
+				output.push_back(0); // UI values are padded with NUL
+		}
+		else
+		{
+			if (nElement == 0x0000 && nLength == 4)
+				nGroupLength = output.size();
+			output.insert(output.end(), pData + nPos, pData + nPos + nHeader + nLength);
+		}
+		nPos += nHeader + nLength;
+	}
+	nDatasetOffset = nPos;
+
+	if (nGroupLength)
+	{
+		const Uint32 nValue = OFstatic_cast(Uint32, output.size() - nGroupLength - 12);
+		for (int iByte = 0; iByte < 4; iByte++)
+			output[nGroupLength + 8 + iByte] = OFstatic_cast(Uint8, nValue >> (8 * iByte));
+	}
+	return OFTrue;
+}
+
+#ifdef WITH_ZLIB
+// deflate one chunk, primed with the nWindow bytes before pData; all but the last chunk end with a sync flush
+static OFBool DeflateChunk(const Uint8* pData, size_t nWindow, size_t nSize, OFBool bLast, int iLevel, OFVector<Uint8>& output)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, iLevel, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return OFFalse;
+	OFBool bDone = nWindow == 0 || deflateSetDictionary(&stream, pData - nWindow, OFstatic_cast(uInt, nWindow)) == Z_OK;
+	if (bDone)
+	{
+		output.resize(deflateBound(&stream, OFstatic_cast(uLong, nSize)) + 16); // and the empty stored block of the flush
+		stream.next_in = OFconst_cast(Bytef*, pData);
+		stream.avail_in = OFstatic_cast(uInt, nSize);
+		stream.next_out = &output[0];
+		stream.avail_out = OFstatic_cast(uInt, output.size());
+		const int iStatus = deflate(&stream, bLast ? Z_FINISH : Z_SYNC_FLUSH);
+		bDone = bLast ? iStatus == Z_STREAM_END : iStatus == Z_OK && stream.avail_in == 0 && stream.avail_out > 0;
+		output.resize(output.size() - stream.avail_out);
+	}
+	deflateEnd(&stream);
+	return bDone;
+}
+
+static void DeflateWorker(const Uint8* pData, size_t nSize, int iLevel, std::atomic<size_t>* pNext,
+	OFVector<OFVector<Uint8> >* pChunks, std::atomic<bool>* pFailed)
+{
+	const size_t nChunks = pChunks->size();
+	for (size_t iChunk = (*pNext)++; iChunk < nChunks && !*pFailed; iChunk = (*pNext)++)
+	{
+		const size_t nStart = iChunk * DEFLATE_CHUNK;
+		const size_t nWindow = std::min<size_t>(nStart, DEFLATE_WINDOW);
+		if (!DeflateChunk(pData + nStart, nWindow, std::min<size_t>(DEFLATE_CHUNK, nSize - nStart), iChunk + 1 == nChunks, iLevel, (*pChunks)[iChunk]))
+			*pFailed = true;
+	}
+}
+#endif
+
+OFBool encodeDeflated(const OFVector<Uint8>& input, OFVector<Uint8>& output, int iLevel, unsigned int nThreads)
+{
+#ifdef WITH_ZLIB
+	size_t nDatasetOffset;
+	OFString ofstrTransferSyntaxUID;
+	output.clear();
+	if (input.empty() || !RewriteMetaHeader(&input[0], input.size(), UID_DeflatedExplicitVRLittleEndianTransferSyntax, output, nDatasetOffset, ofstrTransferSyntaxUID)
+		|| ofstrTransferSyntaxUID != UID_LittleEndianExplicitTransferSyntax)
+		return OFFalse;
+
+	// the calling thread takes chunks too; an ECG of a few hundred kB needs no extra threads
+	const Uint8* pDataset = &input[0] + nDatasetOffset;
+	const size_t nDataset = input.size() - nDatasetOffset;
+	OFVector<OFVector<Uint8> > chunks(std::max<size_t>(1, (nDataset + DEFLATE_CHUNK - 1) / DEFLATE_CHUNK));
+	std::atomic<size_t> nNext(0);
+	std::atomic<bool> bFailed(false);
+	STD_NAMESPACE vector<std::thread> threads;
+	const size_t nExtraThreads = std::min<size_t>(nThreads ? nThreads : 1, chunks.size()) - 1;
+	for (size_t iThread = 0; iThread < nExtraThreads; iThread++)
+		threads.push_back(std::thread(DeflateWorker, pDataset, nDataset, iLevel, &nNext, &chunks, &bFailed));
+	DeflateWorker(pDataset, nDataset, iLevel, &nNext, &chunks, &bFailed);
+	for (size_t iThread = 0; iThread < threads.size(); iThread++)
+		threads[iThread].join();
+	if (bFailed)
+		return OFFalse;
+
+	size_t nDeflated = output.size();
+	for (size_t iChunk = 0; iChunk < chunks.size(); iChunk++)
+		nDeflated += chunks[iChunk].size();
+	output.reserve(nDeflated + 1);
+	for (size_t iChunk = 0; iChunk < chunks.size(); iChunk++)
+		output.insert(output.end(), chunks[iChunk].begin(), chunks[iChunk].end());
+	if (output.size() & 1)
+		output.push_back(0); // the deflated bitstream is padded to an even length (PS3.5 A.5)
+	return OFTrue;
+#else
+	(void)input;
+	(void)output;
+	(void)iLevel;
+	(void)nThreads;
+	return OFFalse;
+#endif
+}
+
+OFBool decodeDeflated(const Uint8* pData, size_t nSize, OFVector<Uint8>& output)
+{
+#ifdef WITH_ZLIB
+	size_t nDatasetOffset;
+	OFString ofstrTransferSyntaxUID;
+	if (!RewriteMetaHeader(pData, nSize, UID_LittleEndianExplicitTransferSyntax, output, nDatasetOffset, ofstrTransferSyntaxUID)
+		|| ofstrTransferSyntaxUID != UID_DeflatedExplicitVRLittleEndianTransferSyntax)
+		return OFFalse;
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+		return OFFalse;
+	const size_t nMeta = output.size();
+	const Uint8* pIn = pData + nDatasetOffset;
+	size_t nInLeft = nSize - nDatasetOffset;
+	size_t nOut = nMeta;
+	int iStatus = Z_OK;
+	while (iStatus == Z_OK)
+	{
+		if (stream.avail_in == 0 && nInLeft > 0)
+		{
+			stream.next_in = OFconst_cast(Bytef*, pIn);
+			stream.avail_in = OFstatic_cast(uInt, std::min<size_t>(nInLeft, 1 << 30));
+			pIn += stream.avail_in;
+			nInLeft -= stream.avail_in;
+		}
+		if (output.size() - nOut < 65536)
+			output.resize(nOut + std::max<size_t>(output.size(), 4 * nSize)); // waveforms rarely deflate to less than a quarter
+		stream.next_out = &output[nOut];
+		stream.avail_out = OFstatic_cast(uInt, std::min<size_t>(output.size() - nOut, 1 << 30));
+		const uInt nAvailOut = stream.avail_out;
+		iStatus = inflate(&stream, Z_NO_FLUSH); // Z_BUF_ERROR: the input ended early
+		nOut += nAvailOut - stream.avail_out;
+	}
+	inflateEnd(&stream);
+	output.resize(iStatus == Z_STREAM_END ? nOut : nMeta);
+	return iStatus == Z_STREAM_END;
+#else
+	(void)pData;
+	(void)nSize;
+	(void)output;
+	return OFFalse;
+#endif
+}
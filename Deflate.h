@@ -0,0 +1,21 @@
+﻿// Deflate.h : Deflated Explicit VR Little Endian (1.2.840.10008.1.2.1.99) encoding of complete Part 10
+// files in memory. The dataset is deflated in 128 kB chunks by parallel threads, pigz style: every chunk
+// is primed with the 32 kB before it and ends on a byte boundary (a sync flush), so the concatenated
+// chunks are one raw deflate stream that any inflater reads. Requires DCMTK with zlib (WITH_ZLIB);
+// without it both functions fail.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/ofstd/ofvector.h"
+
+// an explicit VR little endian file (e.g. from DcmFileFormat::write) as a deflated one: the meta header
+// gets the deflated transfer syntax, the dataset is deflated with iLevel (0-9) by up to nThreads threads
+OFBool encodeDeflated(const OFVector<Uint8>& input, OFVector<Uint8>& output, int iLevel, unsigned int nThreads);
+
+// the reverse: a deflated file as explicit VR little endian, e.g. for the DicomScanner; fails for
+// any other transfer syntax
+OFBool decodeDeflated(const Uint8* pData, size_t nSize, OFVector<Uint8>& output);
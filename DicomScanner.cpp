@@ -0,0 +1,345 @@
+﻿// DicomScanner.cpp : minimal scanner for DICOM Part 10 files (see DicomScanner.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "DicomScanner.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const DcmTagKey _tagItem(DCM_Item);													// (fffe,e000)
+static const DcmTagKey _tagItemDelimitationItem(DCM_ItemDelimitationItem);					// (fffe,e00d)
+static const DcmTagKey _tagSequenceDelimitationItem(DCM_SequenceDelimitationItem);			// (fffe,e0dd)
+static const DcmTagKey _tagTransferSyntaxUID(DCM_TransferSyntaxUID);						// (0002,0010)
+
+MappedFile::MappedFile()
+	: m_pData(NULL), m_nSize(0)
+#ifdef _WIN32
+	, m_hFile(INVALID_HANDLE_VALUE), m_hMapping(NULL)
+#else
+	, m_fd(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+OFBool MappedFile::open(const OFFilename& ofstrFilename)
+{
+	close();
+#ifdef _WIN32
+	m_hFile = CreateFileA(ofstrFilename.getCharPointer(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return OFFalse;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_hFile, &size))
+	{
+		close();
+		return OFFalse;
+	}
+	m_nSize = OFstatic_cast(size_t, size.QuadPart);
+	if (m_nSize == 0)
+		return OFTrue; // nothing to map
+	m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_hMapping)
+		m_pData = OFstatic_cast(const Uint8*, MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+#else
+	m_fd = ::open(ofstrFilename.getCharPointer(), O_RDONLY | O_CLOEXEC);
+	if (m_fd < 0)
+		return OFFalse;
+	struct stat st;
+	if (fstat(m_fd, &st) != 0)
+	{
+		close();
+		return OFFalse;
+	}
+	m_nSize = OFstatic_cast(size_t, st.st_size);
+	if (m_nSize == 0)
+		return OFTrue; // nothing to map
+	void* pMapped = mmap(NULL, m_nSize, PROT_READ, MAP_PRIVATE, m_fd, 0);
+	if (pMapped != MAP_FAILED)
+		m_pData = OFstatic_cast(const Uint8*, pMapped);
+#endif
+	if (m_pData == NULL)
+	{
+		close();
+		return OFFalse;
+	}
+	return OFTrue;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (m_pData)
+		UnmapViewOfFile(m_pData);
+	if (m_hMapping)
+		CloseHandle(m_hMapping);
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(m_hFile);
+	m_hMapping = NULL;
+	m_hFile = INVALID_HANDLE_VALUE;
+#else
+	if (m_pData)
+		munmap(OFconst_cast(Uint8*, m_pData), m_nSize);
+	if (m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+#endif
+	m_pData = NULL;
+	m_nSize = 0;
+}
+
+DicomScanner::DicomScanner()
+	: m_pData(NULL), m_nSize(0), m_bExplicitVR(OFTrue), m_nDatasetOffset(0), m_xfer(EXS_Unknown)
+{
+}
+
+Uint16 DicomScanner::readUint16(size_t nPos) const
+{
+	return OFstatic_cast(Uint16, m_pData[nPos] | (m_pData[nPos + 1] << 8));
+}
+
+Uint32 DicomScanner::readUint32(size_t nPos) const
+{
+	return OFstatic_cast(Uint32, m_pData[nPos]) | (OFstatic_cast(Uint32, m_pData[nPos + 1]) << 8)
+		| (OFstatic_cast(Uint32, m_pData[nPos + 2]) << 16) | (OFstatic_cast(Uint32, m_pData[nPos + 3]) << 24);
+}
+
+OFCondition DicomScanner::scan(const Uint8* pData, size_t nSize)
+{
+	m_pData = pData;
+	m_nSize = nSize;
+	m_xfer = EXS_Unknown;
+	m_elements.clear();
+
+	if (pData == NULL || nSize < 132 || memcmp(pData + 128, "DICM", 4) != 0)
+		return EC_IllegalCall; // not a Part 10 file
+
+	// the meta header is always explicit VR little endian
+	OFCondition cond;
+	OFString ofstrXfer;
+	size_t nPos = 132;
+	while (nPos + 8 <= nSize && readUint16(nPos) == 0x0002)
+	{
+		ScannedElement elem;
+		cond = readElement(nPos, nSize, OFTrue, elem);
+		if (cond.bad())
+			return cond;
+		if (elem.tag == _tagTransferSyntaxUID)
+			getString(elem, ofstrXfer);
+		nPos = elem.endOffset;
+	}
+	m_nDatasetOffset = nPos;
+
+	if (ofstrXfer.compare(UID_LittleEndianExplicitTransferSyntax) == 0)
+	{
+		m_xfer = EXS_LittleEndianExplicit;
+		m_bExplicitVR = OFTrue;
+	}
+	else if (ofstrXfer.compare(UID_LittleEndianImplicitTransferSyntax) == 0)
+	{
+		m_xfer = EXS_LittleEndianImplicit;
+		m_bExplicitVR = OFFalse;
+	}
+	else
+		return EC_IllegalCall; // big endian, deflated or encapsulated; leave it to DCMTK
+
+	while (nPos < nSize)
+	{
+		ScannedElement elem;
+		cond = readElement(nPos, nSize, m_bExplicitVR, elem);
+		if (cond.bad())
+			return cond;
+		m_elements.push_back(elem);
+		nPos = elem.endOffset;
+	}
+	return EC_Normal;
+}
+
+OFCondition DicomScanner::readElement(size_t& nPos, size_t nEnd, OFBool bExplicitVR, ScannedElement& elem) const
+{
+	if (nPos + 8 > nEnd)
+		return EC_CorruptedData;
+
+	elem.offset = nPos;
+	elem.tag = DcmTagKey(readUint16(nPos), readUint16(nPos + 2));
+	elem.vr[0] = elem.vr[1] = elem.vr[2] = 0;
+	if (elem.tag.getGroup() == 0xfffe || !bExplicitVR)
+	{
+		// items, delimiters and implicit VR: tag and 32-bit length
+		elem.length = readUint32(nPos + 4);
+		elem.valueOffset = nPos + 8;
+	}
+	else
+	{
+		elem.vr[0] = OFstatic_cast(char, m_pData[nPos + 4]);
+		elem.vr[1] = OFstatic_cast(char, m_pData[nPos + 5]);
+		static const char* const longVRs[] = { "OB", "OD", "OF", "OL", "OV", "OW", "SQ", "SV", "UC", "UN", "UR", "UT", "UV" };
+		OFBool bLongVR = OFFalse;
+		for (size_t i = 0; i < sizeof(longVRs) / sizeof(longVRs[0]) && !bLongVR; i++)
+			bLongVR = elem.vr[0] == longVRs[i][0] && elem.vr[1] == longVRs[i][1];
+		if (bLongVR)
+		{
+			if (nPos + 12 > nEnd)
+				return EC_CorruptedData;
+			elem.length = readUint32(nPos + 8);
+			elem.valueOffset = nPos + 12;
+		}
+		else
+		{
+			elem.length = readUint16(nPos + 6);
+			elem.valueOffset = nPos + 8;
+		}
+	}
+
+	if (elem.length == DCM_UndefinedLength)
+	{
+		// sequence or encapsulated data; an undefined length UN value is encoded in implicit VR
+		size_t nSkip = elem.valueOffset;
+		const OFBool bUN = elem.vr[0] == 'U' && elem.vr[1] == 'N';
+		OFCondition cond = skipItems(nSkip, nEnd, bExplicitVR && !bUN);
+		if (cond.bad())
+			return cond;
+		elem.endOffset = nSkip;
+	}
+	else
+	{
+		if (elem.length > nEnd - elem.valueOffset)
+			return EC_CorruptedData;
+		elem.endOffset = elem.valueOffset + elem.length;
+	}
+	return EC_Normal;
+}
+
+// skip items up to and including the sequence delimitation item
+OFCondition DicomScanner::skipItems(size_t& nPos, size_t nEnd, OFBool bExplicitVR) const
+{
+	for (;;)
+	{
+		if (nPos + 8 > nEnd)
+			return EC_CorruptedData;
+		const DcmTagKey tag(readUint16(nPos), readUint16(nPos + 2));
+		const Uint32 nLength = readUint32(nPos + 4);
+		nPos += 8;
+		if (tag == _tagSequenceDelimitationItem)
+			return EC_Normal;
+		if (tag != _tagItem)
+			return EC_CorruptedData;
+		if (nLength == DCM_UndefinedLength)
+		{
+			OFCondition cond = skipElements(nPos, nEnd, bExplicitVR, OFTrue);
+			if (cond.bad())
+				return cond;
+		}
+		else
+		{
+			if (nLength > nEnd - nPos)
+				return EC_CorruptedData;
+			nPos += nLength;
+		}
+	}
+}
+
+// skip elements up to the end, or up to and including an item delimitation item
+OFCondition DicomScanner::skipElements(size_t& nPos, size_t nEnd, OFBool bExplicitVR, OFBool bUntilItemDelimiter) const
+{
+	while (nPos < nEnd)
+	{
+		if (bUntilItemDelimiter && nPos + 8 <= nEnd && DcmTagKey(readUint16(nPos), readUint16(nPos + 2)) == _tagItemDelimitationItem)
+		{
+			nPos += 8;
+			return EC_Normal;
+		}
+		ScannedElement elem;
+		OFCondition cond = readElement(nPos, nEnd, bExplicitVR, elem);
+		if (cond.bad())
+			return cond;
+		nPos = elem.endOffset;
+	}
+	return bUntilItemDelimiter ? EC_CorruptedData : EC_Normal;
+}
+
+const ScannedElement* DicomScanner::find(const DcmTagKey& tag) const
+{
+	return find(m_elements, tag);
+}
+
+const ScannedElement* DicomScanner::find(const OFVector<ScannedElement>& elements, const DcmTagKey& tag)
+{
+	for (size_t i = 0; i < elements.size(); i++)
+	{
+		if (elements[i].tag == tag)
+			return &elements[i];
+	}
+	return NULL;
+}
+
+size_t DicomScanner::insertPosition(const DcmTagKey& tag) const
+{
+	// top-level elements are stored in ascending tag order
+	for (size_t i = 0; i < m_elements.size(); i++)
+	{
+		if (tag < m_elements[i].tag)
+			return m_elements[i].offset;
+	}
+	return m_elements.empty() ? m_nDatasetOffset : m_elements.back().endOffset;
+}
+
+OFBool DicomScanner::getString(const ScannedElement& elem, OFString& ofstrValue) const
+{
+	if (elem.length == DCM_UndefinedLength)
+		return OFFalse;
+
+	size_t nLength = elem.length;
+	const char* pValue = OFreinterpret_cast(const char*, m_pData + elem.valueOffset);
+	while (nLength > 0 && (pValue[nLength - 1] == ' ' || pValue[nLength - 1] == '\0'))
+		nLength--;
+	ofstrValue.assign(pValue, nLength);
+	return OFTrue;
+}
+
+OFCondition DicomScanner::getItems(const ScannedElement& seq, OFVector<OFVector<ScannedElement> >& items) const
+{
+	const size_t nEnd = seq.length == DCM_UndefinedLength ? seq.endOffset : seq.valueOffset + seq.length;
+	const OFBool bExplicitVR = m_bExplicitVR && !(seq.vr[0] == 'U' && seq.vr[1] == 'N');
+	size_t nPos = seq.valueOffset;
+	while (nPos + 8 <= nEnd)
+	{
+		const DcmTagKey tag(readUint16(nPos), readUint16(nPos + 2));
+		const Uint32 nLength = readUint32(nPos + 4);
+		nPos += 8;
+		if (tag == _tagSequenceDelimitationItem)
+			break;
+		if (tag != _tagItem || (nLength != DCM_UndefinedLength && nLength > nEnd - nPos))
+			return EC_CorruptedData;
+
+		const size_t nItemEnd = nLength == DCM_UndefinedLength ? nEnd : nPos + nLength;
+		OFVector<ScannedElement> elements;
+		while (nPos < nItemEnd)
+		{
+			if (nLength == DCM_UndefinedLength && nPos + 8 <= nItemEnd && DcmTagKey(readUint16(nPos), readUint16(nPos + 2)) == _tagItemDelimitationItem)
+			{
+				nPos += 8;
+				break;
+			}
+			ScannedElement elem;
+			OFCondition cond = readElement(nPos, nItemEnd, bExplicitVR, elem);
+			if (cond.bad())
+				return cond;
+			elements.push_back(elem);
+			nPos = elem.endOffset;
+		}
+		items.push_back(elements);
+	}
+	return EC_Normal;
+}
@@ -0,0 +1,95 @@
+﻿// DicomScanner.h : minimal scanner for DICOM Part 10 files.
+// Locates elements and their byte offsets without a full DCMTK parse; long values are skipped,
+// not read. Only little endian (implicit or explicit VR) datasets are supported, which covers
+// the Muse exports; anything else is reported as EC_IllegalCall so callers can use DCMTK instead.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/dcmdata/dctk.h"
+#include "dcmtk/ofstd/ofvector.h"
+
+// read-only memory mapping of a complete file
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	OFBool open(const OFFilename& ofstrFilename);
+	void close();
+
+	const Uint8* data() const { return m_pData; }
+	size_t size() const { return m_nSize; }
+#ifndef _WIN32
+	int fd() const { return m_fd; } // descriptor of the mapped file, e.g. for copy_file_range()
+#endif
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const Uint8* m_pData;
+	size_t m_nSize;
+#ifdef _WIN32
+	void* m_hFile;
+	void* m_hMapping;
+#else
+	int m_fd;
+#endif
+};
+
+// one element as found in the file; all offsets are relative to the start of the file
+struct ScannedElement
+{
+	DcmTagKey tag;
+	char vr[3];			// explicit VR, or empty for implicit VR
+	Uint32 length;		// value length field (may be DCM_UndefinedLength)
+	size_t offset;		// first byte of the tag
+	size_t valueOffset;	// first byte of the value
+	size_t endOffset;	// first byte after the element, including a sequence delimitation item
+};
+
+class DicomScanner
+{
+public:
+	DicomScanner();
+
+	// scan the meta header and all top-level elements of the dataset in pData
+	OFCondition scan(const Uint8* pData, size_t nSize);
+
+	E_TransferSyntax getXfer() const { return m_xfer; }
+	size_t getDatasetOffset() const { return m_nDatasetOffset; }
+	const OFVector<ScannedElement>& getElements() const { return m_elements; }
+
+	// top-level element with the given tag, or NULL
+	const ScannedElement* find(const DcmTagKey& tag) const;
+
+	// offset where a missing top-level element with the given tag would have to be inserted
+	size_t insertPosition(const DcmTagKey& tag) const;
+
+	// value of an element as a string, without trailing padding
+	OFBool getString(const ScannedElement& elem, OFString& ofstrValue) const;
+
+	// the elements of every item in a sequence
+	OFCondition getItems(const ScannedElement& seq, OFVector<OFVector<ScannedElement> >& items) const;
+
+	// element with the given tag in a list of (item) elements, or NULL
+	static const ScannedElement* find(const OFVector<ScannedElement>& elements, const DcmTagKey& tag);
+
+private:
+	OFCondition readElement(size_t& nPos, size_t nEnd, OFBool bExplicitVR, ScannedElement& elem) const;
+	OFCondition skipItems(size_t& nPos, size_t nEnd, OFBool bExplicitVR) const;
+	OFCondition skipElements(size_t& nPos, size_t nEnd, OFBool bExplicitVR, OFBool bUntilItemDelimiter) const;
+	Uint16 readUint16(size_t nPos) const;
+	Uint32 readUint32(size_t nPos) const;
+
+	const Uint8* m_pData;
+	size_t m_nSize;
+	OFBool m_bExplicitVR;
+	size_t m_nDatasetOffset;
+	E_TransferSyntax m_xfer;
+	OFVector<ScannedElement> m_elements;
+};
@@ -0,0 +1,148 @@
+﻿// EmbeddedDictionary.cpp : minimal data dictionary compiled into the tool (see EmbeddedDictionary.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "EmbeddedDictionary.h"
+
+#include "dcmtk/ofstd/ofstd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdlib.h>
+
+enum E_DictionaryState
+{
+	EDS_none,		// not installed (yet); DCMTK loads the external dictionaries on first use
+	EDS_embedded,
+	EDS_full
+};
+
+#ifdef AMENDECG_EMBEDDED_DICTIONARY
+
+struct EmbeddedDictEntry
+{
+	Uint16 group;
+	Uint16 element;
+	const char* pszVR;
+	const char* pszName;
+	int vmMin;
+	int vmMax;
+};
+
+// generated at build time from dicom.dic and EmbeddedDictionary.txt, sorted by tag
+static const EmbeddedDictEntry _embeddedDictionary[] =
+{
+#include "EmbeddedDictionary.inc"
+};
+
+static const size_t _nEmbeddedEntries = sizeof(_embeddedDictionary) / sizeof(_embeddedDictionary[0]);
+
+static bool EntryBefore(const EmbeddedDictEntry& entry, const DcmTagKey& tag)
+{
+	return entry.group < tag.getGroup() || (entry.group == tag.getGroup() && entry.element < tag.getElement());
+}
+
+static void SetDictionaryPath(const char* pszPath)
+{
+#ifdef _WIN32
+	_putenv_s(DCM_DICT_ENVIRONMENT_VARIABLE, pszPath ? pszPath : "");
+#else
+	if (pszPath)
+		setenv(DCM_DICT_ENVIRONMENT_VARIABLE, pszPath, 1);
+	else
+		unsetenv(DCM_DICT_ENVIRONMENT_VARIABLE);
+#endif
+}
+
+#endif
+
+static std::mutex _mutexDictionary;
+static std::atomic<int> _eState(EDS_none);
+static OFString _ofstrExternalPath;		// what DCMTK would have loaded
+static OFBool _bExternalPathSet = OFFalse;	// DCMDICTPATH was set: report missing files
+
+OFBool installEmbeddedDictionary()
+{
+#ifdef AMENDECG_EMBEDDED_DICTIONARY
+	std::lock_guard<std::mutex> lock(_mutexDictionary);
+	if (_eState != EDS_none)
+		return _eState == EDS_embedded;
+
+	const char* pszPath = getenv(DCM_DICT_ENVIRONMENT_VARIABLE);
+	_bExternalPathSet = pszPath && *pszPath;
+	if (_bExternalPathSet)
+		_ofstrExternalPath = pszPath;
+#ifdef DCM_DICT_DEFAULT_PATH
+	else
+		_ofstrExternalPath = DCM_DICT_DEFAULT_PATH;
+#endif
+
+	// DCMTK creates the global dictionary on first use; a path of only a separator makes it load no files
+	const OFString ofstrOriginalPath = _bExternalPathSet ? _ofstrExternalPath : OFString();
+	const char szNoPath[2] = { ENVIRONMENT_PATH_SEPARATOR, 0 };
+	SetDictionaryPath(szNoPath);
+	DcmDataDictionary& dict = dcmDataDict.wrlock();
+	SetDictionaryPath(_bExternalPathSet ? ofstrOriginalPath.c_str() : NULL);
+
+	// already in use (or DCMTK has a built-in dictionary): nothing to gain
+	if (dict.numberOfEntries() > dict.numberOfSkeletonEntries())
+	{
+		dcmDataDict.wrunlock();
+		_eState = EDS_full;
+		return OFFalse;
+	}
+
+	for (size_t iEntry = 0; iEntry < _nEmbeddedEntries; iEntry++)
+	{
+		const EmbeddedDictEntry& entry = _embeddedDictionary[iEntry];
+		dict.addEntry(new DcmDictEntry(entry.group, entry.element, DcmVR(entry.pszVR), entry.pszName,
+			entry.vmMin, entry.vmMax, "DICOM", OFFalse /* static strings */, NULL));
+	}
+	dcmDataDict.wrunlock();
+	_eState = EDS_embedded;
+	return OFTrue;
+#else
+	return OFFalse;
+#endif
+}
+
+OFBool isDictionaryPartial()
+{
+	return _eState == EDS_embedded;
+}
+
+OFBool isEmbeddedTag(const DcmTagKey& tag)
+{
+#ifdef AMENDECG_EMBEDDED_DICTIONARY
+	const EmbeddedDictEntry* pEnd = _embeddedDictionary + _nEmbeddedEntries;
+	const EmbeddedDictEntry* pEntry = std::lower_bound(_embeddedDictionary, pEnd, tag, EntryBefore);
+	return pEntry != pEnd && pEntry->group == tag.getGroup() && pEntry->element == tag.getElement();
+#else
+	(void)tag;
+	return OFFalse;
+#endif
+}
+
+OFBool requireFullDictionary()
+{
+	std::lock_guard<std::mutex> lock(_mutexDictionary);
+	if (_eState != EDS_embedded)
+		return OFFalse;
+
+	// the same files, in the same order, as DCMTK itself would have loaded; later entries replace the embedded ones
+	DcmDataDictionary& dict = dcmDataDict.wrlock();
+	size_t nPos = 0;
+	while (nPos < _ofstrExternalPath.length())
+	{
+		size_t nEnd = _ofstrExternalPath.find(ENVIRONMENT_PATH_SEPARATOR, nPos);
+		if (nEnd == OFString_npos)
+			nEnd = _ofstrExternalPath.length();
+		if (nEnd > nPos)
+			dict.loadDictionary(_ofstrExternalPath.substr(nPos, nEnd - nPos).c_str(), _bExternalPathSet);
+		nPos = nEnd + 1;
+	}
+	dcmDataDict.wrunlock();
+	_eState = EDS_full;
+	return OFTrue;
+}
@@ -0,0 +1,25 @@
+﻿// EmbeddedDictionary.h : minimal data dictionary compiled into the tool (AMENDECG_EMBEDDED_DICTIONARY)
+// Parsing the complete dicom.dic dominates the startup of a single-file run. With the embedded dictionary
+// installed, only the tags listed in EmbeddedDictionary.txt are known until something needs more; then
+// the external dictionaries (DCMDICTPATH, or DCMTK's default path) are loaded after all.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/dcmdata/dctk.h"
+
+// install the embedded dictionary; call before anything looks up a tag. Returns OFFalse when it is not
+// compiled in, or when the global dictionary was already loaded
+OFBool installEmbeddedDictionary();
+
+// OFTrue while only the embedded dictionary is loaded
+OFBool isDictionaryPartial();
+
+// OFTrue if the tag is in the embedded dictionary (binary search in the sorted table)
+OFBool isEmbeddedTag(const DcmTagKey& tag);
+
+// load the external dictionaries if only the embedded one is loaded, e.g. before parsing implicit VR
+// data; returns OFTrue if they were loaded by this call
+OFBool requireFullDictionary();
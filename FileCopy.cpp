@@ -0,0 +1,139 @@
+﻿// FileCopy.cpp : file cloning strategies (see FileCopy.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "FileCopy.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+long CopyFileRange(int fdIn, Sint64* pOffIn, int fdOut, Sint64* pOffOut, size_t nLength)
+{
+	loff_t offIn = pOffIn ? *pOffIn : 0;
+	loff_t offOut = pOffOut ? *pOffOut : 0;
+#if defined(HAVE_COPY_FILE_RANGE)
+	const long nCopied = copy_file_range(fdIn, pOffIn ? &offIn : NULL, fdOut, pOffOut ? &offOut : NULL, nLength, 0);
+#elif defined(__NR_copy_file_range)
+	const long nCopied = syscall(__NR_copy_file_range, fdIn, pOffIn ? &offIn : NULL, fdOut, pOffOut ? &offOut : NULL, nLength, 0u);
+#else
+	(void)fdIn; (void)fdOut; (void)nLength;
+	errno = ENOSYS;
+	const long nCopied = -1;
+#endif
+	if (pOffIn)
+		*pOffIn = offIn;
+	if (pOffOut)
+		*pOffOut = offOut;
+	return nCopied;
+}
+
+// reflink or in-kernel copy of an open file; falls back to read/write if the kernel can't copy this pair of files
+static E_CloneResult CloneDescriptor(int fdIn, int fdOut, Uint64 nSize, Uint64& nBytes)
+{
+#ifdef FICLONE
+	if (ioctl(fdOut, FICLONE, fdIn) == 0)
+	{
+		nBytes = nSize;
+		return ECR_reflink;
+	}
+#endif
+
+	E_CloneResult result = ECR_copyFileRange;
+	while (nBytes < nSize)
+	{
+		const long nCopied = CopyFileRange(fdIn, NULL, fdOut, NULL, OFstatic_cast(size_t, nSize - nBytes));
+		if (nCopied > 0)
+		{
+			nBytes += nCopied;
+			continue;
+		}
+		if (nCopied == 0 || nBytes > 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP))
+			return nCopied == 0 ? result : ECR_failed;
+		break; // not supported for this pair of files
+	}
+	if (nBytes == nSize)
+		return result;
+
+	char buffer[65536];
+	ssize_t nRead;
+	while ((nRead = read(fdIn, buffer, sizeof(buffer))) > 0)
+	{
+		for (ssize_t nWritten = 0; nWritten < nRead; )
+		{
+			const ssize_t n = write(fdOut, buffer + nWritten, nRead - nWritten);
+			if (n <= 0)
+				return ECR_failed;
+			nWritten += n;
+		}
+		nBytes += nRead;
+	}
+	return nRead == 0 ? ECR_copy : ECR_failed;
+}
+#endif
+
+E_CloneResult CloneFile(const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile, E_CloneMethod method, Uint64& nBytes)
+{
+	nBytes = 0;
+#ifdef __linux__
+	if (method == ECM_hardlink)
+	{
+		// replace an existing output; link() fails with EXDEV across volumes
+		if (unlink(ofstrOutputFile.getCharPointer()) == 0 || errno == ENOENT)
+		{
+			if (link(ofstrInputFile.getCharPointer(), ofstrOutputFile.getCharPointer()) == 0)
+				return ECR_hardlink;
+		}
+	}
+
+	if (method != ECM_copy)
+	{
+		const int fdIn = open(ofstrInputFile.getCharPointer(), O_RDONLY | O_CLOEXEC);
+		if (fdIn < 0)
+			return ECR_failed;
+		struct stat st;
+		if (fstat(fdIn, &st) != 0)
+		{
+			close(fdIn);
+			return ECR_failed;
+		}
+		const int fdOut = open(ofstrOutputFile.getCharPointer(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+		if (fdOut < 0)
+		{
+			close(fdIn);
+			return ECR_failed;
+		}
+		E_CloneResult result = CloneDescriptor(fdIn, fdOut, OFstatic_cast(Uint64, st.st_size), nBytes);
+		if (close(fdOut) != 0)
+			result = ECR_failed;
+		close(fdIn);
+		return result;
+	}
+#else
+	(void)method;
+#endif
+
+	if (!OFStandard::copyFile(ofstrInputFile, ofstrOutputFile))
+		return ECR_failed;
+	nBytes = OFStandard::getFileSize(ofstrOutputFile);
+	return ECR_copy;
+}
+
+const char* CloneResultName(E_CloneResult result)
+{
+	switch (result)
+	{
+	case ECR_copy: return "copy";
+	case ECR_reflink: return "reflink";
+	case ECR_copyFileRange: return "copy_file_range";
+	case ECR_hardlink: return "hardlink";
+	default: return "failed";
+	}
+}
@@ -0,0 +1,39 @@
+﻿// FileCopy.h : file cloning strategies for copying inputs to the output unchanged
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstd.h"
+
+// what to try when cloning a file
+enum E_CloneMethod
+{
+	ECM_copy,		// plain copy through user space (OFStandard::copyFile)
+	ECM_fast,		// reflink (FICLONE), then copy_file_range(), then a plain copy
+	ECM_hardlink	// hardlink when on the same volume, else as ECM_fast
+};
+
+// how a file was actually cloned
+enum E_CloneResult
+{
+	ECR_failed,
+	ECR_copy,
+	ECR_reflink,
+	ECR_copyFileRange,
+	ECR_hardlink
+};
+
+// clone ofstrInputFile to ofstrOutputFile (overwriting it); nBytes is set to the number of bytes
+// that were copied, which is 0 for a hardlink and the (shared) file size for a reflink
+E_CloneResult CloneFile(const OFFilename& ofstrInputFile, const OFFilename& ofstrOutputFile, E_CloneMethod method, Uint64& nBytes);
+
+const char* CloneResultName(E_CloneResult result);
+
+#ifdef __linux__
+// copy_file_range() (NULL offsets: the file positions); the libc function needs glibc 2.27, so older
+// systems (RHEL 7) use the system call when its number is known. -1 with errno ENOSYS when the running
+// kernel or the build has neither; callers fall back to read/write
+long CopyFileRange(int fdIn, Sint64* pOffIn, int fdOut, Sint64* pOffOut, size_t nLength);
+#endif
@@ -0,0 +1,57 @@
+# GenerateEmbeddedDictionary.cmake : writes the table of the embedded data dictionary
+# Usage: cmake -DDICT_SOURCE=dicom.dic -DTAG_LIST=EmbeddedDictionary.txt -DOUTPUT=EmbeddedDictionary.inc -P GenerateEmbeddedDictionary.cmake
+# The entries of dicom.dic named in TAG_LIST are written sorted by tag, one initializer per line.
+
+file(STRINGS ${TAG_LIST} listLines)
+set(names "")
+foreach(line IN LISTS listLines)
+	string(STRIP "${line}" line)
+	if (NOT line STREQUAL "" AND NOT line MATCHES "^#")
+		list(APPEND names ${line})
+	endif()
+endforeach()
+
+file(STRINGS ${DICT_SOURCE} dictLines REGEX "^\\([0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f],[0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f][0-9A-Fa-f]\\)\t")
+set(entries "")
+set(found "")
+foreach(line IN LISTS dictLines)
+	# (gggg,eeee) VR Name VM Version
+	if (line MATCHES "^\\(([0-9A-Fa-f]+),([0-9A-Fa-f]+)\\)\t+([A-Za-z][A-Za-z])\t+([A-Za-z0-9]+)\t+([0-9n-]+)")
+		set(group ${CMAKE_MATCH_1})
+		set(element ${CMAKE_MATCH_2})
+		set(vr ${CMAKE_MATCH_3})
+		set(name ${CMAKE_MATCH_4})
+		set(vm ${CMAKE_MATCH_5})
+		list(FIND names ${name} iName)
+		if (iName GREATER -1)
+			if (vm MATCHES "^([0-9]+)-[0-9]*n$")
+				set(vmMin ${CMAKE_MATCH_1})
+				set(vmMax "DcmVariableVM")
+			elseif (vm MATCHES "^([0-9]+)-([0-9]+)$")
+				set(vmMin ${CMAKE_MATCH_1})
+				set(vmMax ${CMAKE_MATCH_2})
+			else()
+				set(vmMin ${vm})
+				set(vmMax ${vm})
+			endif()
+			string(TOUPPER "${group}${element}" key)
+			list(APPEND entries "${key}|{ 0x${group}, 0x${element}, \"${vr}\", \"${name}\", ${vmMin}, ${vmMax} },")
+			list(APPEND found ${name})
+		endif()
+	endif()
+endforeach()
+
+foreach(name IN LISTS names)
+	list(FIND found ${name} iFound)
+	if (iFound EQUAL -1)
+		message(FATAL_ERROR "${name} is not in ${DICT_SOURCE}")
+	endif()
+endforeach()
+
+list(SORT entries)
+set(content "// generated from ${DICT_SOURCE} by GenerateEmbeddedDictionary.cmake; do not edit\n")
+foreach(entry IN LISTS entries)
+	string(SUBSTRING "${entry}" 9 -1 entry)
+	string(APPEND content "${entry}\n")
+endforeach()
+file(WRITE ${OUTPUT} "${content}")
@@ -0,0 +1,355 @@
+﻿// Log.cpp : leveled, asynchronous logging (see Log.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "Log.h"
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+
+#define LOG_FLUSH_SIZE 65536	// bytes collected by the sink before it writes them
+#define LOG_IDLE_WAIT_MS 10		// longest delay of a record that arrives while the sink waits
+
+static const char* const _pszLevelNames[] = { "output", "error", "warn", "info", "debug" };
+
+// the level a line of the library announces with its prefix; the prefix stays part of the text
+static E_LogLevel LevelOfLine(const char* pszLine)
+{
+	if (strncmp(pszLine, "VERIFY:", 7) == 0)
+		return ELL_output; // the digests are part of the per-file record, like RESULT
+	if (strncmp(pszLine, "ERROR:", 6) == 0 || strncmp(pszLine, "FAIL:", 5) == 0)
+		return ELL_error;
+	if (strncmp(pszLine, "WARN:", 5) == 0)
+		return ELL_warn;
+	if (strncmp(pszLine, "INFO:", 5) == 0)
+		return ELL_info;
+	return ELL_debug;
+}
+
+static void AppendJsonString(STD_NAMESPACE string& strJson, const STD_NAMESPACE string& strValue)
+{
+	strJson += '"';
+	for (size_t iChar = 0; iChar < strValue.size(); iChar++)
+	{
+		const unsigned char c = OFstatic_cast(unsigned char, strValue[iChar]);
+		switch (c)
+		{
+		case '"': strJson += "\\\""; break;
+		case '\\': strJson += "\\\\"; break;
+		case '\n': strJson += "\\n"; break;
+		case '\r': strJson += "\\r"; break;
+		case '\t': strJson += "\\t"; break;
+		default:
+			if (c < 0x20)
+			{
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				strJson += buf;
+			}
+			else
+				strJson += OFstatic_cast(char, c);
+		}
+	}
+	strJson += '"';
+}
+
+AsyncLog::AsyncLog()
+	: m_level(ELL_warn), m_format(ELF_text), m_pSlots(NULL), m_nMask(0), m_nEnqueue(0), m_nDequeue(0), m_nDropped(0),
+	  m_bStop(false), m_bIdle(false)
+{
+}
+
+AsyncLog::~AsyncLog()
+{
+	stop();
+}
+
+AsyncLog& AsyncLog::global()
+{
+	static AsyncLog log;
+	return log;
+}
+
+void AsyncLog::configure(E_LogLevel level, E_LogFormat format)
+{
+	m_level = level;
+	m_format = format;
+}
+
+OFBool AsyncLog::parseLevel(const OFString& ofstrLevel, E_LogLevel& level)
+{
+	for (int iLevel = ELL_error; iLevel <= ELL_debug; iLevel++)
+	{
+		if (ofstrLevel == _pszLevelNames[iLevel])
+		{
+			level = OFstatic_cast(E_LogLevel, iLevel);
+			return OFTrue;
+		}
+	}
+	return OFFalse;
+}
+
+void AsyncLog::start(size_t nCapacity)
+{
+	if (m_pSlots)
+		return;
+	size_t nSlots = 2;
+	while (nSlots < nCapacity)
+		nSlots *= 2;
+	m_pSlots = new Slot[nSlots];
+	for (size_t iSlot = 0; iSlot < nSlots; iSlot++)
+		m_pSlots[iSlot].nSequence.store(iSlot, std::memory_order_relaxed);
+	m_nMask = nSlots - 1;
+	m_nEnqueue.store(0, std::memory_order_relaxed);
+	m_nDequeue = 0;
+	m_bStop = false;
+	m_sink = std::thread(&AsyncLog::sink, this);
+}
+
+void AsyncLog::stop()
+{
+	if (!m_pSlots)
+		return;
+	m_bStop = true;
+	m_cvRecords.notify_one();
+	m_sink.join();
+	delete[] m_pSlots;
+	m_pSlots = NULL;
+}
+
+void AsyncLog::write(E_LogLevel level, const OFString& ofstrText, const LogContext* pContext)
+{
+	if (!isEnabled(level))
+		return;
+
+	Record record;
+	record.level = level;
+	record.nTime = OFstatic_cast(Uint64, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+	record.strText = ofstrText.c_str();
+	while (!record.strText.empty() && (record.strText[record.strText.size() - 1] == '\n' || record.strText[record.strText.size() - 1] == '\r'))
+		record.strText.erase(record.strText.size() - 1);
+	if (pContext)
+	{
+		record.strFile = pContext->ofstrFile.c_str();
+		record.strUID = pContext->ofstrSOPInstanceUID.c_str();
+	}
+
+	if (!m_pSlots)
+	{
+		STD_NAMESPACE string strOut, strErr;
+		format(record, strOut, strErr);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		fwrite(strOut.data(), 1, strOut.size(), stdout);
+		fwrite(strErr.data(), 1, strErr.size(), stderr);
+		fflush(stdout);
+		return;
+	}
+	if (!push(record))
+		m_nDropped++;
+	else if (m_bIdle.load(std::memory_order_relaxed))
+		m_cvRecords.notify_one(); // without the mutex a wakeup may be missed; the sink then waits LOG_IDLE_WAIT_MS
+}
+
+void AsyncLog::writeLines(const STD_NAMESPACE string& strLines, const LogContext* pContext)
+{
+	size_t nStart = 0;
+	while (nStart < strLines.size())
+	{
+		size_t nEnd = strLines.find('\n', nStart);
+		if (nEnd == STD_NAMESPACE string::npos)
+			nEnd = strLines.size();
+		const STD_NAMESPACE string strLine(strLines, nStart, nEnd - nStart);
+		if (!strLine.empty())
+			write(LevelOfLine(strLine.c_str()), strLine.c_str(), pContext);
+		nStart = nEnd + 1;
+	}
+}
+
+// bounded queue after D. Vyukov: a slot is free for the producer at position n when its sequence is n,
+// and holds a record for the consumer when it is n+1. When the buffer is full, output, errors and
+// warnings wait for the sink; info and debug records are dropped (and counted) instead
+OFBool AsyncLog::push(Record& record)
+{
+	size_t nPos = m_nEnqueue.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		Slot& slot = m_pSlots[nPos & m_nMask];
+		const size_t nSequence = slot.nSequence.load(std::memory_order_acquire);
+		const ptrdiff_t nDiff = OFstatic_cast(ptrdiff_t, nSequence - nPos);
+		if (nDiff == 0)
+		{
+			if (m_nEnqueue.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed))
+			{
+				slot.record.level = record.level;
+				slot.record.nTime = record.nTime;
+				slot.record.strText.swap(record.strText);
+				slot.record.strFile.swap(record.strFile);
+				slot.record.strUID.swap(record.strUID);
+				slot.nSequence.store(nPos + 1, std::memory_order_release);
+				return OFTrue;
+			}
+		}
+		else if (nDiff < 0)
+		{
+			if (record.level >= ELL_info)
+				return OFFalse;
+			m_cvRecords.notify_one();
+			std::this_thread::yield();
+			nPos = m_nEnqueue.load(std::memory_order_relaxed);
+		}
+		else
+			nPos = m_nEnqueue.load(std::memory_order_relaxed);
+	}
+}
+
+OFBool AsyncLog::pop(Record& record)
+{
+	Slot& slot = m_pSlots[m_nDequeue & m_nMask];
+	if (slot.nSequence.load(std::memory_order_acquire) != m_nDequeue + 1)
+		return OFFalse;
+	record.level = slot.record.level;
+	record.nTime = slot.record.nTime;
+	record.strText.swap(slot.record.strText);
+	record.strFile.swap(slot.record.strFile);
+	record.strUID.swap(slot.record.strUID);
+	slot.nSequence.store(m_nDequeue + m_nMask + 1, std::memory_order_release);
+	m_nDequeue++;
+	return OFTrue;
+}
+
+void AsyncLog::format(const Record& record, STD_NAMESPACE string& strOut, STD_NAMESPACE string& strErr) const
+{
+	STD_NAMESPACE string& strTarget = record.level == ELL_error || record.level == ELL_warn ? strErr : strOut;
+	if (m_format == ELF_text)
+	{
+		strTarget += record.strText;
+		strTarget += '\n';
+		return;
+	}
+
+	// {"time":"2021-10-13T12:34:56.789012Z","level":"warn","file":"...","uid":"...","msg":"..."}
+	const time_t nSeconds = OFstatic_cast(time_t, record.nTime / 1000000);
+	struct tm tmTime;
+#ifdef _WIN32
+	gmtime_s(&tmTime, &nSeconds);
+#else
+	gmtime_r(&nSeconds, &tmTime);
+#endif
+	char bufTime[64];
+	snprintf(bufTime, sizeof(bufTime), "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06luZ\",\"level\":\"%s\"",
+		tmTime.tm_year + 1900, tmTime.tm_mon + 1, tmTime.tm_mday, tmTime.tm_hour, tmTime.tm_min, tmTime.tm_sec,
+		OFstatic_cast(unsigned long, record.nTime % 1000000), _pszLevelNames[record.level]);
+	strTarget += bufTime;
+	if (!record.strFile.empty())
+	{
+		strTarget += ",\"file\":";
+		AppendJsonString(strTarget, record.strFile);
+	}
+	if (!record.strUID.empty())
+	{
+		strTarget += ",\"uid\":";
+		AppendJsonString(strTarget, record.strUID);
+	}
+	// the level replaces the prefix of the text
+	size_t nSkip = 0;
+	if (record.level != ELL_output && record.level != ELL_debug)
+	{
+		const size_t nColon = record.strText.find(':');
+		if (nColon != STD_NAMESPACE string::npos && nColon < 6)
+			nSkip = record.strText.find_first_not_of(' ', nColon + 1);
+		if (nSkip == STD_NAMESPACE string::npos)
+			nSkip = record.strText.size();
+	}
+	strTarget += ",\"msg\":";
+	AppendJsonString(strTarget, record.strText.substr(nSkip));
+	strTarget += "}\n";
+}
+
+void AsyncLog::sink()
+{
+	Record record;
+	STD_NAMESPACE string strOut, strErr;
+	unsigned long nDroppedReported = 0;
+	for (;;)
+	{
+		// everything that was pushed before stop() is written before the thread ends
+		const bool bStop = m_bStop;
+		while (pop(record))
+		{
+			format(record, strOut, strErr);
+			if (strOut.size() + strErr.size() >= LOG_FLUSH_SIZE)
+			{
+				fwrite(strErr.data(), 1, strErr.size(), stderr);
+				fwrite(strOut.data(), 1, strOut.size(), stdout);
+				strOut.clear();
+				strErr.clear();
+			}
+		}
+		const unsigned long nDropped = m_nDropped;
+		if (nDropped != nDroppedReported)
+		{
+			Record dropped;
+			dropped.level = ELL_warn;
+			dropped.nTime = OFstatic_cast(Uint64, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+			char buf[96];
+			snprintf(buf, sizeof(buf), "WARN: log buffer full; %lu info/debug messages dropped", nDropped - nDroppedReported);
+			dropped.strText = buf;
+			format(dropped, strOut, strErr);
+			nDroppedReported = nDropped;
+		}
+		if (!strErr.empty())
+		{
+			fwrite(strErr.data(), 1, strErr.size(), stderr);
+			strErr.clear();
+		}
+		if (!strOut.empty())
+		{
+			fwrite(strOut.data(), 1, strOut.size(), stdout);
+			fflush(stdout);
+			strOut.clear();
+		}
+		if (bStop)
+			break;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_bIdle = true;
+		m_cvRecords.wait_for(lock, std::chrono::milliseconds(LOG_IDLE_WAIT_MS));
+		m_bIdle = false;
+	}
+}
+
+// the buffer is a member, so it is attached after the ostream base is constructed
+LogStream::LogStream(const LogContext& context)
+	: STD_NAMESPACE ostream(NULL), m_buffer(context)
+{
+	rdbuf(&m_buffer);
+}
+
+LogStream::~LogStream()
+{
+	m_buffer.writeLine();
+}
+
+void LogStream::LineBuffer::writeLine()
+{
+	AsyncLog::global().writeLines(m_strLine, &m_context);
+	m_strLine.clear();
+}
+
+LogStream::LineBuffer::int_type LogStream::LineBuffer::overflow(int_type c)
+{
+	if (traits_type::eq_int_type(c, traits_type::eof()))
+		return traits_type::not_eof(c);
+	m_strLine += traits_type::to_char_type(c);
+	if (c == '\n')
+		writeLine();
+	return c;
+}
+
+STD_NAMESPACE streamsize LogStream::LineBuffer::xsputn(const char* p, STD_NAMESPACE streamsize n)
+{
+	for (STD_NAMESPACE streamsize i = 0; i < n; i++)
+		overflow(traits_type::to_int_type(p[i]));
+	return n;
+}
@@ -0,0 +1,180 @@
+﻿// Log.h : leveled, asynchronous logging of the command line tool
+// Records are queued in a lock-free ring buffer and written by one sink thread, which flushes once per
+// batch of records instead of once per line; workers never wait for the console. Text output is the
+// same as before (errors and warnings on stderr, the rest on stdout); JSON output has one object per
+// line with time, level, file and SOPInstanceUID, so it can be filtered with grep or jq.
+// The library keeps writing its messages to ostreams; writeLines() turns them into records, with the
+// level taken from the prefix of every line (ERROR:, FAIL:, WARN:, INFO:; anything else is debug).
+// LogStream does the same line by line while they are written.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstream.h"
+#include "dcmtk/ofstd/ofstring.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum E_LogLevel
+{
+	ELL_output,		// RESULT, PROGRESS, STATS, ... lines; always written, never dropped
+	ELL_error,
+	ELL_warn,
+	ELL_info,
+	ELL_debug		// per-item details of -v
+};
+
+enum E_LogFormat
+{
+	ELF_text,
+	ELF_json
+};
+
+// the file a record is about
+struct LogContext
+{
+	LogContext() {}
+	LogContext(const OFString& ofstrPath, const OFString& ofstrUID = OFString()) : ofstrFile(ofstrPath), ofstrSOPInstanceUID(ofstrUID) {}
+
+	OFString ofstrFile;
+	OFString ofstrSOPInstanceUID;
+};
+
+class AsyncLog
+{
+public:
+	AsyncLog();
+	~AsyncLog(); // drains the buffer
+
+	// the log of the process
+	static AsyncLog& global();
+
+	// records below level are discarded; before start() records are written synchronously
+	void configure(E_LogLevel level, E_LogFormat format);
+	// start the sink thread with a buffer of nCapacity records (rounded up to a power of 2)
+	void start(size_t nCapacity);
+	// write everything that is buffered and stop the sink thread
+	void stop();
+
+	OFBool isEnabled(E_LogLevel level) const { return level <= m_level; }
+	static OFBool parseLevel(const OFString& ofstrLevel, E_LogLevel& level);
+
+	// one record; text without line end
+	void write(E_LogLevel level, const OFString& ofstrText, const LogContext* pContext = NULL);
+	// the lines a file's amendment wrote to its message stream, in order
+	void writeLines(const STD_NAMESPACE string& strLines, const LogContext* pContext = NULL);
+
+private:
+	struct Record
+	{
+		E_LogLevel level;
+		Uint64 nTime;				// microseconds since the epoch
+		STD_NAMESPACE string strText;
+		STD_NAMESPACE string strFile;
+		STD_NAMESPACE string strUID;
+	};
+	struct Slot
+	{
+		std::atomic<size_t> nSequence;
+		Record record;
+	};
+
+	AsyncLog(const AsyncLog&);
+	AsyncLog& operator=(const AsyncLog&);
+
+	OFBool push(Record& record);
+	OFBool pop(Record& record);
+	void format(const Record& record, STD_NAMESPACE string& strOut, STD_NAMESPACE string& strErr) const;
+	void sink();
+
+	E_LogLevel m_level;
+	E_LogFormat m_format;
+	Slot* m_pSlots;					// ring buffer (multiple producers, one consumer)
+	size_t m_nMask;
+	std::atomic<size_t> m_nEnqueue;
+	size_t m_nDequeue;				// sink thread only
+	std::atomic<unsigned long> m_nDropped;
+	std::atomic<bool> m_bStop;
+	std::atomic<bool> m_bIdle;		// the sink waits for records
+	std::mutex m_mutex;				// sink wakeup; synchronous writes
+	std::condition_variable m_cvRecords;
+	std::thread m_sink;
+};
+
+// one record built with <<, written when the statement ends; formatting is skipped for disabled levels:
+//   LogLine(ELL_warn) << "WARN: could not write metrics";
+class LogLine
+{
+public:
+	explicit LogLine(E_LogLevel level, const LogContext* pContext = NULL)
+		: m_level(level), m_pContext(pContext), m_bEnabled(AsyncLog::global().isEnabled(level)) {}
+	~LogLine()
+	{
+		if (m_bEnabled)
+			AsyncLog::global().write(m_level, m_stream.str().c_str(), m_pContext);
+	}
+
+	template <typename T> LogLine& operator<<(const T& value)
+	{
+		if (m_bEnabled)
+			m_stream << value;
+		return *this;
+	}
+	LogLine& operator<<(STD_NAMESPACE ostream& (*pManipulator)(STD_NAMESPACE ostream&))
+	{
+		if (m_bEnabled)
+			m_stream << pManipulator;
+		return *this;
+	}
+	LogLine& operator<<(STD_NAMESPACE ios_base& (*pManipulator)(STD_NAMESPACE ios_base&))
+	{
+		if (m_bEnabled)
+			m_stream << pManipulator;
+		return *this;
+	}
+
+private:
+	LogLine(const LogLine&);
+	LogLine& operator=(const LogLine&);
+
+	const E_LogLevel m_level;
+	const LogContext* m_pContext;
+	const OFBool m_bEnabled;
+	OFOStringStream m_stream;
+};
+
+// an ostream for the library's messages about one file that writes every line as a record as soon as
+// it ends (see writeLines()), so -v shows the progress of a single file instead of all of it at the end
+class LogStream : public STD_NAMESPACE ostream
+{
+public:
+	explicit LogStream(const LogContext& context);
+	~LogStream(); // writes an unterminated last line
+
+private:
+	class LineBuffer : public STD_NAMESPACE streambuf
+	{
+	public:
+		explicit LineBuffer(const LogContext& context) : m_context(context) {}
+		void writeLine();
+
+	protected:
+		virtual int_type overflow(int_type c);
+		virtual STD_NAMESPACE streamsize xsputn(const char* p, STD_NAMESPACE streamsize n);
+
+	private:
+		const LogContext m_context;
+		STD_NAMESPACE string m_strLine;
+	};
+
+	LogStream(const LogStream&);
+	LogStream& operator=(const LogStream&);
+
+	LineBuffer m_buffer;
+};
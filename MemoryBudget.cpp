@@ -0,0 +1,99 @@
+﻿// MemoryBudget.cpp : shared memory budget of the files in progress (see MemoryBudget.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "MemoryBudget.h"
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define TRIM_INTERVAL_SECONDS 10 // at most one trim per interval; it walks the whole heap
+
+MemoryBudget::MemoryBudget()
+	: m_nBudget(0), m_nReserved(0), m_nWaits(0), m_bReleased(OFFalse), m_tLastTrim(std::chrono::steady_clock::now())
+{
+}
+
+void MemoryBudget::configure(Uint64 nBudget)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_nBudget = nBudget;
+}
+
+Uint64 MemoryBudget::acquire(Uint64 nBytes)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_nBudget > 0)
+	{
+		if (nBytes > m_nBudget)
+			nBytes = m_nBudget; // runs alone
+		if (m_nReserved + nBytes > m_nBudget)
+		{
+			m_nWaits++;
+			while (m_nReserved + nBytes > m_nBudget)
+				m_cvReleased.wait(lock);
+		}
+	}
+	m_nReserved += nBytes;
+	return nBytes;
+}
+
+void MemoryBudget::release(Uint64 nBytes)
+{
+	OFBool bTrim;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_nReserved -= nBytes < m_nReserved ? nBytes : m_nReserved;
+		m_bReleased = OFTrue;
+		bTrim = claimTrim();
+	}
+	m_cvReleased.notify_all();
+	if (bTrim)
+		TrimHeap();
+}
+
+void MemoryBudget::trimIfIdle()
+{
+	OFBool bTrim;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		bTrim = m_bReleased && claimTrim();
+	}
+	if (bTrim)
+		TrimHeap();
+}
+
+OFBool MemoryBudget::claimTrim()
+{
+	const std::chrono::steady_clock::time_point tNow = std::chrono::steady_clock::now();
+	if (m_nReserved > 0 || tNow - m_tLastTrim < std::chrono::seconds(TRIM_INTERVAL_SECONDS))
+		return OFFalse;
+	m_tLastTrim = tNow;
+	m_bReleased = OFFalse;
+	return OFTrue;
+}
+
+Uint64 MemoryBudget::getReserved()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_nReserved;
+}
+
+unsigned long MemoryBudget::getWaits()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_nWaits;
+}
+
+Uint64 EstimateFileMemory(Uint64 nFileSize)
+{
+	return 2 * nFileSize + 1024 * 1024;
+}
+
+void TrimHeap()
+{
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+}
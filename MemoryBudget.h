@@ -0,0 +1,56 @@
+﻿// MemoryBudget.h : one limit on the memory of all files in progress, shared by the workers of the
+// batch, watch and crawl modes. A worker reserves an estimate for its file before it reads it and
+// waits while the reservations of the others would exceed the budget; a file that is larger than the
+// whole budget runs alone. Whenever nothing is reserved the freed heap is handed back to the system
+// (glibc keeps it otherwise), so the resident size of a long-running process follows its load.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstd.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+class MemoryBudget
+{
+public:
+	MemoryBudget();
+
+	void configure(Uint64 nBudget);		// bytes (0: unlimited; reservations are still counted)
+	Uint64 getBudget() const { return m_nBudget; }
+
+	// wait until nBytes fit and reserve them; returns the reserved amount, which must be released
+	Uint64 acquire(Uint64 nBytes);
+	void release(Uint64 nBytes);
+
+	// trim the heap if nothing is reserved and it wasn't trimmed since the last release, e.g. when a
+	// watch has been idle for a while (release() only trims when the interval has passed)
+	void trimIfIdle();
+
+	Uint64 getReserved();
+	unsigned long getWaits();			// acquisitions that had to wait
+
+private:
+	MemoryBudget(const MemoryBudget&);
+	MemoryBudget& operator=(const MemoryBudget&);
+	OFBool claimTrim(); // with m_mutex held
+
+	std::mutex m_mutex;
+	std::condition_variable m_cvReleased;
+	Uint64 m_nBudget;
+	Uint64 m_nReserved;
+	unsigned long m_nWaits;
+	OFBool m_bReleased;					// since the last trim
+	std::chrono::steady_clock::time_point m_tLastTrim;
+};
+
+// estimate of the memory it takes to amend a file of nFileSize bytes: the dataset in memory plus its
+// encoded output (or the input buffer of the pipeline), and the rest of the working data
+Uint64 EstimateFileMemory(Uint64 nFileSize);
+
+// hand freed heap memory back to the system, where the allocator supports it
+void TrimHeap();
@@ -0,0 +1,264 @@
+﻿// Metrics.cpp : per-stage timing and counters (see Metrics.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "Metrics.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+static const char* _stageNames[EMS_count] =
+{
+	"dictionary", "load_file", "load_all_data", "extract_tags", "scan_annotations", "insert_items", "save_file", "verify", "clone", "sync"
+};
+
+const char* MetricsStageName(int stage)
+{
+	return stage >= 0 && stage < EMS_count ? _stageNames[stage] : "unknown";
+}
+
+// CPU time of the calling thread in seconds, so parallel workers don't count each other's time
+static double ThreadCpuTime()
+{
+#ifdef _WIN32
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+	if (!GetThreadTimes(GetCurrentThread(), &ftCreation, &ftExit, &ftKernel, &ftUser))
+		return 0;
+	ULARGE_INTEGER kernel, user;
+	kernel.LowPart = ftKernel.dwLowDateTime; kernel.HighPart = ftKernel.dwHighDateTime;
+	user.LowPart = ftUser.dwLowDateTime; user.HighPart = ftUser.dwHighDateTime;
+	return (kernel.QuadPart + user.QuadPart) * 1e-7;
+#else
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+void ProcessMemory(Uint64& nResident, Uint64& nPeak)
+{
+	nResident = nPeak = 0;
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		nResident = counters.WorkingSetSize;
+		nPeak = counters.PeakWorkingSetSize;
+	}
+#else
+	// the second field of statm is the number of resident pages
+	FILE* pFile = fopen("/proc/self/statm", "r");
+	if (pFile)
+	{
+		unsigned long long nSize = 0, nPages = 0;
+		if (fscanf(pFile, "%llu %llu", &nSize, &nPages) == 2)
+			nResident = nPages * OFstatic_cast(Uint64, sysconf(_SC_PAGESIZE));
+		fclose(pFile);
+	}
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+#ifdef __APPLE__
+		nPeak = usage.ru_maxrss; // bytes
+#else
+		nPeak = OFstatic_cast(Uint64, usage.ru_maxrss) * 1024; // kB
+#endif
+#endif
+}
+
+FileMetrics::FileMetrics()
+	: nBytesRead(0), nBytesWritten(0)
+{
+	for (int iStage = 0; iStage < EMS_count; iStage++)
+	{
+		wall[iStage] = 0;
+		cpu[iStage] = 0;
+		calls[iStage] = 0;
+	}
+}
+
+void FileMetrics::add(const FileMetrics& other)
+{
+	for (int iStage = 0; iStage < EMS_count; iStage++)
+	{
+		wall[iStage] += other.wall[iStage];
+		cpu[iStage] += other.cpu[iStage];
+		calls[iStage] += other.calls[iStage];
+	}
+	nBytesRead += other.nBytesRead;
+	nBytesWritten += other.nBytesWritten;
+}
+
+StageTimer::StageTimer(FileMetrics* pMetrics, E_MetricsStage stage)
+	: m_pMetrics(pMetrics), m_stage(stage), m_dCpu(0)
+{
+	start();
+}
+
+void StageTimer::start()
+{
+	if (!m_pMetrics)
+		return;
+	m_tWall = std::chrono::steady_clock::now();
+	m_dCpu = ThreadCpuTime();
+}
+
+void StageTimer::stop()
+{
+	if (!m_pMetrics)
+		return;
+	m_pMetrics->wall[m_stage] += std::chrono::duration<double>(std::chrono::steady_clock::now() - m_tWall).count();
+	m_pMetrics->cpu[m_stage] += ThreadCpuTime() - m_dCpu;
+	m_pMetrics->calls[m_stage]++;
+	m_pMetrics = NULL;
+}
+
+void StageTimer::next(E_MetricsStage stage)
+{
+	FileMetrics* pMetrics = m_pMetrics;
+	stop();
+	m_pMetrics = pMetrics;
+	m_stage = stage;
+	start();
+}
+
+MetricsCollector::MetricsCollector()
+	: m_pJson(NULL), m_nResident(0), m_nPeakResident(0)
+{
+}
+
+MetricsCollector::~MetricsCollector()
+{
+	if (m_pJson)
+		fclose(m_pJson);
+}
+
+OFBool MetricsCollector::openJson(const OFString& ofstrFilename)
+{
+	m_pJson = fopen(ofstrFilename.c_str(), "a");
+	return m_pJson != NULL;
+}
+
+void MetricsCollector::setPrometheusFile(const OFString& ofstrFilename)
+{
+	m_ofstrPrometheusFile = ofstrFilename;
+}
+
+// file names may contain anything, so escape them for a JSON string
+static void WriteJsonString(FILE* pFile, const OFString& ofstrValue)
+{
+	fputc('"', pFile);
+	for (size_t i = 0; i < ofstrValue.length(); i++)
+	{
+		const unsigned char c = OFstatic_cast(unsigned char, ofstrValue[i]);
+		if (c == '"' || c == '\\')
+			fprintf(pFile, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(pFile, "\\u%04x", c);
+		else
+			fputc(c, pFile);
+	}
+	fputc('"', pFile);
+}
+
+void MetricsCollector::add(const OFString& ofstrInputFile, int iResult, const FileMetrics& metrics)
+{
+	Uint64 nResident, nPeak;
+	ProcessMemory(nResident, nPeak);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_totals.add(metrics);
+	m_results[iResult]++;
+	m_nResident = nResident;
+	m_nPeakResident = nPeak;
+
+	if (!m_pJson)
+		return;
+	// one line per file; lines are only flushed by flush() or when the buffer is full
+	fputs("{\"file\":", m_pJson);
+	WriteJsonString(m_pJson, ofstrInputFile);
+	fprintf(m_pJson, ",\"result\":%d,\"bytes_read\":%llu,\"bytes_written\":%llu,\"rss_bytes\":%llu,\"stages\":{", iResult,
+		OFstatic_cast(unsigned long long, metrics.nBytesRead), OFstatic_cast(unsigned long long, metrics.nBytesWritten),
+		OFstatic_cast(unsigned long long, nResident));
+	OFBool bFirst = OFTrue;
+	for (int iStage = 0; iStage < EMS_count; iStage++)
+	{
+		if (!metrics.calls[iStage])
+			continue;
+		fprintf(m_pJson, "%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f}", bFirst ? "" : ",", _stageNames[iStage], metrics.wall[iStage], metrics.cpu[iStage]);
+		bFirst = OFFalse;
+	}
+	fputs("}}\n", m_pJson);
+}
+
+void MetricsCollector::addProcess(const FileMetrics& metrics)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_totals.add(metrics);
+}
+
+OFBool MetricsCollector::flush()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	OFBool bResult = OFTrue;
+	if (m_pJson && fflush(m_pJson) != 0)
+		bResult = OFFalse;
+	if (!m_ofstrPrometheusFile.empty() && !writePrometheus())
+		bResult = OFFalse;
+	return bResult;
+}
+
+// the textfile collector may read at any moment, so write a temporary file and rename it
+OFBool MetricsCollector::writePrometheus()
+{
+	const OFString ofstrTemp = m_ofstrPrometheusFile + ".tmp";
+	FILE* pFile = fopen(ofstrTemp.c_str(), "w");
+	if (!pFile)
+		return OFFalse;
+
+	fputs("# HELP amendecg_stage_wall_seconds_total Wall time spent per stage.\n"
+		"# TYPE amendecg_stage_wall_seconds_total counter\n", pFile);
+	for (int iStage = 0; iStage < EMS_count; iStage++)
+		fprintf(pFile, "amendecg_stage_wall_seconds_total{stage=\"%s\"} %.6f\n", _stageNames[iStage], m_totals.wall[iStage]);
+	fputs("# HELP amendecg_stage_cpu_seconds_total CPU time spent per stage.\n"
+		"# TYPE amendecg_stage_cpu_seconds_total counter\n", pFile);
+	for (int iStage = 0; iStage < EMS_count; iStage++)
+		fprintf(pFile, "amendecg_stage_cpu_seconds_total{stage=\"%s\"} %.6f\n", _stageNames[iStage], m_totals.cpu[iStage]);
+	fputs("# HELP amendecg_stage_calls_total Number of times a stage was run.\n"
+		"# TYPE amendecg_stage_calls_total counter\n", pFile);
+	for (int iStage = 0; iStage < EMS_count; iStage++)
+		fprintf(pFile, "amendecg_stage_calls_total{stage=\"%s\"} %lu\n", _stageNames[iStage], OFstatic_cast(unsigned long, m_totals.calls[iStage]));
+	fprintf(pFile, "# HELP amendecg_read_bytes_total Size of all inputs.\n"
+		"# TYPE amendecg_read_bytes_total counter\n"
+		"amendecg_read_bytes_total %llu\n", OFstatic_cast(unsigned long long, m_totals.nBytesRead));
+	fprintf(pFile, "# HELP amendecg_written_bytes_total Size of all outputs and clones.\n"
+		"# TYPE amendecg_written_bytes_total counter\n"
+		"amendecg_written_bytes_total %llu\n", OFstatic_cast(unsigned long long, m_totals.nBytesWritten));
+	fputs("# HELP amendecg_files_total Number of files per result code.\n"
+		"# TYPE amendecg_files_total counter\n", pFile);
+	for (STD_NAMESPACE map<int, Uint64>::const_iterator it = m_results.begin(); it != m_results.end(); ++it)
+		fprintf(pFile, "amendecg_files_total{result=\"%d\"} %llu\n", it->first, OFstatic_cast(unsigned long long, it->second));
+	fprintf(pFile, "# HELP amendecg_resident_bytes Resident set size after the last file.\n"
+		"# TYPE amendecg_resident_bytes gauge\n"
+		"amendecg_resident_bytes %llu\n", OFstatic_cast(unsigned long long, m_nResident));
+	fprintf(pFile, "# HELP amendecg_resident_peak_bytes Peak resident set size of the process.\n"
+		"# TYPE amendecg_resident_peak_bytes gauge\n"
+		"amendecg_resident_peak_bytes %llu\n", OFstatic_cast(unsigned long long, m_nPeakResident));
+
+	const OFBool bWritten = fclose(pFile) == 0;
+	if (!bWritten)
+	{
+		OFStandard::deleteFile(ofstrTemp);
+		return OFFalse;
+	}
+#ifdef _WIN32
+	OFStandard::deleteFile(m_ofstrPrometheusFile); // rename doesn't replace an existing file on Windows
+#endif
+	return OFStandard::renameFile(ofstrTemp, m_ofstrPrometheusFile);
+}
@@ -0,0 +1,98 @@
+﻿// Metrics.h : per-stage wall/CPU timing and per-file counters, written as JSON lines and/or
+// a Prometheus textfile-collector file. When disabled no clocks are read at all.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/ofstd/ofstream.h"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+
+// the measured stages of amending a file
+enum E_MetricsStage
+{
+	EMS_dictionary,			// loading the data dictionary (once per process)
+	EMS_loadFile,
+	EMS_loadAllData,
+	EMS_extractTags,		// SOP class, source tags and waveform sequence
+	EMS_scanAnnotations,	// existing waveform annotation items
+	EMS_insertItems,
+	EMS_saveFile,			// including --splice
+	EMS_verify,				// --verify: content digests of input and output
+	EMS_clone,
+	EMS_sync,				// fsync and rename of the output (see OutputCommit.h), including waiting for the group
+	EMS_count
+};
+
+const char* MetricsStageName(int stage);
+
+// resident set size of the process in bytes, and its peak so far; 0 where unknown
+void ProcessMemory(Uint64& nResident, Uint64& nPeak);
+
+// measurements of one file (or of the process for EMS_dictionary)
+struct FileMetrics
+{
+	FileMetrics();
+	void add(const FileMetrics& other);
+
+	double wall[EMS_count];	// seconds
+	double cpu[EMS_count];	// seconds of CPU time of the measuring thread
+	Uint32 calls[EMS_count];
+	Uint64 nBytesRead;		// size of the input
+	Uint64 nBytesWritten;	// size of the output or the clone
+};
+
+// adds the time between construction and stop() (or destruction) to one stage; a NULL pMetrics disables it
+class StageTimer
+{
+public:
+	StageTimer(FileMetrics* pMetrics, E_MetricsStage stage);
+	~StageTimer() { stop(); }
+
+	void stop();
+	void next(E_MetricsStage stage); // stop the current stage and start measuring another one
+
+private:
+	StageTimer(const StageTimer&);
+	StageTimer& operator=(const StageTimer&);
+	void start();
+
+	FileMetrics* m_pMetrics;
+	E_MetricsStage m_stage;
+	std::chrono::steady_clock::time_point m_tWall;
+	double m_dCpu;
+};
+
+// collects the measurements of all files; add() may be called from any worker thread
+class MetricsCollector
+{
+public:
+	MetricsCollector();
+	~MetricsCollector();
+
+	OFBool openJson(const OFString& ofstrFilename);				// append one JSON line per file
+	void setPrometheusFile(const OFString& ofstrFilename);		// rewritten (atomically) by flush()
+	OFBool isEnabled() const { return m_pJson != NULL || !m_ofstrPrometheusFile.empty(); }
+
+	void add(const OFString& ofstrInputFile, int iResult, const FileMetrics& metrics);
+	void addProcess(const FileMetrics& metrics);	// stages that are not part of a single file
+	OFBool flush();
+
+private:
+	MetricsCollector(const MetricsCollector&);
+	MetricsCollector& operator=(const MetricsCollector&);
+	OFBool writePrometheus();
+
+	std::mutex m_mutex;
+	FILE* m_pJson;
+	OFString m_ofstrPrometheusFile;
+	FileMetrics m_totals;
+	Uint64 m_nResident;		// after the last file
+	Uint64 m_nPeakResident;
+	STD_NAMESPACE map<int, Uint64> m_results;	// number of files per RESULT_* code
+};
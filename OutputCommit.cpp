@@ -0,0 +1,252 @@
+﻿// OutputCommit.cpp : crash-safe replacement of output files (see OutputCommit.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "OutputCommit.h"
+
+#include <atomic>
+#include <set>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+OFBool ParseSyncMode(const OFString& ofstrMode, E_SyncMode& mode)
+{
+	if (ofstrMode == "none") mode = ESM_none;
+	else if (ofstrMode == "file") mode = ESM_file;
+	else if (ofstrMode == "group") mode = ESM_group;
+	else if (ofstrMode == "syncfs") mode = ESM_syncfs;
+	else return OFFalse;
+	return OFTrue;
+}
+
+const char* SyncModeName(E_SyncMode mode)
+{
+	switch (mode)
+	{
+	case ESM_file: return "file";
+	case ESM_group: return "group";
+	case ESM_syncfs: return "syncfs";
+	default: return "none";
+	}
+}
+
+OFString MakeTempOutputName(const OFString& ofstrOutputFile)
+{
+	static std::atomic<unsigned long> _nTemp(0);
+	OFString ofstrDir, ofstrFilename, ofstrTempFile;
+	OFStandard::getDirNameFromPath(ofstrDir, ofstrOutputFile, OFFalse); // empty for a bare file name
+	OFStandard::getFilenameFromPath(ofstrFilename, ofstrOutputFile);
+	char szSuffix[64];
+#ifdef _WIN32
+	sprintf(szSuffix, ".%lu.%lu.tmp", OFstatic_cast(unsigned long, GetCurrentProcessId()), _nTemp++);
+#else
+	sprintf(szSuffix, ".%lu.%lu.tmp", OFstatic_cast(unsigned long, getpid()), _nTemp++);
+#endif
+	// hidden, so watchers and scanners of the output directory ignore it
+	const OFString ofstrTempName = "." + ofstrFilename + szSuffix;
+	if (ofstrDir.empty())
+		return ofstrTempName;
+	OFStandard::combineDirAndFilename(ofstrTempFile, ofstrDir, ofstrTempName, OFTrue);
+	return ofstrTempFile;
+}
+
+// an existing destination passes its mode and, as far as permitted, its owner and group on to the file
+// that replaces it (a new file would get the umask default); on Windows the directory's ACLs are inherited
+static void KeepOutputAttributes(const OFString& ofstrTempFile, const OFString& ofstrOutputFile)
+{
+#ifndef _WIN32
+	struct stat st;
+	if (stat(ofstrOutputFile.c_str(), &st) != 0)
+		return;
+	// only a privileged process can give the file away; otherwise the group is kept if we are a member.
+	// chown first, as it may clear the set-user-ID and set-group-ID bits
+	if (chown(ofstrTempFile.c_str(), st.st_uid, st.st_gid) != 0 && chown(ofstrTempFile.c_str(), OFstatic_cast(uid_t, -1), st.st_gid) != 0)
+		st.st_mode &= ~OFstatic_cast(mode_t, S_ISGID);
+	chmod(ofstrTempFile.c_str(), st.st_mode & 07777);
+#else
+	(void)ofstrTempFile;
+	(void)ofstrOutputFile;
+#endif
+}
+
+static OFBool RenameOutputFile(const OFString& ofstrTempFile, const OFString& ofstrOutputFile)
+{
+#ifdef _WIN32
+	const OFBool bRenamed = MoveFileExA(ofstrTempFile.c_str(), ofstrOutputFile.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	const OFBool bRenamed = rename(ofstrTempFile.c_str(), ofstrOutputFile.c_str()) == 0;
+#endif
+	if (!bRenamed)
+		OFStandard::deleteFile(ofstrTempFile);
+	return bRenamed;
+}
+
+OFBool ReplaceOutputFile(const OFString& ofstrTempFile, const OFString& ofstrOutputFile)
+{
+	KeepOutputAttributes(ofstrTempFile, ofstrOutputFile);
+	return RenameOutputFile(ofstrTempFile, ofstrOutputFile);
+}
+
+static OFBool SyncFile(const OFString& ofstrFile)
+{
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(ofstrFile.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return OFFalse;
+	const OFBool bSynced = FlushFileBuffers(hFile) != 0;
+	CloseHandle(hFile);
+	return bSynced;
+#else
+	const int fd = open(ofstrFile.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return OFFalse;
+	const OFBool bSynced = fsync(fd) == 0;
+	close(fd);
+	return bSynced;
+#endif
+}
+
+// the directory entries (i.e. the renames); NTFS journals them without being asked
+static void SyncDirectory(const OFString& ofstrDir)
+{
+#ifndef _WIN32
+	const int fd = open(ofstrDir.empty() ? "." : ofstrDir.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		fsync(fd);
+		close(fd);
+	}
+#else
+	(void)ofstrDir;
+#endif
+}
+
+// everything written to the file system that holds ofstrDir
+static OFBool SyncFileSystem(const OFString& ofstrDir)
+{
+#ifdef __linux__
+	const int fd = open(ofstrDir.empty() ? "." : ofstrDir.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return OFFalse;
+	const OFBool bSynced = syncfs(fd) == 0;
+	close(fd);
+	return bSynced;
+#else
+	(void)ofstrDir;
+	return OFFalse;
+#endif
+}
+
+OutputCommitter::OutputCommitter()
+	: m_mode(ESM_none), m_nGroupFiles(1), m_groupWait(0), m_bCommitting(OFFalse)
+{
+}
+
+void OutputCommitter::configure(E_SyncMode mode, size_t nGroupFiles, unsigned int nGroupMillis)
+{
+	m_mode = mode;
+	m_nGroupFiles = nGroupFiles ? nGroupFiles : 1;
+	m_groupWait = std::chrono::milliseconds(nGroupMillis);
+}
+
+OFBool OutputCommitter::commit(const OFString& ofstrTempFile, const OFString& ofstrOutputFile)
+{
+	Pending pending;
+	pending.ofstrTempFile = ofstrTempFile;
+	pending.ofstrOutputFile = ofstrOutputFile;
+	pending.bDone = pending.bCommitted = OFFalse;
+	KeepOutputAttributes(ofstrTempFile, ofstrOutputFile); // before any sync, so the attributes are durable with the data
+
+	OFVector<Pending*> group;
+	if (m_mode == ESM_none || m_mode == ESM_file)
+	{
+		group.push_back(&pending);
+		commitGroup(group);
+		return pending.bCommitted;
+	}
+
+	// the data is synced by the worker, in parallel with the others; the group only shares the renames
+	// and the directory syncs
+	if (m_mode == ESM_group && !SyncFile(ofstrTempFile))
+	{
+		OFStandard::deleteFile(ofstrTempFile);
+		return OFFalse;
+	}
+
+	// the first waiting thread that finds the group complete commits it for all others
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_pending.empty())
+		m_tOldest = std::chrono::steady_clock::now();
+	m_pending.push_back(&pending);
+	if (m_pending.size() >= m_nGroupFiles)
+		m_cvDone.notify_all();
+	while (!pending.bDone)
+	{
+		if (!m_bCommitting && !m_pending.empty()
+			&& (m_pending.size() >= m_nGroupFiles || std::chrono::steady_clock::now() >= m_tOldest + m_groupWait))
+		{
+			group.swap(m_pending);
+			m_bCommitting = OFTrue;
+			lock.unlock();
+			commitGroup(group);
+			lock.lock();
+			for (size_t iPending = 0; iPending < group.size(); iPending++)
+				group[iPending]->bDone = OFTrue;
+			group.clear();
+			m_bCommitting = OFFalse;
+			if (!m_pending.empty())
+				m_tOldest = std::chrono::steady_clock::now(); // they waited for the commit; don't let them wait longer
+			m_cvDone.notify_all();
+		}
+		else if (m_bCommitting || m_pending.empty())
+			m_cvDone.wait(lock);
+		else
+			m_cvDone.wait_until(lock, m_tOldest + m_groupWait);
+	}
+	return pending.bCommitted;
+}
+
+// data first, then the renames, then the directories; an output is never visible before its data is durable
+void OutputCommitter::commitGroup(OFVector<Pending*>& group)
+{
+	STD_NAMESPACE set<OFString> dirs;
+	for (size_t iPending = 0; iPending < group.size(); iPending++)
+	{
+		OFString ofstrDir;
+		OFStandard::getDirNameFromPath(ofstrDir, group[iPending]->ofstrOutputFile, OFFalse);
+		dirs.insert(ofstrDir); // empty: the current directory
+	}
+
+	OFBool bFileSystemSynced = OFFalse;
+	if (m_mode == ESM_syncfs)
+	{
+		// one syncfs() per directory is at most one per file system in practice; fall back to fsync per output
+		bFileSystemSynced = OFTrue;
+		for (STD_NAMESPACE set<OFString>::const_iterator it = dirs.begin(); it != dirs.end() && bFileSystemSynced; ++it)
+			bFileSystemSynced = SyncFileSystem(*it);
+	}
+
+	for (size_t iPending = 0; iPending < group.size(); iPending++)
+	{
+		Pending& pending = *group[iPending];
+		const OFBool bSynced = m_mode == ESM_none || m_mode == ESM_group || bFileSystemSynced;
+		if (!bSynced && !SyncFile(pending.ofstrTempFile))
+		{
+			OFStandard::deleteFile(pending.ofstrTempFile);
+			continue;
+		}
+		pending.bCommitted = RenameOutputFile(pending.ofstrTempFile, pending.ofstrOutputFile);
+	}
+
+	if (m_mode != ESM_none)
+	{
+		for (STD_NAMESPACE set<OFString>::const_iterator it = dirs.begin(); it != dirs.end(); ++it)
+			SyncDirectory(*it);
+	}
+}
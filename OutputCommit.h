@@ -0,0 +1,74 @@
+﻿// OutputCommit.h : crash-safe replacement of output files. Outputs are written to a temporary file
+// in the destination directory and renamed over the destination, so a crash never leaves a partial
+// output (nor destroys the original of an in-place amendment). How durable the result is when the
+// rename is done is selectable; group modes let the outputs of parallel workers share the syncs.
+// A replaced file keeps its mode, and its owner and group as far as permitted, but the output is a
+// new inode: hard links to the old file (and open descriptors) keep the old content.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/ofstd/ofvector.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+enum E_SyncMode
+{
+	ESM_none,		// rename only; survives a crash of the process, not of the system
+	ESM_file,		// fsync every output before it is renamed, and its directory after
+	ESM_group,		// every worker fsyncs its own output; a group of outputs shares the renames and one fsync per directory
+	ESM_syncfs		// a group of outputs shares one syncfs() per file system instead of an fsync per output (Linux;
+					// elsewhere, or when syncfs() fails, the committing thread fsyncs each output)
+};
+
+OFBool ParseSyncMode(const OFString& ofstrMode, E_SyncMode& mode);
+const char* SyncModeName(E_SyncMode mode);
+
+// a unique name next to ofstrOutputFile, so the rename never crosses file systems
+OFString MakeTempOutputName(const OFString& ofstrOutputFile);
+
+// rename ofstrTempFile over ofstrOutputFile without any sync, with the attributes of an existing
+// ofstrOutputFile; the temporary file is removed on failure
+OFBool ReplaceOutputFile(const OFString& ofstrTempFile, const OFString& ofstrOutputFile);
+
+// commits the outputs of all workers; commit() may be called from any thread
+class OutputCommitter
+{
+public:
+	OutputCommitter();
+
+	// a group is synced when nGroupFiles outputs are waiting, or when the oldest has waited nGroupMillis
+	void configure(E_SyncMode mode, size_t nGroupFiles, unsigned int nGroupMillis);
+	E_SyncMode getMode() const { return m_mode; }
+
+	// make ofstrTempFile durable as configured and rename it over ofstrOutputFile; returns when that
+	// is done (in group modes: when its group is done). The temporary file is removed on failure.
+	OFBool commit(const OFString& ofstrTempFile, const OFString& ofstrOutputFile);
+
+private:
+	OutputCommitter(const OutputCommitter&);
+	OutputCommitter& operator=(const OutputCommitter&);
+
+	struct Pending
+	{
+		OFString ofstrTempFile;
+		OFString ofstrOutputFile;
+		OFBool bDone;
+		OFBool bCommitted;
+	};
+	void commitGroup(OFVector<Pending*>& group);
+
+	E_SyncMode m_mode;
+	size_t m_nGroupFiles;
+	std::chrono::milliseconds m_groupWait;
+	std::mutex m_mutex;
+	std::condition_variable m_cvDone;
+	OFVector<Pending*> m_pending;
+	std::chrono::steady_clock::time_point m_tOldest;	// when the first of m_pending was added
+	OFBool m_bCommitting;								// a thread is syncing a group
+};
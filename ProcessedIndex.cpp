@@ -0,0 +1,530 @@
+﻿// ProcessedIndex.cpp : persistent index of processed inputs (see ProcessedIndex.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "ProcessedIndex.h"
+
+#include "dcmtk/ofstd/offile.h"
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// record: path hash, size, mtime, UID hash (8 bytes each), result and check (4 bytes each);
+// the same layout is used for the slots of the table (path hash 0: empty slot)
+#define INDEX_RECORD_SIZE 40
+#define INDEX_HEADER_SIZE 32	// magic, capacity, count, covered log size
+#define INDEX_MIN_CAPACITY 1024
+#define INDEX_MIN_TAIL 1024		// the table is rebuilt when the tail has this many entries and 1/8 of the table
+#define INDEX_READ_RECORDS 4096
+
+static const char _szIndexMagic[8] = "AECGIX1";
+
+static Uint64 Fnv1a(const void* pData, size_t nLength)
+{
+	const Uint8* p = OFstatic_cast(const Uint8*, pData);
+	Uint64 nHash = 14695981039346656037ULL;
+	for (size_t i = 0; i < nLength; i++)
+	{
+		nHash ^= p[i];
+		nHash *= 1099511628211ULL;
+	}
+	return nHash;
+}
+
+static void PutUint64(Uint8* p, Uint64 n)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = OFstatic_cast(Uint8, n >> (8 * i));
+}
+
+static Uint64 GetUint64(const Uint8* p)
+{
+	Uint64 n = 0;
+	for (int i = 7; i >= 0; i--)
+		n = (n << 8) | p[i];
+	return n;
+}
+
+static void PutUint32(Uint8* p, Uint32 n)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = OFstatic_cast(Uint8, n >> (8 * i));
+}
+
+static Uint32 GetUint32(const Uint8* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (OFstatic_cast(Uint32, p[3]) << 24);
+}
+
+static void EncodeRecord(Uint8* p, Uint64 nKey, const ProcessedEntry& entry)
+{
+	PutUint64(p, nKey);
+	PutUint64(p + 8, entry.nSize);
+	PutUint64(p + 16, entry.nMTime);
+	PutUint64(p + 24, entry.nUIDHash);
+	PutUint32(p + 32, OFstatic_cast(Uint32, entry.iResult));
+	PutUint32(p + 36, OFstatic_cast(Uint32, Fnv1a(p, 36))); // detects torn or zeroed records
+}
+
+// false for empty slots and records that were not completely written
+static OFBool DecodeRecord(const Uint8* p, Uint64& nKey, ProcessedEntry& entry)
+{
+	nKey = GetUint64(p);
+	if (nKey == 0 || GetUint32(p + 36) != OFstatic_cast(Uint32, Fnv1a(p, 36)))
+		return OFFalse;
+	entry.nSize = GetUint64(p + 8);
+	entry.nMTime = GetUint64(p + 16);
+	entry.nUIDHash = GetUint64(p + 24);
+	entry.iResult = OFstatic_cast(Sint32, GetUint32(p + 32));
+	return OFTrue;
+}
+
+// writable memory mapping of a new file of a fixed size; the table while it is rebuilt
+class MappedOutput
+{
+public:
+	MappedOutput()
+		: m_pData(NULL)
+#ifdef _WIN32
+		, m_hFile(INVALID_HANDLE_VALUE), m_hMapping(NULL)
+#else
+		, m_nSize(0), m_fd(-1)
+#endif
+	{
+	}
+	~MappedOutput() { close(); }
+
+	OFBool create(const OFString& ofstrFilename, Uint64 nSize)
+	{
+#ifdef _WIN32
+		m_hFile = CreateFileA(ofstrFilename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return OFFalse;
+		m_hMapping = CreateFileMappingA(m_hFile, NULL, PAGE_READWRITE, OFstatic_cast(DWORD, nSize >> 32), OFstatic_cast(DWORD, nSize), NULL);
+		if (m_hMapping)
+			m_pData = OFstatic_cast(Uint8*, MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, 0));
+#else
+		m_fd = ::open(ofstrFilename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (m_fd < 0 || ftruncate(m_fd, OFstatic_cast(off_t, nSize)) != 0)
+			return OFFalse;
+		void* pData = mmap(NULL, OFstatic_cast(size_t, nSize), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+		if (pData != MAP_FAILED)
+		{
+			m_pData = OFstatic_cast(Uint8*, pData);
+			m_nSize = OFstatic_cast(size_t, nSize);
+		}
+#endif
+		return m_pData != NULL; // a new file reads as zeros: all slots are empty
+	}
+
+	OFBool close()
+	{
+		OFBool bGood = OFTrue;
+#ifdef _WIN32
+		if (m_pData)
+			bGood = UnmapViewOfFile(m_pData) != 0;
+		if (m_hMapping)
+			CloseHandle(m_hMapping);
+		if (m_hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(m_hFile);
+		m_hMapping = NULL;
+		m_hFile = INVALID_HANDLE_VALUE;
+#else
+		if (m_pData)
+			bGood = munmap(m_pData, m_nSize) == 0;
+		if (m_fd >= 0)
+			bGood = ::close(m_fd) == 0 && bGood;
+		m_nSize = 0;
+		m_fd = -1;
+#endif
+		m_pData = NULL;
+		return bGood;
+	}
+
+	Uint8* data() { return m_pData; }
+
+private:
+	MappedOutput(const MappedOutput&);
+	MappedOutput& operator=(const MappedOutput&);
+
+	Uint8* m_pData;
+#ifdef _WIN32
+	HANDLE m_hFile;
+	HANDLE m_hMapping;
+#else
+	size_t m_nSize;
+	int m_fd;
+#endif
+};
+
+ProcessedEntry::ProcessedEntry()
+	: nSize(0), nMTime(0), nUIDHash(0), iResult(0)
+{
+}
+
+ProcessedIndex::ProcessedIndex()
+	: m_bOpen(OFFalse), m_bRebuilding(OFFalse), m_nTableCapacity(0), m_nTableCount(0), m_nTableLogOffset(0), m_nRetryTail(0)
+#ifdef _WIN32
+	, m_hLog(INVALID_HANDLE_VALUE)
+#else
+	, m_fdLog(-1)
+#endif
+{
+}
+
+ProcessedIndex::~ProcessedIndex()
+{
+	close();
+}
+
+Uint64 ProcessedIndex::hash(const OFString& ofstr)
+{
+	const Uint64 nHash = Fnv1a(ofstr.c_str(), ofstr.length());
+	return nHash ? nHash : 1;
+}
+
+OFBool ProcessedIndex::statFile(const OFString& ofstrPath, Uint64& nSize, Uint64& nMTime)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(ofstrPath.c_str(), &st) != 0)
+		return OFFalse;
+	nMTime = OFstatic_cast(Uint64, st.st_mtime) * 1000000000ULL;
+#else
+	struct stat st;
+	if (stat(ofstrPath.c_str(), &st) != 0)
+		return OFFalse;
+#ifdef __APPLE__
+	nMTime = OFstatic_cast(Uint64, st.st_mtimespec.tv_sec) * 1000000000ULL + st.st_mtimespec.tv_nsec;
+#else
+	nMTime = OFstatic_cast(Uint64, st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec;
+#endif
+#endif
+	nSize = OFstatic_cast(Uint64, st.st_size);
+	return OFTrue;
+}
+
+OFBool ProcessedIndex::open(const OFString& ofstrFilename)
+{
+	close();
+	m_ofstrFilename = ofstrFilename;
+	m_ofstrLogFilename = ofstrFilename + ".log";
+#ifdef _WIN32
+	// FILE_APPEND_DATA makes every WriteFile an atomic append, also between processes
+	m_hLog = CreateFileA(m_ofstrLogFilename.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hLog == INVALID_HANDLE_VALUE)
+		return OFFalse;
+#else
+	m_fdLog = ::open(m_ofstrLogFilename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (m_fdLog < 0)
+		return OFFalse;
+#endif
+
+	// a crash may have left part of a record; pad it, so the next appends are aligned again
+	const Uint64 nLogSize = OFStandard::getFileSize(m_ofstrLogFilename);
+	if (nLogSize % INDEX_RECORD_SIZE)
+	{
+		Uint8 padding[INDEX_RECORD_SIZE] = { 0 };
+		const size_t nPadding = OFstatic_cast(size_t, INDEX_RECORD_SIZE - nLogSize % INDEX_RECORD_SIZE);
+#ifdef _WIN32
+		DWORD nWritten = 0;
+		WriteFile(m_hLog, padding, OFstatic_cast(DWORD, nPadding), &nWritten, NULL);
+#else
+		if (write(m_fdLog, padding, nPadding) != OFstatic_cast(ssize_t, nPadding))
+		{
+			close();
+			return OFFalse;
+		}
+#endif
+	}
+
+	if (!load())
+	{
+		close();
+		return OFFalse;
+	}
+	m_bOpen = OFTrue;
+	return OFTrue;
+}
+
+// map the table (if it is usable) and read the part of the log that it doesn't cover
+OFBool ProcessedIndex::load()
+{
+	Uint64 nLogOffset = 0;
+	m_table.close();
+	m_tail.clear();
+	m_nTableCapacity = m_nTableCount = m_nTableLogOffset = 0;
+	if (m_table.open(m_ofstrFilename) && m_table.size() >= INDEX_HEADER_SIZE && memcmp(m_table.data(), _szIndexMagic, sizeof(_szIndexMagic)) == 0)
+	{
+		const Uint8* p = m_table.data();
+		const Uint64 nCapacity = GetUint64(p + 8);
+		if (nCapacity && !(nCapacity & (nCapacity - 1)) && m_table.size() == INDEX_HEADER_SIZE + nCapacity * INDEX_RECORD_SIZE)
+		{
+			m_nTableCapacity = nCapacity;
+			m_nTableCount = GetUint64(p + 16);
+			nLogOffset = GetUint64(p + 24);
+		}
+	}
+	if (!m_nTableCapacity)
+		m_table.close(); // missing or damaged: the log has everything
+
+	Uint64 nLogSize = OFStandard::getFileSize(m_ofstrLogFilename);
+	nLogSize -= nLogSize % INDEX_RECORD_SIZE;
+	if (nLogOffset > nLogSize)
+	{
+		// the log was replaced or truncated, so the table is stale
+		m_table.close();
+		m_nTableCapacity = m_nTableCount = 0;
+		nLogOffset = 0;
+	}
+	m_nTableLogOffset = nLogOffset;
+	return readLog(nLogOffset, nLogSize);
+}
+
+OFBool ProcessedIndex::readLog(Uint64 nFrom, Uint64 nTo)
+{
+	if (nFrom >= nTo)
+		return OFTrue;
+	OFFile file;
+	if (!file.fopen(m_ofstrLogFilename, "rb") || file.fseek(OFstatic_cast(offile_off_t, nFrom), SEEK_SET) != 0)
+		return OFFalse;
+
+	OFVector<Uint8> buffer(INDEX_READ_RECORDS * INDEX_RECORD_SIZE);
+	while (nFrom < nTo)
+	{
+		size_t nRecords = INDEX_READ_RECORDS;
+		if ((nTo - nFrom) / INDEX_RECORD_SIZE < nRecords)
+			nRecords = OFstatic_cast(size_t, (nTo - nFrom) / INDEX_RECORD_SIZE);
+		if (file.fread(&buffer[0], INDEX_RECORD_SIZE, nRecords) != nRecords)
+			return OFFalse;
+		for (size_t iRecord = 0; iRecord < nRecords; iRecord++)
+		{
+			Uint64 nKey;
+			ProcessedEntry entry;
+			if (DecodeRecord(&buffer[iRecord * INDEX_RECORD_SIZE], nKey, entry))
+				m_tail[nKey] = entry; // later records win
+		}
+		nFrom += nRecords * INDEX_RECORD_SIZE;
+	}
+	return OFTrue;
+}
+
+void ProcessedIndex::close()
+{
+	// nothing else runs concurrently
+	if (m_bOpen && !m_bRebuilding && isTailLong())
+	{
+		m_bRebuilding = OFTrue;
+		rebuildTable(); // the log still has everything if this fails
+	}
+#ifdef _WIN32
+	if (m_hLog != INVALID_HANDLE_VALUE)
+		CloseHandle(m_hLog);
+	m_hLog = INVALID_HANDLE_VALUE;
+#else
+	if (m_fdLog >= 0)
+		::close(m_fdLog);
+	m_fdLog = -1;
+#endif
+	m_table.close();
+	m_tail.clear();
+	m_nTableCapacity = m_nTableCount = m_nTableLogOffset = 0;
+	m_nRetryTail = 0;
+	m_bOpen = OFFalse;
+}
+
+// rebuilding at 1/8 of the table keeps its cost proportional to the records added since the last one
+OFBool ProcessedIndex::isTailLong() const
+{
+	return m_tail.size() >= INDEX_MIN_TAIL && m_tail.size() >= m_nTableCount / 8 && m_tail.size() >= m_nRetryTail;
+}
+
+OFBool ProcessedIndex::findInTable(Uint64 nKey, ProcessedEntry& entry) const
+{
+	if (!m_nTableCapacity)
+		return OFFalse;
+	const Uint8* pSlots = m_table.data() + INDEX_HEADER_SIZE;
+	for (Uint64 iSlot = nKey & (m_nTableCapacity - 1), n = 0; n < m_nTableCapacity; iSlot = (iSlot + 1) & (m_nTableCapacity - 1), n++)
+	{
+		const Uint8* p = pSlots + iSlot * INDEX_RECORD_SIZE;
+		const Uint64 nSlotKey = GetUint64(p);
+		if (nSlotKey == 0)
+			return OFFalse;
+		if (nSlotKey == nKey)
+		{
+			Uint64 nRecordKey;
+			return DecodeRecord(p, nRecordKey, entry);
+		}
+	}
+	return OFFalse;
+}
+
+OFBool ProcessedIndex::find(const OFString& ofstrPath, ProcessedEntry& entry)
+{
+	const Uint64 nKey = hash(ofstrPath);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	STD_NAMESPACE unordered_map<Uint64, ProcessedEntry>::const_iterator it = m_tail.find(nKey);
+	if (it != m_tail.end())
+	{
+		entry = it->second;
+		return OFTrue;
+	}
+	return findInTable(nKey, entry);
+}
+
+OFBool ProcessedIndex::add(const OFString& ofstrPath, const ProcessedEntry& entry)
+{
+	const Uint64 nKey = hash(ofstrPath);
+	Uint8 record[INDEX_RECORD_SIZE];
+	EncodeRecord(record, nKey, entry);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_bOpen)
+			return OFFalse;
+#ifdef _WIN32
+		DWORD nWritten = 0;
+		if (!WriteFile(m_hLog, record, INDEX_RECORD_SIZE, &nWritten, NULL) || nWritten != INDEX_RECORD_SIZE)
+			return OFFalse;
+#else
+		if (write(m_fdLog, record, INDEX_RECORD_SIZE) != INDEX_RECORD_SIZE)
+			return OFFalse;
+#endif
+		m_tail[nKey] = entry;
+
+		// long-running modes (--watch, crawler) never close the index, so the tail is folded in here
+		if (m_bRebuilding || !isTailLong())
+			return OFTrue;
+		m_bRebuilding = OFTrue;
+	}
+	rebuildTable();
+	return OFTrue;
+}
+
+OFBool ProcessedIndex::rebuild()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_bOpen || m_bRebuilding)
+			return OFFalse;
+		m_bRebuilding = OFTrue;
+	}
+	return rebuildTable();
+}
+
+// one slot per path; a later record replaces the slot of an earlier one
+static void InsertSlot(Uint8* pSlots, Uint64 nCapacity, const Uint8* pRecord, Uint64 nKey, Uint64& nCount)
+{
+	Uint64 iSlot = nKey & (nCapacity - 1);
+	Uint8* pSlot;
+	for (;;)
+	{
+		pSlot = pSlots + iSlot * INDEX_RECORD_SIZE;
+		const Uint64 nSlotKey = GetUint64(pSlot);
+		if (nSlotKey == 0)
+			nCount++;
+		if (nSlotKey == 0 || nSlotKey == nKey)
+			break;
+		iSlot = (iSlot + 1) & (nCapacity - 1);
+	}
+	memcpy(pSlot, pRecord, INDEX_RECORD_SIZE);
+}
+
+// write a new table of the current one plus the log records after it, so only the tail is read from the
+// log and paths that were processed again take a single slot. Runs without the mutex (m_bRebuilding keeps
+// others out), so find() and add() go on with the old table and the tail meanwhile; it is only taken to
+// swap in the new table. Records appended in the meantime (also by other processes) stay in the tail.
+// Concurrent rebuilds of other processes write their own temporary file and the last rename wins.
+OFBool ProcessedIndex::rebuildTable()
+{
+	// the old table is only replaced by this function, so it can be read without the mutex
+	Uint64 nFrom, nOldCapacity, nOldCount;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		nFrom = m_nTableLogOffset;
+		nOldCapacity = m_nTableCapacity;
+		nOldCount = m_nTableCount;
+	}
+	Uint64 nLogSize = OFStandard::getFileSize(m_ofstrLogFilename);
+	nLogSize -= nLogSize % INDEX_RECORD_SIZE;
+	if (nLogSize < nFrom)
+		nFrom = nOldCapacity = nOldCount = 0; // the log was replaced or truncated: start over
+
+	Uint64 nCapacity = INDEX_MIN_CAPACITY;
+	while (nCapacity * 3 < (nOldCount + (nLogSize - nFrom) / INDEX_RECORD_SIZE) * 4) // load factor <= 3/4, even if all new paths differ
+		nCapacity *= 2;
+
+	char szPid[32];
+#ifdef _WIN32
+	sprintf(szPid, ".%lu.tmp", OFstatic_cast(unsigned long, GetCurrentProcessId()));
+#else
+	sprintf(szPid, ".%lu.tmp", OFstatic_cast(unsigned long, getpid()));
+#endif
+	const OFString ofstrTemp = m_ofstrFilename + szPid;
+
+	MappedOutput table;
+	OFFile log;
+	OFBool bGood = table.create(ofstrTemp, INDEX_HEADER_SIZE + nCapacity * INDEX_RECORD_SIZE);
+	Uint64 nCount = 0;
+	Uint8* pSlots = bGood ? table.data() + INDEX_HEADER_SIZE : NULL;
+	for (Uint64 iSlot = 0; bGood && iSlot < nOldCapacity; iSlot++)
+	{
+		Uint64 nKey;
+		ProcessedEntry entry;
+		const Uint8* pRecord = m_table.data() + INDEX_HEADER_SIZE + iSlot * INDEX_RECORD_SIZE;
+		if (DecodeRecord(pRecord, nKey, entry))
+			InsertSlot(pSlots, nCapacity, pRecord, nKey, nCount);
+	}
+	if (bGood && nFrom < nLogSize)
+		bGood = log.fopen(m_ofstrLogFilename, "rb") && log.fseek(OFstatic_cast(offile_off_t, nFrom), SEEK_SET) == 0;
+	OFVector<Uint8> buffer(INDEX_READ_RECORDS * INDEX_RECORD_SIZE);
+	for (Uint64 nPos = nFrom; bGood && nPos < nLogSize; )
+	{
+		size_t nRecords = INDEX_READ_RECORDS;
+		if ((nLogSize - nPos) / INDEX_RECORD_SIZE < nRecords)
+			nRecords = OFstatic_cast(size_t, (nLogSize - nPos) / INDEX_RECORD_SIZE);
+		bGood = log.fread(&buffer[0], INDEX_RECORD_SIZE, nRecords) == nRecords;
+		for (size_t iRecord = 0; bGood && iRecord < nRecords; iRecord++)
+		{
+			const Uint8* pRecord = &buffer[iRecord * INDEX_RECORD_SIZE];
+			Uint64 nKey;
+			ProcessedEntry entry;
+			if (DecodeRecord(pRecord, nKey, entry))
+				InsertSlot(pSlots, nCapacity, pRecord, nKey, nCount);
+		}
+		nPos += nRecords * INDEX_RECORD_SIZE;
+	}
+	if (bGood)
+	{
+		Uint8* p = table.data();
+		memcpy(p, _szIndexMagic, sizeof(_szIndexMagic));
+		PutUint64(p + 8, nCapacity);
+		PutUint64(p + 16, nCount);
+		PutUint64(p + 24, nLogSize);
+	}
+	if (log.open())
+		log.fclose();
+	bGood = table.close() && bGood;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_table.close(); // Windows can't replace a mapped file
+	if (bGood)
+	{
+#ifdef _WIN32
+		OFStandard::deleteFile(m_ofstrFilename); // rename doesn't replace an existing file on Windows
+#endif
+		bGood = OFStandard::renameFile(ofstrTemp, m_ofstrFilename);
+	}
+	if (!bGood)
+		OFStandard::deleteFile(ofstrTemp);
+	bGood = load() && bGood; // maps the table; the tail is what was appended since nLogSize
+	m_nRetryTail = bGood ? 0 : 2 * m_tail.size(); // e.g. a read-only index directory
+	m_bRebuilding = OFFalse;
+	return bGood;
+}
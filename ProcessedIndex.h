@@ -0,0 +1,78 @@
+﻿// ProcessedIndex.h : persistent index of the inputs that were already processed, so a rerun can skip
+// unchanged files from their size and modification time alone, without opening them.
+// Every outcome is appended to <file>.log as one fixed-size record with a single write, so several
+// processes and threads can share the index. <file> is an open-addressing hash table of the log up
+// to a recorded offset; the rest of the log is kept in memory and the table is rebuilt from the old
+// table and that tail (into a temporary file that replaces it) when the tail gets long. Both files are little endian.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstd.h"
+
+#include "DicomScanner.h"
+
+#include <mutex>
+#include <unordered_map>
+
+// the last known outcome for one input path
+struct ProcessedEntry
+{
+	ProcessedEntry();
+
+	Uint64 nSize;
+	Uint64 nMTime;		// modification time in nanoseconds since the epoch
+	Uint64 nUIDHash;	// ProcessedIndex::hash() of the SOPInstanceUID (0: unknown, e.g. not parsed)
+	Sint32 iResult;		// RESULT_*
+};
+
+class ProcessedIndex
+{
+public:
+	ProcessedIndex();
+	~ProcessedIndex();
+
+	// open() and close() must not run concurrently with the other functions
+	OFBool open(const OFString& ofstrFilename);	// creates the log if needed
+	void close();								// rebuilds the table first when the tail is long
+	OFBool isOpen() const { return m_bOpen; }
+
+	// lookup and update by input path; both may be called from any worker thread. add() folds the
+	// tail into a new table when it gets long; the others go on meanwhile, only the swap takes the lock
+	OFBool find(const OFString& ofstrPath, ProcessedEntry& entry);
+	OFBool add(const OFString& ofstrPath, const ProcessedEntry& entry);
+
+	// write a new hash table of the old one and the tail (OFFalse if another thread is rebuilding)
+	OFBool rebuild();
+
+	static Uint64 hash(const OFString& ofstr);	// 64 bit FNV-1a; never 0
+	static OFBool statFile(const OFString& ofstrPath, Uint64& nSize, Uint64& nMTime);
+
+private:
+	ProcessedIndex(const ProcessedIndex&);
+	ProcessedIndex& operator=(const ProcessedIndex&);
+	OFBool load();
+	OFBool readLog(Uint64 nFrom, Uint64 nTo);
+	OFBool findInTable(Uint64 nKey, ProcessedEntry& entry) const;
+	OFBool rebuildTable();
+	OFBool isTailLong() const;
+
+	std::mutex m_mutex;
+	OFBool m_bOpen;
+	OFBool m_bRebuilding;		// one rebuildTable() at a time; set under the mutex
+	OFString m_ofstrFilename;
+	OFString m_ofstrLogFilename;
+	MappedFile m_table;
+	Uint64 m_nTableCapacity;	// slots; a power of 2 (0: no usable table)
+	Uint64 m_nTableCount;		// used slots
+	Uint64 m_nTableLogOffset;	// log size that the table covers
+	STD_NAMESPACE unordered_map<Uint64, ProcessedEntry> m_tail;	// log records after the table, by path hash
+	size_t m_nRetryTail;		// after a failed rebuild: the tail size at which add() tries again
+#ifdef _WIN32
+	void* m_hLog;
+#else
+	int m_fdLog;
+#endif
+};
@@ -0,0 +1,298 @@
+﻿// Relay.cpp : DICOM C-STORE relay (see Relay.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "Relay.h"
+#include "Log.h"
+
+#include "dcmtk/ofstd/ofstream.h"
+#include "dcmtk/dcmnet/scppool.h"
+#include "dcmtk/dcmnet/scu.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const char* _ecgSOPClasses[] =
+{
+	UID_TwelveLeadECGWaveformStorage, UID_GeneralECGWaveformStorage, UID_AmbulatoryECGWaveformStorage
+};
+#define ECG_SOP_CLASSES 3
+
+RelayConfig::RelayConfig()
+	: ofstrAETitle("AMENDECG"), nPort(0), nPeerPort(0), nMaxAssociations(8), nQueueSize(16), nForwarders(1), bVerbose(OFFalse)
+{
+}
+
+OFBool ParseRelayDestination(const OFString& ofstrDestination, RelayConfig& config)
+{
+	const size_t nAt = ofstrDestination.find('@');
+	const size_t nColon = ofstrDestination.rfind(':');
+	if (nAt == OFString_npos || nAt == 0 || nColon == OFString_npos || nColon < nAt + 2 || nColon + 1 >= ofstrDestination.length())
+		return OFFalse;
+
+	char* pEnd = NULL;
+	const unsigned long nPort = strtoul(ofstrDestination.c_str() + nColon + 1, &pEnd, 10);
+	if (*pEnd != '\0' || nPort == 0 || nPort > 65535)
+		return OFFalse;
+
+	config.ofstrPeerAETitle = ofstrDestination.substr(0, nAt);
+	config.ofstrPeerHost = ofstrDestination.substr(nAt + 1, nColon - nAt - 1);
+	config.nPeerPort = OFstatic_cast(Uint16, nPort);
+	return OFTrue;
+}
+
+#ifdef WITH_THREADS
+
+static void GetTransferSyntaxes(OFList<OFString>& xfers)
+{
+	xfers.push_back(UID_LittleEndianExplicitTransferSyntax);
+	xfers.push_back(UID_LittleEndianImplicitTransferSyntax);
+}
+
+// one received object on its way to the destination; owned by the receiving SCP thread
+struct RelayJob
+{
+	DcmDataset* pDataset;
+	OFString ofstrSOPClassUID;
+	Uint16 nStatus;		// C-STORE status of the destination, passed back to the sender
+	OFBool bDone;
+};
+
+// shared by the receiving SCP threads and the forwarders
+struct RelayState
+{
+	RelayState(const RelayConfig& relayConfig, RelayAmendFunction amendFunction)
+		: config(relayConfig), amend(amendFunction), bStop(OFFalse), nReceived(0), nAmended(0), nUnchanged(0), nFailed(0) {}
+
+	const RelayConfig& config;
+	RelayAmendFunction amend;
+	STD_NAMESPACE deque<RelayJob*> jobs;
+	OFBool bStop;
+	std::mutex mutex;
+	std::condition_variable cvJobs;		// a job was queued, or stop
+	std::condition_variable cvSpace;	// a forwarder took a job from the queue
+	std::condition_variable cvDone;		// a job was forwarded
+	// counters
+	unsigned long nReceived, nAmended, nUnchanged, nFailed;
+};
+
+// DcmSCPPool creates the SCP instances itself, so they find the shared state here
+static RelayState* _pRelayState = NULL;
+
+class RelaySCP : public DcmThreadSCP
+{
+protected:
+	virtual OFCondition handleIncomingCommand(T_DIMSE_Message* pMessage, const DcmPresentationContextInfo& presInfo)
+	{
+		if (pMessage->CommandField != DIMSE_C_STORE_RQ)
+			return DcmThreadSCP::handleIncomingCommand(pMessage, presInfo); // C-ECHO
+		return handleStore(pMessage->msg.CStoreRQ, presInfo.presentationContextID);
+	}
+
+private:
+	OFCondition handleStore(T_DIMSE_C_StoreRQ& request, const T_ASC_PresentationContextID presID);
+};
+
+// receive, amend and forward one object; the sender only gets its response when the destination has
+// stored it, so nothing is acknowledged that could still be lost
+OFCondition RelaySCP::handleStore(T_DIMSE_C_StoreRQ& request, const T_ASC_PresentationContextID presID)
+{
+	RelayState& state = *_pRelayState;
+	DcmDataset* pDataset = NULL;
+	OFCondition cond = receiveSTORERequest(request, presID, pDataset);
+	if (cond.bad() || !pDataset)
+	{
+		delete pDataset;
+		return cond;
+	}
+
+	OFOStringStream osOut, osErr;
+	const int iResult = state.amend(*pDataset, osOut, osErr);
+
+	RelayJob job;
+	job.pDataset = pDataset;
+	job.ofstrSOPClassUID = request.AffectedSOPClassUID;
+	job.nStatus = STATUS_STORE_Refused_OutOfResources;
+	job.bDone = OFFalse;
+	{
+		std::unique_lock<std::mutex> lock(state.mutex);
+		state.nReceived++;
+		if (iResult == 0) state.nAmended++;
+		else state.nUnchanged++;
+
+		// backpressure: while the queue is full the sender waits for our response
+		while (state.jobs.size() >= state.config.nQueueSize)
+			state.cvSpace.wait(lock);
+		state.jobs.push_back(&job);
+		state.cvJobs.notify_one();
+		while (!job.bDone)
+			state.cvDone.wait(lock);
+
+
+		const LogContext context(OFString(), request.AffectedSOPInstanceUID);
+		AsyncLog::global().writeLines(osOut.str(), &context);
+		AsyncLog::global().writeLines(osErr.str(), &context);
+		LogLine(ELL_output, &context) << "RESULT: " << iResult << " " << request.AffectedSOPInstanceUID << " status=0x" << STD_NAMESPACE hex << job.nStatus << STD_NAMESPACE dec;
+	}
+	delete pDataset;
+	return sendSTOREResponse(presID, request, job.nStatus);
+}
+
+// forwards queued objects over one (persistent) association to the destination
+static void RelayForwarder(RelayState* pState)
+{
+	const RelayConfig& config = pState->config;
+	DcmSCU scu;
+	scu.setAETitle(config.ofstrAETitle);
+	scu.setPeerAETitle(config.ofstrPeerAETitle);
+	scu.setPeerHostName(config.ofstrPeerHost);
+	scu.setPeerPort(config.nPeerPort);
+	OFList<OFString> xfers;
+	GetTransferSyntaxes(xfers);
+	for (int iSOPClass = 0; iSOPClass < ECG_SOP_CLASSES; iSOPClass++)
+		scu.addPresentationContext(_ecgSOPClasses[iSOPClass], xfers);
+	OFCondition cond = scu.initNetwork();
+	if (cond.bad())
+		CERR << "ERROR: could not initialize network for forwarding: " << cond.text() << endl;
+
+	for (;;)
+	{
+		RelayJob* pJob;
+		{
+			std::unique_lock<std::mutex> lock(pState->mutex);
+			while (pState->jobs.empty() && !pState->bStop)
+				pState->cvJobs.wait(lock);
+			if (pState->jobs.empty())
+				break; // stopped and drained
+			pJob = pState->jobs.front();
+			pState->jobs.pop_front();
+			pState->cvSpace.notify_one();
+		}
+
+		Uint16 nStatus = STATUS_STORE_Refused_OutOfResources;
+		OFOStringStream osErr;
+		// an idle association may have been closed by the destination, so reconnect once
+		for (int iTry = 0; iTry < 2 && cond.good(); iTry++)
+		{
+			if (!scu.isConnected())
+			{
+				const OFCondition condConnect = scu.negotiateAssociation();
+				if (condConnect.bad())
+				{
+					osErr << "ERROR: could not connect to " << config.ofstrPeerAETitle << "@" << config.ofstrPeerHost << ":" << config.nPeerPort << ": " << condConnect.text() << endl;
+					continue;
+				}
+			}
+			const T_ASC_PresentationContextID presID = scu.findPresentationContextID(pJob->ofstrSOPClassUID, "");
+			if (presID == 0)
+			{
+				osErr << "ERROR: destination does not accept SOP class " << pJob->ofstrSOPClassUID << endl;
+				nStatus = STATUS_STORE_Refused_SOPClassNotSupported;
+				break;
+			}
+			Uint16 nResponse = 0;
+			const OFCondition condStore = scu.sendSTORERequest(presID, OFFilename(), pJob->pDataset, nResponse);
+			if (condStore.good())
+			{
+				nStatus = nResponse;
+				break;
+			}
+			osErr << "WARN: forwarding failed: " << condStore.text() << endl;
+			scu.closeAssociation(DCMSCU_ABORT_ASSOCIATION);
+		}
+
+		std::lock_guard<std::mutex> lock(pState->mutex);
+		AsyncLog::global().writeLines(osErr.str());
+		if (nStatus != STATUS_Success)
+			pState->nFailed++;
+		pJob->nStatus = nStatus;
+		pJob->bDone = OFTrue;
+		pState->cvDone.notify_all();
+	}
+
+	if (scu.isConnected())
+		scu.closeAssociation(DCMSCU_RELEASE_ASSOCIATION);
+}
+
+struct RelayMonitor
+{
+	DcmSCPPool<RelaySCP>* pPool;
+	volatile sig_atomic_t* pbStop;
+	std::atomic<bool> bListening;
+};
+
+// DcmSCPPool::listen() blocks; stop it from here once a signal has set the stop flag
+static void RelayStopMonitor(RelayMonitor* pMonitor)
+{
+	while (pMonitor->bListening && !*pMonitor->pbStop)
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	pMonitor->pPool->stopAfterCurrentAssociations();
+}
+
+OFCondition RunRelay(const RelayConfig& config, RelayAmendFunction amend, volatile sig_atomic_t* pbStop)
+{
+	RelayState state(config, amend);
+	_pRelayState = &state;
+
+	DcmSCPPool<RelaySCP> pool;
+	DcmSCPConfig& scpConfig = pool.getConfig();
+	scpConfig.setAETitle(config.ofstrAETitle);
+	scpConfig.setPort(config.nPort);
+	scpConfig.setConnectionBlockingMode(DUL_NOBLOCK);
+	scpConfig.setConnectionTimeout(1); // seconds; lets listen() notice a stop request
+	OFList<OFString> xfers;
+	GetTransferSyntaxes(xfers);
+	scpConfig.addPresentationContext(UID_VerificationSOPClass, xfers);
+	for (int iSOPClass = 0; iSOPClass < ECG_SOP_CLASSES; iSOPClass++)
+		scpConfig.addPresentationContext(_ecgSOPClasses[iSOPClass], xfers);
+	pool.setMaxThreads(config.nMaxAssociations);
+
+	STD_NAMESPACE vector<std::thread> forwarders;
+	for (size_t iForwarder = 0; iForwarder < (config.nForwarders ? config.nForwarders : 1); iForwarder++)
+		forwarders.push_back(std::thread(RelayForwarder, &state));
+
+	if (config.bVerbose)
+		LogLine(ELL_info) << "INFO: relaying " << config.ofstrAETitle << ":" << config.nPort << " to " << config.ofstrPeerAETitle << "@"
+			<< config.ofstrPeerHost << ":" << config.nPeerPort << " with " << forwarders.size() << " forwarders";
+
+	RelayMonitor monitor;
+	monitor.pPool = &pool;
+	monitor.pbStop = pbStop;
+	monitor.bListening = true;
+	std::thread monitorThread(RelayStopMonitor, &monitor);
+	const OFCondition cond = pool.listen(); // returns when all associations have ended
+	monitor.bListening = false;
+	monitorThread.join();
+
+	{
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.bStop = OFTrue;
+		state.cvJobs.notify_all();
+	}
+	for (size_t iForwarder = 0; iForwarder < forwarders.size(); iForwarder++)
+		forwarders[iForwarder].join();
+	_pRelayState = NULL;
+
+	LogLine(ELL_output) << "STATS: received=" << state.nReceived << " amended=" << state.nAmended << " unchanged=" << state.nUnchanged
+		<< " failed=" << state.nFailed;
+	if (cond.bad())
+		LogLine(ELL_error) << "ERROR: relay stopped: " << cond.text();
+	return cond;
+}
+
+#else
+
+OFCondition RunRelay(const RelayConfig&, RelayAmendFunction, volatile sig_atomic_t*)
+{
+	CERR << "ERROR: relay mode requires DCMTK built with thread support." << endl;
+	return EC_IllegalCall;
+}
+
+#endif
@@ -0,0 +1,35 @@
+﻿// Relay.h : DICOM C-STORE relay; objects received from e.g. Muse are amended in memory and
+// forwarded to the destination (VNA) before the store is acknowledged to the sender.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/dcmdata/dctk.h"
+
+#include <csignal>
+
+struct RelayConfig
+{
+	RelayConfig();
+
+	OFString ofstrAETitle;			// our own AE title
+	Uint16 nPort;					// port to accept associations on
+	OFString ofstrPeerAETitle;		// destination
+	OFString ofstrPeerHost;
+	Uint16 nPeerPort;
+	Uint16 nMaxAssociations;		// concurrent incoming associations
+	size_t nQueueSize;				// objects waiting to be forwarded; receivers wait when it is full
+	size_t nForwarders;				// outgoing associations
+	OFBool bVerbose;
+};
+
+// parse a destination given as AETITLE@host:port
+OFBool ParseRelayDestination(const OFString& ofstrDestination, RelayConfig& config);
+
+// amends a received dataset; anything but 0 means the dataset must be forwarded as it was received
+typedef int (*RelayAmendFunction)(DcmDataset& dataset, STD_NAMESPACE ostream& out, STD_NAMESPACE ostream& err);
+
+// accept associations until *pbStop is set; returns when all received objects have been handled
+OFCondition RunRelay(const RelayConfig& config, RelayAmendFunction amend, volatile sig_atomic_t* pbStop);
@@ -0,0 +1,531 @@
+﻿// BenchAmendEcgAnnotation.cpp : benchmark of AmendEcgAnnotation on synthetic ECG objects
+// Generates a set of files per scenario and runs the tool once per set in batch mode, reporting
+// files/s, MB/s (of input) and the peak RSS of the tool. The early-exit scenarios (wrong SOP class,
+// already amended, no waveform) measure the paths that only clone the input. With --startup every file
+// gets its own run instead, once with the embedded and once with the complete data dictionary, which
+// shows the cold start cost of a tool that is started per ECG. With --deflate every set is written plain
+// and deflated at a few compression levels, reporting the compression ratio against the throughput.
+// With --soak one batch run passes over the set many times; the resident size that the tool records
+// per file (--metrics-json) should be the same in the last pass as in the first.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "SyntheticEcg.h"
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstream.h"
+#include "dcmtk/dcmdata/dctk.h"
+#include "dcmtk/dcmdata/cmdlnarg.h"
+#include "dcmtk/ofstd/ofconapp.h"
+#include "dcmtk/ofstd/ofstd.h"
+#include "dcmtk/ofstd/ofvector.h"
+
+#include <chrono>
+#include <cstring>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define MY_NAME "BenchAmendEcgAnnotation"
+#define MY_VERSION "0.9.3"
+#define MY_RELEASEDATE "2021-10-13"
+
+static const char rcsid[] = "$amc.nl: " MY_NAME " v" MY_VERSION " " MY_RELEASEDATE " $";
+
+#define SHORTCOL 3
+#define LONGCOL 20
+
+using namespace std;
+
+struct BenchScenario
+{
+	const char* pszName;
+	SyntheticEcgSpec spec;
+};
+
+static OFVector<BenchScenario> MakeScenarios()
+{
+	OFVector<BenchScenario> scenarios;
+	BenchScenario scenario;
+
+	scenario.pszName = "twelve_lead";						// typical resting ECG: rhythm and median group
+	scenarios.push_back(scenario);
+
+	scenario.pszName = "twelve_lead_no_annotations";
+	scenario.spec.nAnnotations = 0;
+	scenarios.push_back(scenario);
+
+	scenario.pszName = "twelve_lead_1000_annotations";
+	scenario.spec.nAnnotations = 1000;
+	scenarios.push_back(scenario);
+
+	scenario.pszName = "twelve_lead_5000_annotations";
+	scenario.spec.nAnnotations = 5000;
+	scenarios.push_back(scenario);
+
+	// scaling of the annotation scan and insertion: a short waveform, so the time per file should
+	// grow linearly with the number of items (text items, then measurements without text)
+	static const char* const pszScalingNames[] = { "annotations_1000", "annotations_10000", "annotations_100000" };
+	unsigned long nScalingItems = 1000;
+	for (size_t iScaling = 0; iScaling < sizeof(pszScalingNames) / sizeof(pszScalingNames[0]); iScaling++, nScalingItems *= 10)
+	{
+		scenario = BenchScenario();
+		scenario.pszName = pszScalingNames[iScaling];
+		scenario.spec.nGroups = 1;
+		scenario.spec.nSamples = 500;
+		scenario.spec.nAnnotations = nScalingItems / 2;
+		scenario.spec.nNumericAnnotations = nScalingItems / 2;
+		scenarios.push_back(scenario);
+	}
+
+	scenario = BenchScenario();
+	scenario.pszName = "twelve_lead_8_groups";
+	scenario.spec.nGroups = 8;
+	scenario.spec.nSamples = 2500;
+	scenarios.push_back(scenario);
+
+	scenario = BenchScenario();
+	scenario.pszName = "general_ecg";
+	scenario.spec.pszSOPClassUID = UID_GeneralECGWaveformStorage;
+	scenario.spec.nGroups = 1;
+	scenario.spec.nChannels = 15;
+	scenario.spec.nSamples = 10000;
+	scenarios.push_back(scenario);
+
+	scenario = BenchScenario();
+	scenario.pszName = "ambulatory_1h";						// 3 channels, one hour at 500 Hz
+	scenario.spec.pszSOPClassUID = UID_AmbulatoryECGWaveformStorage;
+	scenario.spec.nGroups = 1;
+	scenario.spec.nChannels = 3;
+	scenario.spec.nSamples = 1800000;
+	scenarios.push_back(scenario);
+
+	scenario = BenchScenario();
+	scenario.pszName = "no_source_tags";
+	scenario.spec.bSourceTags = OFFalse;
+	scenarios.push_back(scenario);
+
+	scenario = BenchScenario();
+	scenario.pszName = "early_already_amended";
+	scenario.spec.bAmended = OFTrue;
+	scenarios.push_back(scenario);
+
+	scenario = BenchScenario();
+	scenario.pszName = "early_wrong_sop_class";
+	scenario.spec.pszSOPClassUID = UID_SecondaryCaptureImageStorage;
+	scenarios.push_back(scenario);
+
+	scenario = BenchScenario();
+	scenario.pszName = "early_missing_waveform";
+	scenario.spec.nGroups = 0;
+	scenarios.push_back(scenario);
+
+	return scenarios;
+}
+
+// write nFiles objects of one scenario to ofstrDir; returns the total size in bytes (0 on errors)
+static Uint64 GenerateScenario(const BenchScenario& scenario, const OFString& ofstrDir, unsigned long nFiles)
+{
+	Uint64 nBytes = 0;
+	for (unsigned long iFile = 0; iFile < nFiles; iFile++)
+	{
+		char szName[32];
+		snprintf(szName, sizeof(szName), "%05lu.dcm", iFile);
+		OFString ofstrFile;
+		OFStandard::combineDirAndFilename(ofstrFile, ofstrDir, szName, OFTrue);
+
+		DcmFileFormat dfile;
+		OFCondition cond = CreateSyntheticEcg(scenario.spec, dfile);
+		if (cond.good())
+			cond = dfile.saveFile(ofstrFile, EXS_LittleEndianExplicit);
+		if (cond.bad())
+		{
+			CERR << "ERROR: could not create " << ofstrFile << ": " << cond.text() << endl;
+			return 0;
+		}
+		nBytes += OFStandard::getFileSize(ofstrFile);
+	}
+	return nBytes;
+}
+
+// run the tool with its output discarded; nPeakRSS is the peak resident set size in kB (0 if unknown)
+static int RunTool(const OFVector<OFString>& args, long& nPeakRSS)
+{
+	OFVector<const char*> argv;
+	for (size_t iArg = 0; iArg < args.size(); iArg++)
+		argv.push_back(args[iArg].c_str());
+	argv.push_back(NULL);
+	nPeakRSS = 0;
+
+#ifdef _WIN32
+	return OFstatic_cast(int, _spawnv(_P_WAIT, argv[0], &argv[0]));
+#else
+	const pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0)
+	{
+		const int fdNull = open("/dev/null", O_WRONLY);
+		if (fdNull >= 0)
+		{
+			dup2(fdNull, STDOUT_FILENO);
+			dup2(fdNull, STDERR_FILENO);
+		}
+		execv(argv[0], OFconst_cast(char* const*, &argv[0]));
+		_exit(127);
+	}
+
+	int iStatus = 0;
+	struct rusage usage;
+	if (wait4(pid, &iStatus, 0, &usage) < 0)
+		return -1;
+	nPeakRSS = usage.ru_maxrss;
+	// the tool returns negative RESULT_* codes, which arrive as 8 bit exit status
+	return WIFEXITED(iStatus) ? OFstatic_cast(signed char, WEXITSTATUS(iStatus)) : -1;
+#endif
+}
+
+// run the tool once per file, as when it is started for every new ECG; the time per run is mostly
+// process startup and dictionary loading for small files
+static int RunStartup(const BenchScenario& scenario, const OFString& ofstrTool, const OFVector<OFString>& toolOptions,
+	const OFString& ofstrInputDir, const OFString& ofstrOutputDir, unsigned long nFiles)
+{
+	if (!OFStandard::dirExists(ofstrOutputDir) && OFStandard::createDirectory(ofstrOutputDir, OFFilename()).bad())
+	{
+		CERR << "ERROR: could not create directory: " << ofstrOutputDir << endl;
+		return 1;
+	}
+
+	static const char* const pszDictionaries[] = { "embedded", "full" };
+	for (int iDictionary = 0; iDictionary < 2; iDictionary++)
+	{
+		double dSeconds = 0;
+		long nMaxRSS = 0;
+		int iResult = 0;
+		for (unsigned long iFile = 0; iFile < nFiles; iFile++)
+		{
+			char szName[32];
+			snprintf(szName, sizeof(szName), "%05lu.dcm", iFile);
+			OFString ofstrInputFile, ofstrOutputFile;
+			OFStandard::combineDirAndFilename(ofstrInputFile, ofstrInputDir, szName, OFTrue);
+			OFStandard::combineDirAndFilename(ofstrOutputFile, ofstrOutputDir, szName, OFTrue);
+
+			OFVector<OFString> args;
+			args.push_back(ofstrTool);
+			args.push_back("--force");
+			if (iDictionary == 1)
+				args.push_back("--full-dictionary");
+			args.insert(args.end(), toolOptions.begin(), toolOptions.end());
+			args.push_back(ofstrInputFile);
+			args.push_back(ofstrOutputFile);
+
+			long nPeakRSS = 0;
+			const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+			iResult = RunTool(args, nPeakRSS);
+			dSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+			if (nPeakRSS > nMaxRSS)
+				nMaxRSS = nPeakRSS;
+			if (iResult == -1 || iResult == 127)
+				break;
+		}
+
+		COUT << "STARTUP: scenario=" << scenario.pszName << " dictionary=" << pszDictionaries[iDictionary] << " runs=" << nFiles
+			<< " ms_per_run=" << 1000.0 * dSeconds / nFiles << " peak_rss_kB=" << nMaxRSS << " result=" << iResult << endl;
+		if (iResult == -1 || iResult == 127)
+			return 1;
+	}
+	return 0;
+}
+
+// one batch run per compression level (-1: not deflated); the ratio is of input to output bytes
+static int RunDeflate(const BenchScenario& scenario, const OFString& ofstrTool, const OFVector<OFString>& toolOptions,
+	const OFString& ofstrInputDir, const OFString& ofstrOutputDir, unsigned long nFiles, Uint64 nBytes)
+{
+	static const int iLevels[] = { -1, 1, 6, 9 };
+	for (size_t iLevel = 0; iLevel < sizeof(iLevels) / sizeof(iLevels[0]); iLevel++)
+	{
+		char szLevel[16];
+		snprintf(szLevel, sizeof(szLevel), "%d", iLevels[iLevel]);
+
+		OFVector<OFString> args;
+		args.push_back(ofstrTool);
+		args.push_back("--batch");
+		args.push_back("--force");
+		args.push_back("--output-dir");
+		args.push_back(ofstrOutputDir);
+		if (iLevels[iLevel] >= 0)
+		{
+			args.push_back("--write-deflated");
+			args.push_back("--deflate-level");
+			args.push_back(szLevel);
+		}
+		args.insert(args.end(), toolOptions.begin(), toolOptions.end());
+		args.push_back(ofstrInputDir);
+
+		long nPeakRSS = 0;
+		const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+		const int iResult = RunTool(args, nPeakRSS);
+		const double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+		Uint64 nOutputBytes = 0;
+		for (unsigned long iFile = 0; iFile < nFiles; iFile++)
+		{
+			char szName[32];
+			snprintf(szName, sizeof(szName), "%05lu.dcm", iFile);
+			OFString ofstrOutputFile;
+			OFStandard::combineDirAndFilename(ofstrOutputFile, ofstrOutputDir, szName, OFTrue);
+			nOutputBytes += OFStandard::getFileSize(ofstrOutputFile);
+		}
+
+		const double dMB = nBytes / (1024.0 * 1024.0);
+		COUT << "DEFLATE: scenario=" << scenario.pszName << " level=" << (iLevels[iLevel] >= 0 ? szLevel : "none") << " files=" << nFiles
+			<< " MB=" << dMB << " output_MB=" << nOutputBytes / (1024.0 * 1024.0) << " ratio=" << (nOutputBytes ? OFstatic_cast(double, nBytes) / nOutputBytes : 0.0)
+			<< " seconds=" << dSeconds << " MB_per_s=" << dMB / dSeconds << " peak_rss_kB=" << nPeakRSS << " result=" << iResult << endl;
+		if (iResult == -1 || iResult == 127)
+			return 1;
+	}
+	return 0;
+}
+
+// one batch run over the same files nPasses times; compares the resident size of the first and the
+// last pass, as recorded by the tool in its JSON metrics
+static int RunSoak(const BenchScenario& scenario, const OFString& ofstrTool, const OFVector<OFString>& toolOptions,
+	const OFString& ofstrScenarioDir, const OFString& ofstrInputDir, const OFString& ofstrOutputDir, unsigned long nFiles, unsigned long nPasses)
+{
+	OFString ofstrMetricsFile;
+	OFStandard::combineDirAndFilename(ofstrMetricsFile, ofstrScenarioDir, "soak.json", OFTrue);
+	OFStandard::deleteFile(ofstrMetricsFile);
+
+	OFVector<OFString> args;
+	args.push_back(ofstrTool);
+	args.push_back("--batch");
+	args.push_back("--force");
+	args.push_back("--output-dir");
+	args.push_back(ofstrOutputDir);
+	args.push_back("--metrics-json");
+	args.push_back(ofstrMetricsFile);
+	args.insert(args.end(), toolOptions.begin(), toolOptions.end());
+	for (unsigned long iPass = 0; iPass < nPasses; iPass++)
+		args.push_back(ofstrInputDir);
+
+	long nPeakRSS = 0;
+	const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+	const int iResult = RunTool(args, nPeakRSS);
+	const double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+	// the largest resident size per pass
+	OFVector<Uint64> passRSS;
+	FILE* pFile = fopen(ofstrMetricsFile.c_str(), "r");
+	if (pFile)
+	{
+		char szLine[4096];
+		unsigned long nLines = 0;
+		while (fgets(szLine, sizeof(szLine), pFile))
+		{
+			const char* pszRSS = strstr(szLine, "\"rss_bytes\":");
+			if (!pszRSS)
+				continue;
+			const Uint64 nRSS = OFstatic_cast(Uint64, strtoull(pszRSS + 12, NULL, 10));
+			const size_t iPass = nLines++ / nFiles;
+			if (iPass >= passRSS.size())
+				passRSS.push_back(0);
+			if (nRSS > passRSS[iPass])
+				passRSS[iPass] = nRSS;
+		}
+		fclose(pFile);
+	}
+	if (passRSS.size() < 2)
+	{
+		CERR << "ERROR: no resident sizes for two passes in " << ofstrMetricsFile << " (result " << iResult << ")" << endl;
+		return 1;
+	}
+
+	const double dFirstMB = passRSS.front() / (1024.0 * 1024.0);
+	const double dLastMB = passRSS.back() / (1024.0 * 1024.0);
+	COUT << "SOAK: scenario=" << scenario.pszName << " files=" << nFiles << " passes=" << passRSS.size() << " seconds=" << dSeconds
+		<< " first_pass_rss_MB=" << dFirstMB << " last_pass_rss_MB=" << dLastMB << " growth_kB_per_pass=" << 1024.0 * (dLastMB - dFirstMB) / (passRSS.size() - 1)
+		<< " peak_rss_kB=" << nPeakRSS << " result=" << iResult << endl;
+	return iResult == -1 || iResult == 127 ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+	OFConsoleApplication app(MY_NAME, "Benchmark AmendEcgAnnotation on synthetic ECG objects", rcsid);
+	OFCommandLine cmd;
+
+	cmd.setOptionColumns(LONGCOL, SHORTCOL);
+	cmd.setParamColumn(LONGCOL + SHORTCOL + 4);
+
+	cmd.addParam("tool", "path of the AmendEcgAnnotation executable");
+	cmd.addParam("work-dir", "directory for the generated inputs and the outputs");
+
+	cmd.addGroup("general options:", LONGCOL, SHORTCOL + 2);
+	cmd.addOption("--help", "-h", "print this help text and exit", OFTrue /* exclusive */);
+	cmd.addOption("--files", "-n", 1, "[n]umber: integer (default: 20)", "number of files per scenario");
+	cmd.addOption("--scenario", "-s", 1, "[n]ame: string", "only run scenario n (may be repeated)");
+	cmd.addOption("--tool-options", "-a", 1, "[o]ptions: string", "extra options for the tool, separated by spaces\n(e.g. \"--triage --jobs 4\")");
+	cmd.addOption("--generate-only", "-g", "only write the synthetic inputs");
+	cmd.addOption("--startup", "-u", "run the tool once per file, with the embedded and\nwith the complete dictionary (--full-dictionary)");
+	cmd.addOption("--deflate", "-d", "run the tool without and with --write-deflated at\ncompression levels 1, 6 and 9");
+	cmd.addOption("--soak", "-k", 1, "[p]asses: integer", "one batch run that passes p times over the files;\nreports the resident size of the first and last pass");
+	cmd.addOption("--list", "-l", "list the scenarios and exit", OFTrue /* exclusive */);
+
+	OFCmdUnsignedInt nFiles = 20;
+	OFVector<OFString> selected;
+	OFVector<OFString> toolOptions;
+	OFBool bGenerateOnly = OFFalse;
+	OFBool bStartup = OFFalse;
+	OFBool bDeflate = OFFalse;
+	OFCmdUnsignedInt nSoakPasses = 0;
+	const OFVector<BenchScenario> scenarios = MakeScenarios();
+
+	prepareCmdLineArgs(argc, argv, MY_NAME);
+	if (app.parseCommandLine(cmd, argc, argv))
+	{
+		if (cmd.findOption("--help"))
+			app.printUsage(&cmd);
+
+		if (cmd.findOption("--list"))
+		{
+			for (size_t iScenario = 0; iScenario < scenarios.size(); iScenario++)
+				COUT << scenarios[iScenario].pszName << endl;
+			return 0;
+		}
+
+		if (cmd.findOption("--files"))
+			app.checkValue(cmd.getValueAndCheckMin(nFiles, 1));
+
+		if (cmd.findOption("--scenario", 0, OFCommandLine::FOM_First))
+		{
+			do
+			{
+				OFString ofstrName;
+				app.checkValue(cmd.getValue(ofstrName));
+				selected.push_back(ofstrName);
+			} while (cmd.findOption("--scenario", 0, OFCommandLine::FOM_Next));
+		}
+
+		if (cmd.findOption("--tool-options"))
+		{
+			OFString ofstrOptions;
+			app.checkValue(cmd.getValue(ofstrOptions));
+			size_t nPos = 0;
+			while (nPos < ofstrOptions.length())
+			{
+				size_t nEnd = ofstrOptions.find(' ', nPos);
+				if (nEnd == OFString_npos)
+					nEnd = ofstrOptions.length();
+				if (nEnd > nPos)
+					toolOptions.push_back(ofstrOptions.substr(nPos, nEnd - nPos));
+				nPos = nEnd + 1;
+			}
+		}
+
+		if (cmd.findOption("--generate-only"))
+			bGenerateOnly = OFTrue;
+
+		if (cmd.findOption("--startup"))
+			bStartup = OFTrue;
+
+		if (cmd.findOption("--deflate"))
+			bDeflate = OFTrue;
+
+		if (cmd.findOption("--soak"))
+			app.checkValue(cmd.getValueAndCheckMin(nSoakPasses, 2));
+	}
+
+	if (!dcmDataDict.isDictionaryLoaded())
+	{
+		CERR << "ERROR: no data dictionary loaded;  check environment variable: " << DCM_DICT_ENVIRONMENT_VARIABLE << endl;
+		return 1;
+	}
+
+	OFString ofstrTool, ofstrWorkDir;
+	cmd.getParam(1, ofstrTool);
+	cmd.getParam(2, ofstrWorkDir);
+	if (!OFStandard::dirExists(ofstrWorkDir) && OFStandard::createDirectory(ofstrWorkDir, OFFilename()).bad())
+	{
+		CERR << "ERROR: could not create work directory: " << ofstrWorkDir << endl;
+		return 1;
+	}
+
+	int iExit = 0;
+	for (size_t iScenario = 0; iScenario < scenarios.size(); iScenario++)
+	{
+		const BenchScenario& scenario = scenarios[iScenario];
+		OFBool bSelected = selected.empty();
+		for (size_t iSelected = 0; iSelected < selected.size() && !bSelected; iSelected++)
+			bSelected = selected[iSelected] == scenario.pszName;
+		if (!bSelected)
+			continue;
+
+		OFString ofstrScenarioDir, ofstrInputDir, ofstrOutputDir;
+		OFStandard::combineDirAndFilename(ofstrScenarioDir, ofstrWorkDir, scenario.pszName, OFTrue);
+		OFStandard::combineDirAndFilename(ofstrInputDir, ofstrScenarioDir, "in", OFTrue);
+		OFStandard::combineDirAndFilename(ofstrOutputDir, ofstrScenarioDir, "out", OFTrue);
+		if (!OFStandard::dirExists(ofstrInputDir) && OFStandard::createDirectory(ofstrInputDir, ofstrWorkDir).bad())
+		{
+			CERR << "ERROR: could not create directory: " << ofstrInputDir << endl;
+			return 1;
+		}
+
+		const Uint64 nBytes = GenerateScenario(scenario, ofstrInputDir, nFiles);
+		if (nBytes == 0)
+			return 1;
+		if (bGenerateOnly)
+		{
+			COUT << "INFO: generated " << nFiles << " files (" << nBytes << " bytes) in " << ofstrInputDir << endl;
+			continue;
+		}
+
+		if (bStartup)
+		{
+			if (RunStartup(scenario, ofstrTool, toolOptions, ofstrInputDir, ofstrOutputDir, nFiles) != 0)
+				iExit = 1;
+			continue;
+		}
+
+		if (nSoakPasses > 0)
+		{
+			if (RunSoak(scenario, ofstrTool, toolOptions, ofstrScenarioDir, ofstrInputDir, ofstrOutputDir, nFiles, nSoakPasses) != 0)
+				iExit = 1;
+			continue;
+		}
+
+		if (bDeflate)
+		{
+			if (RunDeflate(scenario, ofstrTool, toolOptions, ofstrInputDir, ofstrOutputDir, nFiles, nBytes) != 0)
+				iExit = 1;
+			continue;
+		}
+
+		// one batch run per scenario, so process startup and dictionary loading are amortized
+		OFVector<OFString> args;
+		args.push_back(ofstrTool);
+		args.push_back("--batch");
+		args.push_back("--force");
+		args.push_back("--output-dir");
+		args.push_back(ofstrOutputDir);
+		args.insert(args.end(), toolOptions.begin(), toolOptions.end());
+		args.push_back(ofstrInputDir);
+
+		long nPeakRSS = 0;
+		const std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+		const int iResult = RunTool(args, nPeakRSS);
+		const double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+		const double dMB = nBytes / (1024.0 * 1024.0);
+
+		COUT << "BENCH: scenario=" << scenario.pszName << " files=" << nFiles << " MB=" << dMB << " seconds=" << dSeconds
+			<< " files_per_s=" << nFiles / dSeconds << " MB_per_s=" << dMB / dSeconds << " peak_rss_kB=" << nPeakRSS
+			<< " result=" << iResult << endl;
+		if (iResult == -1 || iResult == 127)
+			iExit = 1; // the tool could not be started or was killed
+	}
+	return iExit;
+}
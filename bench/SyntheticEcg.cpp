@@ -0,0 +1,117 @@
+﻿// SyntheticEcg.cpp : synthetic ECG waveform objects (see SyntheticEcg.h)
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "SyntheticEcg.h"
+
+#include "dcmtk/ofstd/ofvector.h"
+
+#include <cmath>
+
+SyntheticEcgSpec::SyntheticEcgSpec()
+	: pszSOPClassUID(UID_TwelveLeadECGWaveformStorage), nGroups(2), nChannels(12), nSamples(5000),
+	  nAnnotations(3), nNumericAnnotations(0), bSourceTags(OFTrue), bAmended(OFFalse)
+{
+}
+
+// one multiplex group with a channel definition per channel and interleaved 16 bit samples
+static OFCondition AddMultiplexGroup(DcmDataset* pDataset, const SyntheticEcgSpec& spec, unsigned long iGroup)
+{
+	DcmItem* pGroup = NULL;
+	OFCondition cond = pDataset->findOrCreateSequenceItem(DCM_WaveformSequence, pGroup, -2);
+	if (cond.bad())
+		return cond;
+
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%lu", spec.nSamples);
+	pGroup->putAndInsertString(DCM_MultiplexGroupLabel, iGroup == 0 ? "RHYTHM" : "MEDIAN");
+	pGroup->putAndInsertString(DCM_WaveformOriginality, iGroup == 0 ? "ORIGINAL" : "DERIVED");
+	pGroup->putAndInsertUint16(DCM_NumberOfWaveformChannels, OFstatic_cast(Uint16, spec.nChannels));
+	pGroup->putAndInsertString(DCM_NumberOfWaveformSamples, buf);
+	pGroup->putAndInsertString(DCM_SamplingFrequency, "500");
+	pGroup->putAndInsertUint16(DCM_WaveformBitsAllocated, 16);
+	pGroup->putAndInsertString(DCM_WaveformSampleInterpretation, "SS");
+
+	for (unsigned long iChannel = 0; iChannel < spec.nChannels; iChannel++)
+	{
+		DcmItem* pChannel = NULL;
+		cond = pGroup->findOrCreateSequenceItem(DCM_ChannelDefinitionSequence, pChannel, -2);
+		if (cond.bad())
+			return cond;
+		DcmItem* pSource = NULL;
+		if (pChannel->findOrCreateSequenceItem(DCM_ChannelSourceSequence, pSource, -2).good())
+		{
+			snprintf(buf, sizeof(buf), "5.6.3-9-%lu", iChannel + 1);
+			pSource->putAndInsertString(DCM_CodeValue, buf);
+			pSource->putAndInsertString(DCM_CodingSchemeDesignator, "SCPECG");
+			snprintf(buf, sizeof(buf), "Lead %lu", iChannel + 1);
+			pSource->putAndInsertString(DCM_CodeMeaning, buf);
+		}
+		pChannel->putAndInsertString(DCM_ChannelSensitivity, "1");
+	}
+
+	// a sine per channel with a different phase; the values don't matter, the size does
+	OFVector<Uint16> samples(spec.nChannels * spec.nSamples);
+	for (unsigned long iSample = 0; iSample < spec.nSamples; iSample++)
+		for (unsigned long iChannel = 0; iChannel < spec.nChannels; iChannel++)
+			samples[iSample * spec.nChannels + iChannel] = OFstatic_cast(Uint16, OFstatic_cast(Sint16, 1000 * sin(0.0126 * iSample + iChannel)));
+	if (samples.empty())
+		return EC_Normal;
+	return pGroup->putAndInsertUint16Array(DCM_WaveformData, &samples[0], OFstatic_cast(unsigned long, samples.size()));
+}
+
+OFCondition CreateSyntheticEcg(const SyntheticEcgSpec& spec, DcmFileFormat& dfile)
+{
+	DcmDataset* pDataset = dfile.getDataset();
+	char uid[100];
+
+	pDataset->putAndInsertString(DCM_SOPClassUID, spec.pszSOPClassUID);
+	pDataset->putAndInsertString(DCM_SOPInstanceUID, dcmGenerateUniqueIdentifier(uid, SITE_INSTANCE_UID_ROOT));
+	pDataset->putAndInsertString(DCM_StudyInstanceUID, dcmGenerateUniqueIdentifier(uid, SITE_INSTANCE_UID_ROOT));
+	pDataset->putAndInsertString(DCM_SeriesInstanceUID, dcmGenerateUniqueIdentifier(uid, SITE_INSTANCE_UID_ROOT));
+	pDataset->putAndInsertString(DCM_Modality, "ECG");
+	pDataset->putAndInsertString(DCM_PatientID, "SYNTH0001");
+	pDataset->putAndInsertString(DCM_PatientName, "Synthetic^Patient");
+	pDataset->putAndInsertString(DCM_AccessionNumber, "ACC0001");
+	pDataset->putAndInsertString(DCM_StudyDescription, "Rust ECG");
+
+	if (spec.bSourceTags)
+	{
+		pDataset->putAndInsertString(DCM_VisitComments, "Pre-operatieve screening");
+		pDataset->putAndInsertString(DCM_OperatorsName, "Jansen^J");
+		pDataset->putAndInsertString(DCM_ReferringPhysicianName, "de Vries^A");
+		pDataset->putAndInsertString(DCM_PhysiciansOfRecord, "Bakker^B");
+		pDataset->putAndInsertString(DCM_NameOfPhysiciansReadingStudy, "Visser^C");
+	}
+
+	OFCondition cond;
+	for (unsigned long iGroup = 0; iGroup < spec.nGroups && cond.good(); iGroup++)
+		cond = AddMultiplexGroup(pDataset, spec, iGroup);
+
+	char buf[128];
+	for (unsigned long iAnnotation = 0; iAnnotation < spec.nAnnotations && cond.good(); iAnnotation++)
+	{
+		DcmItem* pItem = NULL;
+		cond = pDataset->findOrCreateSequenceItem(DCM_WaveformAnnotationSequence, pItem, -2);
+		if (cond.bad())
+			break;
+		if (spec.bAmended && iAnnotation + 1 == spec.nAnnotations)
+			snprintf(buf, sizeof(buf), "-+-");
+		else
+			snprintf(buf, sizeof(buf), "Synthetic statement %lu: sinusritme", iAnnotation + 1);
+		pItem->putAndInsertString(DCM_ReferencedWaveformChannels, "1\\0");
+		pItem->putAndInsertString(DCM_AnnotationGroupNumber, "0");
+		cond = pItem->putAndInsertString(DCM_UnformattedTextValue, buf);
+	}
+	for (unsigned long iAnnotation = 0; iAnnotation < spec.nNumericAnnotations && cond.good(); iAnnotation++)
+	{
+		DcmItem* pItem = NULL;
+		cond = pDataset->findOrCreateSequenceItem(DCM_WaveformAnnotationSequence, pItem, -2);
+		if (cond.bad())
+			break;
+		pItem->putAndInsertString(DCM_ReferencedWaveformChannels, "1\\1");
+		pItem->putAndInsertString(DCM_AnnotationGroupNumber, "0");
+		cond = pItem->putAndInsertString(DCM_NumericValue, "72");
+	}
+	return cond;
+}
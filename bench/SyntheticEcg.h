@@ -0,0 +1,26 @@
+﻿// SyntheticEcg.h : synthetic ECG waveform objects for benchmarking AmendEcgAnnotation
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#pragma once
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/dcmdata/dctk.h"
+
+// shape of a generated object
+struct SyntheticEcgSpec
+{
+	SyntheticEcgSpec();
+
+	const char* pszSOPClassUID;		// 12-lead, general or ambulatory ECG (or anything else for the wrong-SOP path)
+	unsigned long nGroups;			// waveform multiplex groups; the first is ORIGINAL, the others DERIVED (0: no WaveformSequence)
+	unsigned long nChannels;		// channels per group
+	unsigned long nSamples;			// samples per channel
+	unsigned long nAnnotations;		// existing text annotation items
+	unsigned long nNumericAnnotations;	// existing measurement items (without text), after the text items
+	OFBool bSourceTags;				// VisitComments, OperatorsName and the physician names
+	OFBool bAmended;				// one annotation already contains the -+- separator
+};
+
+// build the complete object in dfile; the caller saves it
+OFCondition CreateSyntheticEcg(const SyntheticEcgSpec& spec, DcmFileFormat& dfile);
@@ -0,0 +1,476 @@
+﻿// TestAmendEcgAnnotation.cpp : regression tests of the amendment library, one per command line name
+// (see CMakeLists.txt); run by ctest in an empty working directory.
+//
+// (c) 2021 Amsterdam UMC - Dept of Radiology and Nuclear Medicine - Paul F.C. Groot
+
+#include "AmendEcgAnnotation.h"
+#include "Archive.h"
+#include "ContentDigest.h"
+#include "Deflate.h"
+#include "DicomScanner.h"
+#include "OutputCommit.h"
+#include "bench/SyntheticEcg.h"
+
+#include "dcmtk/config/osconfig.h"    /* make sure OS specific configuration is included first */
+#include "dcmtk/ofstd/ofstream.h"
+#include "dcmtk/dcmdata/dctk.h"
+#include "dcmtk/ofstd/ofstd.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+#define CHECK(expr) if (!(expr)) { CERR << "FAIL: " << #expr << " (line " << __LINE__ << ")" << endl; return 1; }
+#define TEST_SKIPPED 77 // SKIP_RETURN_CODE in CMakeLists.txt
+
+// no temporary file may be left in the current directory
+static OFBool NoTempFiles()
+{
+	OFList<OFString> files;
+	OFStandard::searchDirectoryRecursively(".", files, "", "", OFFalse);
+	for (OFListIterator(OFString) it = files.begin(); it != files.end(); ++it)
+	{
+		if (it->length() > 4 && it->compare(it->length() - 4, 4, ".tmp") == 0)
+			return OFFalse;
+	}
+	return OFTrue;
+}
+
+// amend a bare relative file name in place (keeping its mode), then clone it (already amended) to another bare name
+static int TestInPlaceRelative()
+{
+	const OFString ofstrTempFile = MakeTempOutputName("out.dcm");
+	CHECK(ofstrTempFile.find(PATH_SEPARATOR) == OFString_npos);
+	CHECK(ofstrTempFile.compare(0, 9, ".out.dcm.") == 0);
+
+	DcmFileFormat dfile;
+	CHECK(CreateSyntheticEcg(SyntheticEcgSpec(), dfile).good());
+	CHECK(dfile.saveFile("inplace.dcm", EXS_LittleEndianExplicit).good());
+#ifndef _WIN32
+	CHECK(chmod("inplace.dcm", 0604) == 0);
+#endif
+
+	AmendOptions options;
+	options.bForceOutput = OFTrue;
+	AmendResult result = amendFile("inplace.dcm", "inplace.dcm", options);
+	CHECK(result.code == RESULT_SUCCESS);
+	CHECK(result.nInserted > 0);
+	CHECK(NoTempFiles());
+#ifndef _WIN32
+	struct stat st;
+	CHECK(stat("inplace.dcm", &st) == 0 && (st.st_mode & 0777) == 0604);
+#endif
+
+	result = amendFile("inplace.dcm", "clone.dcm", options);
+	CHECK(result.code == RESULT_WARN_ALREADY_AMENDED);
+	CHECK(result.cloneResult != ECR_failed);
+	CHECK(OFStandard::getFileSize("clone.dcm") == OFStandard::getFileSize("inplace.dcm"));
+	CHECK(NoTempFiles());
+	return 0;
+}
+
+// a separator after the measurement items still marks the object as amended, for triage as well
+static int TestLateSeparator()
+{
+	SyntheticEcgSpec spec;
+	spec.nNumericAnnotations = 2;
+	DcmFileFormat dfile;
+	CHECK(CreateSyntheticEcg(spec, dfile).good());
+	DcmItem* pItem = NULL;
+	CHECK(dfile.getDataset()->findOrCreateSequenceItem(DCM_WaveformAnnotationSequence, pItem, -2).good());
+	CHECK(pItem->putAndInsertString(DCM_UnformattedTextValue, "-+-").good());
+	CHECK(dfile.saveFile("late.dcm", EXS_LittleEndianExplicit).good());
+
+	AmendOptions options;
+	const AmendResult result = amend(*dfile.getDataset(), options);
+	CHECK(result.code == RESULT_WARN_ALREADY_AMENDED);
+	CHECK(triageFile("late.dcm") == ETC_alreadyAmended);
+	return 0;
+}
+
+// XXH64 against the reference implementation (seed 0, bytes i*7+3), in one piece and in pieces of up to 13
+// bytes; then an amendment with --verify, whose output must have the digest of its input
+static int TestContentDigest()
+{
+	static const struct
+	{
+		size_t nSize;
+		Uint64 nHash;
+	} vectors[] = {
+		{ 0, 0xef46db3751d8e999ULL },
+		{ 1, 0x1f25c8d0bc1f4bb6ULL },
+		{ 4, 0x9bb64b7d66ee9fdaULL },
+		{ 8, 0xdab99d95c6f90092ULL },
+		{ 12, 0xd52e407833af5133ULL },
+		{ 31, 0xa2aa5f33cc4a6119ULL },
+		{ 32, 0x23c3c17ef790fd97ULL },
+		{ 33, 0x50a7cfc7ba588784ULL },
+		{ 63, 0x5e3e54b431c7493cULL },
+		{ 64, 0x0eb64b3ef6eeb01fULL },
+		{ 100, 0xa61f8d4c170fe531ULL },
+		{ 1000, 0x5f235fa033f1a3fbULL }
+	};
+	Uint8 data[1000];
+	for (size_t iByte = 0; iByte < sizeof(data); iByte++)
+		data[iByte] = OFstatic_cast(Uint8, iByte * 7 + 3);
+	for (size_t iVector = 0; iVector < sizeof(vectors) / sizeof(vectors[0]); iVector++)
+	{
+		XxHash64 whole;
+		whole.update(data, vectors[iVector].nSize);
+		CHECK(whole.digest() == vectors[iVector].nHash);
+
+		XxHash64 pieces;
+		for (size_t nPos = 0, nPiece = 1; nPos < vectors[iVector].nSize; nPos += nPiece, nPiece = nPiece % 13 + 1)
+		{
+			if (nPiece > vectors[iVector].nSize - nPos)
+				nPiece = vectors[iVector].nSize - nPos;
+			pieces.update(data + nPos, nPiece);
+		}
+		CHECK(pieces.digest() == vectors[iVector].nHash);
+	}
+
+	SyntheticEcgSpec spec;
+	DcmFileFormat dfile;
+	CHECK(CreateSyntheticEcg(spec, dfile).good());
+	CHECK(dfile.saveFile("input.dcm", EXS_LittleEndianExplicit).good());
+	CHECK(dfile.getDataset()->putAndInsertString(DCM_PatientName, "Changed^Patient").good());
+	CHECK(dfile.saveFile("changed.dcm", EXS_LittleEndianExplicit).good());
+
+	AmendOptions options;
+	options.bVerify = OFTrue;
+	const AmendResult result = amendFile("input.dcm", "output.dcm", options);
+	CHECK(result.code == RESULT_SUCCESS);
+	CHECK(result.nInserted > 0);
+	CHECK(result.bVerified);
+
+	MappedFile input, output, changed;
+	CHECK(input.open("input.dcm") && output.open("output.dcm") && changed.open("changed.dcm"));
+	ContentDigest inputDigest, outputDigest, changedDigest;
+	CHECK(computeContentDigest(input.data(), input.size(), inputDigest).good());
+	CHECK(computeContentDigest(output.data(), output.size(), outputDigest).good());
+	CHECK(computeContentDigest(changed.data(), changed.size(), changedDigest).good());
+	CHECK(inputDigest.nMultiplexGroups == spec.nGroups);
+	CHECK(outputDigest == inputDigest);
+	CHECK(result.digest == inputDigest);
+	CHECK(changedDigest.nWaveform == inputDigest.nWaveform);
+	CHECK(changedDigest.nDataset != inputDigest.nDataset);
+	CHECK(NoTempFiles());
+	return 0;
+}
+
+// an ECG of several 128 kB chunks deflated by several threads: the same stream as by one thread, which
+// decodeDeflated() and DCMTK both read back to the content of the input
+static int TestDeflateThreads()
+{
+#ifdef WITH_ZLIB
+	SyntheticEcgSpec spec;
+	spec.nSamples = 20000; // about 1 MB of WaveformData
+	DcmFileFormat dfile;
+	CHECK(CreateSyntheticEcg(spec, dfile).good());
+	CHECK(dfile.saveFile("input.dcm", EXS_LittleEndianExplicit).good());
+
+	MappedFile mapped;
+	CHECK(mapped.open("input.dcm"));
+	CHECK(mapped.size() > 4 * 128 * 1024);
+	const OFVector<Uint8> input(mapped.data(), mapped.data() + mapped.size());
+	ContentDigest inputDigest;
+	CHECK(computeContentDigest(&input[0], input.size(), inputDigest).good());
+
+	OFVector<Uint8> deflated, single;
+	CHECK(encodeDeflated(input, deflated, 6, 4));
+	CHECK(encodeDeflated(input, single, 6, 1));
+	CHECK(deflated.size() == single.size() && memcmp(&deflated[0], &single[0], deflated.size()) == 0);
+
+	OFVector<Uint8> decoded;
+	CHECK(decodeDeflated(&deflated[0], deflated.size(), decoded));
+	CHECK(decoded.size() == input.size() && memcmp(&decoded[0], &input[0], input.size()) == 0);
+	ContentDigest decodedDigest;
+	CHECK(computeContentDigest(&decoded[0], decoded.size(), decodedDigest).good());
+	CHECK(decodedDigest == inputDigest);
+
+	OFFile file;
+	CHECK(file.fopen("deflated.dcm", "wb"));
+	CHECK(file.fwrite(&deflated[0], 1, deflated.size()) == deflated.size());
+	CHECK(file.fclose() == 0);
+	DcmFileFormat loaded;
+	CHECK(loaded.loadFile("deflated.dcm").good());
+	CHECK(loaded.getDataset()->getOriginalXfer() == EXS_DeflatedLittleEndianExplicit);
+	CHECK(loaded.saveFile("reloaded.dcm", EXS_LittleEndianExplicit).good());
+	MappedFile reloaded;
+	CHECK(reloaded.open("reloaded.dcm"));
+	ContentDigest reloadedDigest;
+	CHECK(computeContentDigest(reloaded.data(), reloaded.size(), reloadedDigest).good());
+	CHECK(reloadedDigest == inputDigest);
+	return 0;
+#else
+	CERR << "deflate-threads: skipped, DCMTK was built without zlib" << endl;
+	return TEST_SKIPPED;
+#endif
+}
+
+// the bytes of a synthetic ECG as DCMTK saves it
+static OFBool SyntheticEcgBytes(const char* pszFile, OFVector<Uint8>& bytes)
+{
+	DcmFileFormat dfile;
+	MappedFile mapped;
+	if (CreateSyntheticEcg(SyntheticEcgSpec(), dfile).bad() || dfile.saveFile(pszFile, EXS_LittleEndianExplicit).bad() || !mapped.open(pszFile))
+		return OFFalse;
+	bytes = OFVector<Uint8>(mapped.data(), mapped.data() + mapped.size());
+	return OFTrue;
+}
+
+static OFBool WriteBytes(const char* pszFile, const OFVector<Uint8>& bytes)
+{
+	OFFile file;
+	return file.fopen(pszFile, "wb") && file.fwrite(&bytes[0], 1, bytes.size()) == bytes.size() && file.fclose() == 0;
+}
+
+static void PutLE(OFVector<Uint8>& buffer, Uint64 nValue, int nBytes)
+{
+	for (int iByte = 0; iByte < nBytes; iByte++)
+		buffer.push_back(OFstatic_cast(Uint8, nValue >> (8 * iByte)));
+}
+
+static void PutBytes(OFVector<Uint8>& buffer, const char* pszText)
+{
+	buffer.insert(buffer.end(), pszText, pszText + strlen(pszText));
+}
+
+// a ustar member: header block, then the content padded to whole blocks
+static void AppendTarMember(OFVector<Uint8>& tar, const char* pszName, const OFVector<Uint8>& content)
+{
+	char header[512];
+	memset(header, 0, sizeof(header));
+	strncpy(header, pszName, 99);
+	memcpy(header + 100, "0000644", 8);
+	memcpy(header + 108, "0000000", 8);
+	memcpy(header + 116, "0000000", 8);
+	sprintf(header + 124, "%011lo", OFstatic_cast(unsigned long, content.size()));
+	memcpy(header + 136, "00000000000", 12);
+	header[156] = '0';
+	memcpy(header + 257, "ustar", 6);
+	memcpy(header + 263, "00", 2);
+	memset(header + 148, ' ', 8);
+	unsigned long nSum = 0;
+	for (size_t iByte = 0; iByte < sizeof(header); iByte++)
+		nSum += OFstatic_cast(unsigned char, header[iByte]);
+	sprintf(header + 148, "%06lo", nSum);
+	header[155] = ' ';
+	tar.insert(tar.end(), header, header + sizeof(header));
+	tar.insert(tar.end(), content.begin(), content.end());
+	tar.resize(tar.size() + (512 - content.size() % 512) % 512, 0);
+}
+
+// amends the members of the bundles; the same as the command line tool, without its logging
+static AmendResult AmendArchiveMember(const OFString& /* ofstrMember */, const OFVector<Uint8>& input, OFVector<Uint8>& output,
+	STD_NAMESPACE ostream& out, STD_NAMESPACE ostream& err)
+{
+	AmendOptions options;
+	options.pOut = &out;
+	options.pErr = &err;
+	return amendStream(input, output, options);
+}
+
+// an amended member is a larger ECG that is already amended
+static OFBool IsAmendedEcg(const OFVector<Uint8>& content, const OFVector<Uint8>& original)
+{
+	OFVector<Uint8> output;
+	return content.size() > original.size() && amendStream(content, output, AmendOptions()).code == RESULT_WARN_ALREADY_AMENDED;
+}
+
+// two ECGs and a text file in a tar bundle; the output is re-read with the reader of the archive mode
+static int TestArchiveTar()
+{
+	OFVector<Uint8> ecg, readme, tar;
+	CHECK(SyntheticEcgBytes("ecg.dcm", ecg));
+	PutBytes(readme, "synthetic ECGs\n");
+	AppendTarMember(tar, "ecg/1.dcm", ecg);
+	AppendTarMember(tar, "README.txt", readme);
+	AppendTarMember(tar, "ecg/2.dcm", ecg);
+	tar.resize(tar.size() + 2 * 512, 0);
+	CHECK(WriteBytes("input.tar", tar));
+
+	ArchiveConfig config;
+	config.nWorkers = 2;
+	OutputCommitter committer;
+	CHECK(RunArchive(config, "input.tar", "output.tar", AmendArchiveMember, committer) == RESULT_SUCCESS);
+	CHECK(OFStandard::getFileSize("output.tar") % (20 * 512) == 0);
+
+	OFVector<ArchiveEntry> entries;
+	OFString ofstrError;
+	CHECK(ReadArchive("output.tar", entries, ofstrError));
+	CHECK(entries.size() == 3);
+	CHECK(entries[0].ofstrName == "ecg/1.dcm" && entries[1].ofstrName == "README.txt" && entries[2].ofstrName == "ecg/2.dcm");
+	for (size_t iEntry = 0; iEntry < entries.size(); iEntry++)
+		CHECK(entries[iEntry].bFile && entries[iEntry].content.size() == entries[iEntry].nSize);
+	CHECK(IsAmendedEcg(entries[0].content, ecg));
+	CHECK(entries[1].content.size() == readme.size() && memcmp(&entries[1].content[0], &readme[0], readme.size()) == 0);
+	CHECK(IsAmendedEcg(entries[2].content, ecg));
+	CHECK(NoTempFiles());
+	return 0;
+}
+
+// a zip bundle of a stored and a deflated ECG, an ECG whose offset is in the zip64 field of the central
+// directory (as streaming writers do) and a text file; every output member must match its CRC and sizes
+static int TestArchiveZip()
+{
+#ifdef WITH_ZLIB
+	OFVector<Uint8> ecg, readme;
+	CHECK(SyntheticEcgBytes("ecg.dcm", ecg));
+	PutBytes(readme, "synthetic ECGs\n");
+
+	static const struct
+	{
+		const char* pszName;
+		Uint16 nMethod;
+		OFBool bZip64Offset;
+	} members[] = {
+		{ "ecg/stored.dcm", 0, OFFalse },
+		{ "ecg/deflated.dcm", 8, OFFalse },
+		{ "ecg/zip64.dcm", 0, OFTrue },
+		{ "README.txt", 0, OFFalse }
+	};
+	const size_t nMembers = sizeof(members) / sizeof(members[0]);
+	OFVector<Uint8> zip, central;
+	for (size_t iMember = 0; iMember < nMembers; iMember++)
+	{
+		const OFVector<Uint8>& content = iMember + 1 < nMembers ? ecg : readme;
+		OFVector<Uint8> data(content);
+		if (members[iMember].nMethod == 8)
+		{
+			// raw deflate, as in zip
+			z_stream stream;
+			memset(&stream, 0, sizeof(stream));
+			CHECK(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+			data.resize(deflateBound(&stream, OFstatic_cast(uLong, content.size())));
+			stream.next_in = OFconst_cast(Bytef*, &content[0]);
+			stream.avail_in = OFstatic_cast(uInt, content.size());
+			stream.next_out = &data[0];
+			stream.avail_out = OFstatic_cast(uInt, data.size());
+			const int iStatus = deflate(&stream, Z_FINISH);
+			data.resize(data.size() - stream.avail_out);
+			deflateEnd(&stream);
+			CHECK(iStatus == Z_STREAM_END);
+		}
+		const Uint32 nCrc = ArchiveCrc32(content);
+		const Uint64 nOffset = zip.size();
+		const Uint16 nVersion = members[iMember].bZip64Offset ? 45 : 20;
+		const size_t nName = strlen(members[iMember].pszName);
+
+		PutLE(zip, 0x04034b50, 4);
+		PutLE(zip, nVersion, 2);
+		PutLE(zip, 0, 2);
+		PutLE(zip, members[iMember].nMethod, 2);
+		PutLE(zip, 0, 2);
+		PutLE(zip, 0x21, 2);
+		PutLE(zip, nCrc, 4);
+		PutLE(zip, data.size(), 4);
+		PutLE(zip, content.size(), 4);
+		PutLE(zip, nName, 2);
+		PutLE(zip, 0, 2);
+		PutBytes(zip, members[iMember].pszName);
+		zip.insert(zip.end(), data.begin(), data.end());
+
+		PutLE(central, 0x02014b50, 4);
+		PutLE(central, nVersion, 2);
+		PutLE(central, nVersion, 2);
+		PutLE(central, 0, 2);
+		PutLE(central, members[iMember].nMethod, 2);
+		PutLE(central, 0, 2);
+		PutLE(central, 0x21, 2);
+		PutLE(central, nCrc, 4);
+		PutLE(central, data.size(), 4);
+		PutLE(central, content.size(), 4);
+		PutLE(central, nName, 2);
+		PutLE(central, members[iMember].bZip64Offset ? 12 : 0, 2);
+		PutLE(central, 0, 2);
+		PutLE(central, 0, 2);
+		PutLE(central, 0, 2);
+		PutLE(central, 0, 4);
+		PutLE(central, members[iMember].bZip64Offset ? 0xffffffff : nOffset, 4);
+		PutBytes(central, members[iMember].pszName);
+		if (members[iMember].bZip64Offset)
+		{
+			PutLE(central, 0x0001, 2);
+			PutLE(central, 8, 2);
+			PutLE(central, nOffset, 8);
+		}
+	}
+	const Uint64 nCentralOffset = zip.size();
+	zip.insert(zip.end(), central.begin(), central.end());
+	PutLE(zip, 0x06054b50, 4);
+	PutLE(zip, 0, 2);
+	PutLE(zip, 0, 2);
+	PutLE(zip, nMembers, 2);
+	PutLE(zip, nMembers, 2);
+	PutLE(zip, central.size(), 4);
+	PutLE(zip, nCentralOffset, 4);
+	PutLE(zip, 0, 2);
+	CHECK(WriteBytes("input.zip", zip));
+
+	// the input as the archive mode reads it
+	OFVector<ArchiveEntry> entries;
+	OFString ofstrError;
+	CHECK(ReadArchive("input.zip", entries, ofstrError));
+	CHECK(entries.size() == nMembers);
+	CHECK(entries[2].content.size() == ecg.size() && memcmp(&entries[2].content[0], &ecg[0], ecg.size()) == 0);
+
+	ArchiveConfig config;
+	config.nWorkers = 2;
+	OutputCommitter committer;
+	CHECK(RunArchive(config, "input.zip", "output.zip", AmendArchiveMember, committer) == RESULT_SUCCESS);
+
+	CHECK(ReadArchive("output.zip", entries, ofstrError));
+	CHECK(entries.size() == nMembers);
+	for (size_t iEntry = 0; iEntry < entries.size(); iEntry++)
+	{
+		CHECK(entries[iEntry].ofstrName == members[iEntry].pszName);
+		CHECK(entries[iEntry].nMethod == members[iEntry].nMethod);
+		CHECK(entries[iEntry].content.size() == entries[iEntry].nSize);
+		CHECK(ArchiveCrc32(entries[iEntry].content) == entries[iEntry].nCrc);
+		if (iEntry + 1 < nMembers)
+			CHECK(IsAmendedEcg(entries[iEntry].content, ecg));
+	}
+	CHECK(entries[nMembers - 1].content.size() == readme.size() && memcmp(&entries[nMembers - 1].content[0], &readme[0], readme.size()) == 0);
+	CHECK(NoTempFiles());
+	return 0;
+#else
+	CERR << "archive-zip: skipped, DCMTK was built without zlib" << endl;
+	return TEST_SKIPPED;
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		CERR << "usage: TestAmendEcgAnnotation <test>" << endl;
+		return 2;
+	}
+	if (!dcmDataDict.isDictionaryLoaded())
+	{
+		CERR << "ERROR: no data dictionary loaded;  check environment variable: " << DCM_DICT_ENVIRONMENT_VARIABLE << endl;
+		return 2;
+	}
+
+	const OFString ofstrTest(argv[1]);
+	if (ofstrTest == "in-place-relative")
+		return TestInPlaceRelative();
+	if (ofstrTest == "late-separator")
+		return TestLateSeparator();
+	if (ofstrTest == "content-digest")
+		return TestContentDigest();
+	if (ofstrTest == "deflate-threads")
+		return TestDeflateThreads();
+	if (ofstrTest == "archive-tar")
+		return TestArchiveTar();
+	if (ofstrTest == "archive-zip")
+		return TestArchiveZip();
+	CERR << "ERROR: unknown test: " << ofstrTest << endl;
+	return 2;
+}